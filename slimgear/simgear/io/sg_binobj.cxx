@@ -39,6 +39,7 @@
 #include <string>
 #include <iostream>
 #include <bitset>
+#include <algorithm>
 
 #include <simgear/bucket/newbucket.hxx>
 #include <simgear/misc/sg_path.hxx>
@@ -797,6 +798,393 @@ bool SGBinObject::read_bin( const SGPath& file ) {
     return true;
 }
 
+// A cursor over a file that has been read (and inflated) into
+// memory.  Reads are bounds checked; running off the end sets the
+// error flag and returns zeroes, much like sgReadError() for gzFiles.
+class sgArenaReader {
+
+private:
+
+    const char *ptr;
+    const char *end;
+    bool error;
+
+public:
+
+    sgArenaReader( const char *p, size_t n ) :
+        ptr(p),
+        end(p + n),
+        error(false)
+    {
+    }
+
+    bool get_error() const { return error; }
+    const char *get_ptr() const { return ptr; }
+
+    // Returns a pointer to the next n bytes and skips over them, or
+    // NULL if there aren't that many.
+    const char *skip( size_t n )
+    {
+        if ( error || (size_t)(end - ptr) < n ) {
+            error = true;
+            return NULL;
+        }
+        const char *result = ptr;
+        ptr += n;
+        return result;
+    }
+
+    template <class T>
+    T read()
+    {
+        T result = 0;
+        const char *p = skip( sizeof(T) );
+        if ( p != NULL ) {
+            memcpy( &result, p, sizeof(T) );
+            if ( sgIsBigEndian() ) {
+                sgEndianSwap( &result );
+            }
+        }
+        return result;
+    }
+
+    char readChar()
+    {
+        const char *p = skip( 1 );
+        return p ? *p : 0;
+    }
+
+    float readFloat()
+    {
+        uint32_t bits = read<uint32_t>();
+        float result;
+        memcpy( &result, &bits, sizeof(float) );
+        return result;
+    }
+
+    double readDouble()
+    {
+        uint64_t bits = read<uint64_t>();
+        double result;
+        memcpy( &result, &bits, sizeof(double) );
+        return result;
+    }
+};
+
+// Reads an unaligned little-endian index of type T from p.
+template <class T>
+static inline int read_flat_index(const char *p)
+{
+    T result;
+    memcpy(&result, p, sizeof(T));
+    if (sgIsBigEndian()) {
+        sgEndianSwap(&result);
+    }
+    return result;
+}
+
+// The flat equivalent of read_indices() - appends the vertex and
+// normal indices of one element to 'indices', and adds a span for
+// them.
+template <class T>
+static void read_flat_indices(const char* buffer,
+                              size_t bytes,
+                              int indexMask,
+                              int vaMask,
+                              unsigned int material,
+                              SGBinObjectIndices& indices)
+{
+    // As in read_indices(), vertices come first, then normals.
+    if (!(indexMask & SG_IDX_VERTICES)) {
+        return;
+    }
+    const int stride = sizeof(T) * (std::bitset<32>((int)indexMask).count() +
+                                    std::bitset<32>((int)vaMask).count());
+    const int count = bytes / stride;
+    const int normal = (indexMask & SG_IDX_NORMALS) ? sizeof(T) : 0;
+    if (count == 0) {
+        return;
+    }
+
+    SGBinObjectSpan span;
+    span.offset = indices.v.size();
+    span.count = count;
+    span.material = material;
+    for (int i = 0; i < count; ++i) {
+        const char *p = buffer + i * stride;
+        int v = read_flat_index<T>(p);
+        indices.v.push_back(v);
+        indices.n.push_back(normal ? read_flat_index<T>(p + normal) : v);
+    }
+
+    // WS2.0 fix : toss zero area triangles
+    if (count == 3) {
+        const int *vs = &indices.v[span.offset];
+        if ((vs[0] == vs[1]) || (vs[1] == vs[2]) || (vs[2] == vs[0])) {
+            indices.v.resize(span.offset);
+            indices.n.resize(span.offset);
+            return;
+        }
+    }
+
+    indices.spans.push_back(span);
+}
+
+// Makes room for n elements in v.  Unlike a plain reserve(), this
+// grows geometrically, since files can have thousands of small
+// objects.
+template <class T>
+static void reserve_flat(vector<T>& v, size_t n)
+{
+    if (n > v.capacity()) {
+        v.reserve(std::max(n, v.capacity() * 2));
+    }
+}
+
+// Returns the index of the given material name in 'materials',
+// adding it if necessary.
+static unsigned int intern_material(const char *name, size_t length,
+                                    string_list& materials)
+{
+    for (size_t i = 0; i < materials.size(); ++i) {
+        if ((materials[i].size() == length) &&
+            (memcmp(materials[i].data(), name, length) == 0)) {
+            return i;
+        }
+    }
+    materials.push_back(string(name, length));
+    return materials.size() - 1;
+}
+
+// Reads the given file into 'buffer', inflating it if necessary.
+// Returns false if the file can't be opened.
+static bool inflate_file(const string& f, vector<char>& buffer)
+{
+    gzFile fp;
+    if ( (fp = gzopen( f.c_str(), "rb" )) == NULL ) {
+        string filegz = f + ".gz";
+        if ( (fp = gzopen( filegz.c_str(), "rb" )) == NULL ) {
+            return false;
+        }
+    }
+
+    // Large reads are inflated directly into our buffer, so the
+    // bigger the better.
+    size_t used = 0;
+    buffer.resize(256 * 1024);
+    while (true) {
+        if (used == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        int n = gzread(fp, &buffer[used], buffer.size() - used);
+        if (n < 0) {
+            gzclose(fp);
+            throw sg_io_exception("Error inflating BTG file", sg_location(f));
+        } else if (n == 0) {
+            break;
+        }
+        used += n;
+    }
+    buffer.resize(used);
+    gzclose(fp);
+
+    return true;
+}
+
+// read a binary file into flat index lists
+bool SGBinObject::read_bin_flat( const SGPath& file ) {
+    // zero out structures
+    gbs_center = SGVec3d(0, 0, 0);
+    gbs_radius = 0.0;
+
+    wgs84_nodes.clear();
+    normals.clear();
+    texcoords.clear();
+    colors.clear();
+    va_flt.clear();
+    va_int.clear();
+
+    flat_tris.clear();
+    flat_strips.clear();
+    flat_fans.clear();
+    materials.clear();
+
+    vector<char> arena;
+    string f = file.local8BitStr();
+    if ( !inflate_file( f, arena ) ) {
+        SG_LOG( SG_EVENT, SG_ALERT,
+                "ERROR: opening " << file << " or " << f << ".gz for reading!");
+        throw sg_io_exception("Error opening for reading (and .gz)", sg_location(f));
+    }
+    sgArenaReader in( arena.empty() ? NULL : &arena[0], arena.size() );
+
+    // read headers
+    uint32_t header = in.read<uint32_t>();
+    if ( ((header & 0xFF000000) >> 24) == 'S' &&
+         ((header & 0x00FF0000) >> 16) == 'G' ) {
+        version = (header & 0x0000FFFF);
+    } else {
+        throw sg_io_exception("Bad BTG magic/version", sg_location(file));
+    }
+
+    // skip creation time
+    in.read<uint32_t>();
+
+    // read number of top level objects
+    int nobjects;
+    if ( version >= 10 ) {
+        nobjects = in.read<int32_t>();
+    } else if ( version >= 7 ) {
+        nobjects = in.read<uint16_t>();
+    } else {
+        nobjects = (int16_t)in.read<uint16_t>();
+    }
+
+    if ( in.get_error() ) {
+        throw sg_io_exception("Error reading BTG file header", sg_location(file));
+    }
+
+    for ( int i = 0; i < nobjects; ++i ) {
+        // read object header
+        char obj_type = in.readChar();
+        uint32_t nproperties, nelements;
+        if ( version >= 10 ) {
+            nproperties = in.read<uint32_t>();
+            nelements = in.read<uint32_t>();
+        } else if ( version >= 7 ) {
+            nproperties = in.read<uint16_t>();
+            nelements = in.read<uint16_t>();
+        } else {
+            nproperties = (int16_t)in.read<uint16_t>();
+            nelements = (int16_t)in.read<uint16_t>();
+        }
+
+        // read properties.  Only the index objects have any we care
+        // about.
+        unsigned char idx_mask = (obj_type == SG_POINTS) ? SG_IDX_VERTICES :
+            (SG_IDX_VERTICES | SG_IDX_TEXCOORDS_0);
+        uint32_t vertex_attrib_mask = 0;
+        unsigned int material = 0;
+        bool haveMaterial = false;
+        for ( uint32_t j = 0; j < nproperties; ++j ) {
+            char prop_type = in.readChar();
+            uint32_t nbytes = in.read<uint32_t>();
+            const char *ptr = in.skip( nbytes );
+            if ( ptr == NULL ) {
+                break;
+            }
+            if ( prop_type == SG_MATERIAL ) {
+                // Same truncation rules as read_object().
+                size_t length = std::min(nbytes, 255U);
+                length = strnlen(ptr, length);
+                material = intern_material( ptr, length, materials );
+                haveMaterial = true;
+            } else if ( (prop_type == SG_INDEX_TYPES) && (nbytes == 1) ) {
+                idx_mask = *ptr;
+            } else if ( (prop_type == SG_VERT_ATTRIBS) && (nbytes == 4) ) {
+                vertex_attrib_mask = read_flat_index<uint32_t>( ptr );
+            }
+        }
+
+        SGBinObjectIndices *indices = NULL;
+        if ( obj_type == SG_TRIANGLE_FACES ) {
+            indices = &flat_tris;
+        } else if ( obj_type == SG_TRIANGLE_STRIPS ) {
+            indices = &flat_strips;
+        } else if ( obj_type == SG_TRIANGLE_FANS ) {
+            indices = &flat_fans;
+        }
+        if ( (indices != NULL) && !haveMaterial ) {
+            // read_object() leaves the name undefined in this case;
+            // we use an empty one.
+            material = intern_material( "", 0, materials );
+        }
+        if ( (indices != NULL) &&
+             (std::bitset<32>((int)idx_mask).count() == 0) ) {
+            throw sg_exception("object index mask has no bits set");
+        }
+
+        // Since everything's in memory, we can size the index lists
+        // in advance.  Count them first.
+        if ( indices != NULL ) {
+            sgArenaReader scan( in );
+            const size_t stride = (version >= 10 ? 4 : 2) *
+                (std::bitset<32>((int)idx_mask).count() +
+                 std::bitset<32>((int)vertex_attrib_mask).count());
+            size_t total = indices->v.size();
+            for ( uint32_t j = 0; j < nelements; ++j ) {
+                uint32_t nbytes = scan.read<uint32_t>();
+                if ( scan.skip( nbytes ) == NULL ) {
+                    break;
+                }
+                total += nbytes / stride;
+            }
+            reserve_flat( indices->v, total );
+            reserve_flat( indices->n, total );
+            reserve_flat( indices->spans, indices->spans.size() + nelements );
+        }
+
+        // read elements
+        for ( uint32_t j = 0; j < nelements; ++j ) {
+            uint32_t nbytes = in.read<uint32_t>();
+            const char *ptr = in.skip( nbytes );
+            if ( ptr == NULL ) {
+                break;
+            }
+
+            if ( obj_type == SG_BOUNDING_SPHERE ) {
+                if ( nbytes >= 3 * sizeof(double) + sizeof(float) ) {
+                    sgArenaReader e( ptr, nbytes );
+                    double x = e.readDouble();
+                    double y = e.readDouble();
+                    double z = e.readDouble();
+                    gbs_center = SGVec3d(x, y, z);
+                    gbs_radius = e.readFloat();
+                }
+            } else if ( obj_type == SG_VERTEX_LIST ) {
+                int count = nbytes / (sizeof(float) * 3);
+                reserve_flat( wgs84_nodes, wgs84_nodes.size() + count );
+                sgArenaReader e( ptr, nbytes );
+                for ( int k = 0; k < count; ++k ) {
+                    float x = e.readFloat();
+                    float y = e.readFloat();
+                    float z = e.readFloat();
+                    // extend from float to double, hmmm
+                    wgs84_nodes.push_back( SGVec3d(x, y, z) );
+                }
+            } else if ( obj_type == SG_NORMAL_LIST ) {
+                int count = nbytes / 3;
+                reserve_flat( normals, normals.size() + count );
+                const unsigned char *p = (const unsigned char *)ptr;
+                for ( int k = 0; k < count; ++k ) {
+                    SGVec3f normal( (p[0]) / 127.5 - 1.0,
+                                    (p[1]) / 127.5 - 1.0,
+                                    (p[2]) / 127.5 - 1.0);
+                    normals.push_back(normalize(normal));
+                    p += 3;
+                }
+            } else if ( indices != NULL ) {
+                if ( version >= 10 ) {
+                    read_flat_indices<uint32_t>( ptr, nbytes, idx_mask,
+                                                 vertex_attrib_mask,
+                                                 material, *indices );
+                } else {
+                    read_flat_indices<uint16_t>( ptr, nbytes, idx_mask,
+                                                 vertex_attrib_mask,
+                                                 material, *indices );
+                }
+            }
+            // Everything else is skipped.
+        }
+
+        if ( in.get_error() ) {
+            throw sg_io_exception("Error while reading object", sg_location(file, i));
+        }
+    }
+
+    return true;
+}
+
 void SGBinObject::write_header(gzFile fp, int type, int nProps, int nElements)
 {
     sgWriteChar(fp, (unsigned char) type);
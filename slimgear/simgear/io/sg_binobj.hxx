@@ -112,6 +112,35 @@ public:
 };
 
 
+/**
+ * A run of indices in an SGBinObjectIndices list, corresponding to
+ * one element (eg, one group of triangles) in the file.  Used by
+ * SGBinObject::read_bin_flat().
+ */
+struct SGBinObjectSpan {
+    unsigned int offset;        // index of the first entry in v and n
+    unsigned int count;         // number of entries
+    unsigned int material;      // index into get_materials()
+};
+
+/**
+ * Vertex and normal indices for all the elements of one kind
+ * (triangles, strips, or fans), stored end to end in two parallel
+ * lists, plus the spans that divide them into elements.  If the file
+ * doesn't give separate normal indices, n is a copy of v.
+ */
+struct SGBinObjectIndices {
+    int_list v;
+    int_list n;
+    std::vector<SGBinObjectSpan> spans;
+
+    void clear( void ) {
+        v.clear();
+        n.clear();
+        spans.clear();
+    };
+};
+
 
 /**
  * A class to manipulate the simgear 3d object format.
@@ -188,6 +217,12 @@ private:
     group_vai_list fans_vas;            // fans vertex attributes ( up to 8 sets )
     string_list fan_materials;	        // fans materials
 
+    // Filled by read_bin_flat() instead of the group lists above.
+    SGBinObjectIndices flat_tris;
+    SGBinObjectIndices flat_strips;
+    SGBinObjectIndices flat_fans;
+    string_list materials;              // interned material names
+
     void read_properties(gzFile fp, int nproperties);
     
     void read_object( gzFile fp,
@@ -274,6 +309,28 @@ public:
      */
     bool read_bin( const SGPath& file );
 
+    /**
+     * A faster alternative to read_bin() for callers that only want
+     * geometry.  The whole file is inflated into a single buffer and
+     * parsed in place.  The bounding sphere, vertices, and normals
+     * are read as usual, but the triangles, strips, and fans are
+     * returned as flat index lists (see get_tris(), get_strips(), and
+     * get_fans()), rather than a vector per element, with each
+     * distinct material name stored just once (see get_materials()).
+     * Colours, texture coordinates, vertex attributes, points, and
+     * the group lists are left empty.  Throws sg_io_exception on
+     * error, like read_bin().
+     * @param file input file name
+     * @return result of read
+     */
+    bool read_bin_flat( const SGPath& file );
+
+    // Flat API (see read_bin_flat())
+    inline const SGBinObjectIndices& get_tris() const { return flat_tris; }
+    inline const SGBinObjectIndices& get_strips() const { return flat_strips; }
+    inline const SGBinObjectIndices& get_fans() const { return flat_fans; }
+    inline const string_list& get_materials() const { return materials; }
+
     /** 
      * Write out the structures to a binary file.  We assume that the
      * groups come to us sorted by material property.  If not, things
@@ -118,6 +118,220 @@ SGGeodesy::SGCartToGeod(const SGVec3<double>& cart, SGGeod& geod)
   geod.setElevationM((k+e2-1)*sqrtDDpZZ/k);
 }
 
+// Batch cartesian to geodetic conversion.  This is the same algorithm
+// as above, but working on several points at once with SIMD
+// instructions.  SSE2 and AVX have no cube root or arctangent, so we
+// supply our own: Newton's method for the cube root, and the Cephes
+// library's rational approximation for the arctangent.  Both are
+// accurate to a few ulps over the ranges we use them in.  Points for
+// which those ranges don't hold (which only happens well away from
+// the earth's surface) are handed to the scalar version.
+
+#if defined(__AVX2__) || defined(__AVX__)
+#  include <immintrin.h>
+#  define SG_GEODESY_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define SG_GEODESY_SSE2 1
+#endif
+
+namespace {
+
+#if defined(SG_GEODESY_AVX)
+struct SIMD {
+  typedef __m256d V;
+  enum { N = 4 };
+  static V load(const double* p) { return _mm256_loadu_pd(p); }
+  static void store(double* p, V v) { _mm256_storeu_pd(p, v); }
+  static V set(double d) { return _mm256_set1_pd(d); }
+  static V add(V a, V b) { return _mm256_add_pd(a, b); }
+  static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+  static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+  static V div(V a, V b) { return _mm256_div_pd(a, b); }
+  static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+  static V max(V a, V b) { return _mm256_max_pd(a, b); }
+  static V lt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+  static V le(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+  static V gt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+  static V eq(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+  static V bitOr(V a, V b) { return _mm256_or_pd(a, b); }
+  static V bitAnd(V a, V b) { return _mm256_and_pd(a, b); }
+  static V andNot(V a, V b) { return _mm256_andnot_pd(a, b); }
+  static V select(V m, V a, V b) { return _mm256_blendv_pd(b, a, m); }
+  static int mask(V m) { return _mm256_movemask_pd(m); }
+};
+#elif defined(SG_GEODESY_SSE2)
+struct SIMD {
+  typedef __m128d V;
+  enum { N = 2 };
+  static V load(const double* p) { return _mm_loadu_pd(p); }
+  static void store(double* p, V v) { _mm_storeu_pd(p, v); }
+  static V set(double d) { return _mm_set1_pd(d); }
+  static V add(V a, V b) { return _mm_add_pd(a, b); }
+  static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+  static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+  static V div(V a, V b) { return _mm_div_pd(a, b); }
+  static V sqrt(V a) { return _mm_sqrt_pd(a); }
+  static V max(V a, V b) { return _mm_max_pd(a, b); }
+  static V lt(V a, V b) { return _mm_cmplt_pd(a, b); }
+  static V le(V a, V b) { return _mm_cmple_pd(a, b); }
+  static V gt(V a, V b) { return _mm_cmpgt_pd(a, b); }
+  static V eq(V a, V b) { return _mm_cmpeq_pd(a, b); }
+  static V bitOr(V a, V b) { return _mm_or_pd(a, b); }
+  static V bitAnd(V a, V b) { return _mm_and_pd(a, b); }
+  static V andNot(V a, V b) { return _mm_andnot_pd(a, b); }
+  static V select(V m, V a, V b)
+  { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+  static int mask(V m) { return _mm_movemask_pd(m); }
+};
+#endif
+
+#if defined(SG_GEODESY_AVX) || defined(SG_GEODESY_SSE2)
+typedef SIMD::V V;
+
+// Cephes atan(), for all lanes.
+inline V atanSIMD(V x)
+{
+  const V signBit = SIMD::set(-0.0);
+  V sign = SIMD::bitAnd(x, signBit);
+  x = SIMD::andNot(signBit, x);
+
+  // Range reduction.
+  V big = SIMD::gt(x, SIMD::set(2.41421356237309504880)); // tan(3pi/8)
+  V mid = SIMD::andNot(big, SIMD::gt(x, SIMD::set(0.66)));
+  V one = SIMD::set(1.0);
+  V xr = SIMD::select(big, SIMD::div(SIMD::set(-1.0), x),
+                      SIMD::select(mid, SIMD::div(SIMD::sub(x, one),
+                                                  SIMD::add(x, one)), x));
+  V y0 = SIMD::select(big, SIMD::set(1.57079632679489661923),
+                      SIMD::select(mid, SIMD::set(0.78539816339744830962), SIMD::set(0.0)));
+  const double moreBits = 6.123233995736765886130E-17;
+  V mb = SIMD::select(big, SIMD::set(moreBits),
+                      SIMD::select(mid, SIMD::set(0.5 * moreBits),
+                                   SIMD::set(0.0)));
+
+  V z = SIMD::mul(xr, xr);
+  V p = SIMD::set(-8.750608600031904122785E-1);
+  p = SIMD::add(SIMD::mul(p, z), SIMD::set(-1.615753718733365076637E1));
+  p = SIMD::add(SIMD::mul(p, z), SIMD::set(-7.500855792314704667340E1));
+  p = SIMD::add(SIMD::mul(p, z), SIMD::set(-1.228866684490136173410E2));
+  p = SIMD::add(SIMD::mul(p, z), SIMD::set(-6.485021904942025371773E1));
+  V q = SIMD::add(z, SIMD::set(2.485846490142306297962E1));
+  q = SIMD::add(SIMD::mul(q, z), SIMD::set(1.650270098316988542046E2));
+  q = SIMD::add(SIMD::mul(q, z), SIMD::set(4.328810604912902668951E2));
+  q = SIMD::add(SIMD::mul(q, z), SIMD::set(4.853903996359136964868E2));
+  q = SIMD::add(SIMD::mul(q, z), SIMD::set(1.945506571482613964425E2));
+  z = SIMD::div(SIMD::mul(z, p), q);
+  z = SIMD::add(SIMD::mul(xr, z), xr);
+  V result = SIMD::add(y0, SIMD::add(z, mb));
+
+  return SIMD::bitOr(result, sign);
+}
+#endif
+
+} // anonymous namespace
+
+void
+SGGeodesy::SGCartToGeod(size_t n, const double* xs, const double* ys,
+                        const double* zs, double* lons, double* lats,
+                        double* elevs)
+{
+  size_t i = 0;
+
+#if defined(SG_GEODESY_AVX) || defined(SG_GEODESY_SSE2)
+  const V vra2 = SIMD::set(ra2), ve2 = SIMD::set(e2), ve4 = SIMD::set(e4);
+  const V zero = SIMD::set(0.0), one = SIMD::set(1.0), two = SIMD::set(2.0);
+  const V three = SIMD::set(3.0);
+  for (; i + SIMD::N <= n; i += SIMD::N) {
+    V X = SIMD::load(xs + i);
+    V Y = SIMD::load(ys + i);
+    V Z = SIMD::load(zs + i);
+
+    V XXpYY = SIMD::add(SIMD::mul(X, X), SIMD::mul(Y, Y));
+    V ZZ = SIMD::mul(Z, Z);
+    V sqrtXXpYY = SIMD::sqrt(XXpYY);
+    V XpSqrtXXpYY = SIMD::add(X, sqrtXXpYY);
+    // Points near the geocenter, and those where the longitude is
+    // atan2(0, 0) (on the polar axis, or at 180 degrees), get special
+    // treatment.
+    V bad = SIMD::bitOr(SIMD::lt(SIMD::add(XXpYY, ZZ), SIMD::set(25.0)),
+                        SIMD::eq(XpSqrtXXpYY, zero));
+
+    V p = SIMD::mul(XXpYY, vra2);
+    V q = SIMD::mul(SIMD::mul(ZZ, SIMD::set(1 - e2)), vra2);
+    V r = SIMD::mul(SIMD::set(1/6.0), SIMD::sub(SIMD::add(p, q), ve4));
+    bad = SIMD::bitOr(bad, SIMD::le(r, zero));
+    V s = SIMD::div(SIMD::mul(SIMD::mul(ve4, p), q),
+                    SIMD::mul(SIMD::mul(SIMD::set(4.0), r), SIMD::mul(r, r)));
+    s = SIMD::max(s, zero);
+    V c = SIMD::add(SIMD::add(one, s),
+                    SIMD::sqrt(SIMD::mul(s, SIMD::add(two, s))));
+    // c is just a little over 1 near the earth's surface.  Our cube
+    // root is good for 1 <= c <= 2.
+    bad = SIMD::bitOr(bad, SIMD::gt(c, two));
+
+    if (SIMD::mask(bad) == (1 << SIMD::N) - 1) {
+      // Nothing for us to do.
+      for (size_t j = i; j < i + SIMD::N; j++) {
+        SGGeod geod;
+        SGCartToGeod(SGVec3<double>(xs[j], ys[j], zs[j]), geod);
+        lons[j] = geod.getLongitudeRad();
+        lats[j] = geod.getLatitudeRad();
+        elevs[j] = geod.getElevationM();
+      }
+      continue;
+    }
+
+    // t = cbrt(c), starting from the tangent at c = 1.
+    V t = SIMD::div(SIMD::add(c, two), three);
+    for (int k = 0; k < 4; k++) {
+      t = SIMD::div(SIMD::add(SIMD::add(t, t), SIMD::div(c, SIMD::mul(t, t))),
+                    three);
+    }
+
+    V u = SIMD::mul(r, SIMD::add(SIMD::add(one, t), SIMD::div(one, t)));
+    V v = SIMD::sqrt(SIMD::add(SIMD::mul(u, u), SIMD::mul(ve4, q)));
+    V w = SIMD::div(SIMD::mul(ve2, SIMD::sub(SIMD::add(u, v), q)),
+                    SIMD::mul(two, v));
+    V k = SIMD::sub(SIMD::sqrt(SIMD::add(SIMD::add(u, v), SIMD::mul(w, w))), w);
+    V D = SIMD::div(SIMD::mul(k, sqrtXXpYY), SIMD::add(k, ve2));
+    // In both arctangents the denominator is non-negative, so
+    // atan2(a, b) == atan(a / b) (even when b is 0, since a / b is
+    // then infinite).
+    V lon = SIMD::mul(two, atanSIMD(SIMD::div(Y, XpSqrtXXpYY)));
+    V sqrtDDpZZ = SIMD::sqrt(SIMD::add(SIMD::mul(D, D), ZZ));
+    V lat = SIMD::mul(two, atanSIMD(SIMD::div(Z, SIMD::add(D, sqrtDDpZZ))));
+    V elev = SIMD::div(SIMD::mul(SIMD::sub(SIMD::add(k, ve2), one), sqrtDDpZZ),
+                       k);
+
+    SIMD::store(lons + i, lon);
+    SIMD::store(lats + i, lat);
+    SIMD::store(elevs + i, elev);
+
+    // Fix up any special cases.
+    int m = SIMD::mask(bad);
+    for (int j = 0; m != 0; j++, m >>= 1) {
+      if (m & 1) {
+        SGGeod geod;
+        SGCartToGeod(SGVec3<double>(xs[i + j], ys[i + j], zs[i + j]), geod);
+        lons[i + j] = geod.getLongitudeRad();
+        lats[i + j] = geod.getLatitudeRad();
+        elevs[i + j] = geod.getElevationM();
+      }
+    }
+  }
+#endif
+
+  // Scalar fallback, and leftovers.
+  for (; i < n; i++) {
+    SGGeod geod;
+    SGCartToGeod(SGVec3<double>(xs[i], ys[i], zs[i]), geod);
+    lons[i] = geod.getLongitudeRad();
+    lats[i] = geod.getLatitudeRad();
+    elevs[i] = geod.getElevationM();
+  }
+}
+
 void
 SGGeodesy::SGGeodToCart(const SGGeod& geod, SGVec3<double>& cart)
 {
@@ -18,6 +18,8 @@
 #ifndef SGGeodesy_H
 #define SGGeodesy_H
 
+#include <cstddef>
+
 class SGGeodesy {
 public:
   // Hard numbers from the WGS84 standard.
@@ -30,6 +32,17 @@ public:
   /// Takes a cartesian coordinate data and returns the geodetic
   /// coordinates.
   static void SGCartToGeod(const SGVec3<double>& cart, SGGeod& geod);
+
+  /// Batch version of the above for n points given as separate x, y
+  /// and z arrays (structure of arrays).  Longitudes and latitudes are
+  /// returned in radians, elevations in metres.  Output arrays may not
+  /// overlap the inputs.  Uses SSE2 where available (AVX if the
+  /// compiler targets it, eg with -mavx2); points far from the
+  /// earth's surface take the scalar path.  Results agree with SGCartToGeod() to
+  /// within 1e-12 radians and 1e-6 metres.
+  static void SGCartToGeod(size_t n, const double* x, const double* y,
+                           const double* z, double* lon, double* lat,
+                           double* elev);
   
   /// Takes a geodetic coordinate data and returns the cartesian
   /// coordinates.
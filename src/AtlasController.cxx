@@ -249,7 +249,7 @@ AtlasController::AtlasController(const char *paletteDir)
     // directories we have, and whether there are maps generated for
     // those directories.
     Preferences& p = globals.prefs;
-    _tm = new TileManager(p.scenery_root, p.path);
+    _tm = new TileManager(p.scenery_root, p.path, p.deriveMaps.get());
     if (_tm->mapLevels().none()) {
 	// EYE - magic numbers
 	bitset<TileManager::MAX_MAP_LEVEL> levels;
@@ -261,6 +261,32 @@ AtlasController::AtlasController(const char *paletteDir)
 	_tm->setMapLevels(levels);
     }
 
+    // Set up the compiled scenery cache, creating its directory if
+    // necessary, and trimming it if it's grown too big.
+    if (p.sceneryCache.get()) {
+	SGPath cache(p.path.get());
+	cache.append("SceneryCache");
+	SGPath dir(cache);
+	dir.append("junk");	// See TileManager::setMapLevels().
+	if (cache.exists() || (dir.create_dir(0755) == 0)) {
+	    Bucket::cacheDir = cache;
+	    Bucket::pruneCache((size_t)p.sceneryCacheSize.get() * 1024 * 1024);
+	} else {
+	    fprintf(stderr, "Couldn't create scenery cache '%s'\n",
+		    cache.c_str());
+	}
+    }
+
+    // Colour scenery with a shader?  This has to be decided before
+    // any scenery is palettized.
+    Bucket::shadedContours = p.shadedContours.get();
+
+    // Live scenery can be drawn at a level of detail that suits the
+    // zoom, within a triangle budget.  Simplifying scenery is slow,
+    // though, so it's optional.
+    Bucket::levelsOfDetail = p.levelsOfDetail.get();
+    Bucket::triangleBudget = p.triangleBudget.get();
+
     // EYE - put inside a try block (see Atlas.cxx)
     _palettes = new Palettes(paletteDir);
     // EYE - is this notification necessary?  Perhaps the Palettes
@@ -39,6 +39,7 @@
 #include "NavData.hxx"
 #include "Palette.hxx"
 #include "Scenery.hxx"
+#include "WorkerPool.hxx"
 
 using namespace std;
 
@@ -109,8 +110,13 @@ class Dispatcher {
     // to what <tile, level> pair.  Returns true if it there's still
     // work left to do, false otherwise.
     bool doWork();
-    // Cancels all mapping (ie, sets state() to DONE).
+    // Cancels all mapping (ie, sets state() to DONE).  Maps already
+    // passed to the tile mapper are still saved.
     void cancel();
+    // Returns the next tile whose maps have all been saved, or NULL
+    // if there are none (see TileMapper::saved()).  Maps are saved in
+    // the background, so this can lag behind tile().
+    Tile *saved() { return _mapper->saved(); }
 
     // Accessors.  Use these to monitor mapping progress.
     vector<Tile *>& tiles() const { return _tiles; }
@@ -126,8 +132,10 @@ class Dispatcher {
     // Returns our notion of missing maps for the current tile, _t.
     bitset<TileManager::MAX_MAP_LEVEL> _missingMaps();
 
-    // The thing that does all the real work.
+    // The thing that does all the real work, and the threads it uses
+    // to save maps.
     TileMapper *_mapper;
+    WorkerPool *_encoder;
     // The tiles that need to be rendered.
     vector<Tile *>& _tiles;
     // If false, only generate a map if it's missing; if true,
@@ -154,6 +162,7 @@ Dispatcher::Dispatcher(AtlasController *ac, vector<Tile *>& tiles, bool force):
 	}
     }
 	       
+    _encoder = new WorkerPool();
     _mapper = new TileMapper(ac->currentPalette(),
 			     maxMapLevel,
 			     ac->discreteContours(),
@@ -163,7 +172,10 @@ Dispatcher::Dispatcher(AtlasController *ac, vector<Tile *>& tiles, bool force):
 			     ac->lightingOn(),
 			     ac->smoothShading(),
 			     ac->imageType(),
-			     ac->JPEGQuality());
+			     ac->JPEGQuality(),
+			     globals.prefs.packMaps.get(),
+			     NULL,
+			     _encoder);
 
     // Starting with the map indicated by _t (and _i) and _level, find
     // the first <tile, level> pair that needs some work done.
@@ -172,7 +184,10 @@ Dispatcher::Dispatcher(AtlasController *ac, vector<Tile *>& tiles, bool force):
 
 Dispatcher::~Dispatcher()
 {
+    // The mapper waits for any maps still being saved, so it must go
+    // before the pool.
     delete _mapper;
+    delete _encoder;
 }
 
 bool Dispatcher::doWork()
@@ -186,9 +201,9 @@ bool Dispatcher::doWork()
 	_mapper->render();
 	_state = WILL_MAP;
     } else if (_state == WILL_MAP) {
-	// Save the rendered map at the current level.
-	_mapper->save(_level);
-	_t->setMapExists(_level++, true);
+	// Save the rendered map at the current level.  The mapper
+	// tells the tile when it's been written.
+	_mapper->save(_level++);
 
 	// Move on to the next level that needs a map, or, if none are
 	// left, the next tile that needs a map, or, if none are left,
@@ -203,6 +218,7 @@ void Dispatcher::cancel()
 {
     _t = NULL;
     _state = DONE;
+    _mapper->finish();
 }
 
 // Starting from, and including, the current _t (and _i) and _level,
@@ -243,7 +259,8 @@ void Dispatcher::_advance()
 
 // Returns a bitset indicating what maps need to be generated for the
 // current tile.  This really means all maps (if _force is true) or
-// just missing maps (if _force is false).
+// just missing maps (if _force is false).  Derived maps are never
+// generated - they come for free with the map they're derived from.
 bitset<TileManager::MAX_MAP_LEVEL> Dispatcher::_missingMaps()
 {
     bitset<TileManager::MAX_MAP_LEVEL> result;
@@ -252,7 +269,7 @@ bitset<TileManager::MAX_MAP_LEVEL> Dispatcher::_missingMaps()
     } else {
 	result = _t->maps() ^ _t->mapLevels();
     }
-    return result;
+    return result & ~_t->tileManager()->derivedLevels();
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -1988,6 +2005,80 @@ void InfoUI::_setVisibility()
     }
 }
 
+//////////////////////////////////////////////////////////////////////
+// CacheUI
+//////////////////////////////////////////////////////////////////////
+CacheUI::CacheUI(int x, int y, Scenery *scenery): _scenery(scenery)
+{
+    const int textHeight = 15;
+    const int bigSpace = 5;
+    // EYE - magic number
+    const int width = 420;
+
+    const int height = textHeight * LINES + 2 * bigSpace;
+
+    _gui = new puPopup(x, y);
+
+    _frame = new puFrame(0, 0, width, height);
+
+    // Lines are listed from the top down.
+    int cury = height - bigSpace - textHeight;
+    for (int i = 0; i < LINES; i++) {
+	// EYE - see InfoUI about font baselines
+	_text[i] = new puText(bigSpace, cury - 5); 
+	cury -= textHeight;
+    }
+
+    _gui->close();
+}
+
+CacheUI::~CacheUI()
+{
+    puDeleteObject(_gui);
+}
+
+void CacheUI::update()
+{
+    const CacheStats &s = _scenery->cacheStats();
+    double elapsed = (SGTimeStamp::now() - s.start).toMSecs();
+
+    _strings[0].printf("Queued: %lu to load, %lu to prefetch "
+		       "(at most %lu, %lu)",
+		       (unsigned long)_scenery->queued(CacheHeap::LOAD),
+		       (unsigned long)_scenery->queued(CacheHeap::PREFETCH),
+		       (unsigned long)s.maxLoadQueue, 
+		       (unsigned long)s.maxPrefetchQueue);
+    _strings[1].printf("Loaded: %u, waited %.0f ms (50%%), %.0f ms (90%%), "
+		       "%.0f ms (max)", s.loads, s.latency.percentile(0.5), 
+		       s.latency.percentile(0.9), s.latency.max());
+    _strings[2].printf("load(): %u calls, %.1f ms mean, %.1f ms max",
+		       s.loadTime.count(), s.loadTime.mean(), 
+		       s.loadTime.max());
+    _strings[3].printf("Prefetched: %u, prefetch(): %.1f ms mean, "
+		       "%.1f ms max", s.prefetches, s.prefetchTime.mean(),
+		       s.prefetchTime.max());
+    _strings[4].printf("Evicted: %u (%u wanted again soon after)", 
+		       s.evictions, s.reloads);
+    _strings[5].printf("Busy: %.0f%% of the time (%u stalls)", 
+		       (elapsed > 0.0) ? s.busy * 100.0 / elapsed : 0.0, 
+		       s.stalls);
+    const char *pools[] = {"Main", "Video"};
+    for (int p = 0; p < CacheObject::POOLS; p++) {
+	CacheObject::Pool pool = (CacheObject::Pool)p;
+	AtlasString &str = _strings[6 + p];
+	size_t limit = _scenery->memoryLimit(pool);
+	str.printf("%s memory: %.1f MB", pools[p], 
+		   _scenery->memoryUsage(pool) / (1024.0 * 1024.0));
+	if (limit > 0) {
+	    str.appendf(" of %.1f MB", limit / (1024.0 * 1024.0));
+	}
+    }
+
+    for (int i = 0; i < LINES; i++) {
+	_text[i]->setLabel(_strings[i].str());
+    }
+}
+
 //////////////////////////////////////////////////////////////////////
 // LightingUI
 //////////////////////////////////////////////////////////////////////
@@ -3477,7 +3568,14 @@ AtlasWindow::AtlasWindow(const char *name,
     glEnable(GL_LIGHT0);
 
     // Initalize scenery object.
+    Texture::mipFiles = globals.prefs.mipFiles.get();
     _scenery = new Scenery(this);
+    _scenery->setPrefetchTime(globals.prefs.prefetchTime.get());
+    _scenery->setMemoryLimit(CacheObject::CPU, 
+			     globals.prefs.cpuMemory.get() * 1024 * 1024);
+    _scenery->setMemoryLimit(CacheObject::GPU, 
+			     globals.prefs.gpuMemory.get() * 1024 * 1024);
+    _scenery->setWorkTime(globals.prefs.cacheWorkTime.get());
 
     // Background map image.
 
@@ -3535,6 +3633,8 @@ AtlasWindow::AtlasWindow(const char *name,
     // Create our user (sub)interfaces.
     _mainUI = new MainUI(20, 20, this);
     _infoUI = new InfoUI(260, 20, this);
+    _cacheUI = new CacheUI(260, 160, _scenery);
+    _cacheUI->hide();
     _lightingUI = new LightingUI(600, 20, this);
     _helpUI = new HelpUI(250, 500, this);
     _mappingUI = new MappingUI(0, 0, this);
@@ -3579,6 +3679,12 @@ AtlasWindow::AtlasWindow(const char *name,
     startTimer((int)(p.update * 1000.0), 
 	       (GLUTWindow::cb)&AtlasWindow::_flightTrackTimer);
 
+    // Log scenery cache statistics periodically if asked.
+    if (p.cacheStats.get() > 0.0) {
+	startTimer((int)(p.cacheStats.get() * 1000.0), 
+		   (GLUTWindow::cb)&AtlasWindow::_cacheStatsTimer);
+    }
+
     // // EYE - hacked in for now.
     // glutTimerFunc(MPTimerInterval, MPAircraftTimer, 0);
 }
@@ -3586,10 +3692,17 @@ AtlasWindow::AtlasWindow(const char *name,
 // EYE - make sure we delete everything we create
 AtlasWindow::~AtlasWindow()
 {
+    // We're called on exit, so this is where we give the final
+    // statistics.
+    if (globals.prefs.cacheStats.get() > 0.0) {
+	_scenery->printCacheStats(stdout, true);
+    }
+
     delete _overlays;
 
     delete _mainUI;
     delete _infoUI;
+    delete _cacheUI;
     delete _helpUI;
     delete _searchUI;
     delete _mappingUI;
@@ -3606,6 +3719,10 @@ AtlasWindow::~AtlasWindow()
 void AtlasWindow::_display()
 {
     assert(glutGetWindow() == id());
+
+    // The scenery cache fits its work in around drawing, so it needs
+    // to know how long we take.
+    SGTimeStamp frameStart = SGTimeStamp::now();
   
     // EYE - get rid of this and use OpenGL Profiler instead?  Wrap in
     // #ifdef DEBUG?
@@ -3700,6 +3817,9 @@ void AtlasWindow::_display()
     }
 
     // Render the widgets.
+    if (_cacheUI->isVisible()) {
+	_cacheUI->update();
+    }
     puDisplay();
 
 #ifdef DEBUG_FRAME_RATE
@@ -3743,6 +3863,9 @@ void AtlasWindow::_display()
     postRedisplay();
 #endif
 
+    // We don't count swapping buffers, as that may just be waiting
+    // for the screen to refresh.
+    _scenery->frameDrawn((SGTimeStamp::now() - frameStart).toMSecs());
     glutSwapBuffers();
 
     // ... and check errors at the end.
@@ -4475,28 +4598,38 @@ bool AtlasWindow::_doWork()
 	// *next*.
 	result = _dispatcher->doWork();
 
-	// We know we've finished mapping a tile if we've moved on to
-	// the next one.  If we haven't, we're still mapping.
+	// If we haven't moved on to the next tile, we're still
+	// mapping.
 	if (t == _dispatcher->tile()) {
 	    _background->setTileStatus(t, Background::MAPPING);
-	} else {
-	    // EYE - send out a notification instead?  Are we
-	    // violating our rules about MVC communiation (see
-	    // notifications.hxx) to be calling Background and Scenery
-	    // methods directly?  Note that we also directly call
-	    // _scenery methods elsewhere, which supports this
-	    // approach.  However, SceneryTile subscribes to
-	    // notifications, which seems to violate it.  If we could
-	    // send parameters with a notification, would that solve
-	    // this problem?
-	    _background->setTileStatus(t, Background::MAPPED);
-	    _scenery->update(t);
 	}
+	// Once we have, we know we've finished mapping it when its
+	// maps have all been saved.
+	_savedMaps();
     }
 
     return result;
 }
 
+// Updates the tiles whose maps the dispatcher has finished saving.
+void AtlasWindow::_savedMaps()
+{
+    Tile *t;
+    while ((t = _dispatcher->saved())) {
+	// EYE - send out a notification instead?  Are we
+	// violating our rules about MVC communiation (see
+	// notifications.hxx) to be calling Background and Scenery
+	// methods directly?  Note that we also directly call
+	// _scenery methods elsewhere, which supports this
+	// approach.  However, SceneryTile subscribes to
+	// notifications, which seems to violate it.  If we could
+	// send parameters with a notification, would that solve
+	// this problem?
+	_background->setTileStatus(t, Background::MAPPED);
+	_scenery->update(t);
+    }
+}
+
 // Called periodically to check for input on network and serial ports.
 void AtlasWindow::_flightTrackTimer()
 {
@@ -4508,6 +4641,16 @@ void AtlasWindow::_flightTrackTimer()
 	       (GLUTWindow::cb)&AtlasWindow::_flightTrackTimer);
 }
 
+// Called periodically to log scenery cache statistics (as specified
+// by the "cache-stats" user preference).
+void AtlasWindow::_cacheStatsTimer()
+{
+    _scenery->printCacheStats(stdout);
+
+    startTimer((int)(globals.prefs.cacheStats.get() * 1000.0), 
+	       (GLUTWindow::cb)&AtlasWindow::_cacheStatsTimer);
+}
+
 // Called to initiate a new search or continue an active search.  If
 // the search is big, it will only do a portion of it, then reschedule
 // itself to continue the search.
@@ -4979,6 +5122,7 @@ void AtlasWindow::cancelMapping()
     // their state in the pixmap correctly represents their real state
     // (which will either be mapped or unmapped).
     _dispatcher->cancel();
+    _savedMaps();
     for (size_t i = _dispatcher->i(); i < _tiles.size(); i++) {
 	Tile *t = _tiles[i];
     	if (t->isType(TileManager::UNMAPPED)) {
@@ -5011,8 +5155,13 @@ void AtlasWindow::notification(Notification::type n)
     	}
     } else if ((n == Notification::AircraftMoved) ||
 	       (n == Notification::AutocentreMode)) {
+	// When we follow the aircraft, the scenery can load what it's
+	// heading towards.
 	if (autocentreMode()) {
 	    centreMapOnAircraft();
+	    _scenery->predict(_ac->currentPoint());
+	} else {
+	    _scenery->predict(NULL);
 	}
     } else if (n == Notification::FlightTrackModified) {
 	// This notification could mean several things.  Most we don't
@@ -5156,6 +5305,41 @@ void AtlasWindow::_debugPrefixKeypressed(unsigned char key, int x, int y)
 	    movePosition(eye());
 	  }
       break;
+      case 'p':
+	// How well is prefetching working?
+	{
+	    const Scenery::Residency &r = _scenery->residency();
+	    printf("Newly visible tiles resident: %u of %u (%.0f%%)\n",
+		   r.residentTiles, r.tiles, 
+		   (r.tiles > 0) ? r.residentTiles * 100.0 / r.tiles : 0.0);
+	    printf("Newly visible buckets resident: %u of %u (%.0f%%)\n",
+		   r.residentBuckets, r.buckets, 
+		   (r.buckets > 0) ? 
+		   r.residentBuckets * 100.0 / r.buckets : 0.0);
+
+	    // And how much memory is it costing?
+	    const char *pools[] = {"Main", "Video"};
+	    for (int p = 0; p < CacheObject::POOLS; p++) {
+		CacheObject::Pool pool = (CacheObject::Pool)p;
+		size_t limit = _scenery->memoryLimit(pool);
+		printf("%s memory used: %.1f MB", pools[p], 
+		       _scenery->memoryUsage(pool) / (1024.0 * 1024.0));
+		if (limit > 0) {
+		    printf(" of %.1f MB", limit / (1024.0 * 1024.0));
+		}
+		printf("\n");
+	    }
+	}
+	break;
+      case 'c':
+	// Show or hide scenery cache statistics.
+	if (_cacheUI->isVisible()) {
+	    _cacheUI->hide();
+	} else {
+	    _cacheUI->reveal();
+	}
+	postRedisplay();
+	break;
     }
 }
 
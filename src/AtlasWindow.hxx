@@ -176,6 +176,7 @@ class ScreenLocation {
 // ...
 class MainUI;
 class InfoUI;
+class CacheUI;
 class LightingUI;
 class HelpUI;
 class SearchUI;
@@ -308,6 +309,7 @@ class AtlasWindow: public AtlasBaseWindow, Subscriber {
 
     MainUI *_mainUI;
     InfoUI *_infoUI;
+    CacheUI *_cacheUI;
     LightingUI *_lightingUI;
     HelpUI *_helpUI;
     SearchUI *_searchUI;
@@ -360,9 +362,12 @@ class AtlasWindow: public AtlasBaseWindow, Subscriber {
     // updates the interface.  If no work is left, it returns false,
     // otherwise it returns true.
     bool _doWork();
+    // Marks tiles whose maps have been saved as mapped.
+    void _savedMaps();
 
     // Timers
     void _flightTrackTimer();
+    void _cacheStatsTimer();
     void _searchTimer();
     void _renderTimer();
 
@@ -550,6 +555,41 @@ class InfoUI: public Subscriber {
     void _setText();
 };
 
+//////////////////////////////////////////////////////////////////////
+//
+// Cache Interface
+//
+// This shows scenery cache statistics: how many tiles are waiting to
+// be loaded, how long they wait, how often they're evicted, and how
+// much memory they're using.  It's a debugging aid, toggled with
+// Ctrl-H c.
+//
+//////////////////////////////////////////////////////////////////////
+class CacheUI {
+  public:
+    CacheUI(int x, int y, Scenery *scenery);
+    ~CacheUI();
+
+    void reveal() { _gui->reveal(); }
+    void hide() { _gui->hide(); }
+    bool isVisible() { return _gui->isVisible(); }
+
+    // Updates the displayed statistics.
+    void update();
+
+  protected:
+    enum { LINES = 8 };
+
+    Scenery *_scenery;
+
+    puPopup *_gui;
+    puFrame *_frame;
+    puText *_text[LINES];
+    // puText doesn't copy its label, so we need to keep the strings
+    // around.
+    AtlasString _strings[LINES];
+};
+
 //////////////////////////////////////////////////////////////////////
 //
 // Network Popup
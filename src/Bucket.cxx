@@ -25,22 +25,168 @@
 #include "Bucket.hxx"
 
 // C++ system files
+#include <algorithm>
+#include <cstring>
 #include <sstream>
 #include <fstream>
 
+// System include files
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#ifdef WIN32
+#  include <io.h>
+#else
+#  include <unistd.h>
+#endif
+
 // Other libraries' include files
+#include <plib/ul.h>
 #include <simgear/bucket/newbucket.hxx>
+#include <simgear/structure/exception.hxx>
 
 // Our project's include files
 #include "Palette.hxx"
 #include "Subbucket.hxx"
+#include "WorkerPool.hxx"
 
 using namespace std;
 
+// Loads a single subbucket in a worker thread.  Subbucket::load()
+// does no OpenGL calls - it just reads the file and builds the vertex,
+// normal, and index arrays.  They're uploaded to the GPU the first
+// time the subbucket is drawn (in the main thread).
+class Bucket::SubbucketJob: public WorkerPool::Job {
+  public:
+    SubbucketJob(Subbucket *sb, Bucket::Projection p): 
+	_sb(sb), _projection(p) {}
+
+    // SGBinObject::read_bin_flat() throws an exception if it can't
+    // read the file (eg, if it's corrupt).  An exception escaping from
+    // a worker thread would take the whole program down, so we catch
+    // it here, and remember what it said.  The subbucket won't be
+    // marked as loaded, and collect() will complain about it.
+    void run() 
+    {
+	try {
+	    _sb->load(_projection);
+	} catch (const sg_exception &e) {
+	    _error = e.getMessage();
+	}
+    }
+
+    // Why the load failed, if it threw an exception, or "" otherwise.
+    const string &error() const { return _error; }
+
+  protected:
+    Subbucket *_sb;
+    Bucket::Projection _projection;
+    string _error;
+};
+
 Palette *Bucket::palette = NULL;
 bool Bucket::discreteContours = true;
 bool Bucket::contourLines = false;
 bool Bucket::polygonEdges = false;
+bool Bucket::shadedContours = false;
+SGPath Bucket::cacheDir;
+bool Bucket::levelsOfDetail = false;
+unsigned int Bucket::triangleBudget = 0;
+
+// A file in the scenery cache, for pruneCache().
+struct __CacheFile {
+    string name;
+    time_t mtime;
+    size_t size;
+
+    // Oldest first.
+    bool operator<(const __CacheFile &f) const { return mtime < f.mtime; }
+};
+
+void Bucket::pruneCache(size_t maxBytes)
+{
+    if (cacheDir.isNull()) {
+	return;
+    }
+    ulDir *dir = ulOpenDir(cacheDir.c_str());
+    if (dir == NULL) {
+	return;
+    }
+
+    // Cache files are named <hash>-<projection>.sbc, and are written
+    // as <name>.<pid>, then renamed (see Subbucket::_writeCache()).
+    // We leave any other files alone.
+    const time_t day = 24 * 60 * 60;
+    time_t now = time(NULL);
+    vector<__CacheFile> files;
+    size_t total = 0;
+    ulDirEnt *entity;
+    while ((entity = ulReadDir(dir)) != NULL) {
+	const char *sbc = strstr(entity->d_name, ".sbc");
+	if (entity->d_isdir || (sbc == NULL)) {
+	    continue;
+	}
+	SGPath p(cacheDir);
+	p.append(entity->d_name);
+	struct stat st;
+	if (stat(p.c_str(), &st) != 0) {
+	    continue;
+	}
+
+	if (sbc[4] != '\0') {
+	    // A temporary file.  If it's more than a day old, whoever
+	    // was writing it isn't going to finish.
+	    if (st.st_mtime < now - day) {
+		unlink(p.c_str());
+	    }
+	    continue;
+	}
+
+	__CacheFile f;
+	f.name = p.str();
+	f.mtime = st.st_mtime;
+	f.size = st.st_size;
+	files.push_back(f);
+	total += f.size;
+    }
+    ulCloseDir(dir);
+
+    if ((maxBytes == 0) || (total <= maxBytes)) {
+	return;
+    }
+
+    // Subbuckets touch cache files whenever they use them, so the
+    // oldest files are the least recently used.
+    sort(files.begin(), files.end());
+    for (size_t i = 0; (i < files.size()) && (total > maxBytes); i++) {
+	if (unlink(files[i].name.c_str()) == 0) {
+	    total -= files[i].size;
+	}
+    }
+}
+
+// The maximum error of each level of detail, in metres.  Each is 4
+// times the last, which roughly quarters the number of triangles in
+// smooth terrain.
+static const double __lodErrors[Bucket::LOD_LEVELS] = {0.0, 5.0, 20.0, 80.0};
+// How big, in pixels, an error can be before it's noticeable.
+static const double __lodPixels = 0.5;
+
+double Bucket::lodError(unsigned int level)
+{
+    return __lodErrors[min(level, LOD_LEVELS - 1)];
+}
+
+unsigned int Bucket::lodLevel(double metresPerPixel)
+{
+    unsigned int level = 0;
+    while ((level + 1 < LOD_LEVELS) && 
+	   (__lodErrors[level + 1] <= metresPerPixel * __lodPixels)) {
+	level++;
+    }
+
+    return level;
+}
 
 // EYE - should we make this nan()/nanl()/nanf() and have an isNanE()
 // function (which is just isnan())?  Note that we can't do simple
@@ -56,7 +202,8 @@ const float Bucket::NanE = -numeric_limits<float>::max();
 // term for a part, and a tile is the 1/8 x 1/8 degree (or whatever)
 // bit corresponding to a single scenery file.
 Bucket::Bucket(const SGPath &p, long int index): 
-    _p(p), _index(index), _loaded(false), _size(0)
+    _p(p), _index(index), _pool(NULL), _loaded(false), _level(0), 
+    _scratchBytes(0)
 {
     // Calculate bounds.
 
@@ -90,7 +237,7 @@ Bucket::~Bucket()
     unload();
 }
 
-void Bucket::load(Projection projection)
+void Bucket::load(Projection projection, WorkerPool *pool)
 {
     // EYE - all guesswork!  Are there docs?
 
@@ -102,13 +249,124 @@ void Bucket::load(Projection projection)
     // (usually airports), and OBJECT_SHARED for something in the
     // Models directory.  We care about OBJECT_BASE and OBJECT types.
 
-    SGPath stg(_p);
-    AtlasString str;
-    str.printf("%d.stg", _index);
-    stg.append(str.str());
-    assert(_size == 0);
+    assert(_subbuckets.empty());
+    assert(!loading());
+
+    vector<SGPath> objects;
+    _objectFiles(objects);
+    for (size_t i = 0; i < objects.size(); i++) {
+	Subbucket *sb = new Subbucket(objects[i]);
+	sb->setLevel(_level);
+	_subbuckets.push_back(sb);
+	if (pool) {
+	    // The real work is done in the background.
+	    SubbucketJob *job = new SubbucketJob(sb, projection);
+	    _jobs.push_back(job);
+	    pool->submit(job);
+	} else {
+	    sb->load(projection);
+	}
+    }
+
+    if (pool && !_jobs.empty()) {
+	// We'll finish up in collect().
+	_pool = pool;
+    } else {
+	_finishLoad();
+    }
+}
+
+bool Bucket::ready()
+{
+    if (!loading()) {
+	return false;
+    }
+
+    for (size_t i = 0; i < _jobs.size(); i++) {
+	if (!_pool->done(_jobs[i])) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+bool Bucket::collect()
+{
+    if (ready()) {
+	// _finishLoad() looks at the jobs to see why any loads failed,
+	// so it must come before we delete them.
+	_finishLoad();
+
+	for (size_t i = 0; i < _jobs.size(); i++) {
+	    delete _jobs[i];
+	}
+	_jobs.clear();
+	_pool = NULL;
+    }
+
+    return _loaded;
+}
+
+void Bucket::wait()
+{
+    if (!loading()) {
+	return;
+    }
+
+    for (size_t i = 0; i < _jobs.size(); i++) {
+	_pool->wait(_jobs[i]);
+    }
+    collect();
+}
+
+void Bucket::_finishLoad()
+{
+    SGPath stg = _stgFile();
+
+    // Get rid of subbuckets that couldn't be loaded.
+    vector<Subbucket *> subbuckets;
+    subbuckets.swap(_subbuckets);
+    for (size_t i = 0; i < subbuckets.size(); i++) {
+	Subbucket *sb = subbuckets[i];
+	if (sb->loaded()) {
+	    sb->setLevel(_level);
+	    _scratchBytes = max(_scratchBytes, sb->scratchBytes());
+	    _subbuckets.push_back(sb);
+	} else {
+	    // If it was loaded in the background, its job knows whether
+	    // it failed because of an exception.  Otherwise the file just
+	    // couldn't be opened.
+	    string why = "not found";
+	    if ((i < _jobs.size()) && !_jobs[i]->error().empty()) {
+		why = _jobs[i]->error();
+	    }
+	    fprintf(stderr, "'%s': couldn't load object file '%s': %s\n", 
+		    stg.c_str(), sb->path().c_str(), why.c_str());
+	    delete sb;
+	}
+    }
+
+    // Find the highest point in the bucket and set _maxElevation.
+    _maxElevation = Bucket::NanE;
+    for (unsigned int i = 0; i < _subbuckets.size(); i++) {
+	if (_subbuckets[i]->maximumElevation() > _maxElevation) {
+	    _maxElevation = _subbuckets[i]->maximumElevation();
+	}
+    }
+
+    _loaded = true;
+}
+
+void Bucket::sceneryFiles(vector<SGPath> &files) const
+{
+    files.push_back(_stgFile());
+    _objectFiles(files);
+}
 
-    ifstream in(stg.c_str());
+void Bucket::_objectFiles(vector<SGPath> &files) const
+{
+    ifstream in(_stgFile().c_str());
     string buf;
     while (getline(in, buf)) {
 	// EYE - use this paradigm for other file reading?
@@ -120,47 +378,150 @@ void Bucket::load(Projection projection)
 	    SGPath object(_p);
 	    object.append(data);
 	    object.concat(".gz"); // EYE - always?
-
-	    Subbucket *sb = new Subbucket(object);
-	    if (sb->load(projection)) {
-		_size += sb->size();
-		_subbuckets.push_back(sb);
-	    } else {
-		fprintf(stderr, "'%s': object file '%s' not found\n", 
-			stg.c_str(), object.c_str());
-	    }
+	    files.push_back(object);
 	}
     }
+}
 
-    // Find the highest point in the bucket and set _maxElevation.
-    _maxElevation = Bucket::NanE;
-    for (unsigned int i = 0; i < _subbuckets.size(); i++) {
-	if (_subbuckets[i]->maximumElevation() > _maxElevation) {
-	    _maxElevation = _subbuckets[i]->maximumElevation();
-	}
-    }
+// Returns the path to our <index>.stg file.
+SGPath Bucket::_stgFile() const
+{
+    SGPath result(_p);
+    AtlasString str;
+    str.printf("%d.stg", _index);
+    result.append(str.str());
 
-    _loaded = true;
+    return result;
 }
 
 void Bucket::unload()
 {
+    // Stop any background loading.  We have to do this before
+    // deleting the subbuckets, since the jobs refer to them.
+    for (size_t i = 0; i < _jobs.size(); i++) {
+	_pool->cancel(_jobs[i]);
+	delete _jobs[i];
+    }
+    _jobs.clear();
+    _pool = NULL;
+
     for (unsigned int i = 0; i < _subbuckets.size(); i++) {
 	delete _subbuckets[i];
     }
     _subbuckets.clear();
-    _size = 0;
+    _scratchBytes = 0;
 
     _loaded = false;
 }
 
 void Bucket::paletteChanged()
 {
+    // Subbuckets that are still being loaded in the background must
+    // be left alone.  They haven't been palettized yet anyway.
+    if (!_loaded) {
+	return;
+    }
+
     for (size_t i = 0; i < _subbuckets.size(); i++) {
 	_subbuckets[i]->paletteChanged();
     }
 }
 
+bool Bucket::palettized() const
+{
+    if (!_loaded) {
+	return false;
+    }
+
+    for (size_t i = 0; i < _subbuckets.size(); i++) {
+	if (!_subbuckets[i]->palettized()) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+void Bucket::palettize(WorkerPool *pool)
+{
+    if (!_loaded) {
+	return;
+    }
+
+    for (size_t i = 0; i < _subbuckets.size(); i++) {
+	_subbuckets[i]->palettize(pool);
+    }
+}
+
+void Bucket::setLevel(unsigned int level)
+{
+    _level = level;
+
+    // Subbuckets being loaded in the background are left alone.  They
+    // were given their level when they were created, and we'll
+    // update them in _finishLoad().
+    if (!_loaded) {
+	return;
+    }
+
+    for (size_t i = 0; i < _subbuckets.size(); i++) {
+	_subbuckets[i]->setLevel(level);
+    }
+}
+
+size_t Bucket::triangles(unsigned int level) const
+{
+    size_t result = 0;
+    if (_loaded) {
+	for (size_t i = 0; i < _subbuckets.size(); i++) {
+	    result += _subbuckets[i]->triangles(level);
+	}
+    }
+
+    return result;
+}
+
+// Subbuckets being loaded in the background belong to the loader, so
+// we don't look at them until we're loaded.
+size_t Bucket::cpuBytes() const
+{
+    size_t result = 0;
+    if (_loaded) {
+	for (size_t i = 0; i < _subbuckets.size(); i++) {
+	    result += _subbuckets[i]->cpuBytes();
+	}
+    }
+
+    return result;
+}
+
+size_t Bucket::gpuBytes() const
+{
+    size_t result = 0;
+    if (_loaded) {
+	for (size_t i = 0; i < _subbuckets.size(); i++) {
+	    result += _subbuckets[i]->gpuBytes();
+	}
+    }
+
+    return result;
+}
+
+bool Bucket::drawable() const
+{
+    if (!_loaded) {
+	return false;
+    }
+
+    for (size_t i = 0; i < _subbuckets.size(); i++) {
+	if (!_subbuckets[i]->drawable()) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
 void Bucket::draw()
 {
     if (!_loaded) {
@@ -172,3 +533,14 @@ void Bucket::draw()
 	_subbuckets[i]->draw();
     }
 }
+
+void Bucket::rasterize(Rasterizer &r)
+{
+    if (!_loaded) {
+	return;
+    }
+
+    for (unsigned int i = 0; i < _subbuckets.size(); i++) {
+	_subbuckets[i]->rasterize(r);
+    }
+}
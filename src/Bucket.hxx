@@ -37,7 +37,9 @@
 
 // Forward class declarations
 class Palette;
+class Rasterizer;
 class Subbucket;
+class WorkerPool;
 
 class Bucket {
 public:
@@ -47,16 +49,55 @@ public:
     // controls whether contour levels should blend into each other;
     // contourLines toggles the drawing of contour lines; polygonEdges
     // toggles the drawing the outline of raw scenery polygons (this
-    // is intended to be used for debugging only).
+    // is intended to be used for debugging only); shadedContours, if
+    // true, colours by elevation (and draws contour lines) with a
+    // shader rather than by chopping triangles (if the shader can't
+    // be used, we chop anyway).
     //
-    // If you change palette or discreteContours, you should notify
-    // all buckets via paletteChanged() or discreteContoursChanged()
-    // respectively, and then draw().  It's not necessary to notify
-    // buckets about changes to contourLines or polygonEdges (because
-    // it doesn't require any recalculations), but you still need to
-    // call draw() of course.
+    // If you change palette (or shadedContours) or discreteContours,
+    // you should notify all buckets via paletteChanged() or
+    // discreteContoursChanged() respectively, and then draw().
+    // Redoing the colouring can take a while, so if you want to
+    // spread the work out, call palettize() on buckets that aren't
+    // palettized() before drawing them.  It's not necessary to
+    // notify buckets about changes to contourLines or polygonEdges
+    // (because it doesn't require any recalculations), but you still
+    // need to call draw() of course.
     static Palette *palette;
     static bool discreteContours, contourLines, polygonEdges;
+    static bool shadedContours;
+
+    // If non-null, subbuckets save their loaded data in this
+    // directory and reuse it the next time they're loaded, rather
+    // than parsing the scenery file again.  It must exist.
+    static SGPath cacheDir;
+    // Deletes the least recently used files in cacheDir until they
+    // take up no more than maxBytes (0 means no limit), as well as
+    // any temporary files left behind by crashes.  Subbuckets delete
+    // cache files that are out of date when they find them, but
+    // files for scenery that has disappeared are only removed by
+    // this.
+    static void pruneCache(size_t maxBytes);
+
+    // Live scenery can be drawn at several levels of detail.  Level
+    // 0 is the scenery as given in the scenery files, and each level
+    // after that is a simplified version of the one before it, whose
+    // surface is within lodError(level) metres of the original (see
+    // MeshSimplifier).  If levelsOfDetail is true, the simplified
+    // levels are created when scenery is loaded, and saved in the
+    // scenery cache along with everything else.  If it's false (the
+    // default), every level is just level 0.
+    static const unsigned int LOD_LEVELS = 4;
+    static bool levelsOfDetail;
+    static double lodError(unsigned int level);
+    // The coarsest level of detail that looks like level 0 at the
+    // given scale (ie, whose error is less than half a pixel).
+    static unsigned int lodLevel(double metresPerPixel);
+    // The approximate maximum number of triangles of live scenery to
+    // draw at once.  If necessary, coarser levels of detail are drawn
+    // than lodLevel() would give (see Scenery::draw()).  0 means
+    // there's no limit.
+    static unsigned int triangleBudget;
 
     // This is a constant representing "Not an Elevation" - it can be
     // used to represent a nonsensical elevation value, and is
@@ -72,17 +113,66 @@ public:
     const atlasSphere& bounds() const { return _bounds; }
     double centreLat() const { return _lat; }
     double centreLon() const { return _lon; }
-
-    void load(Projection p = CARTESIAN);
+    // Appends the scenery files we're made from: our .stg file,
+    // followed by the object files it names (whether or not they
+    // exist).  This only reads the .stg file, so it's quick.
+    void sceneryFiles(std::vector<SGPath> &files) const;
+
+    // Loads the bucket's subbuckets.  If pool is NULL, this is done
+    // immediately, and the bucket is loaded when load() returns.
+    // Otherwise the scenery files are decoded in the background by
+    // the pool, and load() returns right away.  In that case,
+    // loading() will be true until collect() is called and finds that
+    // all the subbuckets are done.
+    void load(Projection p = CARTESIAN, WorkerPool *pool = NULL);
     bool loaded() const { return _loaded; }
+    bool loading() const { return _pool != NULL; }
+    // True if an asynchronous load has finished in the background,
+    // and is just waiting to be collected.
+    bool ready();
+    // Finishes an asynchronous load if the pool is done with all of
+    // our subbuckets.  Must be called in the main thread.  Returns
+    // loaded().
+    bool collect();
+    // Blocks until an asynchronous load is done, then collects it.
+    // Must be called in the main thread.
+    void wait();
+    // Unloads the bucket, cancelling any asynchronous load.
     void unload();
-    unsigned int size() { return _size; }
+    // Memory used by our subbuckets in main memory and on the GPU,
+    // in bytes (0 until we're loaded - see Subbucket::cpuBytes()).
+    size_t cpuBytes() const;
+    size_t gpuBytes() const;
+    // The largest scratchBytes() of our subbuckets (see Subbucket).
+    size_t scratchBytes() const { return _scratchBytes; }
 
     double maximumElevation() const { return _maxElevation; }
 
     void paletteChanged();
+    // True if all of our subbuckets have been coloured according to
+    // the current palette.  If not, draw() will do it.
+    bool palettized() const;
+    // Palettizes our subbuckets, using the given pool, if any (see
+    // Subbucket::palettize()).
+    void palettize(WorkerPool *pool = NULL);
+
+    // Sets the level of detail of our subbuckets (see Subbucket).
+    // This can be done at any time, even before we're loaded.  Like
+    // a palette change, the new level isn't drawn until we're
+    // palettized again.
+    void setLevel(unsigned int level);
+    unsigned int level() const { return _level; }
+    // The number of triangles we have at the given level (0 if we're
+    // not loaded).
+    size_t triangles(unsigned int level) const;
+    // True if we have something to draw, even if it isn't at the
+    // current level of detail or with the current palette.
+    bool drawable() const;
 
     void draw();
+    // Draws into the given rasterizer instead (see
+    // Subbucket::rasterize()).
+    void rasterize(Rasterizer &r);
 
   protected:
     SGPath _p;			// Our scenery directory.
@@ -98,8 +188,24 @@ public:
     std::vector<Subbucket *> _subbuckets;
     double _maxElevation;
 
+    // Used for asynchronous loads.  Each subbucket is loaded by its
+    // own job (one for each entry in _subbuckets).  The pool is
+    // non-NULL while the jobs are outstanding.
+    class SubbucketJob;
+    std::vector<SubbucketJob *> _jobs;
+    WorkerPool *_pool;
+    // Called when all subbuckets have been loaded (or have failed
+    // trying).  Discards (and reports) failures and calculates our
+    // maximum elevation.
+    void _finishLoad();
+
+    SGPath _stgFile() const;
+    // Appends the object files named in our .stg file.
+    void _objectFiles(std::vector<SGPath> &files) const;
+
     bool _loaded;
-    unsigned int _size;		// Size of bucket (approximately) in bytes.
+    unsigned int _level;	// Level of detail.
+    size_t _scratchBytes;
 };
 
 #endif // _BUCKET_H_
@@ -26,6 +26,7 @@
 
 // C++ include files
 #include <cassert>
+#include <cmath>
 #include <algorithm>
 
 // Other libraries' include files
@@ -45,30 +46,218 @@ using namespace std;
 // is used to figure out which one to call when the GLUT timer fires.
 map<int, Cache *> Cache::__map;
 
-CacheObject::CacheObject()
+CacheObject::CacheObject(): 
+    _visible(false), _predicted(false), _resident(false)
 {
+    for (int i = 0; i < 3; i++) {
+	_heapIndex[i] = -1;
+    }
+    for (int p = 0; p < POOLS; p++) {
+	_size[p] = 0;
+    }
 }
 
 CacheObject::~CacheObject()
 {
 }
 
-// More C++ hoops to jump through.
-struct CacheObjectLessThan {
-    bool operator()(CacheObject *a, CacheObject *b) 
-    {
-	return a->dist() < b->dist();
+float CacheHeap::key(const CacheObject *c) const
+{
+    if (_type != UNLOAD) {
+	return c->_dist;
+    } else if (c->_predicted) {
+	// Distances are never negative, so this puts predicted
+	// objects after everyone else.
+	return 1.0;
+    } else {
+	return -c->_dist;
+    }
+}
+
+void CacheHeap::update(CacheObject *c)
+{
+    int i = c->_heapIndex[_type];
+    if (i < 0) {
+	i = _objects.size();
+	_objects.push_back(c);
+	c->_heapIndex[_type] = i;
+    }
+    if (!_up(i)) {
+	_down(i);
+    }
+}
+
+void CacheHeap::remove(CacheObject *c)
+{
+    int i = c->_heapIndex[_type];
+    if (i < 0) {
+	return;
+    }
+    c->_heapIndex[_type] = -1;
+
+    // Fill the hole with the last object, and move it to where it
+    // belongs.
+    CacheObject *last = _objects.back();
+    _objects.pop_back();
+    if (last != c) {
+	_set(i, last);
+	if (!_up(i)) {
+	    _down(i);
+	}
+    }
+}
+
+void CacheHeap::rebuild()
+{
+    for (size_t i = _objects.size() / 2; i-- > 0;) {
+	_down(i);
     }
-};
+}
+
+void CacheHeap::_set(size_t i, CacheObject *c)
+{
+    _objects[i] = c;
+    c->_heapIndex[_type] = i;
+}
+
+// Moves the object at i up as far as it needs to go.  Returns true if
+// it moved.
+bool CacheHeap::_up(size_t i)
+{
+    CacheObject *c = _objects[i];
+    float k = key(c);
+    size_t start = i;
+    while (i > 0) {
+	size_t parent = (i - 1) / 2;
+	if (key(_objects[parent]) <= k) {
+	    break;
+	}
+	_set(i, _objects[parent]);
+	i = parent;
+    }
+    _set(i, c);
+
+    return (i != start);
+}
+
+void CacheHeap::_down(size_t i)
+{
+    CacheObject *c = _objects[i];
+    float k = key(c);
+    size_t n = _objects.size();
+    while (true) {
+	size_t child = i * 2 + 1;
+	if (child >= n) {
+	    break;
+	}
+	if ((child + 1 < n) && 
+	    (key(_objects[child + 1]) < key(_objects[child]))) {
+	    child++;
+	}
+	if (k <= key(_objects[child])) {
+	    break;
+	}
+	_set(i, _objects[child]);
+	i = child;
+    }
+    _set(i, c);
+}
+
+CacheStats::Histogram::Histogram(): _count(0), _total(0.0), _max(0.0)
+{
+    for (int i = 0; i < BINS; i++) {
+	_bins[i] = 0;
+    }
+}
+
+void CacheStats::Histogram::add(double ms)
+{
+    // Bin i (other than the first) holds times from 2^(i-1) to 2^i.
+    int i = 0;
+    while ((i < BINS - 1) && (ms >= ldexp(1.0, i))) {
+	i++;
+    }
+    _bins[i]++;
+    _count++;
+    _total += ms;
+    if (ms > _max) {
+	_max = ms;
+    }
+}
+
+double CacheStats::Histogram::percentile(double fraction) const
+{
+    unsigned int n = 0;
+    for (int i = 0; i < BINS - 1; i++) {
+	n += _bins[i];
+	if ((n > 0) && (n >= fraction * _count)) {
+	    return min(ldexp(1.0, i), _max);
+	}
+    }
+
+    return _max;
+}
+
+void CacheStats::Histogram::print(FILE *f) const
+{
+    for (int i = 0; i < BINS; i++) {
+	if (_bins[i] == 0) {
+	    continue;
+	}
+	double low = (i == 0) ? 0.0 : ldexp(1.0, i - 1);
+	if (i < BINS - 1) {
+	    fprintf(f, "\t%6.0f - %6.0f ms: ", low, ldexp(1.0, i));
+	} else {
+	    fprintf(f, "\t%6.0f ms and up: ", low);
+	}
+	fprintf(f, "%6u (%5.1f%%)\n", _bins[i], _bins[i] * 100.0 / _count);
+    }
+}
+
+CacheStats::CacheStats(): 
+    loads(0), prefetches(0), evictions(0), reloads(0), stalls(0),
+    maxLoadQueue(0), maxPrefetchQueue(0), busy(0.0)
+{
+    start.stamp();
+}
+
+// When the centre has moved more than this fraction of the farthest
+// visible object's distance, we recalculate everyone's distances.
+static const float __rekeyDistance = 0.25;
+// We keep non-visible objects that are this much farther than the
+// farthest visible one.
+static const float __keepDistance = 1.25;
+// An evicted object that is wanted again within this many seconds
+// counts as a reload.  EYE - magic number
+static const double __reloadTime = 60.0;
+// When adaptive, we aim for a frame every __movingPeriod ms while the
+// view is changing (and for __settleTime ms after), and every
+// __staticPeriod ms otherwise, but always work at least __minWorkTime
+// ms.  New frame times are given __frameWeight in the running
+// average.  EYE - magic numbers
+static const double __movingPeriod = 1000.0 / 30.0;
+static const double __staticPeriod = 100.0;
+static const double __settleTime = 500.0;
+static const double __minWorkTime = 2.0;
+static const double __frameWeight = 0.25;
 
 Cache::Cache(int window,
-	     unsigned int cacheSize, 
+	     size_t cpuSize,
+	     size_t gpuSize,
 	     unsigned int workTime, 
 	     unsigned int interval):
-    _window(window), _cacheSize(cacheSize), _objectsSize(0), 
-    _workTime(workTime), _interval(interval), _callbackPending(false), 
-    _running(false)
+    _window(window), _toBeLoaded(CacheHeap::LOAD), 
+    _toBePrefetched(CacheHeap::PREFETCH), _toBeUnloaded(CacheHeap::UNLOAD),
+    _visibleDist(0.0), _keepDist(0.0), _workTime(workTime), 
+    _interval(interval), _adaptive(false), _frameTime(0.0), 
+    _callbackPending(false)
 {
+    _limit[CacheObject::CPU] = cpuSize;
+    _limit[CacheObject::GPU] = gpuSize;
+    _usage[CacheObject::CPU] = _usage[CacheObject::GPU] = 0;
+    sgdZeroVec3(_centre);
+    sgdZeroVec3(_keyCentre);
+
     // Get a valid id for ourselves and add ourselves to the map.
     // This is a bit inefficient, but caches won't be created very
     // often, nor will there be very many.
@@ -83,75 +272,111 @@ Cache::~Cache()
     __map.erase(_id);
 }
 
-// Reset the cache in preparation for a new set of objects.  We update
-// all loaded objects and we forget everything we knew about what
-// needs to be loaded and what needs to be unloaded.  We also stop all
-// cache processing.  We do *not* unload anything - all loaded objects
-// will remain loaded for the time-being.
-void Cache::reset(sgdVec3 centre)
+// Set a new centre.  If we've moved far enough, we update the
+// distances of all the objects in our heaps, and reorder them.  Note
+// that this is the only thing we do that depends on the total number
+// of objects, rather than the number that have changed, and it's
+// rare when panning smoothly.
+void Cache::setCentre(sgdVec3 centre)
 {
     sgdCopyVec3(_centre, centre);
+    _visibleDist = 0.0;
 
-    set<CacheObject *>::const_iterator i;
-    for (i = _all.begin(); i != _all.end(); i++) {
-	(*i)->_toBeLoaded = false;
-	(*i)->_toBeUnloaded = true;
-	(*i)->calcDist(_centre);
+    if (sgdDistanceVec3(_centre, _keyCentre) <= _keepDist * __rekeyDistance) {
+	return;
     }
+    sgdCopyVec3(_keyCentre, _centre);
 
-    _toBeLoaded.clear();
-    _toBeUnloaded.clear();
+    CacheHeap *heaps[3] = {&_toBeLoaded, &_toBePrefetched, &_toBeUnloaded};
+    for (int h = 0; h < 3; h++) {
+	for (size_t i = 0; i < heaps[h]->size(); i++) {
+	    heaps[h]->at(i)->calcDist(_centre);
+	}
+	heaps[h]->rebuild();
+    }
+}
 
-    _running = false;
+// Tells us that a frame has been drawn, and how long it took.
+void Cache::frameDrawn(double ms)
+{
+    // A running average smooths out the odd slow frame.
+    if (_frameEnd == SGTimeStamp()) {
+	_frameTime = ms;
+    } else {
+	_frameTime += (ms - _frameTime) * __frameWeight;
+    }
+    _frameEnd.stamp();
 }
 
-// Add an object for loading.  This should only be done between a
-// reset() and a go().  If this is done after go(), nothing is done.
-// When we add an object, we call its shouldLoad() method, which
-// should return true if the object wants its load() method to be
-// called.
-void Cache::add(CacheObject* c)
+// Tells us about an object's status.  Visible objects are asked if
+// they need loading, predicted objects if they need prefetching, and
+// objects that are neither (but are loaded) become candidates for
+// unloading.
+bool Cache::update(CacheObject* c, bool visible, bool predicted)
 {
-    if (_running) {
-	// EYE - print warning?
-	return;
+    c->calcDist(_centre);
+    c->_visible = visible;
+    c->_predicted = predicted;
+    _measure(c);
+
+    bool result = false;
+    if (visible) {
+	_visibleDist = max(_visibleDist, c->_dist);
+	if (c->shouldLoad()) {
+	    if (!_toBeLoaded.contains(c)) {
+		c->_queued.stamp();
+		_wanted(c);
+	    }
+	    _toBeLoaded.update(c);
+	    _stats.maxLoadQueue = max(_stats.maxLoadQueue, _toBeLoaded.size());
+	    result = true;
+	} else {
+	    _toBeLoaded.remove(c);
+	}
+    } else {
+	_toBeLoaded.remove(c);
     }
 
-    c->_toBeUnloaded = false;
-    if (c->shouldLoad()) {
-	c->calcDist(_centre);
-	c->_toBeLoaded = true;
-	_toBeLoaded.push_back(c);
+    if (predicted && c->shouldPrefetch()) {
+	if (!_toBePrefetched.contains(c)) {
+	    _wanted(c);
+	}
+	_toBePrefetched.update(c);
+	_stats.maxPrefetchQueue = 
+	    max(_stats.maxPrefetchQueue, _toBePrefetched.size());
+    } else {
+	_toBePrefetched.remove(c);
     }
+
+    // Without a limit nothing is ever unloaded, so there's no point
+    // in keeping track of candidates.
+    if (!visible && c->_resident && (_limit[CacheObject::CPU] || 
+				     _limit[CacheObject::GPU])) {
+	_toBeUnloaded.update(c);
+    } else {
+	_toBeUnloaded.remove(c);
+    }
+
+    return result;
 }
 
-// Prepares the cache for loading to commence.  We create the
-// _toBeLoaded and _toBeUnloaded deques (they probably don't need to
-// be deques, but it makes my life a bit easier), sort them by
-// distances, then start the timer.
+// Prepares the cache for loading to commence, starting the timer if
+// necessary.
 void Cache::go()
 {
-    set<CacheObject *>::const_iterator i;
-    for (i = _all.begin(); i != _all.end(); i++) {
-	CacheObject *c = *i;
-	if (c->_toBeUnloaded) {
-	    _toBeUnloaded.push_back(c);
-	}
+    // The farthest visible object is only known after a round of
+    // update() calls.  If nothing visible was updated, we keep the
+    // old value.
+    if (_visibleDist > 0.0) {
+	_keepDist = _visibleDist * __keepDistance;
     }
 
-    // Sort things by decreasing distance from centre.  We load
-    // central objects first.
-    sort(_toBeLoaded.begin(), _toBeLoaded.end(), CacheObjectLessThan());
-    sort(_toBeUnloaded.begin(), _toBeUnloaded.end(), CacheObjectLessThan());
-
     // If the timer isn't going already, then start things going.
     if (!_callbackPending) {
 	// EYE - use idle timer instead?  (And in search stuff?)
 	glutTimerFunc(_interval, _cacheTimer, _id);
 	_callbackPending = true;
     }
-
-    _running = true;
 }
 
 // Called periodically by the glutTimerFunc().
@@ -166,68 +391,108 @@ void Cache::_cacheTimer(int id)
 // The routine that does the real work.  It is called periodically by
 // the timer callback (_cacheTimer).  Each time it is called, it
 // unloads as many objects as necessary (and possible) to bring us
-// under our limit (_cacheSize), then loads as many objects as it can
-// within our time limit (_workTime).
+// under our limits (_limit), then loads as many objects as it can
+// within our time limit (see _budget()).
 void Cache::_load()
 {
     _callbackPending = false;
 
-    // Don't do anything if _running is false (that means we're in the
-    // midst of adding new objects).
-    if (!_running) {
-	return;
-    }
-
     // Make sure that we're 'in' the right window.
     int oldWindow = glutGetWindow();
     glutSetWindow(_window);
 
-    // Unload what we can and should unload.  That means: unload stuff
-    // if we have a cache limit AND we are over the limit AND there is
-    // stuff to unload.
-    if (_cacheSize > 0) {
-	while ((_objectsSize > _cacheSize) && !_toBeUnloaded.empty()) {
-	    // Unload farthest object.
-	    CacheObject *c = _toBeUnloaded.back();
-
-	    _objectsSize -= c->size();
-	    if (c->unload()) {
-		_toBeUnloaded.pop_back();
-		_all.erase(c);
-	    }
-	    _objectsSize += c->size();
-	}
-    }
+    _unload();
 
-    // If there's nothing left to load, we're done.
-    if (_toBeLoaded.empty()) {
+    // If there's nothing left to load (or prefetch), we're done.
+    if (_toBeLoaded.empty() && !_prefetching()) {
 	glutSetWindow(oldWindow);
 	return;
     }
 
-    // Do some work.
+    // Do some work.  Objects that are waiting on somebody else are
+    // taken off the heap while we look for one that isn't, and put
+    // back when we're done.
     SGTimeStamp t1, t2;
-    long microSeconds = _workTime * 1000;
+    double budget = _budget();
+    vector<CacheObject *> waiting[2];
+    bool stalled = false;
     t1.stamp();
     do {
-	// Load nearest object.
-	CacheObject *c = _toBeLoaded.front();
-
-	// Note the slight difference from the logic in the unload
-	// section above.  If something is in _all, that means it is
-	// at least partially loaded and will need to be unloaded in
-	// the future.  So, we add it as soon as we can here, whereas
-	// in the unload section, we only remove it if it has been
-	// completely unloaded.
-	_all.insert(c);
-	_objectsSize -= c->size();
-	if (c->load()) {
-	    _toBeLoaded.pop_front();
-	}
-	_objectsSize += c->size();
+	// Visible objects come first.  When they're all loaded, we
+	// prefetch.
+	bool prefetching = _toBeLoaded.empty();
+	CacheHeap &heap = prefetching ? _toBePrefetched : _toBeLoaded;
+
+	// Load nearest object that isn't waiting on somebody else.
+	while (!heap.empty() && heap.top()->waiting()) {
+	    waiting[prefetching].push_back(heap.top());
+	    heap.pop();
+	}
+	t2.stamp();
+	if (heap.empty()) {
+	    if (prefetching || !_prefetching()) {
+		// Everyone's waiting.  There's no point in spinning,
+		// so give up for now.
+		stalled = true;
+		break;
+	    }
+	    // All the visible objects are waiting, but we can
+	    // prefetch in the meantime.
+	    continue;
+	}
+	CacheObject *c = heap.top();
+
+	// If something is resident, that means it is at least
+	// partially loaded and will need to be unloaded in the
+	// future.  So, we mark it as soon as we can here, whereas in
+	// _unload(), we only unmark it if it has been completely
+	// unloaded.
+	c->_resident = true;
+	bool done = prefetching ? c->prefetch() : c->load();
+	SGTimeStamp t3 = SGTimeStamp::now();
+	if (prefetching) {
+	    _stats.prefetchTime.add((t3 - t2).toMSecs());
+	} else {
+	    _stats.loadTime.add((t3 - t2).toMSecs());
+	}
+	if (done) {
+	    heap.pop();
+	    if (prefetching) {
+		_stats.prefetches++;
+	    } else {
+		_stats.loads++;
+		_stats.latency.add((t3 - c->_queued).toMSecs());
+	    }
+	}
+	_measure(c);
+
+	// A predicted object that isn't visible can be unloaded.
+	if (!c->_visible && (_limit[CacheObject::CPU] || 
+			     _limit[CacheObject::GPU])) {
+	    _toBeUnloaded.update(c);
+	}
+
+	// Prefetching can push us over our limit - make room by
+	// unloading what we don't want.  If that's not possible,
+	// _prefetching() will stop us.
+	if (prefetching) {
+	    _unload();
+	}
 
 	t2.stamp();
-    } while ((_toBeLoaded.size() > 0) && ((t2 - t1).get_usec() < microSeconds));
+    } while ((!_toBeLoaded.empty() || _prefetching()) && 
+	     ((t2 - t1).toMSecs() < budget));
+    _stats.busy += (t2 - t1).toMSecs();
+    if (stalled) {
+	_stats.stalls++;
+    }
+
+    for (size_t i = 0; i < waiting[0].size(); i++) {
+	_toBeLoaded.update(waiting[0][i]);
+    }
+    for (size_t i = 0; i < waiting[1].size(); i++) {
+	_toBePrefetched.update(waiting[1][i]);
+    }
 
     // Return to the old window.
     glutPostWindowRedisplay(_window);
@@ -235,7 +500,185 @@ void Cache::_load()
 
     // Set up the timer for another callback.  Note that we do this
     // even if there's nothing to be loaded, as there may still be
-    // stuff to unload.
-    glutTimerFunc(_interval, _cacheTimer, _id);
+    // stuff to unload.  If we're stalled waiting for others, we wait
+    // at least a work period before checking again, rather than
+    // hammering away at the timer.
+    unsigned int interval = _interval;
+    if (stalled) {
+	interval = max(_interval, (unsigned int)ceil(budget));
+    }
+    glutTimerFunc(interval, _cacheTimer, _id);
     _callbackPending = true;
 }
+
+// Unload what we can and should unload.  That means: unload stuff if
+// we have a cache limit AND we are over the limit (or at it, with
+// something waiting to be prefetched) AND there is stuff to unload
+// (that isn't too near - see _keepDist).  Each pool is handled
+// separately - if we're only over the GPU limit, say, objects that
+// aren't using the GPU are passed over.
+void Cache::_unload()
+{
+    vector<CacheObject *> passedOver;
+    while (!_toBeUnloaded.empty()) {
+	bool over[CacheObject::POOLS], anyOver = false;
+	for (int p = 0; p < CacheObject::POOLS; p++) {
+	    over[p] = (_limit[p] > 0) &&
+		((_usage[p] > _limit[p]) ||
+		 ((_usage[p] == _limit[p]) && !_toBePrefetched.empty()));
+	    anyOver = anyOver || over[p];
+	}
+	if (!anyOver) {
+	    break;
+	}
+
+	// Unload farthest object.
+	CacheObject *c = _toBeUnloaded.top();
+	if (c->_predicted || (c->_dist <= _keepDist)) {
+	    break;
+	}
+
+	bool helps = false;
+	for (int p = 0; p < CacheObject::POOLS; p++) {
+	    helps = helps || (over[p] && (c->_size[p] > 0));
+	}
+	if (!helps) {
+	    passedOver.push_back(c);
+	    _toBeUnloaded.pop();
+	    continue;
+	}
+
+	if (c->unload()) {
+	    _toBeUnloaded.pop();
+	    c->_resident = false;
+	    _stats.evictions++;
+	    c->_evicted.stamp();
+	}
+	_measure(c);
+    }
+
+    for (size_t i = 0; i < passedOver.size(); i++) {
+	_toBeUnloaded.update(passedOver[i]);
+    }
+}
+
+double Cache::_budget() const
+{
+    if (!_adaptive) {
+	return _workTime;
+    }
+
+    SGTimeStamp now = SGTimeStamp::now();
+    double period = __staticPeriod;
+    if ((_viewChanged != SGTimeStamp()) && 
+	((now - _viewChanged).toMSecs() < __settleTime)) {
+	period = __movingPeriod;
+    }
+
+    // Some of the period may have gone already (we may have been
+    // called more than once since the last frame).  However, if a
+    // whole period has gone, nobody's drawing frames, so we start
+    // afresh.
+    double gone = (now - _frameEnd).toMSecs();
+    if (gone >= period) {
+	gone = 0.0;
+    }
+
+    return max(period - gone - _frameTime, __minWorkTime);
+}
+
+bool Cache::_prefetching() const
+{
+    if (_toBePrefetched.empty()) {
+	return false;
+    }
+    for (int p = 0; p < CacheObject::POOLS; p++) {
+	if ((_limit[p] > 0) && (_usage[p] >= _limit[p])) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+void Cache::_measure(CacheObject *c)
+{
+    for (int p = 0; p < CacheObject::POOLS; p++) {
+	_usage[p] -= c->_size[p];
+	c->_size[p] = c->size((CacheObject::Pool)p);
+	_usage[p] += c->_size[p];
+    }
+}
+
+// Called when an object joins the load or prefetch queue.  If we
+// evicted it recently, we probably shouldn't have.
+void Cache::_wanted(CacheObject *c)
+{
+    if (c->_evicted == SGTimeStamp()) {
+	return;
+    }
+    if ((SGTimeStamp::now() - c->_evicted).toSecs() < __reloadTime) {
+	_stats.reloads++;
+    }
+    c->_evicted = SGTimeStamp();
+}
+
+size_t Cache::queued(CacheHeap::Type t) const
+{
+    switch (t) {
+      case CacheHeap::LOAD:
+	return _toBeLoaded.size();
+      case CacheHeap::PREFETCH:
+	return _toBePrefetched.size();
+      default:
+	return _toBeUnloaded.size();
+    }
+}
+
+void Cache::printStats(FILE *f, bool full) const
+{
+    const CacheStats &s = _stats;
+    double elapsed = (SGTimeStamp::now() - s.start).toMSecs();
+
+    fprintf(f, "Cache: %lu to load, %lu to prefetch; ", 
+	    (unsigned long)_toBeLoaded.size(), 
+	    (unsigned long)_toBePrefetched.size());
+    fprintf(f, "%u loaded (latency %.0f/%.0f/%.0f ms 50%%/90%%/max), ",
+	    s.loads, s.latency.percentile(0.5), s.latency.percentile(0.9),
+	    s.latency.max());
+    fprintf(f, "%u prefetched, %u evicted (%u reloaded); ", 
+	    s.prefetches, s.evictions, s.reloads);
+    fprintf(f, "busy %.0f%%; ", 
+	    (elapsed > 0.0) ? s.busy * 100.0 / elapsed : 0.0);
+    const char *pools[] = {"main", "video"};
+    for (int p = 0; p < CacheObject::POOLS; p++) {
+	fprintf(f, "%.1f", _usage[p] / (1024.0 * 1024.0));
+	if (_limit[p] > 0) {
+	    fprintf(f, "/%.1f", _limit[p] / (1024.0 * 1024.0));
+	}
+	fprintf(f, " MB %s%s", pools[p], 
+		(p < CacheObject::POOLS - 1) ? ", " : "\n");
+    }
+    if (!full) {
+	return;
+    }
+
+    fprintf(f, "  Time: %.1f s, %.1f s busy, %u stalls\n", 
+	    elapsed / 1000.0, s.busy / 1000.0, s.stalls);
+    fprintf(f, "  Longest queues: %lu to load, %lu to prefetch\n", 
+	    (unsigned long)s.maxLoadQueue, (unsigned long)s.maxPrefetchQueue);
+    struct {
+	const char *name;
+	const CacheStats::Histogram &h;
+    } histograms[] = {
+	{"Latency (queued to loaded)", s.latency},
+	{"load() calls", s.loadTime},
+	{"prefetch() calls", s.prefetchTime}
+    };
+    for (int i = 0; i < 3; i++) {
+	const CacheStats::Histogram &h = histograms[i].h;
+	fprintf(f, "  %s: %u, mean %.1f ms, max %.1f ms\n", 
+		histograms[i].name, h.count(), h.mean(), h.max());
+	h.print(f);
+    }
+}
@@ -33,11 +33,12 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
-#include <set>
-#include <deque>
+#include <cstdio>
+#include <vector>
 #include <map>
 
 #include <plib/sg.h>
+#include <simgear/timing/timestamp.hxx>
 
 // An object that can be placed in a cache.  It must be able to load
 // and unload itself.  It has a bounds, and can save a distance (this
@@ -51,8 +52,8 @@
 //   and the given point.
 //
 // bool shouldLoad() - this is called when a CacheObject is added to a
-//   Cache, but before loading starts.  Return true if you want your
-//   load() method to be called.
+//   Cache (ie, when the cache is told it's visible), before loading
+//   starts.  Return true if you want your load() method to be called.
 //
 // bool load() - this is called when the Cache determines that the
 //   CacheObject should be loaded.  Return false if you want to be
@@ -65,14 +66,34 @@
 //   (unloading should always be fast and never need to be broken down
 //   into multiple steps), but I didn't want to destroy the symmetry.
 //
-// unsigned int size() - size of CacheObject, in bytes.  Note that it
-//   isn't necessary to be completely accurate.  This is just used by
-//   the Cache to get a rough idea of how much it has loaded into
-//   memory.
+// size_t size(Pool p) - the number of bytes the CacheObject is using
+//   in the given memory pool: main memory (CPU) or video memory
+//   (GPU).  Each pool has its own limit, so try to be accurate.  The
+//   Cache asks whenever it loads, prefetches, unloads, or is told
+//   about the object, so changes made at other times (eg, uploading
+//   data to the GPU when drawing) are noticed the next time the
+//   object is updated.
+//
+// It may optionally implement:
+//
+// bool waiting() - return true if a call to load() (or prefetch(),
+//   once loading is done) right now would be pointless, because the
+//   object is waiting for work being done elsewhere (eg, in a
+//   background thread).  The cache will skip it and try the next
+//   object, coming back to it later.  The default returns false.
+//
+// bool shouldPrefetch(), bool prefetch() - like shouldLoad() and
+//   load(), but for objects that aren't visible yet, but probably
+//   will be soon (see Cache::update()).  The defaults return false
+//   and true respectively (ie, there's nothing to prefetch).
 //
 class CacheObject {
   public:
     friend class Cache;
+    friend class CacheHeap;
+
+    // Memory pools.
+    enum Pool { CPU = 0, GPU, POOLS };
 
     CacheObject();
     virtual ~CacheObject() = 0;
@@ -81,8 +102,10 @@ class CacheObject {
     virtual bool shouldLoad() = 0;
     virtual bool load() = 0;
     virtual bool unload() = 0;
-    // EYE - unsigned long?
-    virtual unsigned int size() = 0;
+    virtual size_t size(Pool p) = 0;
+    virtual bool waiting() { return false; }
+    virtual bool shouldPrefetch() { return false; }
+    virtual bool prefetch() { return true; }
 
     float dist() const { return _dist; }
 
@@ -93,7 +116,113 @@ class CacheObject {
 
     // These are meant to be touched only by the Cache object - they
     // help it keep track of who needs to be loaded and unloaded.
-    bool _toBeLoaded, _toBeUnloaded;
+    // _visible and _predicted are what the cache was last told about
+    // us, and _resident is true if we've been (at least partially)
+    // loaded.  _heapIndex gives our position in each of the cache's
+    // heaps (or -1 if we're not in it), and _size our size in each
+    // pool when the cache last asked.
+    bool _visible, _predicted, _resident;
+    int _heapIndex[3];
+    size_t _size[POOLS];
+    // For statistics (see CacheStats): when we were last queued for
+    // loading, and when we were last evicted (0 if we haven't been
+    // since we were last loaded).
+    SGTimeStamp _queued, _evicted;
+};
+
+// An indexed binary heap of CacheObjects.  Because each object knows
+// where it is in the heap, it can be removed or moved (when its key
+// changes) in O(log n) time, rather than O(n).  The object with the
+// smallest key is on top.  Keys depend on what the heap is for:
+//
+// LOAD, PREFETCH - the object's distance (nearest on top)
+//
+// UNLOAD - the negated distance (farthest on top), except for
+//   predicted objects, which come after everyone else.
+class CacheHeap {
+  public:
+    enum Type { LOAD = 0, PREFETCH, UNLOAD };
+
+    CacheHeap(Type t): _type(t) {}
+
+    bool empty() const { return _objects.empty(); }
+    size_t size() const { return _objects.size(); }
+    CacheObject *top() const { return _objects.front(); }
+    CacheObject *at(size_t i) const { return _objects[i]; }
+    bool contains(const CacheObject *c) const 
+    { return c->_heapIndex[_type] >= 0; }
+    float key(const CacheObject *c) const;
+
+    // Adds the object, or if it's already here, moves it to where its
+    // (presumably changed) key says it should be.
+    void update(CacheObject *c);
+    void remove(CacheObject *c);
+    void pop() { remove(top()); }
+    // Reorders the heap after many keys have changed.
+    void rebuild();
+
+  protected:
+    void _set(size_t i, CacheObject *c);
+    bool _up(size_t i);
+    void _down(size_t i);
+
+    Type _type;
+    std::vector<CacheObject *> _objects;
+};
+
+// Statistics about how well a cache is doing: how long objects wait
+// to be loaded, how long loading takes, and how often objects are
+// unloaded only to be wanted again soon after.  A cache manages one
+// kind of object, so these are statistics for that kind.  All times
+// are in milliseconds.
+class CacheStats {
+  public:
+    // A histogram of times.  Bins double in width: the first is [0,
+    // 1), the next [1, 2), then [2, 4), and so on, with the last
+    // being open-ended.
+    class Histogram {
+      public:
+	enum { BINS = 16 };
+
+	Histogram();
+
+	void add(double ms);
+	unsigned int count() const { return _count; }
+	double mean() const { return (_count > 0) ? _total / _count : 0.0; }
+	double max() const { return _max; }
+	// The time within which the given fraction (0.0 to 1.0) of
+	// samples fall.  This is only as accurate as our bins allow
+	// (we actually return the top of the bin it falls in).
+	double percentile(double fraction) const;
+	// Prints one line per non-empty bin.
+	void print(FILE *f) const;
+
+      protected:
+	unsigned int _bins[BINS], _count;
+	double _total, _max;
+    };
+
+    CacheStats();
+
+    // From when a visible object is queued for loading to when it's
+    // completely loaded.  This is what the user sees as a delay.
+    Histogram latency;
+    // Of individual load() and prefetch() calls.
+    Histogram loadTime, prefetchTime;
+    // Objects completely loaded, completely prefetched, and unloaded
+    // (evicted).  Reloads are evicted objects wanted again (for
+    // loading or prefetching) within a short time of being evicted -
+    // lots of them mean the cache is too small.
+    unsigned int loads, prefetches, evictions, reloads;
+    // The number of times the cache gave up working because every
+    // queued object was waiting on someone else.
+    unsigned int stalls;
+    // The longest the load and prefetch queues have been.
+    size_t maxLoadQueue, maxPrefetchQueue;
+    // How much time the cache has spent working, and when it started
+    // keeping track.
+    double busy;
+    SGTimeStamp start;
 };
 
 // Manages the loading and unloading of a set of objects of class
@@ -101,36 +230,87 @@ class CacheObject {
 class Cache {
   public:
     // The window for which we want objects loaded is given in window.
-    // The maximum size of the cache (in bytes) is cacheSize, although
-    // it will exceed that limit if all objects are visible.  If
-    // cacheSize is 0, there is no limit.  On each call to _load(), it
-    // works workTime milliseconds.  If workTime is 0, it will load
-    // everything in one go.  The number of milliseconds between calls
-    // to _load() is given by interval.
+    // The maximum size of the cache (in bytes) in main memory is
+    // cpuSize, and in video memory is gpuSize, although it will
+    // exceed those limits if all objects are visible (or near the
+    // edge of the visible area - see below).  A limit of 0 means
+    // there is no limit.  On each call to _load(), it works workTime
+    // milliseconds (unless it's adaptive - see setAdaptive()).  The
+    // number of milliseconds between calls to _load() is given by
+    // interval.
     Cache(int window,
-	  unsigned int cacheSize = 50 * 1024 * 1024, // 50 MB
-	  unsigned int workTime = 10,		     // 10 ms
-	  unsigned int interval = 0);		     // 0 ms
+	  size_t cpuSize = 256 * 1024 * 1024,	// 256 MB
+	  size_t gpuSize = 128 * 1024 * 1024,	// 128 MB
+	  unsigned int workTime = 10,		// 10 ms
+	  unsigned int interval = 0);		// 0 ms
     ~Cache();
 
+    // The limit of the given pool (0 means unlimited), and how much of
+    // it our objects are using, in bytes.  Lowering a limit takes
+    // effect the next time the cache goes to work.
+    void setLimit(CacheObject::Pool p, size_t bytes) { _limit[p] = bytes; }
+    size_t limit(CacheObject::Pool p) const { return _limit[p]; }
+    size_t usage(CacheObject::Pool p) const { return _usage[p]; }
+
+    // Normally the cache works workTime milliseconds at a time.  If
+    // adaptive, it instead fits its work in around drawing, working
+    // for whatever part of a target frame period drawing doesn't
+    // need.  The period is short while the view is changing (so that
+    // dragging and zooming stay smooth), and longer when it isn't
+    // (when the user is just waiting for scenery to appear).  To do
+    // this, it needs to be told how long each frame took to draw
+    // (frameDrawn()), and when the view changes (viewChanged()).
+    void setWorkTime(unsigned int ms) { _workTime = ms; }
+    void setAdaptive(bool adaptive) { _adaptive = adaptive; }
+    void frameDrawn(double ms);
+    void viewChanged() { _viewChanged.stamp(); }
+
+    // How many objects are waiting to be loaded (CacheHeap::LOAD) or
+    // prefetched (CacheHeap::PREFETCH), or could be unloaded
+    // (CacheHeap::UNLOAD).
+    size_t queued(CacheHeap::Type t) const;
+    // What we've been doing since we were created.  Print the
+    // statistics as a one-line summary or, if full is true, in
+    // detail, with histograms.
+    const CacheStats &stats() const { return _stats; }
+    void printStats(FILE *f, bool full = false) const;
+
     // These are used, together, to tell the cache which objects are
-    // visible, and should be used in the order given.  
+    // visible, and should be used in the order given.  Unlike earlier
+    // versions of the cache, it is incremental - you only need to
+    // tell it about objects whose status has changed, and it keeps
+    // working while you do.
     //
-    // The reset() call tells the cache the new centre of the
+    // The setCentre() call tells the cache the new centre of the
     // displayed area (the cache needs to know this because it uses
-    // distance from centre to decide which tiles to load first).
-    // When called, the cache will stop all processing, and assume
-    // that no objects are visible.  It will *not* unload any objects
-    // however.
-    // 
-    // The add() is used to add a single object - call this once for
-    // each object you want to load (or, in other words, are visible).
+    // distance from centre to decide which objects to load first and
+    // unload last).  To save work, the cache only recalculates the
+    // distances of all its objects when the centre has moved a fair
+    // bit; in between, it uses slightly stale distances.
     //
-    // After adding all visible objects, call go() to tell the cache
-    // to begin loading.
+    // The update() call tells the cache whether an object is visible
+    // (it will call shouldLoad() and, if necessary, load()), or
+    // predicted to be visible soon (it will call shouldPrefetch() and
+    // prefetch()), or neither.  Call it when an object's status
+    // changes, and for visible and predicted objects, whenever what
+    // they need to load may have changed.  It returns true if the
+    // object is visible and needs loading.  Predicted objects are
+    // only loaded when all visible objects have been, and only while
+    // the cache is under its size limit (they can displace other
+    // non-visible objects, but not visible ones).
     //
-    void reset(sgdVec3 centre);
-    void add(CacheObject* c);
+    // Objects that are neither visible nor predicted are unloaded,
+    // farthest first, when we're over the size limit of either pool
+    // (objects that don't use the pool that's over are left alone).  However, to
+    // prevent objects at the edge of the display from thrashing (ie,
+    // being repeatedly loaded and unloaded as the display jiggles
+    // around), we don't unload objects that are nearly as close as
+    // the farthest visible one.
+    //
+    // After updating objects, call go() to tell the cache to begin
+    // loading.
+    void setCentre(sgdVec3 centre);
+    bool update(CacheObject* c, bool visible, bool predicted = false);
     void go();
 
   protected:
@@ -147,35 +327,54 @@ class Cache {
 
     // Called periodically to load 1 or more tiles
     void _load();
+    // Unloads objects until we're under our limits (if possible).
+    void _unload();
+    // True if there are objects to prefetch and room for them.
+    bool _prefetching() const;
+    // Asks the object its size, and updates _usage.
+    void _measure(CacheObject *c);
+    // Notes that an object is wanted (for the reload statistic).
+    void _wanted(CacheObject *c);
+    // How long (in ms) to work in this call to _load().
+    double _budget() const;
     static void _cacheTimer(int id);
 
-    // All loaded objects (or, to put it another way, all objects
-    // which have not been completely unloaded).
-    std::set<CacheObject *> _all;
-    // Objects which must still be loaded because they're visible
-    // (_toBeLoaded) or unloaded because they're not visible, and
-    // we've exceeded the cache size (_toBeUnloaded).  Objects in
-    // _toBeUnloaded *must* be in _all.
-    std::deque<CacheObject *> _toBeLoaded, _toBeUnloaded;
+    // Visible objects that need loading, predicted objects that need
+    // prefetching, and resident objects that are neither visible nor
+    // predicted (and so can be unloaded).
+    CacheHeap _toBeLoaded, _toBePrefetched, _toBeUnloaded;
 
     // The centre of the area to be displayed.  We use this value to
-    // decide which objects to load first.
-    sgdVec3 _centre;
-
-    // _cacheSize is the maximum desired cache size; _objectsSize is
-    // the actual size of the objects we're managing.  We guarantee to
-    // load all visible objects, and then non-visible up to
-    // _cacheSize.  Set _cacheSize to 0 if cache size is unlimited.
-    unsigned int _cacheSize, _objectsSize;
+    // decide which objects to load first.  _keyCentre is the centre
+    // when we last calculated everyone's distance.
+    sgdVec3 _centre, _keyCentre;
+    // The distance of the farthest visible object, as found in the
+    // current and previous rounds of update() calls.  We keep
+    // non-visible objects loaded within the latter (scaled by a
+    // fudge factor).
+    float _visibleDist, _keepDist;
+
+    // _limit is the maximum desired cache size in each pool; _usage
+    // is the actual size of the objects we're managing.  We guarantee
+    // to load all visible objects, and then non-visible up to the
+    // limits.  A limit of 0 means that pool is unlimited.
+    size_t _limit[CacheObject::POOLS], _usage[CacheObject::POOLS];
     // How much time to spend in one call to _load() (in ms).
     unsigned int _workTime;
     // Time (in ms) between calls to _load().
     unsigned int _interval;
+    // If true, we ignore _workTime, and work out how long to work
+    // from _frameTime, a running average of how long frames take to
+    // draw (in ms), _frameEnd, when the last frame was finished, and
+    // _viewChanged, when the view last changed.
+    bool _adaptive;
+    double _frameTime;
+    SGTimeStamp _frameEnd, _viewChanged;
 
     // True if we have scheduled a call to _load().
     bool _callbackPending;
-    // True if we are active.
-    bool _running;
+
+    CacheStats _stats;
 
     // Used to map between Cache instances and their addresses.
     static std::map<int, Cache *> __map;
@@ -0,0 +1,214 @@
+/*-------------------------------------------------------------------------
+  ChopTest.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  Checks that chopping a subbucket's triangles along contour lines in
+  parallel gives exactly the same result as doing it serially.  Run by
+  'make check'.
+
+  Subbucket::_palettize() splits the triangles into runs, chops each
+  run separately, and then merges the results, joining up vertices
+  made on edges shared by triangles in different runs.  If the merge
+  gets that wrong, the vertices are duplicated or renumbered, or
+  contour lines along shared edges go missing - none of which would
+  necessarily be visible in a map, so we compare the data itself:
+  vertices, normals, elevations, contour indices, triangle lists, and
+  contour lines.
+
+  We use synthetic scenery (see TestScenery.hxx), and lower
+  Subbucket::minChopRun, so that it gets split into several runs even
+  though it isn't very big.  Since the chop test doesn't depend on a
+  real bucket, the scenery file is written to the current directory.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// C++ system include files
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// System include files
+#include <unistd.h>
+
+// Our project's include files
+#include "Bucket.hxx"
+#include "Palette.hxx"
+#include "Subbucket.hxx"
+#include "TestScenery.hxx"
+#include "WorkerPool.hxx"
+
+using namespace std;
+
+// The scenery is a grid of __gridSize x __gridSize vertices, giving
+// about 20,000 triangles.
+static const int __gridSize = 100;
+
+// Everything palettize() produces, in a form we can compare.
+struct Chop {
+    vector<GLfloat> vertices, normals, elevations;
+    vector<int> elevationIndices;
+    // Each triangle list in _indices, in order.
+    vector<vector<GLuint> > lists;
+    vector<vector<GLuint> > contours;
+    // Contour lines, as <lower, higher> index pairs.  They're made
+    // from an unordered set, so their order doesn't mean anything and
+    // we sort them.
+    vector<pair<GLuint, GLuint> > lines;
+
+    bool operator==(const Chop &c) const
+    {
+	return (vertices == c.vertices) && (normals == c.normals) &&
+	    (elevations == c.elevations) &&
+	    (elevationIndices == c.elevationIndices) &&
+	    (lists == c.lists) && (contours == c.contours) &&
+	    (lines == c.lines);
+    }
+};
+
+// A subbucket that lets us look at its innards.
+class TestSubbucket: public Subbucket {
+  public:
+    TestSubbucket(const SGPath &p): Subbucket(p) {}
+
+    unsigned int rawSize() const { return _rawSize; }
+
+    void chop(Chop &c, WorkerPool *pool)
+    {
+	paletteChanged();
+	palettize(pool);
+
+	c.vertices = _vertices;
+	c.normals = _normals;
+	c.elevations = _elevations;
+	c.elevationIndices = _elevationIndices;
+	c.lists.clear();
+	for (size_t i = 0, first = 0; i < _indices.lists(); i++) {
+	    size_t n = _indices.count(i);
+	    c.lists.push_back(vector<GLuint>(_indices.begin() + first,
+					     _indices.begin() + first + n));
+	    first += n;
+	}
+	c.contours.assign(_contours.begin(), _contours.end());
+	c.lines.clear();
+	for (size_t i = 0; i + 1 < _contourLines.size(); i += 2) {
+	    GLuint a = _contourLines[i], b = _contourLines[i + 1];
+	    c.lines.push_back(make_pair(min(a, b), max(a, b)));
+	}
+	sort(c.lines.begin(), c.lines.end());
+    }
+};
+
+static bool __fail(const char *what)
+{
+    fprintf(stderr, "ChopTest: %s\n", what);
+    return false;
+}
+
+// Checks that the serial chop isn't trivial, and that it doesn't
+// duplicate vertices: a contour crossing an edge makes one vertex
+// there, shared by the triangles on both sides.  If they weren't
+// shared, almost every new vertex would have a twin.  Vertices are
+// floats in earth-centred coordinates, though, so where a contour
+// passes very close to a scenery vertex, its crossings of the edges
+// meeting there can round to the same position.  We allow for a few
+// of those.
+static bool __checkSerial(const Chop &serial, unsigned int rawSize)
+{
+    size_t vertices = serial.vertices.size() / 3;
+    if (vertices <= rawSize) {
+	return __fail("chopping didn't create any vertices");
+    }
+    if (serial.lines.empty()) {
+	return __fail("chopping didn't create any contour lines");
+    }
+
+    set<vector<GLfloat> > positions;
+    size_t twins = 0;
+    for (size_t i = rawSize; i < vertices; i++) {
+	vector<GLfloat> v(serial.vertices.begin() + i * 3,
+			  serial.vertices.begin() + i * 3 + 3);
+	if (!positions.insert(v).second) {
+	    twins++;
+	}
+    }
+    if (twins * 100 > vertices - rawSize) {
+	return __fail("chopping duplicated vertices");
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *srcdir = getenv("srcdir");
+    SGPath palette(srcdir ? srcdir : ".");
+    palette.append("data/Palettes/default.ap");
+    try {
+	Bucket::palette = new Palette(palette.c_str());
+    } catch (runtime_error &e) {
+	fprintf(stderr, "%s: %s: %s\n", argv[0], palette.c_str(), e.what());
+	return 1;
+    }
+
+    // Near San Francisco, to give the bucket a typical shape.
+    SGBucket bucket(-122.5, 37.5);
+    SGPath scenery("ChopTest.btg");
+    if (!writeTestScenery(scenery, bucket, __gridSize)) {
+	fprintf(stderr, "%s: couldn't write '%s'\n", argv[0], scenery.c_str());
+	return 1;
+    }
+
+    TestSubbucket sb(scenery);
+    bool ok = sb.load();
+    unlink(scenery.c_str());
+    if (!ok) {
+	fprintf(stderr, "%s: couldn't load '%s'\n", argv[0], scenery.c_str());
+	return 1;
+    }
+
+    Subbucket::minChopRun = 64;
+    Chop serial;
+    sb.chop(serial, NULL);
+    printf("%lu vertices (%u before chopping), %lu contour lines\n",
+	   (unsigned long)serial.vertices.size() / 3, sb.rawSize(),
+	   (unsigned long)serial.lines.size());
+    if (!__checkSerial(serial, sb.rawSize())) {
+	return 1;
+    }
+
+    WorkerPool pool(3);
+    const unsigned int runs[] = {2, 3, 8};
+    for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+	Subbucket::maxChopRuns = runs[i];
+	Chop parallel;
+	sb.chop(parallel, &pool);
+	if (!(parallel == serial)) {
+	    fprintf(stderr, "%s: chopping in %u runs differs from "
+		    "chopping serially\n", argv[0], runs[i]);
+	    return 1;
+	}
+    }
+
+    return 0;
+}
@@ -0,0 +1,317 @@
+/*-------------------------------------------------------------------------
+  ContourShader.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// As in Subbucket.cxx, glew must come before anything that includes
+// gl.h.
+#include <GL/glew.h>
+
+// Our include file
+#include "ContourShader.hxx"
+
+// C++ system include files
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+// Our project's include files
+#include "Palette.hxx"
+
+using namespace std;
+
+// The largest palette we'll bother with (plus the 2 fences).  The
+// real limit may be lower - see _compile().
+static const int __maxEntries = 258;
+
+// The vertex shader.  It passes the elevation (the first texture
+// coordinate) on to the fragment shader, and lights the vertex the
+// way fixed function OpenGL would: scene ambient plus light 0's
+// ambient and diffuse contributions (we don't use specular lighting).
+// Like fixed function OpenGL, we don't normalize the normal.  The
+// material colour isn't known until the fragment shader, so the
+// primary colour is just the amount of light; the fragment shader
+// multiplies it by the palette colour.
+static const char *__vertexShader =
+    "uniform bool lighting;\n"
+    "varying float elevation;\n"
+    "void main()\n"
+    "{\n"
+    "    elevation = gl_MultiTexCoord0.s;\n"
+    "    gl_Position = ftransform();\n"
+    "    if (lighting) {\n"
+    "        vec3 n = gl_NormalMatrix * gl_Normal;\n"
+    "        vec3 l = normalize(gl_LightSource[0].position.xyz);\n"
+    "        gl_FrontColor = gl_LightModel.ambient +\n"
+    "            gl_LightSource[0].ambient +\n"
+    "            gl_LightSource[0].diffuse * max(dot(n, l), 0.0);\n"
+    "    } else {\n"
+    "        gl_FrontColor = vec4(1.0);\n"
+    "    }\n"
+    "}\n";
+
+// The fragment shader.  The elevations array is a copy of the
+// palette's contour elevations, including the fences at either end,
+// and the colours texture has the corresponding colours.  We find the
+// contour interval with a binary search - the result is the same as
+// Palette::contourIndex() + 1.  MAX_ENTRIES (the size of the
+// elevations array) and SEARCH_STEPS (enough binary search steps for
+// that many entries) are defined by _compile(), which also supplies
+// the #version line for both shaders.
+static const char *__fragmentShader =
+    "uniform float elevations[MAX_ENTRIES];\n"
+    "uniform int count;\n"
+    "uniform sampler1D colours;\n"
+    "uniform bool discrete;\n"
+    "uniform bool contourLines;\n"
+    "varying float elevation;\n"
+    "vec4 colour(int i)\n"
+    "{\n"
+    "    return texture1D(colours, (float(i) + 0.5) / float(count));\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "    int lo = 1, hi = count - 2;\n"
+    "    for (int step = 0; step < SEARCH_STEPS; step++) {\n"
+    "        if (lo < hi) {\n"
+    "            int mid = (lo + hi + 1) / 2;\n"
+    "            if (elevation >= elevations[mid]) {\n"
+    "                lo = mid;\n"
+    "            } else {\n"
+    "                hi = mid - 1;\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "    int i = lo;\n"
+    "\n"
+    "    if (contourLines) {\n"
+    "        float d = abs(elevation - elevations[i]);\n"
+    "        if (i + 1 < count - 1) {\n"
+    "            d = min(d, abs(elevations[i + 1] - elevation));\n"
+    "        }\n"
+    "        vec2 g = vec2(dFdx(elevation), dFdy(elevation));\n"
+    "        if (d < 0.5 * length(g)) {\n"
+    "            gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
+    "            return;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    vec4 c;\n"
+    "    if (discrete) {\n"
+    "        c = colour(i);\n"
+    "    } else {\n"
+    "        float scale = (elevation - elevations[i]) /\n"
+    "            (elevations[i + 1] - elevations[i]);\n"
+    "        if (scale > 0.5) {\n"
+    "            c = mix(colour(i), colour(i + 1), scale - 0.5);\n"
+    "        } else {\n"
+    "            c = mix(colour(i - 1), colour(i), scale + 0.5);\n"
+    "        }\n"
+    "    }\n"
+    "    gl_FragColor = vec4(clamp(c.rgb * gl_Color.rgb, 0.0, 1.0), c.a);\n"
+    "}\n";
+
+// Compiles the given shader, printing the log and returning 0 if it
+// fails.
+static GLuint __compileShader(GLenum type, const char *header,
+			      const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    const char *sources[] = {header, source};
+    glShaderSource(shader, 2, sources, NULL);
+    glCompileShader(shader);
+
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+	GLint length;
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+	vector<GLchar> log(length + 1, '\0');
+	glGetShaderInfoLog(shader, length, NULL, &log[0]);
+	fprintf(stderr, "ContourShader: compile failed:\n%s\n", &log[0]);
+	glDeleteShader(shader);
+	shader = 0;
+    }
+
+    return shader;
+}
+
+ContourShader *ContourShader::get()
+{
+    // Only the thread with the OpenGL context can call this, so
+    // there's no need to protect it.  The shader belongs to that
+    // context, and lives as long as it does, so we never delete it.
+    static bool tried = false;
+    static ContourShader *shader = NULL;
+    if (!tried) {
+	tried = true;
+	if (GLEW_VERSION_2_0) {
+	    shader = new ContourShader();
+	    if (!shader->_compile()) {
+		delete shader;
+		shader = NULL;
+	    }
+	}
+    }
+
+    return shader;
+}
+
+ContourShader::ContourShader():
+    _program(0), _texture(0), _maxEntries(0), _palette(NULL), _base(0.0)
+{
+}
+
+ContourShader::~ContourShader()
+{
+    if (_program != 0) {
+	glDeleteProgram(_program);
+    }
+    if (_texture != 0) {
+	glDeleteTextures(1, &_texture);
+    }
+}
+
+bool ContourShader::canShade(const Palette *p) const
+{
+    return (p->size() > 0) && ((int)p->size() + 2 <= _maxEntries);
+}
+
+void ContourShader::begin(Palette *p, bool discrete, bool contourLines)
+{
+    glPushAttrib(GL_TEXTURE_BIT);
+    glUseProgram(_program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_1D, _texture);
+    _setPalette(p);
+
+    glUniform1i(_discreteLoc, discrete);
+    glUniform1i(_contourLinesLoc, contourLines);
+    glUniform1i(_lightingLoc, glIsEnabled(GL_LIGHTING));
+}
+
+void ContourShader::end()
+{
+    glUseProgram(0);
+    glPopAttrib();
+}
+
+bool ContourShader::_compile()
+{
+    // The elevations array takes one uniform component per entry.  We
+    // leave some room for the other uniforms (and whatever the
+    // implementation needs for itself).
+    GLint components;
+    glGetIntegerv(GL_MAX_FRAGMENT_UNIFORM_COMPONENTS, &components);
+    _maxEntries = min(__maxEntries, (int)components - 16);
+    if (_maxEntries < 3) {
+	return false;
+    }
+    int steps = 0;
+    while ((1 << steps) < _maxEntries) {
+	steps++;
+    }
+
+    char header[128];
+    snprintf(header, sizeof(header),
+	     "#version 120\n#define MAX_ENTRIES %d\n#define SEARCH_STEPS %d\n",
+	     _maxEntries, steps);
+    GLuint vs = __compileShader(GL_VERTEX_SHADER, header, __vertexShader);
+    GLuint fs = __compileShader(GL_FRAGMENT_SHADER, header, __fragmentShader);
+    if ((vs == 0) || (fs == 0)) {
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+	return false;
+    }
+
+    _program = glCreateProgram();
+    glAttachShader(_program, vs);
+    glAttachShader(_program, fs);
+    glLinkProgram(_program);
+    // The program holds on to the shaders as long as it needs them.
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint ok;
+    glGetProgramiv(_program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+	GLint length;
+	glGetProgramiv(_program, GL_INFO_LOG_LENGTH, &length);
+	vector<GLchar> log(length + 1, '\0');
+	glGetProgramInfoLog(_program, length, NULL, &log[0]);
+	fprintf(stderr, "ContourShader: link failed:\n%s\n", &log[0]);
+	return false;
+    }
+
+    _elevationsLoc = glGetUniformLocation(_program, "elevations");
+    _countLoc = glGetUniformLocation(_program, "count");
+    _coloursLoc = glGetUniformLocation(_program, "colours");
+    _discreteLoc = glGetUniformLocation(_program, "discrete");
+    _contourLinesLoc = glGetUniformLocation(_program, "contourLines");
+    _lightingLoc = glGetUniformLocation(_program, "lighting");
+
+    // The palette colours are looked up by index, so we don't want
+    // any filtering.
+    glGenTextures(1, &_texture);
+    glBindTexture(GL_TEXTURE_1D, _texture);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_1D, 0);
+
+    return true;
+}
+
+// Uploads the palette's elevations and colours, if they aren't
+// already there.  Assumes our program is in use, and our texture is
+// bound.
+void ContourShader::_setPalette(Palette *p)
+{
+    if ((p == _palette) && (p->base() == _base)) {
+	return;
+    }
+    _palette = p;
+    _base = p->base();
+
+    // Palette doesn't give us its fences (the fake entries below the
+    // first contour and above the last), so we recreate them the same
+    // way its constructor does.  They only matter for smooth colours.
+    int n = p->size();
+    vector<GLfloat> elevations(n + 2);
+    vector<GLfloat> colours((n + 2) * 4);
+    for (int i = 0; i < n; i++) {
+	const Palette::Contour &c = p->contourAtIndex(i);
+	elevations[i + 1] = c.elevation;
+	copy(c.colour, c.colour + 4, colours.begin() + (i + 1) * 4);
+    }
+    elevations[0] = elevations[1] - 1.0;
+    copy(colours.begin() + 4, colours.begin() + 8, colours.begin());
+    elevations[n + 1] = elevations[n] + (elevations[n] - elevations[n - 1]);
+    copy(colours.begin() + n * 4, colours.begin() + (n + 1) * 4,
+	 colours.begin() + (n + 1) * 4);
+
+    glUniform1fv(_elevationsLoc, n + 2, &elevations[0]);
+    glUniform1i(_countLoc, n + 2);
+    glUniform1i(_coloursLoc, 0);
+
+    glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA, n + 2, 0, GL_RGBA, GL_FLOAT,
+		 &colours[0]);
+}
@@ -0,0 +1,109 @@
+/*-------------------------------------------------------------------------
+  ContourShader.hxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  A GLSL program that colours scenery by elevation.  Instead of
+  chopping triangles along contour lines and colouring the pieces
+  (see Subbucket), we give OpenGL the elevation of each vertex and let
+  the shader look up the palette colour for every fragment.  Contour
+  lines are drawn by the shader as well.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+#ifndef _CONTOURSHADER_H_
+#define _CONTOURSHADER_H_
+
+#if defined( __APPLE__)		// For GLuint
+#  include <OpenGL/gl.h>
+#else
+#  include <GL/gl.h>
+#endif
+
+// Forward class declarations
+class Palette;
+
+// The shader needs two things: the palette and the elevation of each
+// vertex.  The palette's contour colours are put in a 1D texture, and
+// its contour elevations in a uniform array.  These only change when
+// the palette (or its base) does, and changing them is just an upload
+// - the scenery doesn't need to be touched at all.  The vertex
+// elevations are passed in as 1D texture coordinates (see
+// ElevationVBO in Subbucket.hxx).
+//
+// Lighting is done in the vertex shader, and mimics OpenGL's fixed
+// function lighting for the way we set it up (light 0, a directional
+// light, with GL_COLOR_MATERIAL tracking ambient and diffuse).  The
+// lighting result is passed on in the primary colour, so flat shading
+// works as usual.  The fragment shader then finds the contour
+// interval the fragment's elevation is in, colours it (discretely or
+// smoothly, as in Palette), and blackens it if it's within half a
+// pixel of a contour elevation (if contour lines are wanted).
+//
+// The shader requires OpenGL 2.0.  There is only one, and you get it
+// with ContourShader::get(), which returns NULL if shaders aren't
+// supported, or the shader fails to compile.  The first call to get()
+// compiles the shader, so there must be a current OpenGL context.
+//
+// To use it, call begin() with the palette, draw the triangles to be
+// coloured by elevation (with vertices, normals, and elevations
+// enabled), then call end().
+class ContourShader {
+  public:
+    static ContourShader *get();
+    ~ContourShader();
+
+    // True if the shader can handle the given palette.  It must have
+    // at least one contour, and the number of contours is limited by
+    // the number of uniforms OpenGL gives us (usually several
+    // hundred, which is more than any reasonable palette would
+    // have).
+    bool canShade(const Palette *p) const;
+
+    // Installs the shader, uploading palette information if
+    // necessary.  If discrete is true, each contour interval is given
+    // a single colour, otherwise colours are blended (see
+    // Palette::smoothColour()).  If contourLines is true, contour
+    // lines are drawn.  Lighting and shading follow the current
+    // OpenGL state.
+    void begin(Palette *p, bool discrete, bool contourLines);
+    // Uninstalls the shader, restoring the state we changed.
+    void end();
+
+  protected:
+    ContourShader();
+
+    bool _compile();
+    void _setPalette(Palette *p);
+
+    GLuint _program;
+    GLuint _texture;
+    // Uniform locations.
+    GLint _elevationsLoc, _countLoc, _coloursLoc, _discreteLoc,
+	_contourLinesLoc, _lightingLoc;
+    // The size of the elevations uniform array (contours plus the 2
+    // fences - see Palette).
+    int _maxEntries;
+
+    // The palette information we've currently uploaded.
+    const Palette *_palette;
+    float _base;
+};
+
+#endif // _CONTOURSHADER_H_
@@ -0,0 +1,276 @@
+/*-------------------------------------------------------------------------
+  Downsampler.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// Our include file
+#include "Downsampler.hxx"
+
+// C++ system include files
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+// System include files
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+// Our project's include files
+#include "WorkerPool.hxx"
+
+using namespace std;
+
+// The number of source pixels (in each direction) that go into each
+// destination pixel.
+static const int __taps = 8;
+
+// Each job makes this many rows of a level.
+static const int __bandRows = 32;
+
+// The Mitchell-Netravali filter, with B = C = 1/3.
+static double __mitchell(double x)
+{
+    const double B = 1.0 / 3.0, C = 1.0 / 3.0;
+    x = fabs(x);
+    if (x < 1.0) {
+	return ((12.0 - 9.0 * B - 6.0 * C) * x * x * x +
+		(-18.0 + 12.0 * B + 6.0 * C) * x * x +
+		(6.0 - 2.0 * B)) / 6.0;
+    } else if (x < 2.0) {
+	return ((-B - 6.0 * C) * x * x * x + (6.0 * B + 30.0 * C) * x * x +
+		(-12.0 * B - 48.0 * C) * x + (8.0 * B + 24.0 * C)) / 6.0;
+    }
+
+    return 0.0;
+}
+
+// The weights for halving an image.  Destination pixel i lies between
+// source pixels 2i and 2i + 1, so it's made from source pixels 2i - 3
+// to 2i + 4, which are 3.5, 2.5, ..., 2.5, 3.5 source pixels (half that
+// many destination pixels) away from it.  The weights are normalized
+// so that they add up to 1.
+static const float *__weights()
+{
+    static float weights[__taps];
+    static bool made = false;
+    if (!made) {
+	double w[__taps], sum = 0.0;
+	for (int k = 0; k < __taps; k++) {
+	    w[k] = __mitchell((k - 3.5) / 2.0);
+	    sum += w[k];
+	}
+	for (int k = 0; k < __taps; k++) {
+	    weights[k] = w[k] / sum;
+	}
+	made = true;
+    }
+
+    return weights;
+}
+
+#ifndef __SSE2__
+// Converts a filtered value to a byte.  The SSE2 code rounds the same
+// way, so both give the same results.
+static GLubyte __byte(float v)
+{
+    return (GLubyte)(min(max(v, 0.0f), 255.0f) + 0.5f);
+}
+#endif
+
+// Filters n bytes from each of the given rows into out.
+static void __filterColumns(const GLubyte **rows, const float *weights,
+			    int n, float *out)
+{
+    int i = 0;
+#ifdef __SSE2__
+    // 16 bytes at a time, as 4 sets of 4 floats.
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+	__m128 sum[4];
+	for (int j = 0; j < 4; j++) {
+	    sum[j] = _mm_setzero_ps();
+	}
+	for (int k = 0; k < __taps; k++) {
+	    __m128 w = _mm_set1_ps(weights[k]);
+	    __m128i b = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+	    __m128i lo = _mm_unpacklo_epi8(b, zero);
+	    __m128i hi = _mm_unpackhi_epi8(b, zero);
+	    __m128 f[4];
+	    f[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+	    f[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+	    f[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+	    f[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+	    for (int j = 0; j < 4; j++) {
+		sum[j] = _mm_add_ps(sum[j], _mm_mul_ps(w, f[j]));
+	    }
+	}
+	for (int j = 0; j < 4; j++) {
+	    _mm_storeu_ps(out + i + j * 4, sum[j]);
+	}
+    }
+#endif
+    // Whatever's left (or everything, without SSE2).
+    for (; i < n; i++) {
+	float sum = 0.0f;
+	for (int k = 0; k < __taps; k++) {
+	    sum += weights[k] * rows[k][i];
+	}
+	out[i] = sum;
+    }
+}
+
+// Filters a row of width pixels, depth floats each, into outWidth
+// pixels of bytes.  With SSE2, we filter all of a pixel's components
+// at once, so row must be padded with 3 extra floats.
+static void __filterRow(const float *row, int width, int depth,
+			const float *weights, GLubyte *out, int outWidth)
+{
+    for (int x = 0; x < outWidth; x++, out += depth) {
+	const float *p[__taps];
+	for (int k = 0; k < __taps; k++) {
+	    int sx = min(max(2 * x - 3 + k, 0), width - 1);
+	    p[k] = row + sx * depth;
+	}
+#ifdef __SSE2__
+	__m128 sum = _mm_setzero_ps();
+	for (int k = 0; k < __taps; k++) {
+	    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]),
+					     _mm_loadu_ps(p[k])));
+	}
+	sum = _mm_min_ps(_mm_max_ps(sum, _mm_setzero_ps()),
+			 _mm_set1_ps(255.0f));
+	sum = _mm_add_ps(sum, _mm_set1_ps(0.5f));
+	int v[4];
+	_mm_storeu_si128((__m128i *)v, _mm_cvttps_epi32(sum));
+	for (int c = 0; c < depth; c++) {
+	    out[c] = v[c];
+	}
+#else
+	for (int c = 0; c < depth; c++) {
+	    float sum = 0.0f;
+	    for (int k = 0; k < __taps; k++) {
+		sum += weights[k] * p[k][c];
+	    }
+	    out[c] = __byte(sum);
+	}
+#endif
+    }
+}
+
+// Makes rows [_y0, _y1) of one level from the level above it.
+class HalveJob: public WorkerPool::Job {
+  public:
+    HalveJob(const GLubyte *src, int srcWidth, int srcHeight,
+	     GLubyte *dst, int dstWidth, int depth, const float *weights,
+	     int y0, int y1):
+	_src(src), _srcWidth(srcWidth), _srcHeight(srcHeight),
+	_dst(dst), _dstWidth(dstWidth), _depth(depth), _weights(weights),
+	_y0(y0), _y1(y1) {}
+
+    void run();
+
+  protected:
+    const GLubyte *_src;
+    int _srcWidth, _srcHeight;
+    GLubyte *_dst;
+    int _dstWidth, _depth;
+    const float *_weights;
+    int _y0, _y1;
+};
+
+void HalveJob::run()
+{
+    // One filtered source row at a time (plus padding for
+    // __filterRow()).
+    size_t stride = (size_t)_srcWidth * _depth;
+    vector<float> row(stride + 3, 0.0f);
+    for (int y = _y0; y < _y1; y++) {
+	// As with GL_CLAMP_TO_EDGE, rows beyond the edges are copies
+	// of the edge.  This also handles an image only 1 pixel high
+	// (which stays 1 pixel high).
+	const GLubyte *rows[__taps];
+	for (int k = 0; k < __taps; k++) {
+	    int sy = min(max(2 * y - 3 + k, 0), _srcHeight - 1);
+	    rows[k] = _src + sy * stride;
+	}
+	__filterColumns(rows, _weights, stride, &row[0]);
+	__filterRow(&row[0], _srcWidth, _depth, _weights,
+		    _dst + (size_t)y * _dstWidth * _depth, _dstWidth);
+    }
+}
+
+void downsampledSize(int width, int height, unsigned int shrink,
+		     int *newWidth, int *newHeight)
+{
+    *newWidth = max(width >> shrink, 1);
+    *newHeight = max(height >> shrink, 1);
+}
+
+void downsample(const GLubyte *image, int width, int height, int depth,
+		unsigned int levels, GLubyte **results, WorkerPool *pool)
+{
+    assert((depth >= 1) && (depth <= 4));
+
+    // We can stop after the last level we've been asked for.
+    while ((levels > 0) && (results[levels - 1] == NULL)) {
+	levels--;
+    }
+
+    const float *weights = __weights();
+    // Levels we make for ourselves alternate between these, so that
+    // one can be made from the other.
+    vector<GLubyte> scratch[2];
+    vector<HalveJob *> jobs;
+    const GLubyte *src = image;
+    for (unsigned int n = 1; n <= levels; n++) {
+	int w, h;
+	downsampledSize(width, height, 1, &w, &h);
+	GLubyte *dst = results[n - 1];
+	if (dst == NULL) {
+	    scratch[n % 2].resize((size_t)w * h * depth);
+	    dst = &scratch[n % 2][0];
+	}
+
+	for (int y = 0; y < h; y += __bandRows) {
+	    HalveJob *j = new HalveJob(src, width, height, dst, w, depth,
+				       weights, y, min(y + __bandRows, h));
+	    jobs.push_back(j);
+	    if (pool) {
+		pool->submit(j);
+	    } else {
+		j->run();
+	    }
+	}
+	for (size_t i = 0; i < jobs.size(); i++) {
+	    if (pool) {
+		pool->wait(jobs[i]);
+	    }
+	    delete jobs[i];
+	}
+	jobs.clear();
+
+	src = dst;
+	width = w;
+	height = h;
+    }
+}
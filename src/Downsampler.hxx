@@ -0,0 +1,72 @@
+/*-------------------------------------------------------------------------
+  Downsampler.hxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  Makes the smaller versions of a map (the lower map levels) from the
+  biggest one.  Each level is half the size of the one above it in
+  each direction (but never less than 1 pixel), as with mipmaps.
+
+  Rather than averaging 2 x 2 blocks of pixels, as glGenerateMipmap()
+  does, we use a Mitchell-Netravali filter (B = C = 1/3), which is
+  separable, so each level is made by filtering columns, then rows,
+  8 source pixels to each destination pixel.  This keeps contour
+  lines and coastlines crisp without the ringing of sharper filters
+  like Lanczos.
+
+  The full-sized image is only read once, to make the first level.
+  Each level after that is made from the one before it, so making all
+  of them is only about a third more work than making the first.  The
+  inner loops use SSE2 where we have it, and the rows of each level
+  can be split among the threads of a worker pool.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+#ifndef _DOWNSAMPLER_H_
+#define _DOWNSAMPLER_H_
+
+#include <cstddef>
+
+#if defined( __APPLE__)		// For GLubyte
+#  include <OpenGL/gl.h>
+#else
+#  include <GL/gl.h>
+#endif
+
+class WorkerPool;
+
+// The size of an image shrunk by a factor of 2^shrink in each
+// direction (but at least 1 x 1).
+void downsampledSize(int width, int height, unsigned int shrink,
+		     int *newWidth, int *newHeight);
+
+// Makes levels shrunken versions of the given width x height image
+// (depth bytes per pixel, rows packed with no padding).  Shrunken
+// image n (from 1 to levels) is written to results[n - 1], which must
+// have room for it (see downsampledSize()).  If results[n - 1] is
+// NULL, we don't need that level, but it is still made, in scratch
+// memory, if any smaller one is needed.
+//
+// If pool is non-NULL, the rows of each level are made in parallel by
+// its threads; otherwise it's all done in the calling thread.
+void downsample(const GLubyte *image, int width, int height, int depth,
+		unsigned int levels, GLubyte **results,
+		WorkerPool *pool = NULL);
+
+#endif // _DOWNSAMPLER_H_
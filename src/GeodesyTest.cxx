@@ -0,0 +1,134 @@
+/*-------------------------------------------------------------------------
+  GeodesyTest.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  Checks that the batch version of SGGeodesy::SGCartToGeod(), which
+  Subbucket uses to convert scenery vertices, agrees with the scalar
+  version to within its stated tolerance (1e-12 radians and 1e-6
+  metres), and reports how fast each is.  Run by 'make check'.
+
+  The points are scattered over the whole earth, from 500 metres below
+  sea level to 10 km above it, as scenery is.  Some are deliberately
+  awkward: on the poles, on the antimeridian, and near the centre of
+  the earth (which the batch version hands to the scalar one).  The
+  count isn't a multiple of the SIMD width, so the leftovers are
+  checked too.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// C++ system include files
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+
+// Other libraries' include files
+#include <simgear/math/SGMath.hxx>
+
+using namespace std;
+
+// The tolerances promised by SGGeodesy.hxx.
+static const double __maxAngleError = 1e-12;	// Radians
+static const double __maxElevationError = 1e-6;	// Metres
+
+// The number of points (deliberately not a multiple of 4).
+static const size_t __points = 1000003;
+
+// A simple, repeatable random number generator, giving numbers in
+// [0.0, 1.0).
+static double __random()
+{
+    static unsigned long long state = 1;
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double __seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+    vector<double> x(__points), y(__points), z(__points);
+    for (size_t i = 0; i < __points; i++) {
+	double lon = (__random() * 2.0 - 1.0) * SGD_PI;
+	double lat = (__random() - 0.5) * SGD_PI;
+	double elev = __random() * 10500.0 - 500.0;
+	if (i % 1000 == 0) {
+	    lat = (i % 2000 == 0) ? SGD_PI_2 : -SGD_PI_2;
+	}
+	if (i % 1001 == 0) {
+	    lon = SGD_PI;
+	}
+	if (i % 997 == 0) {
+	    elev = -6.3e6;
+	}
+
+	SGVec3<double> c =
+	    SGVec3<double>::fromGeod(SGGeod::fromRadM(lon, lat, elev));
+	x[i] = c[0];
+	y[i] = c[1];
+	z[i] = c[2];
+	if (i % 1001 == 0) {
+	    // Exactly on the antimeridian.
+	    y[i] = 0.0;
+	}
+    }
+
+    // The batch version.
+    vector<double> lon(__points), lat(__points), elev(__points);
+    clock_t start = clock();
+    SGGeodesy::SGCartToGeod(__points, &x[0], &y[0], &z[0],
+			    &lon[0], &lat[0], &elev[0]);
+    double batch = __seconds(start);
+
+    // The scalar version.
+    vector<SGGeod> geods(__points);
+    start = clock();
+    for (size_t i = 0; i < __points; i++) {
+	SGGeodesy::SGCartToGeod(SGVec3<double>(x[i], y[i], z[i]), geods[i]);
+    }
+    double scalar = __seconds(start);
+
+    double dLon = 0.0, dLat = 0.0, dElev = 0.0;
+    for (size_t i = 0; i < __points; i++) {
+	dLon = max(dLon, fabs(lon[i] - geods[i].getLongitudeRad()));
+	dLat = max(dLat, fabs(lat[i] - geods[i].getLatitudeRad()));
+	dElev = max(dElev, fabs(elev[i] - geods[i].getElevationM()));
+    }
+
+    printf("%lu points\n", (unsigned long)__points);
+    printf("Maximum differences: longitude %g rad, latitude %g rad, "
+	   "elevation %g m\n", dLon, dLat, dElev);
+    printf("Scalar: %.1f ns/point, batch: %.1f ns/point\n",
+	   scalar / __points * 1e9, batch / __points * 1e9);
+
+    // NaNs fail too.
+    if (!(dLon <= __maxAngleError) || !(dLat <= __maxAngleError) ||
+	!(dElev <= __maxElevationError)) {
+	fprintf(stderr, "%s: batch results differ by more than %g rad "
+		"or %g m\n", argv[0], __maxAngleError, __maxElevationError);
+	return 1;
+    }
+
+    return 0;
+}
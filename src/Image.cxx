@@ -25,7 +25,10 @@
 #include "Image.hxx"
 
 // C++ system include files
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <vector>
 
 // Other libraries' include files
 #include <png.h>
@@ -45,6 +48,8 @@
 // declare the enumerated boolean type when it sees that.
 #include <jpeglib.h>
 
+using namespace std;
+
 // This is a constant representing "Not an Elevation" - it is
 // guaranteed to be less than any possible real elevation value.
 static const float NanE = -std::numeric_limits<float>::max();
@@ -70,13 +75,48 @@ METHODDEF(void) my_error_exit(j_common_ptr cinfo)
     longjmp(myerr->setjmp_buffer, 1);
 }
 
-char *loadJPEG(const char *filename, int *width, int *height, int *depth,
-	       float *maxElev)
+// A JPEG data source for images in memory.  When we run out of data,
+// we feed the library an end-of-image marker, which it will treat as
+// a truncated image.
+static void __initSource(j_decompress_ptr cinfo)
 {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-	return NULL;
+}
+
+static boolean __fillInputBuffer(j_decompress_ptr cinfo)
+{
+    static const JOCTET eoi[2] = {0xFF, JPEG_EOI};
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+
+    return TRUE;
+}
+
+static void __skipInputData(j_decompress_ptr cinfo, long n)
+{
+    if (n <= 0) {
+	return;
     }
+    if ((size_t)n > cinfo->src->bytes_in_buffer) {
+	__fillInputBuffer(cinfo);
+    } else {
+	cinfo->src->next_input_byte += n;
+	cinfo->src->bytes_in_buffer -= n;
+    }
+}
+
+static void __termSource(j_decompress_ptr cinfo)
+{
+}
+
+// Decodes a JPEG image from fp if it's non-NULL, or from data (length
+// bytes long) otherwise.  The name is used in error messages.
+static char *__loadJPEG(FILE *fp, const char *data, size_t length,
+			const char *name, int *width, int *height, int *depth,
+			float *maxElev, char *buffer, size_t size, 
+			unsigned int shrink)
+{
+    // The JPEG library can only scale down to 1/8.
+    assert(shrink <= 3);
 
     jpeg_decompress_struct cinfo;
     memset(&cinfo, 0, sizeof cinfo);
@@ -91,12 +131,11 @@ char *loadJPEG(const char *filename, int *width, int *height, int *depth,
 	// When an error occurs, we'll jump to this block of code.
 	// First, output the name of the file and the canned JPEG
 	// error message.
-	fprintf(stderr, "%s: ", filename);
+	fprintf(stderr, "%s: ", name);
 	(cinfo.err->output_message)((jpeg_common_struct *)&cinfo);
 
 	// Clean things up and return.
 	jpeg_destroy_decompress(&cinfo);
-	fclose(fp);
 	return NULL;
     }
 
@@ -104,7 +143,20 @@ char *loadJPEG(const char *filename, int *width, int *height, int *depth,
     jpeg_create_decompress(&cinfo);
 
     // Specify the data source.
-    jpeg_stdio_src(&cinfo, fp);
+    jpeg_source_mgr src;
+    if (fp) {
+	jpeg_stdio_src(&cinfo, fp);
+    } else {
+	memset(&src, 0, sizeof(src));
+	src.init_source = __initSource;
+	src.fill_input_buffer = __fillInputBuffer;
+	src.skip_input_data = __skipInputData;
+	src.resync_to_restart = jpeg_resync_to_restart;
+	src.term_source = __termSource;
+	src.next_input_byte = (const JOCTET *)data;
+	src.bytes_in_buffer = length;
+	cinfo.src = &src;
+    }
 
     // Map stores elevation information for the map in the APP1
     // marker, so tell the JPEG library we're interested.  This must
@@ -133,13 +185,21 @@ char *loadJPEG(const char *filename, int *width, int *height, int *depth,
 	}
     }
 
+    // Ask for a scaled image.  The library does this as part of the
+    // inverse DCT, so it does less work, not more.
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1 << shrink;
+
     // Now get the image.
     jpeg_start_decompress(&cinfo);
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
 
     char *image = NULL;
     if (cinfo.out_color_space == JCS_RGB) {
 	*depth = 3;
-	image = new char[cinfo.output_width * cinfo.output_height * *depth];
+	size_t bytes = cinfo.output_width * cinfo.output_height * *depth;
+	image = (buffer && (bytes <= size)) ? buffer : new char[bytes];
 
 	while (cinfo.output_scanline < cinfo.output_height) {
 	    char *buf = 
@@ -151,23 +211,101 @@ char *loadJPEG(const char *filename, int *width, int *height, int *depth,
     jpeg_finish_decompress(&cinfo);
     jpeg_destroy_decompress(&cinfo);
 
-    fclose(fp);
-
     return image;
 }
 
-char *loadPNG(const char *filename, int *width, int *height, int *depth,
-	      float *maxElev)
+char *loadJPEG(const char *filename, int *width, int *height, int *depth,
+	       float *maxElev, char *buffer, size_t size, unsigned int shrink)
 {
-    char *header[8];
-
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
 	return NULL;
     }
+    char *result = __loadJPEG(fp, NULL, 0, filename, width, height, depth, 
+			      maxElev, buffer, size, shrink);
+    fclose(fp);
+
+    return result;
+}
+
+char *decodeJPEG(const char *data, size_t length, 
+		 int *width, int *height, int *depth,
+		 float *maxElev, char *buffer, size_t size, unsigned int shrink)
+{
+    return __loadJPEG(NULL, data, length, "decodeJPEG", width, height, depth,
+		      maxElev, buffer, size, shrink);
+}
+
+// Shrinks the given image by 2^shrink in each direction, by averaging
+// blocks of pixels, and puts the result in dst.  If the image isn't
+// a multiple of 2^shrink in size, the blocks along the right and
+// bottom edges are smaller.
+static void __shrink(const char *src, int width, int height, int depth,
+		     unsigned int shrink, char *dst, int *newWidth, 
+		     int *newHeight)
+{
+    const int block = 1 << shrink;
+    *newWidth = (width + block - 1) / block;
+    *newHeight = (height + block - 1) / block;
+
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned char *d = (unsigned char *)dst;
+    for (int y = 0; y < *newHeight; y++) {
+	int y0 = y * block, y1 = std::min(y0 + block, height);
+	for (int x = 0; x < *newWidth; x++) {
+	    int x0 = x * block, x1 = std::min(x0 + block, width);
+	    int n = (x1 - x0) * (y1 - y0);
+	    for (int c = 0; c < depth; c++) {
+		unsigned int sum = 0;
+		for (int j = y0; j < y1; j++) {
+		    const unsigned char *p = s + ((size_t)j * width + x0) * depth;
+		    for (int i = x0; i < x1; i++, p += depth) {
+			sum += p[c];
+		    }
+		}
+		*d++ = (sum + n / 2) / n;
+	    }
+	}
+    }
+}
+
+// A PNG image in memory, and how much of it has been read.
+struct __PNGSource {
+    const char *data;
+    size_t length, offset;
+};
+
+static void __readPNG(png_structp png_ptr, png_bytep out, png_size_t n)
+{
+    __PNGSource *src = (__PNGSource *)png_get_io_ptr(png_ptr);
+    if (n > src->length - src->offset) {
+	png_error(png_ptr, "truncated image");
+    }
+    memcpy(out, src->data + src->offset, n);
+    src->offset += n;
+}
+
+// Decodes a PNG image from fp if it's non-NULL, or from data (length
+// bytes long) otherwise.
+static char *__loadPNG(FILE *fp, const char *data, size_t length,
+		       int *width, int *height, int *depth,
+		       float *maxElev, char *buffer, size_t size, 
+		       unsigned int shrink)
+{
+    char header[8];
 
     // Check to see if this might be PNG.
-    fread(header, 1, 8, fp);
+    __PNGSource src = {data, length, 8};
+    if (fp) {
+	if (fread(header, 1, 8, fp) != 8) {
+	    return NULL;
+	}
+    } else {
+	if (length < 8) {
+	    return NULL;
+	}
+	memcpy(header, data, 8);
+    }
     if (png_sig_cmp((png_bytep)header, 0, 8)) {
 	return NULL;
     }
@@ -185,8 +323,25 @@ char *loadPNG(const char *filename, int *width, int *height, int *depth,
 	return NULL;
     }
 
+    // If something goes wrong (ie, the image is corrupt), we'll end
+    // up here.
+    png_bytep *volatile rows = NULL;
+    char *volatile image = NULL;
+    if (setjmp(png_jmpbuf(png_ptr))) {
+	delete[] rows;
+	if (image != buffer) {
+	    delete[] image;
+	}
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	return NULL;
+    }
+
     // Initialize IO.
-    png_init_io(png_ptr, fp);
+    if (fp) {
+	png_init_io(png_ptr, fp);
+    } else {
+	png_set_read_fn(png_ptr, &src, __readPNG);
+    }
     png_set_sig_bytes(png_ptr, 8);
 
     png_read_info(png_ptr, info_ptr);
@@ -218,9 +373,15 @@ char *loadPNG(const char *filename, int *width, int *height, int *depth,
 	return NULL;
     }
 
-    // Allocate image chunk.
-    png_bytep *rows = new png_bytep[*height];
-    char *image = new char[*width * *height * *depth];
+    // Allocate image chunk.  If we're shrinking it, we read the full
+    // image into a temporary chunk first.
+    rows = new png_bytep[*height];
+    size_t bytes = *width * *height * *depth;
+    if (shrink > 0) {
+	image = new char[bytes];
+    } else {
+	image = (buffer && (bytes <= size)) ? buffer : new char[bytes];
+    }
     for (int i = 0; i < *height; i++) {
 	rows[i] = (png_bytep)(image + i * *width * *depth);
     }
@@ -246,21 +407,94 @@ char *loadPNG(const char *filename, int *width, int *height, int *depth,
 
     delete[] rows;
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-    fclose(fp);
 
-    return image;
+    char *result = image;
+    if (shrink > 0) {
+	int block = 1 << shrink;
+	bytes = (size_t)((*width + block - 1) / block) * 
+	    ((*height + block - 1) / block) * *depth;
+	result = (buffer && (bytes <= size)) ? buffer : new char[bytes];
+	__shrink(image, *width, *height, *depth, shrink, result, 
+		 width, height);
+	delete[] image;
+    }
+
+    return result;
 }
 
-void saveJPEG(const char *file, int quality, 
-	      GLubyte *image, int width, int height, float maxElev)
+char *loadPNG(const char *filename, int *width, int *height, int *depth,
+	      float *maxElev, char *buffer, size_t size, unsigned int shrink)
 {
-    // Open the output file.
-    FILE *fp = fopen(file, "wb");
+    FILE *fp = fopen(filename, "rb");
     if (!fp) {
-	fprintf(stderr, "saveJPEG: can't create '%s'\n", file);
-	return;
+	return NULL;
+    }
+    char *result = __loadPNG(fp, NULL, 0, width, height, depth, 
+			     maxElev, buffer, size, shrink);
+    fclose(fp);
+
+    return result;
+}
+
+char *decodePNG(const char *data, size_t length, 
+		int *width, int *height, int *depth,
+		float *maxElev, char *buffer, size_t size, unsigned int shrink)
+{
+    return __loadPNG(NULL, data, length, width, height, depth, 
+		     maxElev, buffer, size, shrink);
+}
+
+char *decodeImage(const char *data, size_t length, 
+		  int *width, int *height, int *depth,
+		  float *maxElev, char *buffer, size_t size, unsigned int shrink)
+{
+    static const unsigned char signature[] = {0x89, 'P', 'N', 'G'};
+    if ((length >= sizeof(signature)) && 
+	(memcmp(data, signature, sizeof(signature)) == 0)) {
+	return decodePNG(data, length, width, height, depth, 
+			 maxElev, buffer, size, shrink);
     }
+    return decodeJPEG(data, length, width, height, depth, 
+		      maxElev, buffer, size, shrink);
+}
+
+// A JPEG destination that appends to a vector.
+struct __JPEGDestination {
+    jpeg_destination_mgr pub;
+    vector<char> *out;
+    JOCTET buffer[4096];
+};
 
+static void __initDestination(j_compress_ptr cinfo)
+{
+    __JPEGDestination *dest = (__JPEGDestination *)cinfo->dest;
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = sizeof(dest->buffer);
+}
+
+static boolean __emptyOutputBuffer(j_compress_ptr cinfo)
+{
+    __JPEGDestination *dest = (__JPEGDestination *)cinfo->dest;
+    dest->out->insert(dest->out->end(), 
+		      dest->buffer, dest->buffer + sizeof(dest->buffer));
+    __initDestination(cinfo);
+
+    return TRUE;
+}
+
+static void __termDestination(j_compress_ptr cinfo)
+{
+    __JPEGDestination *dest = (__JPEGDestination *)cinfo->dest;
+    dest->out->insert(dest->out->end(), dest->buffer, 
+		      dest->buffer + sizeof(dest->buffer) - 
+		      dest->pub.free_in_buffer);
+}
+
+// Encodes a JPEG image to fp if it's non-NULL, or appends it to out
+// otherwise.
+static void __saveJPEG(FILE *fp, vector<char> *out, int quality, 
+		       GLubyte *image, int width, int height, float maxElev)
+{
     jpeg_compress_struct cinfo;
     memset(&cinfo, 0, sizeof cinfo);
 
@@ -269,7 +503,16 @@ void saveJPEG(const char *file, int quality,
     cinfo.err = jpeg_std_error(&jerr);
 
     jpeg_create_compress(&cinfo);
-    jpeg_stdio_dest(&cinfo, fp);
+    __JPEGDestination dest;
+    if (fp) {
+	jpeg_stdio_dest(&cinfo, fp);
+    } else {
+	dest.pub.init_destination = __initDestination;
+	dest.pub.empty_output_buffer = __emptyOutputBuffer;
+	dest.pub.term_destination = __termDestination;
+	dest.out = out;
+	cinfo.dest = &dest.pub;
+    }
 
     cinfo.image_width = width;
     cinfo.image_height = height;
@@ -305,20 +548,42 @@ void saveJPEG(const char *file, int quality,
 
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
-
-    fclose(fp);
 }
 
-void savePNG(const char *file, 
-	     GLubyte *image, int width, int height, float maxElev)
+void saveJPEG(const char *file, int quality, 
+	      GLubyte *image, int width, int height, float maxElev)
 {
     // Open the output file.
     FILE *fp = fopen(file, "wb");
     if (!fp) {
-	fprintf(stderr, "savePNG: can't create '%s'\n", file);
+	fprintf(stderr, "saveJPEG: can't create '%s'\n", file);
 	return;
     }
+    __saveJPEG(fp, NULL, quality, image, width, height, maxElev);
+    fclose(fp);
+}
+
+void encodeJPEG(vector<char> &out, int quality, 
+		GLubyte *image, int width, int height, float maxElev)
+{
+    __saveJPEG(NULL, &out, quality, image, width, height, maxElev);
+}
+
+static void __writePNG(png_structp png_ptr, png_bytep data, png_size_t n)
+{
+    vector<char> *out = (vector<char> *)png_get_io_ptr(png_ptr);
+    out->insert(out->end(), (const char *)data, (const char *)data + n);
+}
+
+static void __flushPNG(png_structp png_ptr)
+{
+}
 
+// Encodes a PNG image to fp if it's non-NULL, or appends it to out
+// otherwise.
+static void __savePNG(FILE *fp, vector<char> *out,
+		      GLubyte *image, int width, int height, float maxElev)
+{
     // Create PNG structure.
     png_structp png_ptr = 
 	png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
@@ -332,11 +597,14 @@ void savePNG(const char *file,
 
     if (setjmp(png_jmpbuf(png_ptr))) {
 	png_destroy_write_struct(&png_ptr, &info_ptr);
-	fclose(fp);
 	return;
     }
 
-    png_init_io(png_ptr, fp);
+    if (fp) {
+	png_init_io(png_ptr, fp);
+    } else {
+	png_set_write_fn(png_ptr, out, __writePNG, __flushPNG);
+    }
     png_set_IHDR(png_ptr, info_ptr, width, height, 8, 
 		 PNG_COLOR_TYPE_RGB, 
 		 PNG_INTERLACE_NONE, 
@@ -370,7 +638,24 @@ void savePNG(const char *file,
 
     png_write_end(png_ptr, info_ptr);
     png_destroy_write_struct(&png_ptr, &info_ptr);
+}
 
+void savePNG(const char *file, 
+	     GLubyte *image, int width, int height, float maxElev)
+{
+    // Open the output file.
+    FILE *fp = fopen(file, "wb");
+    if (!fp) {
+	fprintf(stderr, "savePNG: can't create '%s'\n", file);
+	return;
+    }
+    __savePNG(fp, NULL, image, width, height, maxElev);
     fclose(fp);
 }
 
+void encodePNG(vector<char> &out, 
+	       GLubyte *image, int width, int height, float maxElev)
+{
+    __savePNG(NULL, &out, image, width, height, maxElev);
+}
+
@@ -28,6 +28,7 @@
 #define _IMAGE_H_
 
 #include <stdlib.h>		// For NULL
+#include <vector>
 #if defined( __APPLE__)		// For GLubyte
 #  include <OpenGL/gl.h>
 #else
@@ -36,14 +37,48 @@
 
 enum ImageType {PNG, JPEG};
 
+// Load the given image file, returning NULL on failure.  If buffer
+// is given, and it's big enough (size bytes), the image is decoded
+// into it and buffer is returned.  Otherwise the image is allocated
+// with new[], and it's up to the caller to delete[] it.  These are
+// safe to call from more than one thread at once.
+//
+// If shrink is greater than 0, the image is reduced by a factor of
+// 2^shrink in each direction as it's loaded (width and height give
+// the reduced size).  JPEG images are scaled by the JPEG library as
+// they're decoded, which only works for shrinks of up to 3 (1/8
+// scale), and is much faster than a full decode.  PNG images are
+// decoded in full, then averaged down.
 char *loadJPEG(const char *filename, int *width, int *height, int *depth,
-	       float *maxElev = NULL);
+	       float *maxElev = NULL, char *buffer = NULL, size_t size = 0,
+	       unsigned int shrink = 0);
 char *loadPNG(const char *filename, int *width, int *height, int *depth,
-	      float *maxElev = NULL);
+	      float *maxElev = NULL, char *buffer = NULL, size_t size = 0,
+	      unsigned int shrink = 0);
+
+// The same, but decoding images in memory (data, length bytes long).
+char *decodeJPEG(const char *data, size_t length, 
+		 int *width, int *height, int *depth,
+		 float *maxElev = NULL, char *buffer = NULL, size_t size = 0,
+		 unsigned int shrink = 0);
+char *decodePNG(const char *data, size_t length, 
+		int *width, int *height, int *depth,
+		float *maxElev = NULL, char *buffer = NULL, size_t size = 0,
+		unsigned int shrink = 0);
+// Either of the above, telling which by the image's signature.
+char *decodeImage(const char *data, size_t length, 
+		  int *width, int *height, int *depth,
+		  float *maxElev = NULL, char *buffer = NULL, size_t size = 0,
+		  unsigned int shrink = 0);
 
 void saveJPEG(const char *file, int quality, 
 	      GLubyte *image, int width, int height, float maxElev);
 void savePNG(const char *file, 
 	     GLubyte *image, int width, int height, float maxElev);
+// The same, but appending the encoded image to out.
+void encodeJPEG(std::vector<char> &out, int quality, 
+		GLubyte *image, int width, int height, float maxElev);
+void encodePNG(std::vector<char> &out, 
+	       GLubyte *image, int width, int height, float maxElev);
 
 #endif
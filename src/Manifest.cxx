@@ -0,0 +1,166 @@
+/*-------------------------------------------------------------------------
+  Manifest.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// Our include file
+#include "Manifest.hxx"
+
+// C++ system include files
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+// System include files
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Other libraries' include files
+#include <simgear/misc/sg_hash.hxx>
+
+// Our project's include files
+#include "Bucket.hxx"
+#include "Tiles.hxx"
+#include "misc.hxx"
+
+using namespace std;
+
+// The first line of every manifest.  If the format changes, change
+// the version, and all old manifests will (correctly) fail to match.
+static const char *__header = "# Atlas map manifest (version 1)";
+
+Manifest::Manifest(Tile *t, const string &style): _t(t)
+{
+    // Get all the scenery files.
+    const SGPath &dir = t->sceneryDir();
+    vector<long int> indices;
+    t->bucketIndices(indices);
+    vector<SGPath> files;
+    for (size_t i = 0; i < indices.size(); i++) {
+	Bucket b(dir, indices[i]);
+	b.sceneryFiles(files);
+    }
+
+    // One line per file, giving its size, modification time, and name
+    // (relative to the scenery directory, so that moving the scenery
+    // doesn't invalidate anything).  Files named in a .stg file that
+    // don't exist are recorded as such, so that we notice if they
+    // appear.  The lines are sorted so that the order we find things
+    // in doesn't matter.
+    const string prefix = dir.str() + "/";
+    vector<string> lines;
+    for (size_t i = 0; i < files.size(); i++) {
+	string name = files[i].str();
+	if (name.compare(0, prefix.size(), prefix) == 0) {
+	    name.erase(0, prefix.size());
+	}
+
+	AtlasString line;
+	struct stat st;
+	if (stat(files[i].c_str(), &st) == 0) {
+	    line.printf("%ld %ld %s\n",
+			(long)st.st_size, (long)st.st_mtime, name.c_str());
+	} else {
+	    line.printf("- - %s\n", name.c_str());
+	}
+	lines.push_back(line.str());
+    }
+    sort(lines.begin(), lines.end());
+
+    ostringstream str;
+    str << __header << "\n";
+    str << "style " << style << "\n";
+    for (size_t i = 0; i < lines.size(); i++) {
+	str << lines[i];
+    }
+    _contents = str.str();
+}
+
+bool Manifest::matches() const
+{
+    ifstream in(path(_t).c_str(), ios::binary);
+    if (!in) {
+	return false;
+    }
+    ostringstream saved;
+    saved << in.rdbuf();
+
+    return saved.str() == _contents;
+}
+
+bool Manifest::save() const
+{
+    // Create the manifests directory if necessary.  SGPath creates
+    // the directory containing the path we give it.
+    SGPath p = path(_t);
+    if (p.create_dir(0755) < 0) {
+	return false;
+    }
+
+    // Nobody should ever see a partially written manifest.
+    AtomicFile out(p.c_str());
+    if (out.fp() == NULL) {
+	return false;
+    }
+
+    return out.commit(fwrite(_contents.data(), 1, _contents.size(), 
+			     out.fp()) == _contents.size());
+}
+
+SGPath Manifest::path(Tile *t)
+{
+    SGPath result = t->mapsDir();
+    result.append("Manifests");
+    result.append(t->name());
+
+    return result;
+}
+
+string Manifest::digest(const SGPath &file)
+{
+    FILE *f = fopen(file.c_str(), "rb");
+    if (f == NULL) {
+	return "";
+    }
+
+    simgear::sha1nfo info;
+    simgear::sha1_init(&info);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+	simgear::sha1_write(&info, buf, n);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    if (!ok) {
+	return "";
+    }
+
+    const uint8_t *hash = simgear::sha1_result(&info);
+    AtlasString result;
+    for (int i = 0; i < HASH_LENGTH; i++) {
+	result.appendf("%02x", hash[i]);
+    }
+
+    return result.str();
+}
@@ -0,0 +1,78 @@
+/*-------------------------------------------------------------------------
+  Manifest.hxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  A manifest records what went into a tile's maps: the size and
+  modification time of each of its scenery files (its .stg files and
+  the objects they name), plus a "style" string describing everything
+  else that affects how the maps look (the palette, lighting, ...).
+  Map saves one for each tile it renders, and, when asked to rebuild
+  incrementally, compares it with a fresh one to decide whether the
+  tile's maps are out of date.
+
+  Making a manifest only needs a stat() of each scenery file (and a
+  read of the small .stg files), so checking every tile is cheap -
+  much cheaper than loading, let alone rendering, its scenery.  As
+  with the scenery cache (see Subbucket), a file is considered changed
+  if its size or modification time changes, even if its contents
+  don't.
+
+  Manifests are plain text files, one per tile, kept in
+  <maps>/Manifests.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <string>
+
+#include <simgear/misc/sg_path.hxx> // SGPath
+
+// Forward class declarations
+class Tile;
+
+class Manifest {
+  public:
+    // Creates a manifest of t's scenery as it is now, for maps drawn
+    // in the given style.
+    Manifest(Tile *t, const std::string &style);
+
+    // True if t's saved manifest is the same as this one (ie, if its
+    // maps were rendered from the same scenery in the same style).
+    bool matches() const;
+    // Saves the manifest, replacing any earlier one.  Returns false
+    // if it couldn't be written.
+    bool save() const;
+
+    Tile *tile() const { return _t; }
+
+    // Where t's manifest is saved.
+    static SGPath path(Tile *t);
+    // The SHA-1 digest of the given file's contents, as a hex string,
+    // or "" if it can't be read.  Useful for making style strings.
+    static std::string digest(const SGPath &file);
+
+  protected:
+    Tile *_t;
+    std::string _contents;
+};
+
+#endif // _MANIFEST_H_
@@ -44,6 +44,8 @@
 #endif
 
 // C++ system files
+#include <map>
+#include <set>
 #include <stdexcept>
 
 // Other libraries' include files
@@ -51,10 +53,13 @@
 
 // Our project's include files
 #include "config.h"		// For VERSION
+#include "Bucket.hxx"
+#include "Manifest.hxx"
 #include "misc.hxx"
 #include "Palette.hxx"
 #include "Tiles.hxx"
 #include "TileMapper.hxx"
+#include "WorkerPool.hxx"
 
 using namespace std;
 
@@ -71,11 +76,37 @@ static bool lighting = true;
 static bool discreteContours = true;
 // True if we want contour lines.
 static bool contourLines = false;
+// True if we want to colour contours with a shader rather than by
+// chopping triangles.
+static bool shadedContours = false;
 // Position of light.  We always set the light at infinity (w = 0.0);
 // EYE - this must be shared with Atlas - make defaults global?
 static float azimuth = 315.0, elevation = 55.0;
 // True if we want smooth shading, false if we want flat shading.
 static bool smoothShading = true;
+// True if we only render some map levels, and let Atlas derive the
+// others from them (see TileManager::derivedLevels()).
+static bool deriveMaps = false;
+// True if we save maps in per-chunk map archives (see MapArchive).
+static bool packMaps = false;
+// True if, when a tile already has a map at the largest level, we
+// make its missing maps by shrinking that one, rather than by
+// rendering its scenery (see TileMapper::setFromMap()).
+static bool shrinkMaps = false;
+// True if we re-render the maps of tiles whose scenery (or map style)
+// has changed since they were last rendered (see Manifest).
+static bool incremental = false;
+// The number of threads used to load scenery, and the number used to
+// save maps (0 means one less than the number of processors, but at
+// least 1 - see WorkerPool).
+static unsigned int jobs = 0;
+// Render with OpenGL, or on the CPU (see Rasterizer)?
+static TileMapper::Renderer renderer = TileMapper::OPENGL;
+// How many tiles ahead of the one being rendered we load scenery.
+// Each tile can have dozens of buckets, so this doesn't need to be
+// big to keep the loaders busy, and it keeps a limit on how much
+// scenery we have in memory.
+static const size_t lookahead = 2;
 
 // If true, we just print out what we would do, then exit.
 static bool test = false;
@@ -88,17 +119,106 @@ static Palette *atlasPalette;
 
 // Handles rendering of maps.
 static TileMapper *mapper;
+// Our worker pools, for loading scenery and saving maps.
+static WorkerPool *loaders, *encoders;
 
 static int bufferSize;	// Size of rendering buffer.
 
+// The style of the maps we make (see mapStyle()).
+static string style;
+// In incremental mode, the tiles whose maps are out of date.
+static set<Tile *> staleTiles;
+// The manifests to save for the tiles we render, once their new maps
+// have been written.
+static map<Tile *, Manifest *> manifests;
+
+// True if t's missing maps can be made from its largest map.  A stale
+// tile's largest map is as out of date as the rest.
+bool shrinkable(Tile *t)
+{
+    return shrinkMaps && t->maps()[mapper->maxDesiredLevel()] &&
+	(staleTiles.count(t) == 0);
+}
+
+// The maps we need to render for t: its missing maps or, if it's
+// stale, all of them (except those Atlas derives for itself).
+bitset<TileManager::MAX_MAP_LEVEL> mapsToRender(Tile *t)
+{
+    if (staleTiles.count(t) > 0) {
+	return tileManager->mapLevels() & ~tileManager->derivedLevels();
+    }
+    return t->missingMaps() & ~tileManager->derivedLevels();
+}
+
+// A string describing everything besides the scenery that affects how
+// our maps look, for manifests.  The palette is described by its
+// contents, so editing it (or switching to another) changes the
+// style.
+string mapStyle(const SGPath &palettePath)
+{
+    AtlasString result;
+    result.printf("palette=%s", Manifest::digest(palettePath).c_str());
+    result.appendf(" contours=%s", discreteContours ? "discrete" : "smooth");
+    result.appendf(" contour-lines=%d", contourLines);
+    result.appendf(" light=%.1f,%.1f", azimuth, elevation);
+    result.appendf(" lighting=%d", lighting);
+    result.appendf(" smooth-shading=%d", smoothShading);
+    // Only OpenGL can shade contours (see main()).
+    result.appendf(" shaded-contours=%d", 
+		   shadedContours && (renderer == TileMapper::OPENGL));
+    result.appendf(" renderer=%s", 
+		   (renderer == TileMapper::OPENGL) ? "opengl" : "cpu");
+    if (imageType == TileMapper::JPEG) {
+	result.appendf(" image=jpeg,%u", jpegQuality);
+    } else {
+	result.appendf(" image=png");
+    }
+
+    return result.str();
+}
+
+// Finds out which tiles have changed since their maps were rendered,
+// and so need to be rendered again.
+void findStaleTiles()
+{
+    TileIterator ti(tileManager, TileManager::DOWNLOADED);
+    for (Tile *t = ti.first(); t; t = ti++) {
+	Manifest *m = new Manifest(t, style);
+	if (m->matches()) {
+	    delete m;
+	} else {
+	    staleTiles.insert(t);
+	    manifests[t] = m;
+	}
+    }
+}
+
+// Saves the manifests of tiles whose new maps have all been written.
+void saveManifests()
+{
+    Tile *t;
+    while ((t = mapper->saved()) != NULL) {
+	map<Tile *, Manifest *>::iterator i = manifests.find(t);
+	if (i == manifests.end()) {
+	    continue;
+	}
+	if (!i->second->save()) {
+	    fprintf(stderr, "%s: Unable to save manifest '%s'\n",
+		    appName, Manifest::path(t).c_str());
+	}
+	delete i->second;
+	manifests.erase(i);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Renders a single scenery tile, perhaps at several different sizes,
 // storing the results as image files.  It only generates maps if they
-// don't already exist.
+// don't already exist (or, in incremental mode, are out of date).
 ////////////////////////////////////////////////////////////////////////////////
 void renderMap(Tile *t)
 {
-    const bitset<TileManager::MAX_MAP_LEVEL>& maps = t->missingMaps();
+    const bitset<TileManager::MAX_MAP_LEVEL> maps = mapsToRender(t);
     if (maps.none()) {
 	return;
     }
@@ -109,8 +229,24 @@ void renderMap(Tile *t)
 	bool first = true;
 	printf("%s: ", t->name());
 
-	mapper->set(t);
-	mapper->render();
+	bool shrunk = shrinkable(t) && mapper->setFromMap(t);
+	if (!shrunk) {
+	    // Record the scenery we're about to render, so that the
+	    // tile's manifest can be saved once its maps are (see
+	    // saveManifests()).  Stale tiles already have one.  If
+	    // we're only rendering some of the tile's maps, the others
+	    // may come from other scenery or be in another style, so
+	    // we leave its manifest (if it has one) alone - likewise
+	    // for shrunk maps, which are only as up to date as the map
+	    // they come from.
+	    if ((manifests.count(t) == 0) && 
+		(maps == (tileManager->mapLevels() & 
+			  ~tileManager->derivedLevels()))) {
+		manifests[t] = new Manifest(t, style);
+	    }
+	    mapper->set(t);
+	    mapper->render();
+	}
 	for (unsigned int i = 0; i < TileManager::MAX_MAP_LEVEL; i++) {
 	    if (maps[i]) {
 		mapper->save(i);
@@ -120,13 +256,24 @@ void renderMap(Tile *t)
 		}
 		printf("%u", i);
 		first = false;
-		if (!renderToFramebuffer) {
+		if (!renderToFramebuffer && (renderer == TileMapper::OPENGL)) {
 		    glutSwapBuffers();
 		}
 	    }
 	}
+	if (shrunk) {
+	    printf(" (from %u)", mapper->maxDesiredLevel());
+	} else if (verbose) {
+	    printf(" (vertex table %.1f KB)", mapper->scratchBytes() / 1024.0);
+	}
 	printf("\n");
     } catch (runtime_error &e) {
+	// The tile's maps weren't made, so it keeps its old manifest.
+	map<Tile *, Manifest *>::iterator i = manifests.find(t);
+	if (i != manifests.end()) {
+	    delete i->second;
+	    manifests.erase(i);
+	}
 	// EYE - make these strings constants?
 	if (strcmp(e.what(), "scenery") == 0) {
 	    fprintf(stderr, "%s: Unable to load buckets for '%s' from '%s'\n", 
@@ -153,12 +300,32 @@ void print_help()
     printf("  --smooth-contour   Blend contour colours\n");
     printf("  --no-contour-lines Don't draw contour lines (default)\n");
     printf("  --contour-lines    Draw contour lines\n");
+    printf("  --chopped-contours Chop triangles to colour contours (default)\n");
+    printf("  --shaded-contours  Colour contours with a shader (OpenGL 2.0)\n");
     printf("  --light=azim,elev  Set light position (default = <%.0f, %.0f>)\n",
 	   azimuth, elevation);
     printf("  --lighting         Light the terrain (default)\n");
     printf("  --no-lighting      Don't light the terrain (flat light)\n");
     printf("  --smooth-shading   Smooth polygons (default)\n");
     printf("  --flat-shading     Don't smooth polygons\n");
+    printf("  --derive-maps      Only render maps at some levels, and derive\n");
+    printf("                     the others from them\n");
+    printf("  --no-derive-maps   Render maps at all levels (default)\n");
+    printf("  --pack-maps        Save maps in one archive file per chunk\n");
+    printf("  --no-pack-maps     Save maps in one file per tile (default)\n");
+    printf("  --shrink-maps      Make missing maps by shrinking existing maps\n");
+    printf("                     at the largest level\n");
+    printf("  --no-shrink-maps   Render all missing maps from scenery (default)\n");
+    printf("  --incremental      Also re-render maps whose scenery or style\n");
+    printf("                     (palette, lighting, image type, ...) has\n");
+    printf("                     changed since they were rendered, or that\n");
+    printf("                     have no record of how they were rendered\n");
+    printf("  --jobs=integer     Load scenery with this many threads, and save\n");
+    printf("                     maps with as many again (default = number\n");
+    printf("                     of processors - 1, and at least 1, each)\n");
+    printf("  --renderer=opengl  Render maps with OpenGL (default)\n");
+    printf("  --renderer=cpu     Render maps on the CPU (no OpenGL or display\n");
+    printf("                     needed; implies --chopped-contours)\n");
     printf("  --test             Do nothing, but report what Map would do\n");
     printf("  --verbose          Display extra information while mapping\n");
     printf("  --version          Print version and exit\n");
@@ -189,6 +356,10 @@ bool parse_arg(char* arg)
 	contourLines = true;
     } else if (strcmp(arg, "--no-contour-lines") == 0) {
 	contourLines = false;
+    } else if (strcmp(arg, "--chopped-contours") == 0) {
+	shadedContours = false;
+    } else if (strcmp(arg, "--shaded-contours") == 0) {
+	shadedContours = true;
     } else if (strcmp(arg, "--render-offscreen") == 0) {
 	renderToFramebuffer = true;
     } else if (strcmp(arg, "--render-to-window") == 0) {
@@ -210,6 +381,26 @@ bool parse_arg(char* arg)
 	smoothShading = true;
     } else if (strcmp(arg, "--flat-shading") == 0) {
 	smoothShading = false;
+    } else if (strcmp(arg, "--derive-maps") == 0) {
+	deriveMaps = true;
+    } else if (strcmp(arg, "--no-derive-maps") == 0) {
+	deriveMaps = false;
+    } else if (strcmp(arg, "--pack-maps") == 0) {
+	packMaps = true;
+    } else if (strcmp(arg, "--no-pack-maps") == 0) {
+	packMaps = false;
+    } else if (strcmp(arg, "--shrink-maps") == 0) {
+	shrinkMaps = true;
+    } else if (strcmp(arg, "--no-shrink-maps") == 0) {
+	shrinkMaps = false;
+    } else if (strcmp(arg, "--incremental") == 0) {
+	incremental = true;
+    } else if (sscanf(arg, "--jobs=%u", &jobs) == 1) {
+	// Nothing more to do.
+    } else if (strcmp(arg, "--renderer=opengl") == 0) {
+	renderer = TileMapper::OPENGL;
+    } else if (strcmp(arg, "--renderer=cpu") == 0) {
+	renderer = TileMapper::CPU;
     } else if (strcmp(arg, "--test") == 0) {
 	test = true;
     } else if (strcmp(arg, "--verbose") == 0) {
@@ -249,19 +440,99 @@ Palette *loadPalette(const char *path)
 // Deletes whatever we've allocated.
 void cleanup(int exitCode)
 {
+    if (mapper) {
+	// This waits for any maps still being saved, so it must come
+	// before we delete the tiles and the pools.
+	delete mapper;
+    }
     if (atlasPalette) {
 	delete atlasPalette;
     }
+    // Manifests of tiles we didn't finish mapping are just dropped.
+    map<Tile *, Manifest *>::iterator i;
+    for (i = manifests.begin(); i != manifests.end(); i++) {
+	delete i->second;
+    }
+    manifests.clear();
     if (tileManager) {
 	delete tileManager;
     }
-   if (mapper) {
-	delete mapper;
+    if (loaders) {
+	delete loaders;
+    }
+    if (encoders) {
+	delete encoders;
     }
 
     exit(exitCode);
 }
 
+// Creates our window and OpenGL context, and checks that OpenGL can
+// do what we need.
+void initOpenGL(int &argc, char **argv)
+{
+    int windowSize = bufferSize;
+    if (renderToFramebuffer) {
+	// Just pick a small window size - we shouldn't see it anyway.
+	windowSize = 256;
+    }
+    glutInit(&argc, argv);
+    // We don't need a depth buffer, multisampling, etc.
+    glutInitDisplayString("rgba");
+    // EYE - if this is gone, we don't need the windowSize calculation
+    // above, do we?
+    // glutInitWindowSize(windowSize, windowSize);
+    glutCreateWindow("Map");
+  
+    // Check for sufficient OpenGL capabilities.
+    GLenum err = glewInit();
+    if (err != GLEW_OK) {
+	fprintf(stderr, "Failed to initialize GLEW!\n");
+	exit(0);
+    }
+    if (!GLEW_VERSION_1_5) {
+    	fprintf(stderr, "OpenGL version 1.5 not supported!\n");
+	exit(0);
+    }
+    // EYE - Really we should just ask for OpenGL 3.0, which
+    // incorporated all the following as core functions.  However,
+    // some people, namely the developer, are living in the past and
+    // don't have OpenGL 3.0.
+    if (!GLEW_EXT_framebuffer_object) {
+	fprintf(stderr, "EXT_framebuffer_object not supported!\n");
+	exit(0);
+    }
+    if (!GLEW_EXT_framebuffer_multisample) {
+	fprintf(stderr, "EXT_framebuffer_multisample not supported!\n");
+	exit(0);
+    }
+    if (verbose) {
+	printf("OpenGL 1.5 supported\n");
+	printf("OpenGL framebuffer object extension supported\n");
+	printf("OpenGL framebuffer multisample extension supported\n");
+    }
+
+    // Check if largest desired size will fit into a texture.  In some
+    // ways this is immaterial to Map.  However, the user should be
+    // warned if she is about to create maps that Atlas will be unable
+    // to load.
+    GLint textureSize = min(bufferSize, 0x1 << TileMapper::maxPossibleLevel());
+    if (verbose) {
+	printf("Maximum supported texture/buffer size <= map size: %dx%d\n", 
+	       (int)textureSize, (int)textureSize);
+    }
+
+    if (textureSize < bufferSize) {
+	printf("Warning: you have requested maps of maximum size %dx%d,\n",
+	       bufferSize, bufferSize);
+	printf("which is larger than the largest texture/buffer size\n");
+	printf("supported by this machine's graphics hardware (%dx%d).\n",
+	       (int)textureSize, (int)textureSize);
+	printf("Although Map can probably generate the maps, Atlas will\n");
+	printf("probably not be able to read them on this machine.\n");
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // main
 ////////////////////////////////////////////////////////////////////////////////
@@ -371,7 +642,7 @@ int main(int argc, char **argv)
     // atlas directories and catalogue what we've got.  We ask it to
     // create directories if they don't exist.
     try {
-	tileManager = new TileManager(scenery, atlas);
+	tileManager = new TileManager(scenery, atlas, deriveMaps);
 	if (tileManager->mapLevels().none()) {
 	    // EYE - magic numbers
 	    bitset<TileManager::MAX_MAP_LEVEL> levels;
@@ -417,6 +688,8 @@ int main(int argc, char **argv)
     if (verbose) {
 	printf("Map sizes: ");
 	bitset<TileManager::MAX_MAP_LEVEL> sizes = tileManager->mapLevels();
+	bitset<TileManager::MAX_MAP_LEVEL> derived = 
+	    tileManager->derivedLevels();
 	bool first = true;
 	for (unsigned int i = 0; i < sizes.size(); i++) {
 	    if (sizes[i]) {
@@ -424,7 +697,7 @@ int main(int argc, char **argv)
 		if (!first) {
 		    printf(", ");
 		}
-		printf("%d (%dx%d)", i, x, x);
+		printf("%d (%dx%d%s)", i, x, x, derived[i] ? ", derived" : "");
 		first = false;
 	    }
 	}
@@ -452,66 +725,18 @@ int main(int argc, char **argv)
     // (or, in other words, 2^bufferLevel = bufferSize).
     bufferSize = 1 << bufferLevel;
 
-    // Initialize OpenGL.
-    int windowSize = bufferSize;
-    if (renderToFramebuffer) {
-	// Just pick a small window size - we shouldn't see it anyway.
-	windowSize = 256;
-    }
-    glutInit(&argc, argv);
-    // We don't need a depth buffer, multisampling, etc.
-    glutInitDisplayString("rgba");
-    // EYE - if this is gone, we don't need the windowSize calculation
-    // above, do we?
-    // glutInitWindowSize(windowSize, windowSize);
-    glutCreateWindow("Map");
-  
-    // Check for sufficient OpenGL capabilities.
-    GLenum err = glewInit();
-    if (err != GLEW_OK) {
-	fprintf(stderr, "Failed to initialize GLEW!\n");
-	exit(0);
-    }
-    if (!GLEW_VERSION_1_5) {
-    	fprintf(stderr, "OpenGL version 1.5 not supported!\n");
-	exit(0);
-    }
-    // EYE - Really we should just ask for OpenGL 3.0, which
-    // incorporated all the following as core functions.  However,
-    // some people, namely the developer, are living in the past and
-    // don't have OpenGL 3.0.
-    if (!GLEW_EXT_framebuffer_object) {
-	fprintf(stderr, "EXT_framebuffer_object not supported!\n");
-	exit(0);
-    }
-    if (!GLEW_EXT_framebuffer_multisample) {
-	fprintf(stderr, "EXT_framebuffer_multisample not supported!\n");
-	exit(0);
-    }
-    if (verbose) {
-	printf("OpenGL 1.5 supported\n");
-	printf("OpenGL framebuffer object extension supported\n");
-	printf("OpenGL framebuffer multisample extension supported\n");
-    }
-
-    // Check if largest desired size will fit into a texture.  In some
-    // ways this is immaterial to Map.  However, the user should be
-    // warned if she is about to create maps that Atlas will be unable
-    // to load.
-    GLint textureSize = min(bufferSize, 0x1 << TileMapper::maxPossibleLevel());
-    if (verbose) {
-	printf("Maximum supported texture/buffer size <= map size: %dx%d\n", 
-	       (int)textureSize, (int)textureSize);
+    // Initialize OpenGL, unless we're rendering on the CPU, which
+    // doesn't need it (or even a display).
+    if (renderer == TileMapper::OPENGL) {
+	initOpenGL(argc, argv);
     }
 
-    if (textureSize < bufferSize) {
-	printf("Warning: you have requested maps of maximum size %dx%d,\n",
-	       bufferSize, bufferSize);
-	printf("which is larger than the largest texture/buffer size\n");
-	printf("supported by this machine's graphics hardware (%dx%d).\n",
-	       (int)textureSize, (int)textureSize);
-	printf("Although Map can probably generate the maps, Atlas will\n");
-	printf("probably not be able to read them on this machine.\n");
+    style = mapStyle(palettePath);
+    if (incremental) {
+	findStaleTiles();
+	if (verbose) {
+	    printf("Changed: %lu tiles\n", (unsigned long)staleTiles.size());
+	}
     }
 
     if (test) {
@@ -528,14 +753,15 @@ int main(int argc, char **argv)
 	for (unsigned int i = 0; i < TileManager::MAX_MAP_LEVEL; i++) {
 	    if (mapLevels[i]) {
 		int size = 1 << i;
-		printf("\t%d (%dx%d)\n", i, size, size);
+		printf("\t%d (%dx%d%s)\n", i, size, size, 
+		       tileManager->derivedLevels()[i] ? ", derived" : "");
 	    }
 	}
 
 	int tileCount = 0, mapCount = 0;
 	TileIterator ti(tileManager, TileManager::DOWNLOADED);
 	for (Tile *t = ti.first(); t; t = ti++) {
-	    const bitset<TileManager::MAX_MAP_LEVEL>& maps = t->missingMaps();
+	    const bitset<TileManager::MAX_MAP_LEVEL> maps = mapsToRender(t);
 	    if (!maps.none()) {
 		if (tileCount == 0) {
 		    printf("Missing maps:\n");
@@ -549,6 +775,9 @@ int main(int argc, char **argv)
 			printf("%d ", j);
 		    }
 		}
+		if (staleTiles.count(t) > 0) {
+		    printf("(changed)");
+		}
 		printf("\n");
 	    }
 	}
@@ -570,15 +799,47 @@ int main(int argc, char **argv)
     // EYE - if we always use a TileMapper (and if it always uses a
     //       framebuffer), we should get rid of the
     //       render-to-window/render-offscreen options.
+    //
+    // Mapping is a pipeline: while we render one tile in this thread,
+    // the loaders load the scenery for the next few, and the
+    // encoders save the maps of the previous ones.
+    loaders = new WorkerPool(jobs);
+    encoders = new WorkerPool(jobs);
+    if (verbose) {
+	printf("Using %u loading and %u saving threads\n", 
+	       loaders->threads(), encoders->threads());
+    }
     mapper = new TileMapper(atlasPalette, bufferLevel, 
     			    discreteContours, contourLines,
     			    azimuth, elevation, lighting, smoothShading,
-			    imageType, jpegQuality);
-
+			    imageType, jpegQuality, packMaps, 
+			    loaders, encoders, renderer);
+    // The shader needs OpenGL.
+    Bucket::shadedContours = 
+	shadedContours && (renderer == TileMapper::OPENGL);
+
+    // Find the tiles that need mapping, so that we can prefetch the
+    // ones we'll render in the order we'll render them.
+    vector<Tile *> tiles;
     TileIterator ti(tileManager, TileManager::DOWNLOADED);
     for (Tile *t = ti.first(); t; t = ti++) {
-	renderMap(t);
+	if (!mapsToRender(t).none()) {
+	    tiles.push_back(t);
+	}
+    }
+    size_t prefetched = 0;
+    for (size_t i = 0; i < tiles.size(); i++) {
+	for (; (prefetched < tiles.size()) && (prefetched <= i + lookahead);
+	     prefetched++) {
+	    if (!shrinkable(tiles[prefetched])) {
+		mapper->prefetch(tiles[prefetched]);
+	    }
+	}
+	renderMap(tiles[i]);
+	saveManifests();
     }
+    mapper->finish();
+    saveManifests();
 
     cleanup(0);
     
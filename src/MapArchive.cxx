@@ -0,0 +1,354 @@
+/*-------------------------------------------------------------------------
+  MapArchive.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+  ---------------------------------------------------------------------------*/
+
+// Our include file
+#include "MapArchive.hxx"
+
+// C++ system include files
+#include <cstdio>
+#include <cstring>
+
+// System include files
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef WIN32
+#  include <io.h>
+#else
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+// Our project's include files
+#include "misc.hxx"
+
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+
+using namespace std;
+
+static const char __magic[8] = {'A', 'T', 'L', 'A', 'S', 'P', 'A', 'K'};
+static const uint32_t __version = 1;
+static const size_t __headerSize = 16, __entrySize = 16;
+static const size_t __indexSize =
+    __headerSize + MapArchive::SLOTS * __entrySize;
+
+// Little-endian conversions.
+static uint32_t __get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void __put32(unsigned char *p, uint32_t x)
+{
+    for (int i = 0; i < 4; i++, x >>= 8) {
+	p[i] = x & 0xff;
+    }
+}
+
+static uint64_t __get64(const unsigned char *p)
+{
+    return __get32(p) | ((uint64_t)__get32(p + 4) << 32);
+}
+
+static void __put64(unsigned char *p, uint64_t x)
+{
+    __put32(p, x & 0xffffffff);
+    __put32(p + 4, x >> 32);
+}
+
+static void __putEntry(unsigned char *p, uint64_t offset, uint32_t length,
+		       float maxElevation)
+{
+    uint32_t e;
+    memcpy(&e, &maxElevation, sizeof(e));
+    __put64(p, offset);
+    __put32(p + 8, length);
+    __put32(p + 12, e);
+}
+
+// Checks the header of an index.
+static bool __validHeader(const unsigned char *p)
+{
+    return (memcmp(p, __magic, sizeof(__magic)) == 0) &&
+	(__get32(p + 8) == __version) &&
+	(__get32(p + 12) == MapArchive::SLOTS);
+}
+
+SGPath MapArchive::path(const SGPath &dir, const char *chunk)
+{
+    SGPath result(dir);
+    result.append(chunk);
+    result.concat(".pack");
+
+    return result;
+}
+
+bool MapArchive::isArchive(const char *name)
+{
+    const char *suffix = strrchr(name, '.');
+    return suffix && (strcmp(suffix, ".pack") == 0);
+}
+
+unsigned int MapArchive::slot(const char *tile)
+{
+    char ew, ns;
+    int lon, lat;
+    if ((sscanf(tile, "%c%3d%c%2d", &ew, &lon, &ns, &lat) != 4) ||
+	((ew != 'e') && (ew != 'w')) || ((ns != 'n') && (ns != 's'))) {
+	return SLOTS;
+    }
+    if (ew == 'w') {
+	lon = -lon;
+    }
+    if (ns == 's') {
+	lat = -lat;
+    }
+
+    // Chunks start at multiples of 10 degrees, so tiles in the chunk
+    // w130n30 (for example) have longitudes from -130 to -121 and
+    // latitudes from 30 to 39.
+    return ((lat % 10 + 10) % 10) * 10 + (lon % 10 + 10) % 10;
+}
+
+MapArchive::MapArchive(const SGPath &path, bool map):
+    _valid(false), _data(NULL), _size(0), _mapped(false), _refs(1)
+{
+    memset(_index, 0, sizeof(_index));
+
+    int fd = open(path.c_str(), O_RDONLY | O_BINARY);
+    if (fd < 0) {
+	return;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < __indexSize)) {
+	close(fd);
+	return;
+    }
+
+    unsigned char index[__indexSize];
+    const unsigned char *p = index;
+    if (map) {
+	_size = st.st_size;
+#ifndef WIN32
+	void *m = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m != MAP_FAILED) {
+	    _data = (const char *)m;
+	    _mapped = true;
+	}
+#endif
+	// EYE - on Windows we read the whole archive.  We should use
+	// CreateFileMapping() instead.
+	if (!_mapped) {
+	    char *buf = new char[_size];
+	    if (read(fd, buf, _size) == (ssize_t)_size) {
+		_data = buf;
+	    } else {
+		delete []buf;
+	    }
+	}
+	p = (const unsigned char *)_data;
+    } else if (read(fd, index, __indexSize) != (ssize_t)__indexSize) {
+	p = NULL;
+    }
+    close(fd);
+    if ((p == NULL) || !__validHeader(p)) {
+	return;
+    }
+
+    // Read the index.  Entries that point past the end of the file
+    // (which shouldn't happen, since images are written before their
+    // index entries) are treated as empty.
+    p += __headerSize;
+    for (unsigned int i = 0; i < SLOTS; i++, p += __entrySize) {
+	Entry &e = _index[i];
+	e.offset = __get64(p);
+	e.length = __get32(p + 8);
+	uint32_t elev = __get32(p + 12);
+	memcpy(&e.maxElevation, &elev, sizeof(elev));
+	if ((e.offset < __indexSize) ||
+	    (e.offset + e.length > (uint64_t)st.st_size)) {
+	    e.length = 0;
+	}
+    }
+    _valid = true;
+}
+
+MapArchive::~MapArchive()
+{
+#ifndef WIN32
+    if (_mapped) {
+	munmap((void *)_data, _size);
+	return;
+    }
+#endif
+    delete []_data;
+}
+
+bool MapArchive::has(unsigned int slot) const
+{
+    return (slot < SLOTS) && (_index[slot].length > 0);
+}
+
+float MapArchive::maximumElevation(unsigned int slot) const
+{
+    return _index[slot].maxElevation;
+}
+
+const char *MapArchive::image(unsigned int slot, size_t *length) const
+{
+    if ((_data == NULL) || !has(slot)) {
+	return NULL;
+    }
+    *length = _index[slot].length;
+
+    return _data + _index[slot].offset;
+}
+
+bool MapArchive::add(const SGPath &path, unsigned int slot,
+		     const char *image, size_t length, float maxElevation)
+{
+    if (slot >= SLOTS) {
+	return false;
+    }
+
+    unsigned char header[__headerSize];
+    FILE *fp = fopen(path.c_str(), "r+b");
+    if (fp != NULL) {
+	// Make sure it's really an archive, so that we don't scribble
+	// on something else.
+	if ((fread(header, __headerSize, 1, fp) != 1) ||
+	    !__validHeader(header)) {
+	    fclose(fp);
+	    return false;
+	}
+    } else {
+	// Create an empty archive.
+	fp = fopen(path.c_str(), "w+b");
+	if (fp == NULL) {
+	    return false;
+	}
+	unsigned char index[__indexSize];
+	memset(index, 0, sizeof(index));
+	memcpy(index, __magic, sizeof(__magic));
+	__put32(index + 8, __version);
+	__put32(index + 12, SLOTS);
+	if (fwrite(index, sizeof(index), 1, fp) != 1) {
+	    fclose(fp);
+	    return false;
+	}
+    }
+
+    // Append the image, and make sure it's on disk before the index
+    // refers to it.
+    // EYE - ftell() limits archives to 2GB on some systems.
+    bool ok = (fseek(fp, 0, SEEK_END) == 0);
+    long offset = ftell(fp);
+    ok = ok && (offset >= (long)__indexSize) &&
+	(fwrite(image, 1, length, fp) == length) && (fflush(fp) == 0);
+
+    // Now update the index.
+    unsigned char entry[__entrySize];
+    __putEntry(entry, offset, length, maxElevation);
+    ok = ok && (fseek(fp, __headerSize + slot * __entrySize, SEEK_SET) == 0) &&
+	(fwrite(entry, sizeof(entry), 1, fp) == 1);
+    ok = (fclose(fp) == 0) && ok;
+
+    // The map has been added regardless of whether this works.
+    if (ok) {
+	compact(path);
+    }
+
+    return ok;
+}
+
+bool MapArchive::remove(const SGPath &path, unsigned int slot)
+{
+    if (slot >= SLOTS) {
+	return false;
+    }
+    FILE *fp = fopen(path.c_str(), "r+b");
+    if (fp == NULL) {
+	return false;
+    }
+
+    unsigned char header[__headerSize], entry[__entrySize];
+    memset(entry, 0, sizeof(entry));
+    bool ok = (fread(header, __headerSize, 1, fp) == 1) &&
+	__validHeader(header) &&
+	(fseek(fp, __headerSize + slot * __entrySize, SEEK_SET) == 0) &&
+	(fwrite(entry, sizeof(entry), 1, fp) == 1);
+    ok = (fclose(fp) == 0) && ok;
+    if (ok) {
+	compact(path);
+    }
+
+    return ok;
+}
+
+bool MapArchive::compact(const SGPath &path)
+{
+    MapArchive a(path);
+    if (!a.valid() || (a._data == NULL)) {
+	return false;
+    }
+
+    uint64_t used = __indexSize;
+    for (unsigned int i = 0; i < SLOTS; i++) {
+	used += a._index[i].length;
+    }
+    if (used * 2 >= a._size) {
+	return true;
+    }
+
+    // Write the maps one after another, in slot order, with a new
+    // index to match.  Anyone who has the old archive mapped keeps
+    // the old file until they unmap it.
+    unsigned char index[__indexSize];
+    memset(index, 0, sizeof(index));
+    memcpy(index, __magic, sizeof(__magic));
+    __put32(index + 8, __version);
+    __put32(index + 12, SLOTS);
+    uint64_t offset = __indexSize;
+    for (unsigned int i = 0; i < SLOTS; i++) {
+	const Entry &e = a._index[i];
+	if (e.length > 0) {
+	    __putEntry(index + __headerSize + i * __entrySize, 
+		       offset, e.length, e.maxElevation);
+	    offset += e.length;
+	}
+    }
+
+    AtomicFile out(path.c_str());
+    if (out.fp() == NULL) {
+	return false;
+    }
+    bool ok = (fwrite(index, sizeof(index), 1, out.fp()) == 1);
+    for (unsigned int i = 0; ok && (i < SLOTS); i++) {
+	const Entry &e = a._index[i];
+	ok = (fwrite(a._data + e.offset, 1, e.length, out.fp()) == e.length);
+    }
+
+    return out.commit(ok);
+}
@@ -0,0 +1,130 @@
+/*-------------------------------------------------------------------------
+  MapArchive.hxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  A map archive holds all the maps at one level for one chunk (ie,
+  up to 100 tiles) in a single file, rather than one file per tile.
+  With a lot of scenery, this means far fewer files for the tile
+  manager to look through at startup, and for Atlas to open when
+  loading maps.
+
+  An archive is called <chunk>.pack (eg, w130n30.pack), and lives in
+  the same directory as the ordinary map files for that level.  It
+  consists of:
+
+    header: 8-byte magic number ("ATLASPAK"), 4-byte version, 4-byte
+            slot count (always 100)
+    index:  one entry per slot, each an 8-byte offset, a 4-byte
+            length, and the map's 4-byte maximum elevation (a float,
+            in feet)
+    maps:   the map images (JPEG or PNG files), one after another
+
+  All numbers are little-endian.  A slot with a length of 0 is empty.
+  Tiles go in slots by their position within the chunk, 10 * lat +
+  lon (where lat and lon are 0 - 9).
+
+  Maps are added by appending the image to the file, then updating
+  the index, so an archive can be added to a map at a time and is
+  never in an inconsistent state.  Replaced and removed maps aren't
+  removed from the file straight away, so it will have some wasted
+  space.  When more than half of it is wasted, it is rewritten
+  without the dead maps (see compact()), so that an archive that is
+  remade over and over doesn't grow without limit.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+#ifndef _MAPARCHIVE_H_
+#define _MAPARCHIVE_H_
+
+#include <simgear/misc/sg_path.hxx>
+#include <simgear/misc/stdint.hxx>
+
+class MapArchive {
+  public:
+    static const unsigned int SLOTS = 100;
+
+    // The archive for the given chunk (eg, "w130n30") in the given
+    // map directory (eg, <maps>/10).
+    static SGPath path(const SGPath &dir, const char *chunk);
+    // True if the given file name is that of an archive.
+    static bool isArchive(const char *name);
+    // The slot of the given tile (eg, "w123n37") in its chunk's
+    // archive.  Returns SLOTS if the name isn't a tile name.
+    static unsigned int slot(const char *tile);
+
+    // Opens the given archive.  If map is false, we just read the
+    // index, which is enough to find out what maps it has.  If true,
+    // we map the file (or, where we can't, read the whole thing) so
+    // that the map images can be had with image().  Check valid() to
+    // see if it worked.
+    MapArchive(const SGPath &path, bool map = true);
+    ~MapArchive();
+
+    bool valid() const { return _valid; }
+    // True if there's a map in the given slot.
+    bool has(unsigned int slot) const;
+    // The maximum elevation of the map in the given slot.
+    float maximumElevation(unsigned int slot) const;
+    // The map image in the given slot, and its length, or NULL if the
+    // slot is empty or the archive isn't mapped.  The image is only
+    // valid for the lifetime of the archive.
+    const char *image(unsigned int slot, size_t *length) const;
+
+    // Adds the given map image to the archive, replacing whatever was
+    // in the slot, and creating the archive if necessary.  Returns
+    // true if successful.
+    static bool add(const SGPath &path, unsigned int slot,
+		    const char *image, size_t length, float maxElevation);
+    // Empties the given slot (if the archive exists).
+    static bool remove(const SGPath &path, unsigned int slot);
+    // If more than half of the archive is taken up by maps that have
+    // been replaced or removed, rewrites it without them.  add() and
+    // remove() call this, so there's normally no need to.  Returns
+    // false if the archive needed compacting but couldn't be.
+    static bool compact(const SGPath &path);
+
+    // Archives created with new can be shared using reference
+    // counting.  An archive starts with one reference (its creator's),
+    // and is deleted when the last reference is released.  This is
+    // not thread-safe, so only one thread (the main one) should call
+    // these.  Other threads can use the archive's images as long as
+    // they're sure it will be around.
+    void ref() { _refs++; }
+    void unref() { if (--_refs == 0) delete this; }
+
+  protected:
+    struct Entry {
+	uint64_t offset;
+	uint32_t length;
+	float maxElevation;
+    };
+
+    bool _valid;
+    Entry _index[SLOTS];
+
+    // The file contents, if mapped.
+    const char *_data;
+    size_t _size;
+    bool _mapped;
+
+    unsigned int _refs;
+};
+
+#endif	// _MAPARCHIVE_H_
@@ -0,0 +1,539 @@
+/*-------------------------------------------------------------------------
+  MeshSimplifier.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// Our include file
+#include "MeshSimplifier.hxx"
+
+// C++ system include files
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace std;
+
+// Returns the cross product of b - a and c - a.
+static void __cross(const double *a, const double *b, const double *c,
+		    double *result)
+{
+    double u[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    double v[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    result[0] = u[1] * v[2] - u[2] * v[1];
+    result[1] = u[2] * v[0] - u[0] * v[2];
+    result[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+static double __dot(const double *a, const double *b)
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// Normalizes v, returning false if it's too short to have a
+// direction.
+static bool __normalize(double *v)
+{
+    double length = sqrt(__dot(v, v));
+    if (length < 1e-12) {
+	return false;
+    }
+    v[0] /= length;
+    v[1] /= length;
+    v[2] /= length;
+
+    return true;
+}
+
+// The shape of a triangle seen from above, as given by _flatness(),
+// is between 0 (a sliver) and 0.29 (equilateral).  We don't create
+// triangles worse than this (unless they were already).
+static const double __minFlatness = 0.01;
+
+// The matrix is stored as the upper triangle, row by row:
+//
+//   a[0] a[1] a[2] a[3]
+//        a[4] a[5] a[6]
+//             a[7] a[8]
+//                  a[9]
+MeshSimplifier::Quadric::Quadric()
+{
+    fill(a, a + 10, 0.0);
+}
+
+void MeshSimplifier::Quadric::addPlane(const double *p, const double *n)
+{
+    // The plane is n.x + d = 0.
+    double d = -__dot(n, p);
+    a[0] += n[0] * n[0]; a[1] += n[0] * n[1]; a[2] += n[0] * n[2];
+    a[3] += n[0] * d;
+    a[4] += n[1] * n[1]; a[5] += n[1] * n[2]; a[6] += n[1] * d;
+    a[7] += n[2] * n[2]; a[8] += n[2] * d;
+    a[9] += d * d;
+}
+
+void MeshSimplifier::Quadric::operator+=(const Quadric &q)
+{
+    for (int i = 0; i < 10; i++) {
+	a[i] += q.a[i];
+    }
+}
+
+double MeshSimplifier::Quadric::error(const double *p) const
+{
+    double x = p[0], y = p[1], z = p[2];
+    double result =
+	a[0] * x * x + 2.0 * a[1] * x * y + 2.0 * a[2] * x * z + 2.0 * a[3] * x +
+	a[4] * y * y + 2.0 * a[5] * y * z + 2.0 * a[6] * y +
+	a[7] * z * z + 2.0 * a[8] * z +
+	a[9];
+
+    // Rounding can make it slightly negative.
+    return max(result, 0.0);
+}
+
+MeshSimplifier::MeshSimplifier(const vector<double> &positions,
+			       const vector<int> &nodes,
+			       const vector<float> &normals):
+    _positions(positions), _nodes(nodes), _normals(normals), _alive(0),
+    _started(false)
+{
+    _listStarts.push_back(0);
+
+    size_t n = positions.size() / 3;
+    _triangles.resize(n);
+    _vertices.resize(n);
+    _quadrics.resize(n);
+    _stamps.resize(n, 0);
+    _removed.resize(n, false);
+    for (size_t i = 0; i < nodes.size(); i++) {
+	_vertices[nodes[i]].push_back(i);
+    }
+}
+
+size_t MeshSimplifier::add(const vector<unsigned int> &triangles)
+{
+    assert(!_started);
+
+    size_t l = _listStarts.size() - 1;
+    for (size_t i = 0; i + 2 < triangles.size(); i += 3) {
+	int t = _lists.size();
+	_corners.insert(_corners.end(),
+			triangles.begin() + i, triangles.begin() + i + 3);
+	// Triangles whose corners are distinct vertices, but not
+	// distinct nodes, have no area, and aren't worth keeping.
+	int n0 = _node(t * 3), n1 = _node(t * 3 + 1), n2 = _node(t * 3 + 2);
+	if ((n0 == n1) || (n1 == n2) || (n2 == n0)) {
+	    _lists.push_back(-1);
+	    continue;
+	}
+	_lists.push_back(l);
+	_alive++;
+	_triangles[n0].push_back(t);
+	_triangles[n1].push_back(t);
+	_triangles[n2].push_back(t);
+    }
+    _listStarts.push_back(_lists.size());
+
+    return l;
+}
+
+// Calculates the initial quadrics and queues the first collapses.
+void MeshSimplifier::_start()
+{
+    _started = true;
+
+    // Each node gets the planes of its triangles.
+    for (size_t t = 0; t < _lists.size(); t++) {
+	if (_lists[t] < 0) {
+	    continue;
+	}
+	double n[3];
+	__cross(_position(_node(t * 3)), _position(_node(t * 3 + 1)),
+		_position(_node(t * 3 + 2)), n);
+	if (!__normalize(n)) {
+	    continue;
+	}
+	for (int i = 0; i < 3; i++) {
+	    _quadrics[_node(t * 3 + i)].addPlane(_position(_node(t * 3)), n);
+	}
+    }
+
+    // Edges on the mesh boundary and between materials get a plane
+    // perpendicular to their triangle, so that moving them sideways
+    // costs something.
+    vector<Edge> edges;
+    vector<int> lists;
+    for (size_t u = 0; u < _triangles.size(); u++) {
+	_edges(u, edges, lists);
+	for (size_t i = 0; i < edges.size(); i++) {
+	    const Edge &e = edges[i];
+	    if ((e.node < (int)u) || ((e.triangles == 2) && !e.mixed)) {
+		continue;
+	    }
+	    // Find a triangle with the edge.
+	    double n[3] = {0.0, 0.0, 0.0};
+	    for (size_t j = 0; j < _triangles[u].size(); j++) {
+		int t = _triangles[u][j];
+		if ((_node(t * 3) == e.node) || (_node(t * 3 + 1) == e.node) ||
+		    (_node(t * 3 + 2) == e.node)) {
+		    __cross(_position(_node(t * 3)),
+			    _position(_node(t * 3 + 1)),
+			    _position(_node(t * 3 + 2)), n);
+		    break;
+		}
+	    }
+	    const double *p = _position(u), *q = _position(e.node);
+	    double along[3] = {q[0] - p[0], q[1] - p[1], q[2] - p[2]};
+	    double perpendicular[3] = {
+		along[1] * n[2] - along[2] * n[1],
+		along[2] * n[0] - along[0] * n[2],
+		along[0] * n[1] - along[1] * n[0]};
+	    if (__normalize(perpendicular)) {
+		_quadrics[u].addPlane(p, perpendicular);
+		_quadrics[e.node].addPlane(p, perpendicular);
+	    }
+	}
+    }
+
+    for (size_t u = 0; u < _triangles.size(); u++) {
+	_evaluate(u);
+    }
+}
+
+void MeshSimplifier::simplify(double maxError)
+{
+    if (!_started) {
+	_start();
+    }
+
+    double maxCost = maxError * maxError;
+    while (!_queue.empty() && (_queue.front().cost <= maxCost)) {
+	pop_heap(_queue.begin(), _queue.end());
+	Collapse c = _queue.back();
+	_queue.pop_back();
+
+	if (_removed[c.u] || (c.stamp != _stamps[c.u])) {
+	    // Stale.
+	    continue;
+	}
+	if (!_valid(c.u, c.v)) {
+	    // Something nearby has changed since the collapse was
+	    // queued.  Find u's best collapse again.
+	    _evaluate(c.u);
+	    continue;
+	}
+	_collapse(c.u, c.v);
+    }
+}
+
+void MeshSimplifier::list(size_t l, vector<unsigned int> &triangles) const
+{
+    triangles.clear();
+    for (size_t t = _listStarts[l]; t < _listStarts[l + 1]; t++) {
+	if (_lists[t] >= 0) {
+	    triangles.insert(triangles.end(),
+			     _corners.begin() + t * 3,
+			     _corners.begin() + t * 3 + 3);
+	}
+    }
+}
+
+size_t MeshSimplifier::bytes() const
+{
+    size_t result = _corners.size() * sizeof(unsigned int) +
+	_lists.size() * sizeof(int) * 4 + // Counting node triangles too
+	_vertices.size() * (sizeof(vector<int>) * 2 + sizeof(Quadric) +
+			    sizeof(unsigned int)) +
+	_nodes.size() * sizeof(unsigned int) +
+	_queue.capacity() * sizeof(Collapse);
+
+    return result;
+}
+
+void MeshSimplifier::_prune(int node)
+{
+    vector<int> &tris = _triangles[node];
+    size_t j = 0;
+    for (size_t i = 0; i < tris.size(); i++) {
+	if (_lists[tris[i]] >= 0) {
+	    tris[j++] = tris[i];
+	}
+    }
+    tris.resize(j);
+}
+
+bool MeshSimplifier::_edges(int node, vector<Edge> &edges,
+			    vector<int> &lists) const
+{
+    edges.clear();
+    lists.clear();
+
+    const vector<int> &tris = _triangles[node];
+    for (size_t i = 0; i < tris.size(); i++) {
+	int t = tris[i];
+	int l = _lists[t];
+	if (l < 0) {
+	    continue;
+	}
+	if (find(lists.begin(), lists.end(), l) == lists.end()) {
+	    lists.push_back(l);
+	}
+	for (int c = 0; c < 3; c++) {
+	    int n = _node(t * 3 + c);
+	    if (n == node) {
+		continue;
+	    }
+	    size_t j;
+	    for (j = 0; j < edges.size(); j++) {
+		if (edges[j].node == n) {
+		    break;
+		}
+	    }
+	    if (j == edges.size()) {
+		Edge e = {n, 0, l, false};
+		edges.push_back(e);
+	    }
+	    Edge &e = edges[j];
+	    e.triangles++;
+	    if (e.list != l) {
+		e.mixed = true;
+	    }
+	}
+    }
+
+    // We can't move nodes on the edge of the mesh, or where it's
+    // non-manifold.
+    for (size_t j = 0; j < edges.size(); j++) {
+	if (edges[j].triangles != 2) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+void MeshSimplifier::_evaluate(int u)
+{
+    _stamps[u]++;
+    if (_removed[u]) {
+	return;
+    }
+    _prune(u);
+    if (!_edges(u, _uEdges, _uLists)) {
+	return;
+    }
+
+    // Inside a material, u can go to any neighbour.  If it's on the
+    // boundary between two materials, it can only move along the
+    // boundary.  Otherwise it's stuck.
+    size_t mixed = 0;
+    for (size_t i = 0; i < _uEdges.size(); i++) {
+	if (_uEdges[i].mixed) {
+	    mixed++;
+	}
+    }
+    if (!(((mixed == 0) && (_uLists.size() == 1)) ||
+	  ((mixed == 2) && (_uLists.size() == 2)))) {
+	return;
+    }
+
+    // Sort the candidates by cost, then take the first valid one.
+    // _valid() uses _uEdges, so we need a copy.
+    vector<pair<double, int> > candidates;
+    for (size_t i = 0; i < _uEdges.size(); i++) {
+	const Edge &e = _uEdges[i];
+	if ((mixed > 0) && !e.mixed) {
+	    continue;
+	}
+	const double *p = _position(e.node);
+	double cost = _quadrics[u].error(p) + _quadrics[e.node].error(p);
+	candidates.push_back(make_pair(cost, e.node));
+    }
+    sort(candidates.begin(), candidates.end());
+    for (size_t i = 0; i < candidates.size(); i++) {
+	if (_valid(u, candidates[i].second)) {
+	    Collapse c = {candidates[i].first, u, candidates[i].second,
+			  _stamps[u]};
+	    _queue.push_back(c);
+	    push_heap(_queue.begin(), _queue.end());
+	    return;
+	}
+    }
+}
+
+// True if u can be collapsed to v without making a mess.  This
+// assumes that u's edges are allowed to move along <u, v> (ie, that
+// _evaluate() would consider it).
+bool MeshSimplifier::_valid(int u, int v)
+{
+    if (_removed[u] || _removed[v]) {
+	return false;
+    }
+    _prune(u);
+    _prune(v);
+    if (!_edges(u, _uEdges, _uLists)) {
+	return false;
+    }
+
+    // <u, v> must still be an edge, and if it's a boundary, it has to
+    // still be one.
+    size_t mixed = 0;
+    const Edge *uv = NULL;
+    for (size_t i = 0; i < _uEdges.size(); i++) {
+	if (_uEdges[i].mixed) {
+	    mixed++;
+	}
+	if (_uEdges[i].node == v) {
+	    uv = &_uEdges[i];
+	}
+    }
+    if ((uv == NULL) || ((mixed > 0) && !uv->mixed)) {
+	return false;
+    }
+
+    // The link condition: the only neighbours u and v have in common
+    // are the far corners of the two triangles sharing their edge.
+    // Otherwise the collapse would fold the mesh onto itself.
+    _edges(v, _vEdges, _vLists);
+    int common = 0;
+    for (size_t i = 0; i < _uEdges.size(); i++) {
+	for (size_t j = 0; j < _vEdges.size(); j++) {
+	    if (_uEdges[i].node == _vEdges[j].node) {
+		common++;
+	    }
+	}
+    }
+    if (common != 2) {
+	return false;
+    }
+
+    // No triangle may flip over or collapse to a sliver.  Scenery is
+    // usually seen from above, so a triangle that stays right side
+    // up, but flips over (or becomes a sliver) when seen from above
+    // (ie, in x and y), is just as bad.
+    const vector<int> &tris = _triangles[u];
+    for (size_t i = 0; i < tris.size(); i++) {
+	int t = tris[i];
+	if ((_node(t * 3) == v) || (_node(t * 3 + 1) == v) ||
+	    (_node(t * 3 + 2) == v)) {
+	    // This one disappears.
+	    continue;
+	}
+	double before[3], after[3];
+	_normal(t, u, u, before);
+	_normal(t, u, v, after);
+	double b = __dot(before, before), a = __dot(after, after);
+	if ((__dot(before, after) <= 0.0) || (a < b * 1e-6)) {
+	    return false;
+	}
+	double qb = _flatness(t, u, u), qa = _flatness(t, u, v);
+	if ((qb * qa <= 0.0) || (fabs(qa) < min(fabs(qb), __minFlatness))) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+void MeshSimplifier::_collapse(int u, int v)
+{
+    vector<int> &tris = _triangles[u];
+    for (size_t i = 0; i < tris.size(); i++) {
+	int t = tris[i];
+	unsigned int *c = &_corners[t * 3];
+	if ((_nodes[c[0]] == v) || (_nodes[c[1]] == v) || (_nodes[c[2]] == v)) {
+	    _lists[t] = -1;
+	    _alive--;
+	    continue;
+	}
+	for (int j = 0; j < 3; j++) {
+	    if (_nodes[c[j]] == u) {
+		c[j] = _closestVertex(v, c[j]);
+	    }
+	}
+	_triangles[v].push_back(t);
+    }
+    tris.clear();
+    _quadrics[v] += _quadrics[u];
+    _removed[u] = true;
+    _stamps[u]++;
+
+    // Everything around v has changed.
+    _prune(v);
+    vector<Edge> edges;
+    vector<int> lists;
+    _edges(v, edges, lists);
+    _evaluate(v);
+    for (size_t i = 0; i < edges.size(); i++) {
+	_evaluate(edges[i].node);
+    }
+}
+
+unsigned int MeshSimplifier::_closestVertex(int v, unsigned int i) const
+{
+    const vector<unsigned int> &vertices = _vertices[v];
+    unsigned int result = vertices[0];
+    float best = -2.0;
+    for (size_t j = 0; (j < vertices.size()) && (vertices.size() > 1); j++) {
+	const float *a = &_normals[i * 3], *b = &_normals[vertices[j] * 3];
+	float d = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	if (d > best) {
+	    best = d;
+	    result = vertices[j];
+	}
+    }
+
+    return result;
+}
+
+double MeshSimplifier::_flatness(int t, int u, int v) const
+{
+    const double *p[3];
+    for (int i = 0; i < 3; i++) {
+	int node = _node(t * 3 + i);
+	p[i] = _position((node == u) ? v : node);
+    }
+
+    // Twice the area, and the sum of the squared edge lengths.
+    double area = (p[1][0] - p[0][0]) * (p[2][1] - p[0][1]) - 
+	(p[2][0] - p[0][0]) * (p[1][1] - p[0][1]);
+    double lengths = 0.0;
+    for (int i = 0; i < 3; i++) {
+	double dx = p[(i + 1) % 3][0] - p[i][0];
+	double dy = p[(i + 1) % 3][1] - p[i][1];
+	lengths += dx * dx + dy * dy;
+    }
+    if (lengths == 0.0) {
+	return 0.0;
+    }
+
+    return area / lengths;
+}
+
+void MeshSimplifier::_normal(int t, int u, int v, double *n) const
+{
+    const double *p[3];
+    for (int i = 0; i < 3; i++) {
+	int node = _node(t * 3 + i);
+	p[i] = _position((node == u) ? v : node);
+    }
+    __cross(p[0], p[1], p[2], n);
+}
@@ -0,0 +1,197 @@
+/*-------------------------------------------------------------------------
+  MeshSimplifier.hxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  Simplifies a scenery mesh by collapsing edges, for drawing live
+  scenery at lower levels of detail.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+#ifndef _MESHSIMPLIFIER_H_
+#define _MESHSIMPLIFIER_H_
+
+#include <cstddef>
+#include <vector>
+
+// A MeshSimplifier takes a set of triangle lists (one per material,
+// as in Subbucket), and reduces the number of triangles in them by
+// repeatedly collapsing an edge <u, v> - that is, by moving node u to
+// node v, which removes the two triangles sharing the edge.  Nodes
+// are never moved anywhere else (this is called a "half-edge
+// collapse"), so the simplified triangles use the same vertices as
+// the original ones, and can share their vertex buffers.
+//
+// A node is a position.  Because a vertex is really a <position,
+// normal> pair (see Subbucket::load()), several vertices can have the
+// same node.  When a node is collapsed, each of its vertices is
+// replaced by the vertex of the other node with the most similar
+// normal.
+//
+// The error of a collapse is measured with quadrics (Garland and
+// Heckbert, "Surface Simplification Using Quadric Error Metrics",
+// 1997): each node accumulates the planes of all the original
+// triangles that have been collapsed into it, and the error of
+// putting it somewhere is the sum of the squared distances from
+// there to those planes.  Since it's a sum, its square root is an
+// upper bound on how far any of the original triangles are from the
+// simplified surface.  For scenery, which is mostly flat, this is
+// essentially the elevation error, so contour bands (which are
+// elevation ranges) are preserved to within that error.
+//
+// To keep features intact, we're stingy about which nodes can be
+// collapsed:
+//
+// (a) Nodes on the edge of the mesh are never collapsed, so that
+//     simplified subbuckets still meet their neighbours without
+//     gaps.
+//
+// (b) Nodes on the boundary between two materials can only be
+//     collapsed along that boundary, and the boundary's shape is
+//     part of the error (each boundary edge adds a plane
+//     perpendicular to it), so material boundaries are simplified,
+//     but are still within the error of the original ones.  Nodes
+//     where three or more materials meet are never collapsed.
+//
+// (c) Collapses that would flip a triangle over, or make the mesh
+//     non-manifold, are not allowed.
+//
+// Positions are given in metres in some local cartesian frame (x and
+// y horizontal, z up is best, but not required).  The simplifier
+// keeps references to the position, node, and normal vectors, so
+// they must outlive it.
+//
+// To use it, create it, add() the triangle lists, then call
+// simplify() with increasing errors, collecting the results with
+// list() after each one.
+class MeshSimplifier {
+  public:
+    // Positions are <x, y, z> triples, one per node.  nodes[i] is
+    // the node of vertex i, and normals[i * 3] to normals[i * 3 + 2]
+    // its normal.
+    MeshSimplifier(const std::vector<double> &positions,
+		   const std::vector<int> &nodes,
+		   const std::vector<float> &normals);
+
+    // Adds a list of triangles (in GL_TRIANGLES format, as vertex
+    // indices), returning its number.  All lists must be added before
+    // the first call to simplify().
+    size_t add(const std::vector<unsigned int> &triangles);
+
+    // Collapses edges until none can be collapsed without the error
+    // exceeding maxError metres.  Successive calls pick up where the
+    // last one left off, so maxError should increase.
+    void simplify(double maxError);
+
+    // Sets triangles to the current (simplified) version of the
+    // given list, in the same format as add().
+    void list(size_t l, std::vector<unsigned int> &triangles) const;
+    // The number of triangles left, in all lists.
+    size_t triangles() const { return _alive; }
+
+    // Memory used by the simplifier, in bytes.
+    size_t bytes() const;
+
+  protected:
+    // A symmetric 4x4 matrix, representing a sum of squared distances
+    // to planes.
+    struct Quadric {
+	double a[10];
+
+	Quadric();
+	// Adds the plane through p with unit normal n.
+	void addPlane(const double *p, const double *n);
+	void operator+=(const Quadric &q);
+	// The sum of squared distances from p to our planes.
+	double error(const double *p) const;
+    };
+
+    // A candidate collapse, from node u to node v.  Stamp is u's
+    // stamp when the collapse was evaluated - if u's stamp has
+    // changed since, the candidate is stale.
+    struct Collapse {
+	double cost;
+	int u, v;
+	unsigned int stamp;
+
+	// For the priority queue - the cheapest collapse is on top.
+	bool operator<(const Collapse &c) const { return cost > c.cost; }
+    };
+
+    // Information about an edge from some node to a neighbour.
+    struct Edge {
+	int node;		// The neighbour.
+	int triangles;		// Number of triangles sharing the edge.
+	int list;		// List of the first of those triangles.
+	bool mixed;		// True if they're from different lists.
+    };
+
+    void _start();
+    int _node(int corner) const { return _nodes[_corners[corner]]; }
+    const double *_position(int node) const { return &_positions[node * 3]; }
+    // Removes dead triangles from the node's triangle list.
+    void _prune(int node);
+    // Finds the node's neighbours.  Assumes the node has been
+    // pruned.  Returns false if the node can't move at all.
+    bool _edges(int node, std::vector<Edge> &edges,
+		std::vector<int> &lists) const;
+    // Finds the best collapse for node u, and queues it.
+    void _evaluate(int u);
+    bool _valid(int u, int v);
+    void _collapse(int u, int v);
+    // The vertex of node v whose normal is closest to vertex i's.
+    unsigned int _closestVertex(int v, unsigned int i) const;
+    // The unnormalized normal of triangle t, with node u moved to
+    // node v.
+    void _normal(int t, int u, int v, double *n) const;
+    // The shape of triangle t seen from above (ie, in x and y), with
+    // node u moved to node v: its area divided by the sum of the
+    // squares of its sides.  This is small for slivers, and negative
+    // if the triangle faces down.
+    double _flatness(int t, int u, int v) const;
+
+    const std::vector<double> &_positions;
+    const std::vector<int> &_nodes;
+    const std::vector<float> &_normals;
+
+    // All triangles, as vertex indices, 3 per triangle, and the list
+    // each belongs to (-1 if it has been collapsed away).
+    std::vector<unsigned int> _corners;
+    std::vector<int> _lists;
+    // Where each list starts in _lists (plus one extra for the end).
+    std::vector<size_t> _listStarts;
+    size_t _alive;
+
+    // Per node: its triangles (some of which may be dead), its
+    // vertices, its quadric, and its current stamp.
+    std::vector<std::vector<int> > _triangles;
+    std::vector<std::vector<unsigned int> > _vertices;
+    std::vector<Quadric> _quadrics;
+    std::vector<unsigned int> _stamps;
+    std::vector<bool> _removed;
+
+    bool _started;
+    std::vector<Collapse> _queue; // A heap.
+
+    // Scratch space for _evaluate(), _valid(), and _collapse().
+    std::vector<Edge> _uEdges, _vEdges;
+    std::vector<int> _uLists, _vLists;
+};
+
+#endif // _MESHSIMPLIFIER_H_
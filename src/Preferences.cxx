@@ -601,6 +601,47 @@ Preferences::Preferences():
     JPEGQuality("jpeg-quality", "<q>", 
 		"Set JPEG file quality (0 = lowest, 100 = highest)"),
     palette("palette", "<name>", "Specify Atlas palette"),
+    sceneryCache("scenery-cache", "y", "y|n",
+		 "Keep decoded live scenery in a cache on disk "
+		 "(in <atlas path>/SceneryCache)"),
+    sceneryCacheSize("scenery-cache-size", "<MB>",
+		     "Keep the scenery cache below about <MB> megabytes, "
+		     "discarding the least recently used scenery "
+		     "(0 = no limit)"),
+    shadedContours("shaded-contours", "y", "y|n",
+		   "Colour scenery by elevation with a shader, rather "
+		   "than by chopping triangles (needs OpenGL 2.0)"),
+    levelsOfDetail("levels-of-detail", "y", "y|n",
+		   "Simplify live scenery as it's loaded, so that it can "
+		   "be drawn with fewer triangles (makes uncached scenery "
+		   "much slower to load)"),
+    triangleBudget("triangle-budget", "<n>",
+		   "Draw at most about <n> triangles of live scenery, "
+		   "using simplified scenery if there is any (0 = no limit)"),
+    prefetchTime("prefetch", "<s>",
+		 "When following the aircraft, load scenery it will fly "
+		 "over in the next <s> seconds (0 = don't)"),
+    cpuMemory("cpu-memory", "<MB>",
+	      "Keep at most about <MB> megabytes of scenery in main "
+	      "memory (0 = no limit)"),
+    gpuMemory("gpu-memory", "<MB>",
+	      "Keep at most about <MB> megabytes of scenery in video "
+	      "memory (0 = no limit)"),
+    cacheWorkTime("cache-work", "<ms>",
+		  "Load scenery for <ms> milliseconds at a time (0 = fit "
+		  "loading in around drawing)"),
+    cacheStats("cache-stats", "<s>",
+	       "Print scenery cache statistics every <s> seconds, and in "
+	       "detail on exit (0 = don't)"),
+    mipFiles("mip-files", "y", "y|n",
+	     "Keep maps with their mipmaps in .mip files next to them "
+	     "(faster to load, but about 10 times the disk space)"),
+    deriveMaps("derive-maps", "y", "y|n",
+	       "Only render maps at some levels, and make smaller maps "
+	       "by shrinking them as they're loaded (saves disk space)"),
+    packMaps("pack-maps", "y", "y|n",
+	     "Save rendered maps in one archive file per chunk, rather "
+	     "than one file per tile"),
 
     version("version", "Print version number"),
     help("help", "Print this help"),
@@ -849,6 +890,19 @@ bool Preferences::load(int argc, char *argv[])
     JPEGQuality.set(75, Pref::FACTORY);
     imageType.set(TileMapper::JPEG, Pref::FACTORY);
     palette.set("default.ap", Pref::FACTORY);
+    sceneryCache.set(true, Pref::FACTORY);
+    sceneryCacheSize.set(2048, Pref::FACTORY);
+    shadedContours.set(false, Pref::FACTORY);
+    levelsOfDetail.set(false, Pref::FACTORY);
+    triangleBudget.set(2000000, Pref::FACTORY);
+    prefetchTime.set(60.0, Pref::FACTORY);
+    cpuMemory.set(256, Pref::FACTORY);
+    gpuMemory.set(128, Pref::FACTORY);
+    cacheWorkTime.set(0, Pref::FACTORY);
+    cacheStats.set(0.0, Pref::FACTORY);
+    mipFiles.set(false, Pref::FACTORY);
+    deriveMaps.set(false, Pref::FACTORY);
+    packMaps.set(false, Pref::FACTORY);
 
     return true;
 }
@@ -422,6 +422,18 @@ class Preferences {
     TypedPref<TileMapper::ImageType> imageType;
     TypedPref<unsigned int> JPEGQuality;
     TypedPref<std::string> palette;
+    TypedPref<Prefs::Bool> sceneryCache;
+    TypedPref<unsigned int> sceneryCacheSize;
+    TypedPref<Prefs::Bool> shadedContours;
+    TypedPref<Prefs::Bool> levelsOfDetail;
+    TypedPref<unsigned int> triangleBudget;
+    TypedPref<float> prefetchTime;
+    TypedPref<unsigned int> cpuMemory, gpuMemory;
+    TypedPref<unsigned int> cacheWorkTime;
+    TypedPref<float> cacheStats;
+    TypedPref<Prefs::Bool> mipFiles;
+    TypedPref<Prefs::Bool> deriveMaps;
+    TypedPref<Prefs::Bool> packMaps;
 
     NoArgPref version, help;
 
@@ -0,0 +1,399 @@
+/*-------------------------------------------------------------------------
+  Rasterizer.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// Our include file
+#include "Rasterizer.hxx"
+
+// C++ system include files
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Our project's include files
+#include "WorkerPool.hxx"
+
+using namespace std;
+
+// Bins are this many pixels on a side.
+static const int __binSize = 64;
+
+// OpenGL's default global ambient light.
+static const float __ambient = 0.2;
+
+// Converts a colour component to a byte, as OpenGL does when writing
+// to an 8-bit buffer.
+static GLubyte __byte(float c)
+{
+    return (GLubyte)(min(max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+// Rasterizes one bin: pixels [_x0, _x1) x [_y0, _y1) of the image.
+class Rasterizer::BinJob: public WorkerPool::Job {
+  public:
+    BinJob(const Rasterizer *r, int x0, int y0, int x1, int y1):
+	_r(r), _x0(x0), _y0(y0), _x1(x1), _y1(y1) {}
+
+    // The primitives that touch us, in the order they were drawn.
+    vector<size_t> primitives;
+    // Where the results go (the whole image).
+    GLubyte *image;
+
+    void run();
+
+  protected:
+    void _triangle(const Primitive &p);
+    void _line(const Primitive &p);
+
+    const Rasterizer *_r;
+    int _x0, _y0, _x1, _y1;
+    // Our samples - RGB, row by row, bottom to top, samples x samples
+    // per pixel.
+    vector<GLubyte> _samples;
+    int _stride;
+};
+
+void Rasterizer::BinJob::run()
+{
+    unsigned int s = _r->_samples;
+    _stride = (_x1 - _x0) * s;
+    _samples.assign((size_t)_stride * (_y1 - _y0) * s * 3, 0);
+
+    for (size_t i = 0; i < primitives.size(); i++) {
+	const Primitive &p = _r->_primitives[primitives[i]];
+	if (p.line) {
+	    _line(p);
+	} else {
+	    _triangle(p);
+	}
+    }
+
+    // Resolve the samples, by averaging them, into the image.
+    unsigned int n = s * s;
+    for (int y = _y0; y < _y1; y++) {
+	for (int x = _x0; x < _x1; x++) {
+	    unsigned int sum[3] = {0, 0, 0};
+	    for (unsigned int j = 0; j < s; j++) {
+		const GLubyte *sample = &_samples[
+		    (((size_t)(y - _y0) * s + j) * _stride + (x - _x0) * s) * 3];
+		for (unsigned int i = 0; i < s; i++, sample += 3) {
+		    sum[0] += sample[0];
+		    sum[1] += sample[1];
+		    sum[2] += sample[2];
+		}
+	    }
+	    GLubyte *pixel = image + ((size_t)y * _r->_width + x) * 3;
+	    for (int c = 0; c < 3; c++) {
+		pixel[c] = (sum[c] + n / 2) / n;
+	    }
+	}
+    }
+
+    // We won't need these again.
+    vector<GLubyte>().swap(_samples);
+}
+
+// The edge function of the edge from a to b at p, which is positive
+// if p is to the left of the edge (ie, inside a counterclockwise
+// triangle).
+static double __edge(double ax, double ay, double bx, double by,
+		     double px, double py)
+{
+    return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+}
+
+void Rasterizer::BinJob::_triangle(const Primitive &p)
+{
+    // Counterclockwise triangles have a positive area.
+    double area = __edge(p.x[0], p.y[0], p.x[1], p.y[1], p.x[2], p.y[2]);
+    if (area <= 0.0) {
+	return;
+    }
+
+    // Which pixels might it cover?
+    int x0 = max(_x0, (int)floor(min(p.x[0], min(p.x[1], p.x[2]))));
+    int x1 = min(_x1, (int)ceil(max(p.x[0], max(p.x[1], p.x[2]))));
+    int y0 = max(_y0, (int)floor(min(p.y[0], min(p.y[1], p.y[2]))));
+    int y1 = min(_y1, (int)ceil(max(p.y[0], max(p.y[1], p.y[2]))));
+
+    // A sample exactly on an edge belongs to the triangle if it's a
+    // left or top edge, so that triangles sharing an edge don't both
+    // claim it (and there are no cracks between them).  Edge i is
+    // opposite vertex i.
+    bool inclusive[3];
+    for (int i = 0; i < 3; i++) {
+	int a = (i + 1) % 3, b = (i + 2) % 3;
+	double dx = p.x[b] - p.x[a], dy = p.y[b] - p.y[a];
+	inclusive[i] = (dy < 0.0) || ((dy == 0.0) && (dx < 0.0));
+    }
+
+    unsigned int s = _r->_samples;
+    for (int y = y0; y < y1; y++) {
+	for (int x = x0; x < x1; x++) {
+	    // Find the samples it covers.
+	    bool covered[64];
+	    bool any = false;
+	    for (unsigned int j = 0; j < s; j++) {
+		double sy = y + (j + 0.5) / s;
+		for (unsigned int i = 0; i < s; i++) {
+		    double sx = x + (i + 0.5) / s;
+		    bool in = true;
+		    for (int e = 0; (e < 3) && in; e++) {
+			int a = (e + 1) % 3, b = (e + 2) % 3;
+			double d = __edge(p.x[a], p.y[a], p.x[b], p.y[b],
+					  sx, sy);
+			in = (d > 0.0) || ((d == 0.0) && inclusive[e]);
+		    }
+		    covered[j * s + i] = in;
+		    any = any || in;
+		}
+	    }
+	    if (!any) {
+		continue;
+	    }
+
+	    // As with OpenGL multisampling, the colour is calculated
+	    // once, at the centre of the pixel, and written to all
+	    // the samples the triangle covers.
+	    double cx = x + 0.5, cy = y + 0.5;
+	    double w[3];
+	    for (int e = 0; e < 3; e++) {
+		int a = (e + 1) % 3, b = (e + 2) % 3;
+		w[e] = __edge(p.x[a], p.y[a], p.x[b], p.y[b], cx, cy) / area;
+	    }
+	    GLubyte rgb[3];
+	    for (int c = 0; c < 3; c++) {
+		rgb[c] = __byte(w[0] * p.rgb[0][c] + w[1] * p.rgb[1][c] +
+				w[2] * p.rgb[2][c]);
+	    }
+	    for (unsigned int j = 0; j < s; j++) {
+		GLubyte *sample = &_samples[
+		    (((size_t)(y - _y0) * s + j) * _stride + (x - _x0) * s) * 3];
+		for (unsigned int i = 0; i < s; i++, sample += 3) {
+		    if (covered[j * s + i]) {
+			memcpy(sample, rgb, 3);
+		    }
+		}
+	    }
+	}
+    }
+}
+
+void Rasterizer::BinJob::_line(const Primitive &p)
+{
+    // A line is a rectangle, width wide, centred on the line between
+    // its endpoints, as in OpenGL's multisampled line rasterization.
+    double dx = p.x[1] - p.x[0], dy = p.y[1] - p.y[0];
+    double length = sqrt(dx * dx + dy * dy);
+    if (length == 0.0) {
+	return;
+    }
+    dx /= length;
+    dy /= length;
+    double halfWidth = p.width / 2.0;
+
+    int x0 = max(_x0, (int)floor(min(p.x[0], p.x[1]) - halfWidth));
+    int x1 = min(_x1, (int)ceil(max(p.x[0], p.x[1]) + halfWidth));
+    int y0 = max(_y0, (int)floor(min(p.y[0], p.y[1]) - halfWidth));
+    int y1 = min(_y1, (int)ceil(max(p.y[0], p.y[1]) + halfWidth));
+
+    GLubyte rgb[3];
+    for (int c = 0; c < 3; c++) {
+	rgb[c] = __byte(p.rgb[0][c]);
+    }
+    unsigned int s = _r->_samples;
+    for (int y = y0; y < y1; y++) {
+	for (unsigned int j = 0; j < s; j++) {
+	    double sy = y + (j + 0.5) / s - p.y[0];
+	    GLubyte *sample = &_samples[
+		(((size_t)(y - _y0) * s + j) * _stride + (x0 - _x0) * s) * 3];
+	    for (int x = x0; x < x1; x++) {
+		for (unsigned int i = 0; i < s; i++, sample += 3) {
+		    double sx = x + (i + 0.5) / s - p.x[0];
+		    // Distance along the line, and from it.
+		    double along = sx * dx + sy * dy;
+		    double across = sx * dy - sy * dx;
+		    if ((along >= 0.0) && (along < length) &&
+			(fabs(across) < halfWidth)) {
+			memcpy(sample, rgb, 3);
+		    }
+		}
+	    }
+	}
+    }
+}
+
+Rasterizer::Rasterizer(int width, int height, unsigned int samples):
+    _width(width), _height(height),
+    _samples(min(max(samples, 1U), 8U)),
+    _scaleX(1.0), _offsetX(0.0), _scaleY(1.0), _offsetY(0.0),
+    _lighting(false), _smooth(true), _diffuse(0.0)
+{
+}
+
+Rasterizer::~Rasterizer()
+{
+}
+
+void Rasterizer::setView(double left, double right, double bottom,
+			 double top)
+{
+    _scaleX = _width / (right - left);
+    _offsetX = -left * _scaleX;
+    _scaleY = _height / (top - bottom);
+    _offsetY = -bottom * _scaleY;
+}
+
+void Rasterizer::setLight(bool lighting, const float *direction,
+			  float diffuse)
+{
+    _lighting = lighting;
+    if (_lighting) {
+	memcpy(_direction, direction, sizeof(_direction));
+	_diffuse = diffuse;
+    }
+}
+
+void Rasterizer::triangles(const GLfloat *vertices, const GLfloat *normals,
+			   const GLfloat *colours, const float *colour,
+			   const GLuint *indices, size_t count)
+{
+    for (size_t i = 0; i + 2 < count; i += 3) {
+	Primitive p;
+	p.line = false;
+	p.width = 0.0;
+	for (int v = 0; v < 3; v++) {
+	    _transform(vertices, indices[i + v], &p.x[v], &p.y[v]);
+	}
+	if (_smooth) {
+	    for (int v = 0; v < 3; v++) {
+		_light(normals, colours, colour, indices[i + v], p.rgb[v]);
+	    }
+	} else {
+	    // As in OpenGL, a flat-shaded triangle takes the colour of
+	    // its last vertex.
+	    _light(normals, colours, colour, indices[i + 2], p.rgb[2]);
+	    memcpy(p.rgb[0], p.rgb[2], sizeof(p.rgb[2]));
+	    memcpy(p.rgb[1], p.rgb[2], sizeof(p.rgb[2]));
+	}
+	_primitives.push_back(p);
+    }
+}
+
+void Rasterizer::lines(const GLfloat *vertices, const GLuint *indices,
+		       size_t count, const float *colour, float width)
+{
+    for (size_t i = 0; i + 1 < count; i += 2) {
+	Primitive p;
+	p.line = true;
+	p.width = width;
+	for (int v = 0; v < 2; v++) {
+	    _transform(vertices, indices[i + v], &p.x[v], &p.y[v]);
+	    memcpy(p.rgb[v], colour, sizeof(p.rgb[v]));
+	}
+	_primitives.push_back(p);
+    }
+}
+
+void Rasterizer::finish(GLubyte *image, WorkerPool *pool)
+{
+    // Create the bins.
+    int columns = (_width + __binSize - 1) / __binSize;
+    int rows = (_height + __binSize - 1) / __binSize;
+    vector<BinJob *> bins;
+    for (int r = 0; r < rows; r++) {
+	for (int c = 0; c < columns; c++) {
+	    BinJob *b = new BinJob(this, c * __binSize, r * __binSize,
+				   min((c + 1) * __binSize, _width),
+				   min((r + 1) * __binSize, _height));
+	    b->image = image;
+	    bins.push_back(b);
+	}
+    }
+
+    // Put each primitive in the bins its bounding box touches.
+    for (size_t i = 0; i < _primitives.size(); i++) {
+	const Primitive &p = _primitives[i];
+	int n = p.line ? 2 : 3;
+	float pad = p.width / 2.0;
+	float minX = p.x[0], maxX = p.x[0], minY = p.y[0], maxY = p.y[0];
+	for (int v = 1; v < n; v++) {
+	    minX = min(minX, p.x[v]);
+	    maxX = max(maxX, p.x[v]);
+	    minY = min(minY, p.y[v]);
+	    maxY = max(maxY, p.y[v]);
+	}
+	if ((maxX + pad < 0.0) || (minX - pad >= _width) ||
+	    (maxY + pad < 0.0) || (minY - pad >= _height)) {
+	    continue;
+	}
+	int c0 = max(0, (int)floor((minX - pad) / __binSize));
+	int c1 = min(columns - 1, (int)floor((maxX + pad) / __binSize));
+	int r0 = max(0, (int)floor((minY - pad) / __binSize));
+	int r1 = min(rows - 1, (int)floor((maxY + pad) / __binSize));
+	for (int r = r0; r <= r1; r++) {
+	    for (int c = c0; c <= c1; c++) {
+		bins[r * columns + c]->primitives.push_back(i);
+	    }
+	}
+    }
+
+    // Rasterize the bins, in parallel if we can.
+    for (size_t i = 0; i < bins.size(); i++) {
+	if (pool) {
+	    pool->submit(bins[i]);
+	} else {
+	    bins[i]->run();
+	}
+    }
+    for (size_t i = 0; i < bins.size(); i++) {
+	if (pool) {
+	    pool->wait(bins[i]);
+	}
+	delete bins[i];
+    }
+
+    _primitives.clear();
+}
+
+void Rasterizer::_transform(const GLfloat *vertices, GLuint i,
+			    float *x, float *y)
+{
+    *x = vertices[i * 3] * _scaleX + _offsetX;
+    *y = vertices[i * 3 + 1] * _scaleY + _offsetY;
+}
+
+void Rasterizer::_light(const GLfloat *normals, const GLfloat *colours,
+			const float *colour, GLuint i, float *rgb)
+{
+    const float *c = colours ? colours + i * 4 : colour;
+    float shade = 1.0;
+    if (_lighting) {
+	const GLfloat *n = normals + i * 3;
+	float d = n[0] * _direction[0] + n[1] * _direction[1] +
+	    n[2] * _direction[2];
+	shade = __ambient + _diffuse * max(d, 0.0f);
+    }
+    for (int j = 0; j < 3; j++) {
+	rgb[j] = min(c[j] * shade, 1.0f);
+    }
+}
@@ -0,0 +1,132 @@
+/*-------------------------------------------------------------------------
+  Rasterizer.hxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  A rasterizer draws triangles and lines into an RGB image entirely on
+  the CPU, without OpenGL.  It's used by TileMapper to render maps on
+  machines without a suitable graphics card (or without a display at
+  all), and so that the maps it creates don't depend on the vagaries
+  of graphics drivers.
+
+  It does just what TileMapper asks of OpenGL, and no more: an
+  orthographic view, a single directional light (like GL_LIGHT0 with
+  GL_COLOR_MATERIAL), smooth or flat shading, back-face culling,
+  multisampled anti-aliasing, and no depth buffer (things are drawn in
+  the order they're given).
+
+  Drawing doesn't actually happen until finish() is called.  Until
+  then, primitives are just transformed, lit, and recorded.  The image
+  is then divided into square bins, and each bin is rasterized, with
+  all the primitives that touch it, in a worker thread if finish() is
+  given a pool.  Each bin has
+  its own samples, so bins don't interfere with one another, and the
+  samples for the whole image never need to be in memory at once.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+#ifndef _RASTERIZER_H_
+#define _RASTERIZER_H_
+
+#include <cstddef>
+#include <vector>
+
+#if defined( __APPLE__)		// For GLfloat, GLuint, GLubyte
+#  include <OpenGL/gl.h>
+#else
+#  include <GL/gl.h>
+#endif
+
+class WorkerPool;
+
+class Rasterizer {
+  public:
+    // Creates a rasterizer for a width x height image, with samples x
+    // samples samples per pixel.
+    Rasterizer(int width, int height, unsigned int samples = 4);
+    ~Rasterizer();
+
+    // Maps the given rectangle to the image, like gluOrtho2D().
+    void setView(double left, double right, double bottom, double top);
+    // Sets the light.  If lighting is false, colours are used as
+    // given.  Otherwise, like OpenGL with GL_COLOR_MATERIAL, the
+    // default global ambient light, and a directional light with the
+    // given diffuse brightness, a colour c at a vertex with normal n
+    // becomes c * (0.2 + diffuse * max(n . direction, 0)).  The
+    // direction must be normalized.
+    void setLight(bool lighting, const float *direction = NULL,
+		  float diffuse = 0.0);
+    // Smooth (like GL_SMOOTH) or flat (like GL_FLAT) shading.
+    void setSmoothShading(bool smooth) { _smooth = smooth; }
+
+    // Adds count / 3 triangles, like glDrawElements(GL_TRIANGLES,
+    // ...).  Vertices and normals are <x, y, z> triplets (z is
+    // ignored for vertices), and indices index them.  If colours is
+    // non-NULL, it gives an RGBA colour for each vertex; otherwise
+    // all triangles are the given colour.  Triangles that are wound
+    // clockwise (in the image) are culled.
+    void triangles(const GLfloat *vertices, const GLfloat *normals,
+		   const GLfloat *colours, const float *colour,
+		   const GLuint *indices, size_t count);
+    // Adds count / 2 lines, like glDrawElements(GL_LINES, ...), in
+    // the given colour (unlit), and the given width in pixels.
+    void lines(const GLfloat *vertices, const GLuint *indices, size_t count,
+	       const float *colour, float width);
+
+    // Rasterizes everything, and writes the result to image, which
+    // must have room for width x height RGB pixels.  As with
+    // glReadPixels(), the first row is the bottom of the image.  Bins
+    // are rasterized in parallel by the given pool, if any, and
+    // otherwise in the calling thread.  The rasterizer can then be
+    // used again.
+    void finish(GLubyte *image, WorkerPool *pool = NULL);
+
+  protected:
+    class BinJob;
+    friend class BinJob;
+
+    // A transformed, lit triangle or line.
+    struct Primitive {
+	bool line;
+	// Image coordinates of the vertices (lines only use 2).
+	float x[3], y[3];
+	// Vertex colours (0.0 to 1.0).
+	float rgb[3][3];
+	// Line width, in pixels.
+	float width;
+    };
+
+    // Transforms vertex i into image coordinates.
+    void _transform(const GLfloat *vertices, GLuint i, float *x, float *y);
+    // Colours vertex i.
+    void _light(const GLfloat *normals, const GLfloat *colours,
+		const float *colour, GLuint i, float *rgb);
+
+    int _width, _height;
+    unsigned int _samples;
+    // The view transformation: x' = x * _scaleX + _offsetX, and
+    // likewise for y.
+    double _scaleX, _offsetX, _scaleY, _offsetY;
+    bool _lighting, _smooth;
+    float _direction[3], _diffuse;
+
+    std::vector<Primitive> _primitives;
+};
+
+#endif // _RASTERIZER_H_
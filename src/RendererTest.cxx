@@ -0,0 +1,251 @@
+/*-------------------------------------------------------------------------
+  RendererTest.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  Renders a map of synthetic scenery on the CPU (as 'Map
+  --renderer=cpu' does), and compares it with a reference image,
+  RendererTest.png.  Run by 'make check'.
+
+  The scenery (see TestScenery.hxx) covers part of one tile, so the
+  map has ocean, lakes, hills coloured by elevation, and a coastline.
+  Floating point results can differ a little between compilers and
+  processors, so rather than insisting on identical images, we allow
+  small differences in a small fraction of the pixels.  Anything
+  more - a missing ocean, wrongly coloured contours, a misplaced
+  bucket, a change in lighting - fails.
+
+  If the renderer is changed on purpose, check the new map by eye,
+  then run 'RendererTest --update' to make it the reference.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// C++ system include files
+#include <bitset>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+// Other libraries' include files
+#include <simgear/bucket/newbucket.hxx>
+
+// Our project's include files
+#include "Image.hxx"
+#include "Palette.hxx"
+#include "TestScenery.hxx"
+#include "TileMapper.hxx"
+#include "Tiles.hxx"
+#include "WorkerPool.hxx"
+
+using namespace std;
+
+// Everything is made in here, in the current directory.
+static const char *__dir = "RendererTest.dir";
+// The tile we map, and the level of its map (7 = 128 x 128 pixels).
+static const char *__tile = "w123n37";
+static const int __lat = 37, __lon = -123;
+static const unsigned int __level = 7;
+
+// How different the map can be from the reference: the mean
+// difference (over all colour components, from 0 to 255), and the
+// fraction of components that differ by more than __bigDifference.
+static const double __maxMeanDifference = 1.0;
+static const int __bigDifference = 16;
+static const double __maxBigFraction = 0.01;
+
+// Writes scenery for the buckets of the tile south-west of a diagonal
+// line, so that the rest is ocean.  Returns false if it couldn't.
+static bool __writeScenery(const SGPath &terrain)
+{
+    for (int y = 0; y < 8; y++) {
+	for (int x = 0; x < 8 - y; x++) {
+	    SGBucket b(__lon + (x + 0.5) / 8.0, __lat + (y + 0.5) / 8.0);
+	    SGPath dir(terrain);
+	    dir.append(b.gen_base_path());
+	    char index[32];
+	    snprintf(index, sizeof(index), "%ld", b.gen_index());
+
+	    SGPath btg(dir);
+	    btg.append(index);
+	    btg.concat(".btg.gz");
+	    if ((btg.create_dir(0755) < 0) || 
+		!writeTestScenery(btg, b, 17)) {
+		return false;
+	    }
+
+	    SGPath stg(dir);
+	    stg.append(index);
+	    stg.concat(".stg");
+	    FILE *f = fopen(stg.c_str(), "w");
+	    if (f == NULL) {
+		return false;
+	    }
+	    fprintf(f, "OBJECT_BASE %s.btg\n", index);
+	    if (fclose(f) != 0) {
+		return false;
+	    }
+	}
+    }
+
+    return true;
+}
+
+// Copies the file from to the file to.
+static bool __copy(const SGPath &from, const SGPath &to)
+{
+    FILE *in = fopen(from.c_str(), "rb");
+    if (in == NULL) {
+	return false;
+    }
+    FILE *out = fopen(to.c_str(), "wb");
+    if (out == NULL) {
+	fclose(in);
+	return false;
+    }
+
+    char buf[4096];
+    size_t n;
+    bool ok = true;
+    while (ok && ((n = fread(buf, 1, sizeof(buf), in)) > 0)) {
+	ok = (fwrite(buf, 1, n, out) == n);
+    }
+    ok = !ferror(in) && ok;
+    fclose(in);
+    ok = (fclose(out) == 0) && ok;
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    bool update = (argc > 1) && (strcmp(argv[1], "--update") == 0);
+    const char *srcdir = getenv("srcdir");
+    if (srcdir == NULL) {
+	srcdir = ".";
+    }
+    SGPath reference(srcdir);
+    reference.append("RendererTest.png");
+    SGPath palettePath(srcdir);
+    palettePath.append("data/Palettes/default.ap");
+
+    SGPath scenery(__dir), maps(__dir);
+    scenery.append("Scenery");
+    maps.append("Maps");
+    SGPath terrain(scenery);
+    terrain.append("Terrain");
+    if (!__writeScenery(terrain)) {
+	fprintf(stderr, "%s: couldn't write scenery in '%s'\n", 
+		argv[0], terrain.c_str());
+	return 1;
+    }
+
+    Palette *palette;
+    TileManager *tm;
+    try {
+	palette = new Palette(palettePath.c_str());
+	tm = new TileManager(scenery, maps);
+	bitset<TileManager::MAX_MAP_LEVEL> levels;
+	levels[__level] = true;
+	tm->setMapLevels(levels);
+    } catch (runtime_error &e) {
+	fprintf(stderr, "%s: %s\n", argv[0], e.what());
+	return 1;
+    }
+    Tile *t = tm->tile(__tile);
+    if (t == NULL) {
+	fprintf(stderr, "%s: no scenery for %s\n", argv[0], __tile);
+	return 1;
+    }
+
+    // Map's defaults, except for the renderer, and saving PNGs, which
+    // are lossless.
+    {
+	WorkerPool loaders, encoders;
+	TileMapper mapper(palette, __level, true, false, 315.0, 55.0, true,
+			  true, TileMapper::PNG, 75, false, &loaders, &encoders,
+			  TileMapper::CPU);
+	mapper.set(t);
+	mapper.render();
+	mapper.save(__level);
+	mapper.finish();
+    }
+
+    SGPath map(maps);
+    char level[3];
+    snprintf(level, sizeof(level), "%u", __level);
+    map.append(level);
+    map.append(__tile);
+    map.concat(".png");
+
+    if (update) {
+	if (!__copy(map, reference)) {
+	    fprintf(stderr, "%s: couldn't copy '%s' to '%s'\n", argv[0], 
+		    map.c_str(), reference.c_str());
+	    return 1;
+	}
+	printf("Updated '%s'\n", reference.c_str());
+	return 0;
+    }
+
+    int width, height, depth;
+    char *image = loadPNG(map.c_str(), &width, &height, &depth);
+    if (image == NULL) {
+	fprintf(stderr, "%s: couldn't read '%s'\n", argv[0], map.c_str());
+	return 1;
+    }
+
+    int rWidth, rHeight, rDepth;
+    char *expected = loadPNG(reference.c_str(), &rWidth, &rHeight, &rDepth);
+    if (expected == NULL) {
+	fprintf(stderr, "%s: couldn't read '%s'\n", argv[0], 
+		reference.c_str());
+	return 1;
+    }
+    if ((width != rWidth) || (height != rHeight) || (depth != rDepth)) {
+	fprintf(stderr, "%s: map is %dx%dx%d, but reference is %dx%dx%d\n",
+		argv[0], width, height, depth, rWidth, rHeight, rDepth);
+	return 1;
+    }
+
+    size_t n = (size_t)width * height * depth, big = 0;
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+	int d = abs((unsigned char)image[i] - (unsigned char)expected[i]);
+	sum += d;
+	if (d > __bigDifference) {
+	    big++;
+	}
+    }
+    double mean = sum / n, fraction = (double)big / n;
+    printf("Mean difference %.3f, %.2f%% of components differ by more "
+	   "than %d\n", mean, fraction * 100.0, __bigDifference);
+    if ((mean > __maxMeanDifference) || (fraction > __maxBigFraction)) {
+	fprintf(stderr, "%s: '%s' differs from '%s'\n", 
+		argv[0], map.c_str(), reference.c_str());
+	return 1;
+    }
+
+    delete []image;
+    delete []expected;
+    delete tm;
+    delete palette;
+
+    return 0;
+}
@@ -29,13 +29,27 @@
 // Our include file
 #include "Scenery.hxx"
 
+// C++ system include files
+#include <algorithm>
+#include <cstring>
+
+// System include files
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Other libraries' include files
+#include <simgear/misc/stdint.hxx>
+
 // Our project's include files
 #include "AtlasWindow.hxx"
 #include "AtlasController.hxx"
 #include "Bucket.hxx"
+#include "FlightTrack.hxx"
 #include "Geographics.hxx"
 #include "Image.hxx"
 #include "LayoutManager.hxx"
+#include "MapArchive.hxx"
+#include "TextureArray.hxx"
 #include "OOGL.hxx"
 
 using namespace std;
@@ -57,9 +71,9 @@ using namespace std;
 // (a) Calculate the desired display resolution (including if we want
 //     live scenery).
 //
-// (b) Ask the culler for a list of visible tiles, and tell those
-//     tiles they are visible.  The tiles will in turn inform the
-//     relevant cache that they are visible.  The cache will begin
+// (b) Ask the culler for a list of visible tiles, and tell the cache
+//     about them, and about any that have just dropped out of sight.
+//     The cache asks the tiles what they need, and will begin
 //     loading textures/scenery as required.
 //
 // (c) Tell the tiles to draw themselves.  The tiles will draw
@@ -69,25 +83,48 @@ using namespace std;
 // A cache object containing a texture.
 class MapTexture {
   public:
-    MapTexture(const SGPath &f, int lat, int lon);
+    // The map is in file f, shrunk by the given amount if it's
+    // derived from a larger map (see TileManager::derivedLevels()).
+    MapTexture(const SGPath &f, unsigned int shrink, int lat, int lon);
+    // The same, but the map is in the given slot of a map archive.
+    MapTexture(MapArchive *archive, unsigned int slot, unsigned int shrink,
+	       int lat, int lon);
     ~MapTexture();
 
     // Load the texture, extracting its maximum elevation (embedded in
-    // the file) if it has one.
-    void load();
+    // the file) if it has one.  If pool is given, the file is decoded
+    // in the background (see Texture::load()).
+    void load(WorkerPool *pool = NULL);
+    bool loading() const { return _t.loading(); }
+    bool ready() { return _t.ready(); }
+    bool collect() { return _t.collect(); }
     void unload();
     bool loaded() const;
-    unsigned int size() { return _t.size(); }
+    size_t gpuBytes() const { return _t.gpuBytes(); }
 
     float maximumElevation() { return _maxElevation; }
 
+    // True if we're in a texture array, in which case we can be drawn
+    // in a batch with others in the same array, rather than by draw().
+    bool batched() const { return _t.array() != NULL; }
+    TextureArray *array() const { return _t.array(); }
+    // Adds our triangles (vertices and texture coordinates) to the
+    // given batch.
+    void batch(vector<GLfloat> &vertices);
+
     void draw();
 
   protected:
     Texture _t;
     SGPath _f;
+    MapArchive *_archive;
+    unsigned int _slot;
+    unsigned int _shrink;
     int _lat, _lon;
     DisplayList _dlist;		// Display list to draw this texture.
+    // Our corners (and points along our edges), north then south,
+    // west to east, for batching.
+    vector<GLfloat> _corners;
     float _maxElevation;	// Maximum elevation of the map.
 };
 
@@ -100,10 +137,13 @@ class SceneryTile: public Cullable, public CacheObject, Subscriber {
     // have been added or deleted.
     void update();
 
-    // Draws a texture appropriate to the given level.
+    // The loaded texture most appropriate to the given level (NULL if
+    // none), and a way to draw it.
+    MapTexture *texture(unsigned int level);
     void drawTexture(unsigned int level);
-    // Draws bucket(s).
-    void drawBuckets();
+    // Adds our buckets that are within the scenery culler's frustum
+    // to the given vector.
+    void liveBuckets(vector<Bucket *> &buckets);
     // Labels the scenery tile or its buckets with MEFs (minimum
     // elevation figures).
     void label(double metresPerPixel, bool live);
@@ -121,7 +161,10 @@ class SceneryTile: public Cullable, public CacheObject, Subscriber {
     bool shouldLoad();
     bool load();
     bool unload();
-    unsigned int size() { return _size; }
+    size_t size(Pool p);
+    bool waiting();
+    bool shouldPrefetch();
+    bool prefetch();
 
     // This will get called when we receive a notification.
     void notification(Notification::type n);
@@ -149,20 +192,371 @@ class SceneryTile: public Cullable, public CacheObject, Subscriber {
     // true, it returns the level of the best texture nearest 'level'
     // that has already been loaded.
     unsigned int _calcBest(unsigned int level, bool loaded = false);
-    // The following are set in shouldLoad() and used in load().  They
-    // record what work we need to do at the behest of the cache.
-    unsigned int _mapToBeLoaded;	 // Map to be loaded.
-    vector<Bucket *> _bucketsToBeLoaded;  // Current buckets to be loaded.
-    // Sets _size, which is our approximation of how big we are in
-    // bytes (this figure is used by the cache).
-    void _calcSize();
-    unsigned int _size;
+    // Work we need to do at the behest of the cache.  It's set in
+    // shouldLoad() (for what's visible) or shouldPrefetch() (for what
+    // will probably be visible soon), and done in load() or
+    // prefetch().
+    struct Work {
+	Work(): mapToBeLoaded(TileManager::MAX_MAP_LEVEL) {}
+	void clear();
+	bool done() const;
+
+	unsigned int mapToBeLoaded;	   // Map to be loaded.
+	vector<Bucket *> bucketsToBeLoaded; // Buckets to be loaded.
+	// Loaded buckets that need to be palettized.  Buckets are
+	// added to this when they finish loading too.
+	vector<Bucket *> bucketsToBePalettized;
+    };
+    Work _work, _prefetchWork;
+    bool _load(Work &w);
+    bool _waiting(const Work &w);
 };
 
 GLubyte Texture::__defaultImage[Texture::__defaultSize][Texture::__defaultSize][3];
 GLuint Texture::__defaultTexture = 0;
 
-Texture::Texture(): _name(0), _size(0)
+// Pixel buffer objects that images are decoded into.  Mapping a
+// pixel buffer object gives us memory that the worker threads can
+// write to, and that OpenGL can later copy to the texture without
+// blocking us.  Buffers are reused (though we give them new storage
+// each time, so OpenGL needn't wait until it's finished with the old
+// contents).  We map at most __maxBuffers at a time; decodes beyond
+// that use ordinary memory.  Buffers are __bufferSize bytes, the size
+// of the last image we decoded (maps at one level are all the same
+// size, and we usually load lots at the same level).  EYE - magic
+// numbers
+static vector<GLuint> __freeBuffers;
+static unsigned int __mappedBuffers = 0;
+static const unsigned int __maxBuffers = 8;
+static size_t __bufferSize = 1024 * 1024 * 3;
+
+// Returns the image file for f: f itself if it has a jpg or png
+// extension, or f with one of those added, or a null path if there
+// isn't one.
+static SGPath __imageFile(const SGPath &f)
+{
+    if ((f.extension() == "jpg") || (f.extension() == "png")) {
+	return f;
+    }
+    // EYE - we should not have to guess this - the full pathname
+    // should be passed in (as a const char *, I might add).
+    const char *extensions[] = {".jpg", ".png"};
+    for (int i = 0; i < 2; i++) {
+	SGPath result(f);
+	result.concat(extensions[i]);
+	if (result.exists()) {
+	    return result;
+	}
+    }
+
+    return SGPath();
+}
+
+// The number of mipmap levels an image has, down to 1x1, and their
+// total size in bytes.
+static int __levels(int width, int height)
+{
+    int result = 1;
+    for (; (width > 1) || (height > 1); result++) {
+	width = max(width / 2, 1);
+	height = max(height / 2, 1);
+    }
+
+    return result;
+}
+
+static size_t __chainBytes(int width, int height, int depth, int levels)
+{
+    size_t result = 0;
+    for (int i = 0; i < levels; i++) {
+	result += (size_t)width * height * depth;
+	width = max(width / 2, 1);
+	height = max(height / 2, 1);
+    }
+
+    return result;
+}
+
+// Builds a complete mipmap chain for the given image by averaging
+// 2x2 blocks, returning the levels one after another (starting with
+// the image itself).  As with loadJPEG(), the chain is put in buffer
+// if it fits, and otherwise allocated with new[].
+static char *__mipmap(const char *image, int width, int height, int depth,
+		      char *buffer, size_t size)
+{
+    int levels = __levels(width, height);
+    size_t bytes = __chainBytes(width, height, depth, levels);
+    char *result = (buffer && (bytes <= size)) ? buffer : new char[bytes];
+
+    if (result != image) {
+	memcpy(result, image, (size_t)width * height * depth);
+    }
+    const unsigned char *src = (const unsigned char *)result;
+    for (int l = 1; l < levels; l++) {
+	int w = max(width / 2, 1), h = max(height / 2, 1);
+	unsigned char *dst = 
+	    (unsigned char *)src + (size_t)width * height * depth;
+	// When one dimension is already 1, we average 1x2 (or 2x1)
+	// blocks instead.
+	int dx = (width > 1) ? depth : 0;
+	size_t dy = (height > 1) ? (size_t)width * depth : 0;
+	for (int y = 0; y < h; y++) {
+	    const unsigned char *row = src + (size_t)y * 2 * width * depth;
+	    for (int x = 0; x < w; x++) {
+		const unsigned char *p = row + x * 2 * depth;
+		for (int c = 0; c < depth; c++) {
+		    *dst++ = (p[c] + p[c + dx] + p[c + dy] + p[c + dx + dy] 
+			      + 2) / 4;
+		}
+	    }
+	}
+	src += (size_t)width * height * depth;
+	width = w;
+	height = h;
+    }
+
+    return result;
+}
+
+// Makes sure the given image (with the given number of levels) has a
+// complete mipmap chain, building one (see __mipmap()) if it doesn't.
+// The image is replaced (and deleted, unless it's in buffer) if
+// necessary.
+static char *__chain(char *image, int width, int height, int depth,
+		     int *levels, char *buffer, size_t size)
+{
+    if ((image == NULL) || (*levels > 1)) {
+	return image;
+    }
+    char *result = __mipmap(image, width, height, depth, buffer, size);
+    if ((image != result) && (image != buffer)) {
+	delete []image;
+    }
+    *levels = __levels(width, height);
+
+    return result;
+}
+
+// Maps can be saved, with all their mipmap levels, in mip files next
+// to them (see Texture::mipFiles).  A mip file is an uncompressed
+// copy of what we give OpenGL, so it can be read (or mapped) straight
+// into a pixel buffer object.  It consists of:
+//
+//   header (__MipHeader)
+//   mipmap levels, largest first, each one height rows of width *
+//   depth bytes, with no padding
+//
+// The map file's modification time and size tell us if the mip file
+// is out of date.
+struct __MipHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height, depth;
+    uint32_t levels;
+    int64_t mtime;		// Map file modification time
+    int64_t size;		// and size.
+    float maxElevation;		// In feet.
+    uint32_t padding;
+};
+static const char __mipMagic[8] = {'A', 'T', 'L', 'A', 'S', 'M', 'I', 'P'};
+static const uint32_t __mipVersion = 1;
+
+bool Texture::mipFiles = false;
+
+// The mip file for the given image file, shrunk by the given amount.
+// Shrunken images (see TileManager::deriveMaps()) get their own mip
+// files, named <tile>-<shrink>.mip.
+static SGPath __mipFile(const SGPath &file, unsigned int shrink)
+{
+    SGPath result(file.base());
+    if (shrink > 0) {
+	char str[4];
+	snprintf(str, sizeof(str), "-%u", shrink);
+	result.concat(str);
+    }
+    result.concat(".mip");
+
+    return result;
+}
+
+// Loads the image in the given file, shrunk by 2^shrink in each
+// direction (see loadJPEG()).  If we're using mip files, we
+// try to load its mip file, and failing that, we decode the image,
+// build its mipmaps, and save them in a new mip file.  In either
+// case *levels tells how many levels we got.  As with loadJPEG(),
+// data goes in buffer if it fits.  This is safe to call in a worker
+// thread.
+static char *__load(const SGPath &f, unsigned int shrink, 
+		    int *width, int *height, int *depth,
+		    int *levels, float *maximumElevation, 
+		    char *buffer, size_t size)
+{
+    SGPath file = __imageFile(f);
+    if (file.isNull()) {
+	return NULL;
+    }
+    *levels = 1;
+
+    // EYE - we only write little-endian files, and can't be bothered
+    // to swap bytes on the rare big-endian machine.
+    struct stat st;
+    if (!Texture::mipFiles || sgIsBigEndian() || 
+	(stat(file.c_str(), &st) != 0)) {
+	if (file.extension() == "jpg") {
+	    return loadJPEG(file.c_str(), width, height, depth, 
+			    maximumElevation, buffer, size, shrink);
+	} else {
+	    return loadPNG(file.c_str(), width, height, depth, 
+			   maximumElevation, buffer, size, shrink);
+	}
+    }
+
+    // Try the mip file.
+    SGPath mip = __mipFile(file, shrink);
+    FILE *fp = fopen(mip.c_str(), "rb");
+    if (fp != NULL) {
+	__MipHeader h;
+	char *result = NULL;
+	if ((fread(&h, sizeof(h), 1, fp) == 1) &&
+	    (memcmp(h.magic, __mipMagic, sizeof(__mipMagic)) == 0) &&
+	    (h.version == __mipVersion) &&
+	    (h.mtime == (int64_t)st.st_mtime) &&
+	    (h.size == (int64_t)st.st_size) &&
+	    ((h.depth == 3) || (h.depth == 4)) &&
+	    (h.levels == (uint32_t)__levels(h.width, h.height))) {
+	    size_t bytes = __chainBytes(h.width, h.height, h.depth, h.levels);
+	    result = (buffer && (bytes <= size)) ? buffer : new char[bytes];
+	    if (fread(result, 1, bytes, fp) == bytes) {
+		*width = h.width;
+		*height = h.height;
+		*depth = h.depth;
+		*levels = h.levels;
+		if (maximumElevation) {
+		    *maximumElevation = h.maxElevation;
+		}
+	    } else {
+		// Truncated.
+		if (result != buffer) {
+		    delete []result;
+		}
+		result = NULL;
+	    }
+	}
+	fclose(fp);
+	if (result != NULL) {
+	    return result;
+	}
+    }
+
+    // No luck, so decode the image and make a new mip file.
+    float maxElevation;
+    char *image;
+    if (file.extension() == "jpg") {
+	image = loadJPEG(file.c_str(), width, height, depth, &maxElevation,
+			 NULL, 0, shrink);
+    } else {
+	image = loadPNG(file.c_str(), width, height, depth, &maxElevation,
+			NULL, 0, shrink);
+    }
+    if (image == NULL) {
+	return NULL;
+    }
+    if (maximumElevation) {
+	*maximumElevation = maxElevation;
+    }
+    char *result = __mipmap(image, *width, *height, *depth, buffer, size);
+    delete []image;
+    *levels = __levels(*width, *height);
+
+    __MipHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, __mipMagic, sizeof(__mipMagic));
+    h.version = __mipVersion;
+    h.width = *width;
+    h.height = *height;
+    h.depth = *depth;
+    h.levels = *levels;
+    h.mtime = st.st_mtime;
+    h.size = st.st_size;
+    h.maxElevation = maxElevation;
+
+    // Write the mip file so that nobody ever sees it partially
+    // written.  If something goes wrong, we just don't create it.
+    AtomicFile out(mip.c_str());
+    if (out.fp() != NULL) {
+	size_t bytes = __chainBytes(*width, *height, *depth, *levels);
+	out.commit((fwrite(&h, sizeof(h), 1, out.fp()) == 1) &&
+		   (fwrite(result, 1, bytes, out.fp()) == bytes));
+    }
+
+    return result;
+}
+
+// Decodes a texture file in a worker thread.  It does no OpenGL calls
+// - if we're given a mapped pixel buffer object, it just writes to
+// it.
+class Texture::DecodeJob: public WorkerPool::Job {
+  public:
+    DecodeJob(const SGPath &f, unsigned int shrink):
+	pbo(0), buffer(NULL), size(0), mipmap(false), data(NULL), 
+	maximumElevation(Bucket::NanE), 
+	_f(f), _image(NULL), _length(0), _shrink(shrink) {}
+    // Decodes an image already in memory, which must stay there until
+    // the job is done.
+    DecodeJob(const char *image, size_t length, unsigned int shrink):
+	pbo(0), buffer(NULL), size(0), mipmap(false), data(NULL), 
+	maximumElevation(Bucket::NanE), 
+	_image(image), _length(length), _shrink(shrink) {}
+    ~DecodeJob()
+    {
+	if (data != buffer) {
+	    delete []data;
+	}
+    }
+
+    void run()
+    {
+	// If we have to make mipmaps, we decode into ordinary memory,
+	// then build the mipmap chain in buffer.
+	char *b = mipmap ? NULL : buffer;
+	size_t s = mipmap ? 0 : size;
+	if (_image != NULL) {
+	    levels = 1;
+	    data = decodeImage(_image, _length, &width, &height, &depth, 
+			       &maximumElevation, b, s, _shrink);
+	} else {
+	    data = __load(_f, _shrink, &width, &height, &depth, &levels, 
+			  &maximumElevation, b, s);
+	}
+	if (mipmap) {
+	    data = __chain(data, width, height, depth, &levels, buffer, size);
+	}
+    }
+
+    // The pixel buffer object (0 if none), where it's mapped, and how
+    // big it is.
+    GLuint pbo;
+    char *buffer;
+    size_t size;
+    // True if we need to make a complete mipmap chain (for a texture
+    // array).
+    bool mipmap;
+    // The results.  If the image didn't fit in buffer, data is
+    // somewhere else (and we delete it).
+    char *data;
+    int width, height, depth, levels;
+    float maximumElevation;
+
+  protected:
+    SGPath _f;
+    const char *_image;
+    size_t _length;
+    unsigned int _shrink;
+};
+
+Texture::Texture(bool array): 
+    _name(0), _gpuBytes(0), _useArray(array), _array(NULL), _layer(0), 
+    _width(0), _height(0), _job(NULL), _pool(NULL), _maxElevation(NULL)
 {
 }
 
@@ -172,40 +566,170 @@ Texture::~Texture()
 }
 
 // Loads the given file, which is assumed to be a JPEG or PNG file.
-// On success, loaded() will return true.
-void Texture::load(SGPath f, float *maximumElevation)
+// On success, loaded() will return true (immediately if pool is NULL,
+// or after a successful collect() otherwise).
+void Texture::load(SGPath f, float *maximumElevation, WorkerPool *pool,
+		   unsigned int shrink)
 {
-    GLubyte *data;
-    int width, height, depth;
+    // Clear any existing data.
+    unload();
+    assert(_name == 0);
+
+    if (pool == NULL) {
+	int width, height, depth, levels;
+	char *data = __load(f, shrink, &width, &height, &depth, &levels, 
+			    maximumElevation, NULL, 0);
+	if (_arrayed()) {
+	    data = __chain(data, width, height, depth, &levels, NULL, 0);
+	}
+	if (data != NULL) {
+	    _create(data, width, height, depth, levels);
+	    delete []data;
+	}
+	return;
+    }
 
+    _submit(new DecodeJob(f, shrink), pool, maximumElevation);
+}
+
+// Loads the given JPEG or PNG image, which is in memory.  We don't use
+// mip files for these.
+void Texture::load(const char *data, size_t length, float *maximumElevation,
+		   WorkerPool *pool, unsigned int shrink)
+{
     // Clear any existing data.
     unload();
     assert(_name == 0);
 
-    // Load the data.
-    if (f.extension() == "jpg") {
-	data = (GLubyte *)loadJPEG(f.c_str(), &width, &height, &depth, 
-				   maximumElevation);
-    } else if (f.extension() == "png") {
-	data = (GLubyte *)loadPNG(f.c_str(), &width, &height, &depth,
-				  maximumElevation);
-    } else {
-	// EYE - we should not have to guess this - the full pathname
-	// should be passed in (as a const char *, I might add).
-	f.concat(".jpg");
-	data = (GLubyte *)loadJPEG(f.c_str(), &width, &height, &depth, 
-				   maximumElevation);
-	if (!data) {
-	    f.set(f.base());
-	    f.concat(".png");
-	    data = (GLubyte *)loadPNG(f.c_str(), &width, &height, &depth,
-				      maximumElevation);
-	}
-    }
-    if (data == NULL) {
+    if (pool == NULL) {
+	int width, height, depth, levels = 1;
+	char *image = decodeImage(data, length, &width, &height, &depth, 
+				  maximumElevation, NULL, 0, shrink);
+	if (_arrayed()) {
+	    image = __chain(image, width, height, depth, &levels, NULL, 0);
+	}
+	if (image != NULL) {
+	    _create(image, width, height, depth, levels);
+	    delete []image;
+	}
+	return;
+    }
+
+    _submit(new DecodeJob(data, length, shrink), pool, maximumElevation);
+}
+
+// Starts the given job in the given pool.
+void Texture::_submit(DecodeJob *job, WorkerPool *pool, 
+		      float *maximumElevation)
+{
+    // Give the job a pixel buffer object to decode into, if we have
+    // one to spare.
+    if ((GLEW_VERSION_2_1 || GLEW_ARB_pixel_buffer_object) &&
+	(__mappedBuffers < __maxBuffers)) {
+	GLuint pbo;
+	if (__freeBuffers.empty()) {
+	    glGenBuffers(1, &pbo);
+	} else {
+	    pbo = __freeBuffers.back();
+	    __freeBuffers.pop_back();
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, __bufferSize, NULL, 
+		     GL_STREAM_DRAW);
+	char *buffer = 
+	    (char *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (buffer == NULL) {
+	    __freeBuffers.push_back(pbo);
+	} else {
+	    __mappedBuffers++;
+	    job->pbo = pbo;
+	    job->buffer = buffer;
+	    job->size = __bufferSize;
+	}
+    }
+
+    job->mipmap = _arrayed();
+    _job = job;
+    _pool = pool;
+    _maxElevation = maximumElevation;
+    _pool->submit(_job);
+}
+
+bool Texture::ready()
+{
+    return loading() && _pool->done(_job);
+}
+
+bool Texture::collect()
+{
+    if (!ready()) {
+	return !loading();
+    }
+
+    // If the image was decoded into the pixel buffer object, we
+    // create the texture from there (an offset of 0 into it).
+    // Otherwise we create it from wherever it was decoded.
+    DecodeJob *j = _job;
+    if (j->pbo != 0) {
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, j->pbo);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+    if (j->data != NULL) {
+	if (j->data == j->buffer) {
+	    _create((const GLvoid *)0, j->width, j->height, j->depth, 
+		    j->levels);
+	} else {
+	    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	    _create(j->data, j->width, j->height, j->depth, j->levels);
+	}
+	__bufferSize = __chainBytes(j->width, j->height, j->depth, j->levels);
+	if (_maxElevation) {
+	    *_maxElevation = j->maximumElevation;
+	}
+    }
+    _finishJob();
+
+    return true;
+}
+
+// Deletes our job, giving back its pixel buffer object.
+void Texture::_finishJob()
+{
+    if (_job->pbo != 0) {
+	__freeBuffers.push_back(_job->pbo);
+	__mappedBuffers--;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    delete _job;
+    _job = NULL;
+    _pool = NULL;
+}
+
+bool Texture::_arrayed() const
+{
+    return _useArray && TextureArray::supported();
+}
+
+void Texture::_create(const GLvoid *data, int width, int height, int depth,
+		      int levels)
+{
+    _width = width;
+    _height = height;
+
+    // Texture arrays need all the mipmaps, and their layers are
+    // square, with sides a power of 2.  Maps are always powers of 2,
+    // but we check anyway.
+    if (_arrayed() && (levels == __levels(width, height)) &&
+	((width & (width - 1)) == 0) && ((height & (height - 1)) == 0)) {
+	_array = TextureArray::allocate(max(width, height), depth, &_layer);
+	_array->upload(_layer, data, width, height);
+	_gpuBytes = _array->layerBytes();
 	return;
     }
-    _size = width * height * depth;
+
+    // The full mipmap chain adds about a third.
+    _gpuBytes = __chainBytes(width, height, depth, __levels(width, height));
 
     // Create the texture.
     glGenTextures(1, &_name);
@@ -236,13 +760,29 @@ void Texture::load(SGPath f, float *maximumElevation)
     // we *must* do mipmapping.
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
-    if (depth == 3) {
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height,
-		     0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    } else {
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height,
-		     0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    // If we've been given all the mipmap levels, we just load them.
+    // They're packed tightly, so small levels won't have rows
+    // aligned the way OpenGL normally expects.
+    glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    const char *level = (const char *)data;
+    for (int l = 0; l < levels; l++) {
+	if (depth == 3) {
+	    glTexImage2D(GL_TEXTURE_2D, l, GL_RGB8, width, height,
+			 0, GL_RGB, GL_UNSIGNED_BYTE, level);
+	} else {
+	    glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA8, width, height,
+			 0, GL_RGBA, GL_UNSIGNED_BYTE, level);
+	}
+	level += (size_t)width * height * depth;
+	width = max(width / 2, 1);
+	height = max(height / 2, 1);
+    }
+    glPopClientAttrib();
+    if (levels > 1) {
+	return;
     }
+
     // EYE - glGenerateMipmapEXT() should exist if the
     // GL_EXT_framebuffer_object extension exists.  As of OpenGL 3.0,
     // we can also use glGenerateMipmap().  Note that we may need to
@@ -254,16 +794,31 @@ void Texture::load(SGPath f, float *maximumElevation)
     //
     // For more.
     glGenerateMipmapEXT(GL_TEXTURE_2D);
-
-    delete []data;
 }
 
 void Texture::unload()
 {
-    if (loaded()) {
+    // Stop any background decoding.  The job may be writing into a
+    // mapped pixel buffer object, so it has to be done before we unmap
+    // it.
+    if (loading()) {
+	_pool->cancel(_job);
+	if (_job->pbo != 0) {
+	    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _job->pbo);
+	    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+	_finishJob();
+    }
+
+    if (_array) {
+	_array->release(_layer);
+	_array = NULL;
+	_gpuBytes = 0;
+    }
+    if (_name != 0) {
 	glDeleteTextures(1, &_name);
 	_name = 0;
-	_size = 0;
+	_gpuBytes = 0;
     }
 }
 
@@ -272,7 +827,7 @@ void Texture::unload()
 // is a red and white checkerboard.
 GLuint Texture::name() const
 {
-    if (loaded()) {
+    if (_name != 0) {
     	return _name;
     } else {
 	// Has our default texture been initialized?
@@ -316,14 +871,30 @@ GLuint Texture::name() const
 // Creates a texture cache object.  It's redundant to give the path
 // and the lat and lon, because the lat and lon can be extracted from
 // the path name, but it makes our life easier.
-MapTexture::MapTexture(const SGPath &f, int lat, int lon): 
-    _f(f), _lat(lat), _lon(lon), _maxElevation(Bucket::NanE)
+MapTexture::MapTexture(const SGPath &f, unsigned int shrink, int lat, int lon): 
+    _t(true), _f(f), _archive(NULL), _slot(0), _shrink(shrink), _lat(lat), _lon(lon), 
+    _maxElevation(Bucket::NanE)
 {
 }
 
+// The archive's index has the map's maximum elevation, so we know it
+// before the map is loaded.
+MapTexture::MapTexture(MapArchive *archive, unsigned int slot, 
+		       unsigned int shrink, int lat, int lon): 
+    _t(true), _archive(archive), _slot(slot), _shrink(shrink), _lat(lat), _lon(lon), 
+    _maxElevation(archive->maximumElevation(slot))
+{
+    _archive->ref();
+}
+
 MapTexture::~MapTexture()
 {
+    // This waits for any decoding of the archive's images to finish,
+    // so it's safe to let go of the archive afterwards.
     unload();
+    if (_archive) {
+	_archive->unref();
+    }
 }
 
 void MapTexture::draw()
@@ -389,11 +960,67 @@ void MapTexture::draw()
     _dlist.call();
 }
 
-void MapTexture::load()
+// Adds a vertex, with its texture coordinates, to a batch.
+static void __batchVertex(vector<GLfloat> &vertices, const GLfloat *v, 
+			  float s, float t, float layer)
+{
+    vertices.insert(vertices.end(), v, v + 3);
+    vertices.push_back(s);
+    vertices.push_back(t);
+    vertices.push_back(layer);
+}
+
+void MapTexture::batch(vector<GLfloat> &vertices)
+{
+    // Our geometry is the same as in draw(), but with triangles, not
+    // a triangle strip, so that all the tiles in a batch can be drawn
+    // at once.  Converting to cartesian coordinates isn't cheap, so
+    // we only do it once.
+    int width = Tile::width(_lat + 90);
+    if (_corners.empty()) {
+	for (int i = 0; i < 2; i++) {
+	    for (int j = 0; j <= width; j++) {
+		SGVec3<double> cart;
+		SGGeodesy::SGGeodToCart(SGGeod::fromDeg(_lon + j, _lat + 1 - i), 
+					cart);
+		_corners.push_back(cart[0]);
+		_corners.push_back(cart[1]);
+		_corners.push_back(cart[2]);
+	    }
+	}
+    }
+
+    // Our image might not fill its layer.
+    TextureArray *a = _t.array();
+    float s = _t.width() / (float)a->size(), t = _t.height() / (float)a->size();
+    float layer = _t.layer();
+    const GLfloat *north = &_corners[0], *south = &_corners[(width + 1) * 3];
+    for (int i = 0; i < width; i++) {
+	float s0 = s * i / width, s1 = s * (i + 1) / width;
+	__batchVertex(vertices, north + i * 3, s0, 0.0, layer);
+	__batchVertex(vertices, south + i * 3, s0, t, layer);
+	__batchVertex(vertices, north + (i + 1) * 3, s1, 0.0, layer);
+
+	__batchVertex(vertices, north + (i + 1) * 3, s1, 0.0, layer);
+	__batchVertex(vertices, south + i * 3, s0, t, layer);
+	__batchVertex(vertices, south + (i + 1) * 3, s1, t, layer);
+    }
+}
+
+void MapTexture::load(WorkerPool *pool)
 {
     // Load the file.  Map files can have the map's maximum elevation
     // embedded in them as a text comment, so extract it if it exists.
-    _t.load(_f, &_maxElevation);
+    if (_archive == NULL) {
+	_t.load(_f, &_maxElevation, pool, _shrink);
+	return;
+    }
+
+    size_t length;
+    const char *image = _archive->image(_slot, &length);
+    if (image != NULL) {
+	_t.load(image, length, &_maxElevation, pool, _shrink);
+    }
 }
 
 void MapTexture::unload()
@@ -452,13 +1079,28 @@ void SceneryTile::update()
 		delete _textures[i];
 	    }
 
+	    // The map may be derived from a larger one, and may be in
+	    // a map archive.
+	    unsigned int source = _ti->mapSource(i);
+	    MapArchive *archive = NULL;
+	    if (_ti->mapPacked(source)) {
+		archive = _scenery->archive(_ti, source);
+	    }
+	    if (archive) {
+		_textures[i] = new MapTexture(archive, 
+					      MapArchive::slot(_ti->name()),
+					      source - i, 
+					      _ti->lat(), _ti->lon());
+		continue;
+	    }
+
 	    char str[3];
-	    sprintf(str, "%d", i);
+	    sprintf(str, "%d", source);
 
 	    SGPath f = _ti->mapsDir();
 	    f.append(str);
 	    f.append(_ti->name());
-	    _textures[i] = new MapTexture(f, _ti->lat(), _ti->lon());
+	    _textures[i] = new MapTexture(f, source - i, _ti->lat(), _ti->lon());
 	} else if (_textures[i]) {
 	    delete _textures[i];
 	    _textures[i] = (MapTexture *)NULL;
@@ -470,7 +1112,20 @@ void SceneryTile::update()
 // to centre.
 void SceneryTile::calcDist(sgdVec3 centre)
 {
-    _dist = sgdDistanceSquaredVec3(centre, _bounds.center);
+    _dist = sgdDistanceVec3(centre, _bounds.center);
+}
+
+void SceneryTile::Work::clear()
+{
+    mapToBeLoaded = TileManager::MAX_MAP_LEVEL;
+    bucketsToBeLoaded.clear();
+    bucketsToBePalettized.clear();
+}
+
+bool SceneryTile::Work::done() const
+{
+    return (mapToBeLoaded == TileManager::MAX_MAP_LEVEL) &&
+	bucketsToBeLoaded.empty() && bucketsToBePalettized.empty();
 }
 
 // Called by the cache when we are added to it.  We return true if we
@@ -478,19 +1133,14 @@ void SceneryTile::calcDist(sgdVec3 centre)
 // if required.
 bool SceneryTile::shouldLoad()
 {
-    bool result = false;
-
-    // Calculate what map to load.  If there's nothing to load, set it
-    // to MAX_MAP_LEVEL.
-    _mapToBeLoaded = _calcBest(_scenery->level());
-    if (_mapToBeLoaded != TileManager::MAX_MAP_LEVEL) {
-	// We need to load a map if it exists and it hasn't been
-	// loaded already.
-	if (_textures[_mapToBeLoaded] && !_textures[_mapToBeLoaded]->loaded()) {
-	    result = true;
-	} else {
-	    _mapToBeLoaded = TileManager::MAX_MAP_LEVEL;
-	}
+    _work.clear();
+
+    // Calculate what map to load.  We need to load a map if it
+    // exists and it hasn't been loaded already.
+    unsigned int map = _calcBest(_scenery->level());
+    if ((map != TileManager::MAX_MAP_LEVEL) && 
+	_textures[map] && !_textures[map]->loaded()) {
+	_work.mapToBeLoaded = map;
     }
 
     if (_scenery->live()) {
@@ -499,63 +1149,205 @@ bool SceneryTile::shouldLoad()
 
 	// Schedule some buckets for loading.  We load a bucket if:
 	// (a) there is one, (b) it hasn't been loaded, and (c) it is
-	// within the viewing frustum.
-	_bucketsToBeLoaded.clear();
-
+	// within the viewing frustum.  Similarly, we palettize loaded
+	// buckets in the frustum that need it (eg, after a palette
+	// change).
 	for (unsigned int i = 0; i < _buckets->size(); i++) {
 	    Bucket *b = (*_buckets)[i];
-	    if ((b != NULL) && !b->loaded() && 
-		_scenery->frustum()->intersects(b->bounds())) {
-		_bucketsToBeLoaded.push_back(b);
-		result = true;
+	    if ((b == NULL) || 
+		!_scenery->frustum()->intersects(b->bounds())) {
+		continue;
+	    }
+	    // A bucket at the wrong level of detail needs to be
+	    // palettized again.
+	    b->setLevel(_scenery->lod());
+	    if (!b->loaded()) {
+		_work.bucketsToBeLoaded.push_back(b);
+	    } else if (!b->palettized()) {
+		_work.bucketsToBePalettized.push_back(b);
 	    }
 	}
     }
 
-    return result;
+    return !_work.done();
 }
 
 // Load a map and/or some buckets.  This is called from a cache, after
-// the call to shouldLoad(), where _mapToBeLoaded and
-// _bucketsToBeLoaded were set.  In the interests of responsiveness,
-// we only do a bit of work (ie, loading the map or one bucket) per
-// call.  We return true when everything has been loaded.
+// the call to shouldLoad().
 bool SceneryTile::load()
 {
-    if (_mapToBeLoaded != TileManager::MAX_MAP_LEVEL) {
-	_textures[_mapToBeLoaded]->load();
-	_calcSize();
+    return _load(_work);
+}
+
+// Called by the cache to see if there's any point in calling load()
+// (or prefetch()).
+bool SceneryTile::waiting()
+{
+    return _waiting(_work.done() ? _prefetchWork : _work);
+}
 
-	// Set our maximum elevation figure if it hasn't been set
-	// already.
-	if (_maxElevation == Bucket::NanE) {
-	    _maxElevation = _textures[_mapToBeLoaded]->maximumElevation();
+// Called by the cache when we're on the scenery's predicted path (see
+// Scenery::predict()).  Like shouldLoad(), but we only look at things
+// that aren't visible now, but will be on the path.
+bool SceneryTile::shouldPrefetch()
+{
+    _prefetchWork.clear();
+    if (!_scenery->frustum()->intersects(_bounds)) {
+	// We're not visible, so whatever we were asked to load
+	// before is moot.
+	_work.clear();
+    }
+
+    // Our map, unless it's already been asked for.
+    unsigned int map = _calcBest(_scenery->level());
+    if ((map != TileManager::MAX_MAP_LEVEL) && 
+	_textures[map] && !_textures[map]->loaded() &&
+	(map != _work.mapToBeLoaded)) {
+	_prefetchWork.mapToBeLoaded = map;
+    }
+
+    if (_scenery->live()) {
+	_findBuckets();
+
+	for (unsigned int i = 0; i < _buckets->size(); i++) {
+	    Bucket *b = (*_buckets)[i];
+	    if ((b == NULL) || 
+		_scenery->frustum()->intersects(b->bounds()) ||
+		!_scenery->predicted(b->bounds())) {
+		continue;
+	    }
+	    b->setLevel(_scenery->lod());
+	    if (!b->loaded()) {
+		_prefetchWork.bucketsToBeLoaded.push_back(b);
+	    } else if (!b->palettized()) {
+		_prefetchWork.bucketsToBePalettized.push_back(b);
+	    }
+	}
+    }
+
+    return !_prefetchWork.done();
+}
+
+bool SceneryTile::prefetch()
+{
+    return _load(_prefetchWork);
+}
+
+// Does the given work.  In the interests of responsiveness, we only
+// do a bit of work (ie, loading the map, palettizing a bucket, or
+// starting or collecting background bucket loads) per call.  We
+// return true when everything has been loaded.
+bool SceneryTile::_load(Work &w)
+{
+    if (w.mapToBeLoaded != TileManager::MAX_MAP_LEVEL) {
+	// Maps are decoded in the background.  The first time we get
+	// here, we hand ours to the loader.  After that, we see if
+	// it's finished.
+	MapTexture *t = _textures[w.mapToBeLoaded];
+	if (!t->loading() && !t->loaded()) {
+	    t->load(_scenery->loader());
 	}
+	if (t->collect()) {
+	    // Set our maximum elevation figure if it hasn't been set
+	    // already.
+	    if (_maxElevation == Bucket::NanE) {
+		_maxElevation = t->maximumElevation();
+	    }
+
+	    w.mapToBeLoaded = TileManager::MAX_MAP_LEVEL;
+
+	    // Tell others that new scenery has been loaded.
+	    Notification::notify(Notification::NewScenery);
+
+	    // If we still have buckets to load, tell the cache we're
+	    // not done.
+	    return w.done();
+	}
+
+	// While the map is being decoded, we get on with our
+	// buckets.
+    }
+
+    if (!w.bucketsToBePalettized.empty()) {
+	// Palettizing a bucket can take a while, so we only do one,
+	// the one nearest the eye.
+	vector<Bucket *> &buckets = w.bucketsToBePalettized;
+	vector<Bucket *>::iterator nearest = buckets.begin();
+	double nearestDist = 
+	    sgdDistanceSquaredVec3(_scenery->eye(), (*nearest)->bounds().center);
+	vector<Bucket *>::iterator i;
+	for (i = nearest + 1; i != buckets.end(); i++) {
+	    double dist = 
+		sgdDistanceSquaredVec3(_scenery->eye(), (*i)->bounds().center);
+	    if (dist < nearestDist) {
+		nearest = i;
+		nearestDist = dist;
+	    }
+	}
+	(*nearest)->palettize(_scenery->palettizer());
+	buckets.erase(nearest);
+
+	return w.done();
+    }
 
-	_mapToBeLoaded = TileManager::MAX_MAP_LEVEL;
+    if (!w.bucketsToBeLoaded.empty()) {
+	// Buckets are loaded in the background.  The first time we
+	// get here, we hand them all to the loader.  After that, we
+	// collect whichever ones have finished.
+	bool loaded = false;
+	vector<Bucket *>::iterator i = w.bucketsToBeLoaded.begin();
+	while (i != w.bucketsToBeLoaded.end()) {
+	    Bucket *b = *i;
+	    if (!b->loading() && !b->loaded()) {
+		b->load(Bucket::CARTESIAN, _scenery->loader());
+	    }
+	    if (b->collect()) {
+		i = w.bucketsToBeLoaded.erase(i);
+		w.bucketsToBePalettized.push_back(b);
+		loaded = true;
+	    } else {
+		i++;
+	    }
+	}
 
-	// Tell others that new scenery has been loaded.
-	Notification::notify(Notification::NewScenery);
+	if (loaded) {
+	    // Tell others that new scenery has been loaded.
+	    Notification::notify(Notification::NewScenery);
+	}
 
-	// If we still have buckets to load, tell the cache we're not
-	// done.
-	return _bucketsToBeLoaded.empty();
+	return w.done();
     }
 
-    if (!_bucketsToBeLoaded.empty()) {
-	Bucket *b = _bucketsToBeLoaded.back();
-	_bucketsToBeLoaded.pop_back();
-	b->load();
-	_calcSize();
+    // If we get here, we're done, unless we're waiting for our map.
+    return w.done();
+}
 
-	// Tell others that new scenery has been loaded.
-	Notification::notify(Notification::NewScenery);
+// There's no point in doing the given work if the only thing left to
+// do is wait for the loader to finish with our map and buckets.
+bool SceneryTile::_waiting(const Work &w)
+{
+    if (!w.bucketsToBePalettized.empty()) {
+	return false;
+    }
 
-	return _bucketsToBeLoaded.empty();
+    bool waiting = false;
+    if (w.mapToBeLoaded != TileManager::MAX_MAP_LEVEL) {
+	MapTexture *t = _textures[w.mapToBeLoaded];
+	if (!t->loading() || t->ready()) {
+	    return false;
+	}
+	waiting = true;
     }
 
-    // If we get here, we're done.
-    return true;
+    for (size_t i = 0; i < w.bucketsToBeLoaded.size(); i++) {
+	Bucket *b = w.bucketsToBeLoaded[i];
+	if (!b->loading() || b->ready()) {
+	    return false;
+	}
+	waiting = true;
+    }
+
+    return waiting;
 }
 
 // Unload our textures and buckets.  This is called from a cache.  We
@@ -574,42 +1366,55 @@ bool SceneryTile::unload()
 	}
     }
 
-    // We could just set _size to 0, but this seems cleaner.
-    _calcSize();
-
     return true;
 }
 
-void SceneryTile::_calcSize()
+// Our size in the given pool.  Our buckets' sizes change when they're
+// palettized and drawn, not just when we load them, so we add them
+// up each time we're asked.
+size_t SceneryTile::size(Pool p)
 {
-    _size = 0;
-    for (unsigned int i = 0; i < TileManager::MAX_MAP_LEVEL; i++) {
-	if (_textures[i]) {
-	    _size += _textures[i]->size();
+    size_t result = 0;
+    if (p == GPU) {
+	for (unsigned int i = 0; i < TileManager::MAX_MAP_LEVEL; i++) {
+	    if (_textures[i]) {
+		result += _textures[i]->gpuBytes();
+	    }
 	}
     }
     
     if (_buckets != NULL) {
 	for (unsigned int i = 0; i < _buckets->size(); i++) {
-	    _size += (*_buckets)[i]->size();
+	    Bucket *b = (*_buckets)[i];
+	    result += (p == CPU) ? b->cpuBytes() : b->gpuBytes();
 	}
     }
+
+    return result;
 }
 
 // Draws the texture that best matches the given level, where "best"
 // means the first texture we find at this level or below.  Failing
 // that, we choose the first one we find above this level.
-void SceneryTile::drawTexture(unsigned int level)
+MapTexture *SceneryTile::texture(unsigned int level)
 {
     unsigned int best = _calcBest(level, true);
-    if (best != TileManager::MAX_MAP_LEVEL) {
-	_textures[best]->draw();
+    if (best == TileManager::MAX_MAP_LEVEL) {
+	return NULL;
     }
+
+    return _textures[best];
 }
 
-// Draw the buckets in the tile that are within the scenery culler's
-// frustum.
-void SceneryTile::drawBuckets()
+void SceneryTile::drawTexture(unsigned int level)
+{
+    MapTexture *t = texture(level);
+    if (t) {
+	t->draw();
+    }
+}
+
+void SceneryTile::liveBuckets(vector<Bucket *> &buckets)
 {
     if (_buckets == NULL) {
 	// If we haven't loaded our buckets yet, just return.
@@ -618,10 +1423,8 @@ void SceneryTile::drawBuckets()
 
     for (unsigned int i = 0; i < _buckets->size(); i++) {
 	Bucket *b = (*_buckets)[i];
-	if ((b != NULL) && 
-	    (b->loaded()) && 
-	    _scenery->frustum()->intersects(b->bounds())) {
-	    b->draw();
+	if ((b != NULL) && _scenery->frustum()->intersects(b->bounds())) {
+	    buckets.push_back(b);
 	}
     }
 }
@@ -630,12 +1433,14 @@ void SceneryTile::drawBuckets()
 void SceneryTile::notification(Notification::type n)
 {
     if (n == Notification::Palette) {
-	// Got a new palette.
+	// Got a new palette.  Tell our buckets, and tell the scenery
+	// object, so that it will get the cache to palettize them.
 	if (_buckets) {
 	    for (unsigned int i = 0; i < _buckets->size(); i++) {
 		_buckets->at(i)->paletteChanged();
 	    }
 	}
+	_scenery->paletteChanged();
     } else {
 	assert(false);
     }
@@ -774,7 +1579,9 @@ unsigned int SceneryTile::_calcBest(unsigned int level, bool loaded)
 // displayed in the given window.
 Scenery::Scenery(AtlasWindow *aw): 
     _aw(aw), _dirty(true), _level(TileManager::MAX_MAP_LEVEL), _live(false), 
-    _tm(_aw->ac()->tileManager()), _levels(_tm->mapLevels()), _cache(_aw->id())
+    _lod(0), _tm(_aw->ac()->tileManager()), _levels(_tm->mapLevels()), 
+    _batchVBO(0), _batchGeneration(0), _prefetchTime(0.0), _predictions(0), 
+    _heading(0.0), _haveHeading(false), _cache(_aw->id())
 {
     // Create a culler and a frustum searcher for it.
     _culler = new Culler();
@@ -820,6 +1627,19 @@ Scenery::~Scenery()
     }
     _tiles.clear();
 
+    map<string, MapArchive *>::const_iterator j;
+    for (j = _archives.begin(); j != _archives.end(); j++) {
+	j->second->unref();
+    }
+    _archives.clear();
+
+    if (_batchVBO != 0) {
+	glDeleteBuffers(1, &_batchVBO);
+    }
+
+    for (size_t i = 0; i < _predicted.size(); i++) {
+	delete _predicted[i];
+    }
     delete _frustum;
     delete _culler;
 }
@@ -827,8 +1647,10 @@ Scenery::~Scenery()
 void Scenery::move(const sgdMat4 modelViewMatrix, const sgdVec3 eye)
 {
     _frustum->move(modelViewMatrix);
+    sgdCopyMat4(_modelView, modelViewMatrix);
     sgdCopyVec3(_eye, eye);
     _dirty = true;
+    _cache.viewChanged();
 }
 
 // Called when the user zooms in or out.  We update the frustum
@@ -839,8 +1661,15 @@ void Scenery::zoom(const sgdFrustum& frustum, double metresPerPixel)
     _frustum->zoom(frustum.getLeft(), frustum.getRight(), 
 		   frustum.getBot(), frustum.getTop(),
 		   frustum.getNear(), frustum.getFar());
+    for (size_t i = 0; i < _predicted.size(); i++) {
+	_predicted[i]->zoom(frustum.getLeft(), frustum.getRight(), 
+			    frustum.getBot(), frustum.getTop(),
+			    frustum.getNear(), frustum.getFar());
+    }
+    _view = frustum;
     _dirty = true;
     _metresPerPixel = metresPerPixel;
+    _cache.viewChanged();
 
     // Calculate the ideal level.  We calculate the height in pixels
     // of a map tile at the current zoom level.  We then take the
@@ -866,9 +1695,10 @@ void Scenery::zoom(const sgdFrustum& frustum, double metresPerPixel)
 
     // We have no maps detailed enough.  We set live to true, but in
     // the interests of performance, we only do so if we're not zoomed
-    // out too far.
+    // out too far.  Further out than this, even the coarsest level of
+    // detail has more triangles than pixels.
     // EYE - magic number
-    if (metresPerPixel < 125.0) {
+    if (metresPerPixel < 250.0) {
 	_live = true;
     }
 
@@ -888,30 +1718,102 @@ void Scenery::zoom(const sgdFrustum& frustum, double metresPerPixel)
     }
 }
 
+void Scenery::setWorkTime(unsigned int ms)
+{
+    _cache.setAdaptive(ms == 0);
+    if (ms > 0) {
+	_cache.setWorkTime(ms);
+    }
+}
+
 void Scenery::draw(bool lightingOn)
 {
     // We assume that when called, the depth test and lighting are
     // off.
     assert(!glIsEnabled(GL_DEPTH_TEST) && !glIsEnabled(GL_LIGHTING));
 
+    // Choose a level of detail for live scenery.  If it changes, we
+    // need to tell the cache.
+    if (_live) {
+	_chooseLOD();
+    } else {
+	_buckets.clear();
+    }
+
     // Has our view of the world changed?
+    bool viewChanged = _dirty;
     if (_dirty) {
 	// Yes.  Update our idea of what to display, ask the culler
-	// for visible tiles, and tell the cache.
-	_cache.reset(_eye);
+	// for visible tiles and tiles on the predicted path (nearest
+	// first), and tell the cache.  Visible tiles can be predicted
+	// too - they may have buckets that aren't visible yet.
+	_cache.setCentre(_eye);
 
-	// Now ask the culler for all visible tiles, and add them to
-	// the cache for loading.
+	set<SceneryTile *> visibleTiles, predictedTiles;
 	const vector<Cullable *>& intersections = _frustum->intersections();
 	for (unsigned int i = 0; i < intersections.size(); i++) {
-	    SceneryTile *t = dynamic_cast<SceneryTile *>(intersections[i]);
-	    if (!t) {
-		continue;
+	    visibleTiles.insert(static_cast<SceneryTile *>(intersections[i]));
+	}
+	for (size_t i = 0; i < _predictions; i++) {
+	    const vector<Cullable *>& tiles = _predicted[i]->intersections();
+	    for (unsigned int j = 0; j < tiles.size(); j++) {
+		predictedTiles.insert(static_cast<SceneryTile *>(tiles[j]));
 	    }
+	}
+
+	// The cache only needs to hear about tiles whose status has
+	// changed, and tiles that are visible or predicted (what they
+	// need changes as we move).  So first tell it about tiles
+	// that have dropped out of sight.
+	set<SceneryTile *>::const_iterator t;
+	for (t = _visibleTiles.begin(); t != _visibleTiles.end(); t++) {
+	    if ((visibleTiles.find(*t) == visibleTiles.end()) &&
+		(predictedTiles.find(*t) == predictedTiles.end())) {
+		_cache.update(*t, false);
+	    }
+	}
+	for (t = _predictedTiles.begin(); t != _predictedTiles.end(); t++) {
+	    if ((visibleTiles.find(*t) == visibleTiles.end()) &&
+		(predictedTiles.find(*t) == predictedTiles.end())) {
+		_cache.update(*t, false);
+	    }
+	}
 
-	    _cache.add(t);
+	// Now the visible ones.  We note which ones have just come
+	// into view, and whether we had them already.
+	for (t = visibleTiles.begin(); t != visibleTiles.end(); t++) {
+	    bool predicted = (predictedTiles.find(*t) != predictedTiles.end());
+	    bool loading = _cache.update(*t, true, predicted);
+	    if (_visibleTiles.find(*t) == _visibleTiles.end()) {
+		_residency.tiles++;
+		if (!loading) {
+		    _residency.residentTiles++;
+		}
+	    }
 	}
 
+	// And finally the ones that are just predicted.
+	for (t = predictedTiles.begin(); t != predictedTiles.end(); t++) {
+	    if (visibleTiles.find(*t) == visibleTiles.end()) {
+		_cache.update(*t, false, true);
+	    }
+	}
+	_visibleTiles.swap(visibleTiles);
+	_predictedTiles.swap(predictedTiles);
+
+	// Ditto for buckets.
+	set<Bucket *> visibleBuckets(_buckets.begin(), _buckets.end());
+	set<Bucket *>::const_iterator b;
+	for (b = visibleBuckets.begin(); b != visibleBuckets.end(); b++) {
+	    if (_visibleBuckets.find(*b) == _visibleBuckets.end()) {
+		_residency.buckets++;
+		if ((*b)->loaded()) {
+		    _residency.residentBuckets++;
+		}
+	    }
+	}
+	_visibleBuckets.swap(visibleBuckets);
+
 	// Now start the cache.
 	_cache.go();
 
@@ -931,15 +1833,31 @@ void Scenery::draw(bool lightingOn)
     //     only cover part of that area (because part of it may be
     //     open ocean, or otherwise have no scenery).
 
-    // Draw textures.
+    // Draw textures.  Those in texture arrays are drawn in batches,
+    // one per array, from a vertex buffer that we only rebuild when
+    // what's visible or what's in the arrays changes.  Others are
+    // drawn one at a time.
+    bool rebatch = viewChanged || 
+	(_batchGeneration != TextureArray::generation());
+    map<TextureArray *, vector<GLfloat> > batches;
     const vector<Cullable *>& intersections = _frustum->intersections();
     for (unsigned int i = 0; i < intersections.size(); i++) {
-    	SceneryTile *t = dynamic_cast<SceneryTile *>(intersections[i]);
-    	if (!t) {
-    	    continue;
-    	}
-    	t->drawTexture(_level);
+	// Our culler only has scenery tiles in it, so there's no need
+	// for a dynamic_cast.
+    	SceneryTile *t = static_cast<SceneryTile *>(intersections[i]);
+	MapTexture *m = t->texture(_level);
+	if (!m) {
+	    continue;
+	} else if (!m->batched()) {
+	    m->draw();
+	} else if (rebatch) {
+	    m->batch(batches[m->array()]);
+	}
+    }
+    if (rebatch) {
+	_setBatches(batches);
     }
+    _drawBatches();
 
     // Render "live" scenery too if we're zoomed in close enough.
     if (_live) {
@@ -952,13 +1870,27 @@ void Scenery::draw(bool lightingOn)
 	// bits of the scenery might be occluded by other bits, but I
 	// think that's actually unlikely (does FlightGear have
 	// caves?).
+	//
+	// We only draw palettized buckets - the cache palettizes the
+	// rest a few at a time (see SceneryTile::load()), nearest
+	// first, so that palette and level of detail changes don't
+	// freeze us while every visible bucket is redone.  If we're
+	// over our triangle budget even at the coarsest level of
+	// detail, we draw the nearest buckets, and leave the rest to
+	// the textures.
 	glEnable(GL_DEPTH_TEST);
-	for (unsigned int i = 0; i < intersections.size(); i++) {
-	    SceneryTile *t = dynamic_cast<SceneryTile *>(intersections[i]);
-	    if (!t) {
+	size_t triangles = 0;
+	for (unsigned int i = 0; i < _buckets.size(); i++) {
+	    Bucket *b = _buckets[i];
+	    if (!b->drawable()) {
 		continue;
 	    }
-	    t->drawBuckets();
+	    triangles += b->triangles(b->level());
+	    if ((Bucket::triangleBudget > 0) && (i > 0) &&
+		(triangles > Bucket::triangleBudget)) {
+		break;
+	    }
+	    b->draw();
 	}
 	glDisable(GL_DEPTH_TEST);
 
@@ -970,16 +1902,257 @@ void Scenery::draw(bool lightingOn)
     }
 }
 
+// Orders buckets by their distance from a point, nearest first.
+class __NearestBucket {
+  public:
+    __NearestBucket(const sgdVec3 &eye) { sgdCopyVec3(_eye, eye); }
+    bool operator()(const Bucket *a, const Bucket *b) const {
+	return (sgdDistanceSquaredVec3(_eye, a->bounds().center) <
+		sgdDistanceSquaredVec3(_eye, b->bounds().center));
+    }
+
+  protected:
+    sgdVec3 _eye;
+};
+
+// Finds the visible buckets, nearest first, and picks the level of
+// detail for them.  We start with the coarsest level that looks the
+// same as the original at this scale (Bucket::lodLevel()), and go
+// coarser if the loaded buckets have too many triangles.  Buckets
+// that haven't been loaded don't count (they have no triangles), so
+// as they load we may go coarser, but never finer, until the view
+// changes.
+void Scenery::_chooseLOD()
+{
+    _buckets.clear();
+    const vector<Cullable *>& intersections = _frustum->intersections();
+    for (unsigned int i = 0; i < intersections.size(); i++) {
+	SceneryTile *t = static_cast<SceneryTile *>(intersections[i]);
+	t->liveBuckets(_buckets);
+    }
+    sort(_buckets.begin(), _buckets.end(), __NearestBucket(_eye));
+
+    unsigned int lod = Bucket::lodLevel(_metresPerPixel);
+    while ((Bucket::triangleBudget > 0) && (lod < Bucket::LOD_LEVELS - 1)) {
+	size_t triangles = 0;
+	for (unsigned int i = 0; i < _buckets.size(); i++) {
+	    triangles += _buckets[i]->triangles(lod);
+	}
+	if (triangles <= Bucket::triangleBudget) {
+	    break;
+	}
+	lod++;
+    }
+
+    if (lod != _lod) {
+	_lod = lod;
+	_dirty = true;
+    }
+}
+
+// We predict the aircraft's path by assuming it holds its heading and
+// speed, and put a frustum (the same shape as ours) at points along
+// it, spaced so that each overlaps the next by at least half.  If
+// the aircraft is turning, those predictions are worthless, so we
+// cancel them until it straightens out.  Note that for atlas
+// protocol flight tracks, speed is airspeed rather than groundspeed,
+// but it's close enough.
+// EYE - magic numbers
+static const size_t __maxPredictions = 8;
+static const float __headingTolerance = 5.0;	// Degrees.
+
+void Scenery::predict(const FlightData *d)
+{
+    size_t predictions = 0;
+    bool straight = false;
+    if (d != NULL) {
+	float turn = fmod(fabs(d->hdg - _heading), 360.0f);
+	straight = _haveHeading && 
+	    (min(turn, 360.0f - turn) <= __headingTolerance);
+	_heading = d->hdg;
+	_haveHeading = true;
+    } else {
+	_haveHeading = false;
+    }
+
+    double spacing = min(_view.getRight() - _view.getLeft(),
+			 _view.getTop() - _view.getBot()) / 2.0;
+    double distance = (d != NULL) ? d->spd * SG_KT_TO_MPS * _prefetchTime : 0.0;
+    if (straight && (spacing > 0.0) && (distance > 0.0)) {
+	predictions = min((size_t)ceil(distance / spacing), __maxPredictions);
+    }
+
+    SGGeod start = SGGeod::fromDeg(d ? d->lon : 0.0, d ? d->lat : 0.0);
+    for (size_t i = 0; i < predictions; i++) {
+	SGGeod p;
+	double course;
+	if (!SGGeodesy::direct(start, d->hdg, distance * (i + 1) / predictions, 
+			       p, course)) {
+	    predictions = i;
+	    break;
+	}
+
+	// Look at the centre of the earth from the predicted point, as
+	// AtlasWindow does from the real one.  For the up vector, we
+	// use our current one, straightened to be perpendicular to the
+	// new viewing direction.
+	sgdVec3 eye, f, up, along, s, u;
+	atlasGeodToCart(p.getLatitudeDeg(), p.getLongitudeDeg(), 0.0, eye);
+	sgdNegateVec3(f, eye);
+	sgdNormalizeVec3(f);
+	sgdSetVec3(up, _modelView[0][1], _modelView[1][1], _modelView[2][1]);
+	sgdSetVec3(along, f[0], f[1], f[2]);
+	sgdScaleVec3(along, sgdScalarProductVec3(up, f));
+	sgdSubVec3(up, along);
+	sgdNormalizeVec3(up);
+	sgdVectorProductVec3(s, f, up);
+	sgdVectorProductVec3(u, s, f);
+
+	sgdMat4 m, t;
+	sgdSetVec4(m[0], s[0], u[0], -f[0], 0.0);
+	sgdSetVec4(m[1], s[1], u[1], -f[1], 0.0);
+	sgdSetVec4(m[2], s[2], u[2], -f[2], 0.0);
+	sgdSetVec4(m[3], 0.0, 0.0, 0.0, 1.0);
+	sgdNegateVec3(eye);
+	sgdMakeTransMat4(t, eye);
+	sgdPreMultMat4(m, t);
+
+	if (i == _predicted.size()) {
+	    Culler::FrustumSearch *search = new Culler::FrustumSearch(*_culler);
+	    search->zoom(_view.getLeft(), _view.getRight(), 
+			 _view.getBot(), _view.getTop(),
+			 _view.getNear(), _view.getFar());
+	    _predicted.push_back(search);
+	}
+	_predicted[i]->move(m);
+    }
+
+    // If we had predictions, or have new ones, the cache needs to be
+    // told.
+    if ((predictions > 0) || (_predictions > 0)) {
+	_dirty = true;
+    }
+    _predictions = predictions;
+}
+
+bool Scenery::predicted(const atlasSphere &bounds) const
+{
+    for (size_t i = 0; i < _predictions; i++) {
+	if (_predicted[i]->intersects(bounds)) {
+	    return true;
+	}
+    }
+
+    return false;
+}
+
 // Tells us that the tile's status has changed.  We find the
 // corresponding SceneryTile and pass the message on and set _dirty to
 // true.
 void Scenery::update(Tile *t)
 {
+    // The tile's maps may have been added to its chunk's archives, so
+    // forget the ones we have open.  Tiles still using them have
+    // references to them, and the maps they're using haven't moved.
+    string chunk = t->chunk()->name();
+    map<string, MapArchive *>::iterator i = _archives.begin();
+    while (i != _archives.end()) {
+	if (SGPath(i->first).file_base() == chunk) {
+	    i->second->unref();
+	    _archives.erase(i++);
+	} else {
+	    i++;
+	}
+    }
+
     // EYE - check to make sure there's an entry for the tile?
     _tiles[t]->update();
     _dirty = true;
 }
 
+MapArchive *Scenery::archive(Tile *t, unsigned int level)
+{
+    char str[3];
+    snprintf(str, sizeof(str), "%d", level);
+    SGPath dir = t->mapsDir();
+    dir.append(str);
+    SGPath path = MapArchive::path(dir, t->chunk()->name());
+
+    map<string, MapArchive *>::const_iterator i = _archives.find(path.str());
+    if (i != _archives.end()) {
+	return i->second;
+    }
+    MapArchive *result = new MapArchive(path);
+    if (!result->valid()) {
+	result->unref();
+	return NULL;
+    }
+    _archives[path.str()] = result;
+
+    return result;
+}
+
+void Scenery::_setBatches(const map<TextureArray *, vector<GLfloat> > &batches)
+{
+    _batches.clear();
+    _batchGeneration = TextureArray::generation();
+
+    // Each vertex has 3 coordinates and 3 texture coordinates.
+    size_t floats = 0;
+    map<TextureArray *, vector<GLfloat> >::const_iterator i;
+    for (i = batches.begin(); i != batches.end(); i++) {
+	Batch b;
+	b.array = i->first;
+	b.first = floats / 6;
+	b.count = i->second.size() / 6;
+	_batches.push_back(b);
+	floats += i->second.size();
+    }
+    if (floats == 0) {
+	return;
+    }
+
+    if (_batchVBO == 0) {
+	glGenBuffers(1, &_batchVBO);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, _batchVBO);
+    glBufferData(GL_ARRAY_BUFFER, floats * sizeof(GLfloat), NULL, 
+		 GL_DYNAMIC_DRAW);
+    size_t offset = 0;
+    for (i = batches.begin(); i != batches.end(); i++) {
+	size_t bytes = i->second.size() * sizeof(GLfloat);
+	glBufferSubData(GL_ARRAY_BUFFER, offset, bytes, &(i->second[0]));
+	offset += bytes;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Scenery::_drawBatches()
+{
+    if (_batches.empty()) {
+	return;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, _batchVBO);
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT); {
+	GLsizei stride = 6 * sizeof(GLfloat);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, stride, 0);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer(3, GL_FLOAT, stride, 
+			  (const GLvoid *)(3 * sizeof(GLfloat)));
+
+	TextureArray::begin();
+	for (size_t i = 0; i < _batches.size(); i++) {
+	    _batches[i].array->bind();
+	    glDrawArrays(GL_TRIANGLES, _batches[i].first, _batches[i].count);
+	}
+	TextureArray::end();
+    }
+    glPopClientAttrib();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 // Labels the scenery (which means just adding an elevation figure on
 // each live scenery bucket).  We assume that draw() has been called
 // previously, and don't have to worry about any _dirty business.
@@ -1004,10 +2177,7 @@ void Scenery::_label(bool live)
     // Draw elevation figures.
     const vector<Cullable *>& intersections = _frustum->intersections();
     for (unsigned int i = 0; i < intersections.size(); i++) {
-	SceneryTile *t = dynamic_cast<SceneryTile *>(intersections[i]);
-	if (!t) {
-	    continue;
-	}
+	SceneryTile *t = static_cast<SceneryTile *>(intersections[i]);
 	t->label(_metresPerPixel, live);
     }
 }
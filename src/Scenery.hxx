@@ -42,6 +42,9 @@
 
 #include <bitset>
 #include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 #if defined( __APPLE__)		// For GLubyte and GLuint
 #  include <OpenGL/gl.h>
@@ -55,9 +58,14 @@
 #include "Culler.hxx"		// Culler::FrustumSearch
 #include "Notifications.hxx"
 #include "Tiles.hxx"		// TileManager::MAX_MAP_LEVEL
+#include "WorkerPool.hxx"
 
 // Forward class declarations
 class AtlasWindow;
+class Bucket;
+class FlightData;
+class MapArchive;
+class TextureArray;
 
 // Handles loading and unloading of a single texture (ie, map).  The
 // texture doesn't know how to draw itself.
@@ -73,23 +81,90 @@ class Texture {
     static GLuint __defaultTexture;
 
   public:
-    Texture();
+    // If array is true, the texture is put in a texture array (see
+    // TextureArray) if they're supported and the image is a suitable
+    // size.  Check array() to find out if it was.
+    Texture(bool array = false);
     ~Texture();
 
     // Load the given file.  Maps can have a maximum elevation
     // embedded in them as a text comment.  If you're interested in
-    // the value, pass a pointer to a float.
-    void load(SGPath f, float *maximumElevation = NULL);
+    // the value, pass a pointer to a float.  If pool is NULL, the
+    // texture is loaded when load() returns.  Otherwise the file is
+    // decoded in the background by the pool, and load() returns right
+    // away.  In that case, loading() will be true until collect() is
+    // called and finds the decoding done, at which point it creates
+    // the texture (and sets the maximum elevation).  If shrink is
+    // greater than 0, the image is shrunk by 2^shrink in each
+    // direction (see loadJPEG()).
+    void load(SGPath f, float *maximumElevation = NULL, 
+	      WorkerPool *pool = NULL, unsigned int shrink = 0);
+    // The same, but for a JPEG or PNG image of the given length in
+    // memory.  It must stay there until the texture is loaded.
+    void load(const char *data, size_t length, 
+	      float *maximumElevation = NULL, 
+	      WorkerPool *pool = NULL, unsigned int shrink = 0);
+    bool loading() const { return _job != NULL; }
+    // True if an asynchronous load has finished decoding in the
+    // background, and is just waiting to be collected.
+    bool ready();
+    // Finishes an asynchronous load if the pool is done decoding.
+    // Must be called in the main thread.  Returns true if we're no
+    // longer loading (check loaded() to see if we succeeded).
+    bool collect();
+    // Unloads the texture, cancelling any asynchronous load.
     void unload();
-    bool loaded() const { return _name != 0; }
-    unsigned int size() { return _size; }
+    bool loaded() const { return (_name != 0) || (_array != NULL); }
+    // The size of the texture (including mipmaps) on the GPU, in
+    // bytes.  We don't keep a copy in main memory.
+    size_t gpuBytes() const { return _gpuBytes; }
 
-    // Texture name.
+    // Texture name.  This isn't valid for textures in arrays.
     GLuint name() const;
+    // The texture array and layer we're in, if we're in one, and the
+    // size of our image.
+    TextureArray *array() const { return _array; }
+    int layer() const { return _layer; }
+    int width() const { return _width; }
+    int height() const { return _height; }
+
+    // If true, we keep a copy of each map, with all its mipmaps
+    // already made, in a mip file next to it.  These load faster than
+    // JPEGs or PNGs, since there's nothing to decode and no mipmaps
+    // to generate, but take up about 10 times as much disk space.
+    // Mip files are made the first time a map is loaded, and remade
+    // if the map changes.
+    static bool mipFiles;
 
   protected:
+    // Decodes a file in the background.
+    class DecodeJob;
+
+    // Creates the texture from the given image, which may be an
+    // offset into the currently bound pixel buffer object.  If levels
+    // is greater than 1, the image is followed by that many mipmap
+    // levels (including the image), packed one after another.
+    // Otherwise we generate the mipmaps.
+    void _create(const GLvoid *data, int width, int height, int depth,
+		 int levels = 1);
+    void _submit(DecodeJob *job, WorkerPool *pool, float *maximumElevation);
+    void _finishJob();
+
+    // True if we'll go in a texture array.
+    bool _arrayed() const;
+
     GLuint _name;		// Texture name, initialized to 0.
-    unsigned int _size;		// Size, in bytes.
+    size_t _gpuBytes;
+    bool _useArray;
+    TextureArray *_array;	// Our array and layer (instead of _name).
+    int _layer;
+    int _width, _height;
+
+    // Our asynchronous load (if any), the pool doing it, and where to
+    // put the maximum elevation when it's done.
+    DecodeJob *_job;
+    WorkerPool *_pool;
+    float *_maxElevation;
 };
 
 class SceneryTile;
@@ -112,14 +187,85 @@ class Scenery {
 
     bool live() const { return _live; }
     unsigned int level() const { return _level; }
+    // The level of detail of live scenery (see Bucket::LOD_LEVELS).
+    unsigned int lod() const { return _lod; }
     Culler::FrustumSearch* frustum() const { return _frustum; }
+    // Scenery files and maps are decoded in the background by this
+    // pool.
+    WorkerPool *loader() { return &_loader; }
+    // Buckets are palettized by the main thread, with help from this
+    // pool.
+    WorkerPool *palettizer() { return &_palettizer; }
 
     // Tells us that the tile's status has changed.
     void update(Tile *t);
+    // The map archive holding the given tile's map at the given
+    // level, or NULL if there isn't one.  Archives are opened when
+    // first asked for and shared by all the chunk's tiles, which
+    // should ref() them if they keep them.
+    MapArchive *archive(Tile *t, unsigned int level);
+    // Tells us that buckets need to be palettized again.  They will
+    // be palettized by the cache, nearest first.
+    void paletteChanged() { _dirty = true; }
+    // Our eye point.
+    const sgdVec3 &eye() const { return _eye; }
+
+    // When the map is following the aircraft, scenery it's heading
+    // towards will soon be visible, so we can load it ahead of time.
+    // Tell us where the aircraft is with predict() whenever it moves,
+    // and we'll prefetch what will be visible over the next
+    // prefetchTime seconds (if it keeps going straight).  Pass NULL
+    // to stop prefetching.  A prefetch time of 0 disables it.
+    void predict(const FlightData *d);
+    void setPrefetchTime(float seconds) { _prefetchTime = seconds; }
+    // True if the bounds intersect one of the frusta on the
+    // predicted path.
+    bool predicted(const atlasSphere &bounds) const;
+
+    // How much memory (in bytes) maps and live scenery may use, in
+    // main memory (CacheObject::CPU) and on the GPU
+    // (CacheObject::GPU), and how much they're using.  A limit of 0
+    // means there's no limit.  See Cache.
+    void setMemoryLimit(CacheObject::Pool p, size_t bytes) 
+    { _cache.setLimit(p, bytes); }
+    size_t memoryLimit(CacheObject::Pool p) const { return _cache.limit(p); }
+    size_t memoryUsage(CacheObject::Pool p) const { return _cache.usage(p); }
+
+    // How long the cache works at a time, in milliseconds.  If 0, it
+    // fits its work in around drawing, in which case we need to be
+    // told how long each frame takes to draw.  See Cache.
+    void setWorkTime(unsigned int ms);
+    void frameDrawn(double ms) { _cache.frameDrawn(ms); }
+
+    // Cache statistics: how many tiles are waiting to be loaded or
+    // prefetched, and how long they've been taking.  See Cache.
+    size_t queued(CacheHeap::Type t) const { return _cache.queued(t); }
+    const CacheStats &cacheStats() const { return _cache.stats(); }
+    void printCacheStats(FILE *f, bool full = false) const
+    { _cache.printStats(f, full); }
+
+    // How well prefetching is working: the number of tiles and live
+    // buckets that have become visible, and how many of those were
+    // already loaded when they did.
+    struct Residency {
+	Residency(): tiles(0), residentTiles(0), 
+		     buckets(0), residentBuckets(0) {}
+	unsigned int tiles, residentTiles;
+	unsigned int buckets, residentBuckets;
+    };
+    const Residency &residency() const { return _residency; }
 
   protected:
     // Draws MEF labels on the scenery.
     void _label(bool live);
+    // Finds visible buckets, and chooses a level of detail for them
+    // that keeps us within Bucket::triangleBudget.
+    void _chooseLOD();
+    // Uploads the given triangles for textures in texture arrays (see
+    // MapTexture::batch()), and draws them, a batch per array.
+    void _setBatches(const std::map<TextureArray *, 
+		     std::vector<GLfloat> > &batches);
+    void _drawBatches();
 
     AtlasWindow *_aw;		// Our owning window.
     bool _dirty;		// True if the eyepoint has moved or
@@ -127,9 +273,13 @@ class Scenery {
     bool _MEFs;			// True if we need to draw MEFs.
 
     sgdVec3 _eye;		// Our eye point (used by the cache).
+    sgdMat4 _modelView;		// Our model view matrix.
+    sgdFrustum _view;		// Our viewing frustum.
     double _metresPerPixel;	// Current zoom level.
     unsigned int _level;	// Current texture level to display.
     bool _live;			// True if we need to display live scenery.
+    unsigned int _lod;		// Current level of detail of live
+				// scenery.
     TileManager *_tm;
     // Bit <n> is set if we have a texture directory for level <n>.
     const std::bitset<TileManager::MAX_MAP_LEVEL>& _levels;
@@ -141,10 +291,52 @@ class Scenery {
     // A SceneryTile object manages all the textures and live scenery
     // for a 1 degree by 1 degree (usually) chunk of the earth.
     std::map<Tile*, SceneryTile *>_tiles;
+    // Open map archives, by file name.
+    std::map<std::string, MapArchive *> _archives;
+    // Visible buckets (ie, in a visible tile and in the frustum),
+    // found by _chooseLOD().
+    std::vector<Bucket *> _buckets;
+
+    // Visible textures in texture arrays, as batches of triangles,
+    // one for each array, in _batchVBO.  They were made when the
+    // arrays were at _batchGeneration (see TextureArray::generation()).
+    struct Batch {
+	TextureArray *array;
+	GLint first;
+	GLsizei count;
+    };
+    std::vector<Batch> _batches;
+    GLuint _batchVBO;
+    unsigned int _batchGeneration;
+
+    // Prefetching.  The first _predictions frusta in _predicted are
+    // on the aircraft's predicted path, nearest first.  _heading is
+    // the aircraft's heading at the last call to predict(), if
+    // _haveHeading is true.
+    float _prefetchTime;
+    std::vector<Culler::FrustumSearch *> _predicted;
+    size_t _predictions;
+    float _heading;
+    bool _haveHeading;
+
+    // What was visible (and predicted) last time we told the cache.
+    // We use these to tell the cache what's changed, and to work out
+    // _residency.
+    std::set<SceneryTile *> _visibleTiles, _predictedTiles;
+    std::set<Bucket *> _visibleBuckets;
+    Residency _residency;
 
     // The cache is used to manage the loading of textures and buckets
     // (live scenery).
     Cache _cache;
+    // Threads for loading buckets.  Decoding a scenery file can take
+    // much longer than the cache's work period, so we do it in the
+    // background and let the cache pick up the results.
+    WorkerPool _loader;
+    // Threads for palettizing buckets.  These are kept apart from the
+    // loaders so that the main thread never waits behind a queue of
+    // scenery files.
+    WorkerPool _palettizer;
 };
 
 #endif
@@ -31,8 +31,33 @@
 // Our include file
 #include "Subbucket.hxx"
 
+// C++ system include files
+#include <algorithm>
+#include <cstring>
+
+// System include files
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef WIN32
+#  include <io.h>
+#  include <sys/utime.h>
+#else
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  include <utime.h>
+#endif
+
+// Other libraries' include files
+#include <simgear/misc/stdint.hxx>
+
 // Our project's include files
+#include "ContourShader.hxx"
+#include "MeshSimplifier.hxx"
 #include "Palette.hxx"
+#include "Rasterizer.hxx"
+#include "WorkerPool.hxx"
+#include "misc.hxx"
 
 using namespace std;
 using namespace tr1;
@@ -41,7 +66,7 @@ template <class T>
 const size_t VBO<T>::NaRS = std::numeric_limits<size_t>::max();
 
 template <class T>
-VBO<T>::VBO(): _name(0), _size(0)
+VBO<T>::VBO(): _name(0), _size(0), _keep(0), _gpuBytes(0)
 {
 }
 
@@ -53,6 +78,7 @@ VBO<T>::~VBO()
 	_name = 0;
     }
     _size = 0;
+    _gpuBytes = 0;
 }
 
 template <class T>
@@ -76,8 +102,19 @@ void VBO<T>::upload(GLenum target)
 
     glBindBuffer(target, _name);
     glBufferData(target, sizeof(T) * _size, vector<T>::data(), GL_STATIC_DRAW);
-
-    vector<T>::clear();
+    _gpuBytes = sizeof(T) * _size;
+
+    if (_keep >= _size) {
+	// Keep everything.
+    } else if (_keep > 0) {
+	// Keep the first _keep objects.  We copy them to a new vector
+	// so that we don't hold on to the excess capacity.
+	vector<T>(vector<T>::begin(), 
+		  vector<T>::begin() + _keep).swap(*this);
+    } else {
+	// Note that clear() wouldn't free anything.
+	vector<T>().swap(*this);
+    }
 }
 
 template <class T>
@@ -93,15 +130,23 @@ void VBO<T>::download(GLenum target, size_t rawSize)
 	rawSize = _size;
     }
 
-    T *ptr;
-    glBindBuffer(target, _name);
-    ptr = (T *)glMapBuffer(target, GL_READ_ONLY);
-    assert(ptr);
-    for (size_t i = 0; i < rawSize; i++) {
-	vector<T>::push_back(ptr[i]);
+    if (vector<T>::size() >= rawSize) {
+	// We kept a copy when we uploaded (see keep()), so there's no
+	// need to go to the GPU.
+	vector<T>::resize(rawSize);
+    } else {
+	vector<T>::clear();
+
+	T *ptr;
+	glBindBuffer(target, _name);
+	ptr = (T *)glMapBuffer(target, GL_READ_ONLY);
+	assert(ptr);
+	for (size_t i = 0; i < rawSize; i++) {
+	    vector<T>::push_back(ptr[i]);
+	}
+	// EYE - check return value?
+	glUnmapBuffer(target);
     }
-    // EYE - check return value?
-    glUnmapBuffer(target);
 
     // Indicate that we have been unloaded.
     _size = 0;
@@ -111,10 +156,11 @@ template <class T>
 void VBO<T>::clear(bool deleteVBO)
 {
     _size = 0;
-    vector<T>::clear();
+    vector<T>().swap(*this);
     if (deleteVBO && (_name != 0)) {
 	glDeleteBuffers(1, &_name);
 	_name = 0;
+	_gpuBytes = 0;
     }
 }
 
@@ -223,6 +269,23 @@ void ColourVBO::stage()
     enable();
 }
 
+void ElevationVBO::enable()
+{
+    AttributeVBO::enable(GL_TEXTURE_COORD_ARRAY);
+}
+
+void ElevationVBO::disable()
+{
+    AttributeVBO::disable(GL_TEXTURE_COORD_ARRAY);
+}
+
+void ElevationVBO::stage()
+{
+    AttributeVBO::stage();
+    glTexCoordPointer(1, GL_FLOAT, 0, 0);
+    enable();
+}
+
 void IndexVBO::draw(GLenum mode)
 {
     if (!uploaded()) {
@@ -264,8 +327,271 @@ void LinesVBO::push_back(GLuint i0, GLuint i1)
     vector<GLuint>::push_back(i1);
 }
 
+void TriangleListsVBO::Batch::add(const TriangleListsVBO &vbo, size_t list)
+{
+    size_t first = vbo._firsts[list];
+    GLsizei count = vbo._lasts[list] - first;
+    if (count == 0) {
+	return;
+    }
+
+    if (!_counts.empty() && (_firsts.back() + _counts.back() == first)) {
+	// This list follows on from the last one, so just extend it.
+	_counts.back() += count;
+    } else {
+	_counts.push_back(count);
+	_firsts.push_back(first);
+    }
+}
+
+void TriangleListsVBO::Batch::clear()
+{
+    _counts.clear();
+    _firsts.clear();
+}
+
+TriangleListsVBO::TriangleListsVBO(): _type(GL_UNSIGNED_INT)
+{
+}
+
+size_t TriangleListsVBO::add(const vector<GLuint> &triangles)
+{
+    _firsts.push_back(vector<GLuint>::size());
+    insert(end(), triangles.begin(), triangles.end());
+    _lasts.push_back(vector<GLuint>::size());
+
+    return _firsts.size() - 1;
+}
+
+// The size of the post-transform vertex cache we optimize for.  Real
+// caches vary, but the ordering isn't very sensitive to this.
+static const int __cacheSize = 16;
+
+// Reorders the given triangles (in place) for the vertex cache, using
+// Tipsify, from "Fast Triangle Reordering for Vertex Locality and
+// Reduced Overdraw" (Sander, Nehab, and Barczak, 2007).  It's a
+// greedy algorithm: we pick a "fanning" vertex, emit all of its
+// remaining triangles, then pick the next fanning vertex from the
+// vertices just emitted, preferring ones that will still be in the
+// cache after their remaining triangles are emitted.  It runs in
+// linear time.
+static void __reorder(GLuint *begin, GLuint *end)
+{
+    size_t size = end - begin, n = size / 3;
+    if (n == 0) {
+	return;
+    }
+
+    // Renumber the vertices from 0, in order of appearance.  The map
+    // from global to local indices is -1 for vertices we haven't
+    // seen.
+    GLuint lo = *min_element(begin, end), hi = *max_element(begin, end);
+    vector<int> local(hi - lo + 1, -1);
+    vector<GLuint> global;
+    vector<int> tris(size);
+    for (size_t i = 0; i < size; i++) {
+	int &l = local[begin[i] - lo];
+	if (l < 0) {
+	    l = global.size();
+	    global.push_back(begin[i]);
+	}
+	tris[i] = l;
+    }
+    int vertices = global.size();
+
+    // For each vertex, the triangles using it.  Vertex v's triangles
+    // are adjacent[start[v]] to adjacent[start[v + 1] - 1].  The live
+    // count is the number of those triangles not yet emitted.
+    vector<int> live(vertices, 0), start(vertices + 1, 0);
+    for (size_t i = 0; i < size; i++) {
+	live[tris[i]]++;
+    }
+    for (int v = 0; v < vertices; v++) {
+	start[v + 1] = start[v] + live[v];
+    }
+    vector<int> adjacent(size), fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < size; i++) {
+	adjacent[fill[tris[i]]++] = i / 3;
+    }
+
+    // Cache timestamps.  A vertex is in the cache if it was put there
+    // less than __cacheSize ticks ago.
+    vector<int> cacheTime(vertices, 0);
+    int time = __cacheSize + 1;
+    vector<bool> emitted(n, false);
+    vector<int> deadEnd, candidates;
+    int fanning = 0, cursor = 1;
+    GLuint *out = begin;
+    while (fanning >= 0) {
+	candidates.clear();
+	for (int i = start[fanning]; i < start[fanning + 1]; i++) {
+	    int t = adjacent[i];
+	    if (emitted[t]) {
+		continue;
+	    }
+	    for (int j = 0; j < 3; j++) {
+		int v = tris[t * 3 + j];
+		*out++ = global[v];
+		deadEnd.push_back(v);
+		candidates.push_back(v);
+		live[v]--;
+		if (time - cacheTime[v] > __cacheSize) {
+		    cacheTime[v] = time++;
+		}
+	    }
+	    emitted[t] = true;
+	}
+
+	// Pick the next fanning vertex.  First choice is the candidate
+	// that will be in the cache longest (assuming all its
+	// remaining triangles are emitted).  Failing that, a recently
+	// emitted vertex with live triangles, and failing that, the
+	// next vertex (in order of appearance) with live triangles.
+	fanning = -1;
+	int best = -1;
+	for (size_t i = 0; i < candidates.size(); i++) {
+	    int v = candidates[i];
+	    if (live[v] > 0) {
+		int p = 0;
+		if (time - cacheTime[v] + 2 * live[v] <= __cacheSize) {
+		    p = time - cacheTime[v];
+		}
+		if (p > best) {
+		    best = p;
+		    fanning = v;
+		}
+	    }
+	}
+	while ((fanning < 0) && !deadEnd.empty()) {
+	    int v = deadEnd.back();
+	    deadEnd.pop_back();
+	    if (live[v] > 0) {
+		fanning = v;
+	    }
+	}
+	for (; (fanning < 0) && (cursor < vertices); cursor++) {
+	    if (live[cursor] > 0) {
+		fanning = cursor;
+	    }
+	}
+    }
+    assert(out == end);
+}
+
+// Reordering is done in runs of at most this many triangles, which
+// can be done in parallel.  Triangles in different runs can't share
+// the cache, but with runs this long, it hardly matters.
+static const size_t __reorderRun = 8192;
+
+class __ReorderJob: public WorkerPool::Job {
+  public:
+    __ReorderJob(GLuint *begin, GLuint *end): _begin(begin), _end(end) {}
+    void run() { __reorder(_begin, _end); }
+
+  protected:
+    GLuint *_begin, *_end;
+};
+
+void TriangleListsVBO::reorder(WorkerPool *pool)
+{
+    vector<__ReorderJob *> jobs;
+    for (size_t i = 0; i < _firsts.size(); i++) {
+	size_t triangles = (_lasts[i] - _firsts[i]) / 3;
+	size_t runs = (triangles + __reorderRun - 1) / __reorderRun;
+	for (size_t j = 0; j < runs; j++) {
+	    GLuint *base = data() + _firsts[i];
+	    __ReorderJob *job = 
+		new __ReorderJob(base + triangles * j / runs * 3, 
+				 base + triangles * (j + 1) / runs * 3);
+	    jobs.push_back(job);
+	    if (pool) {
+		pool->submit(job);
+	    } else {
+		job->run();
+	    }
+	}
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+	if (pool) {
+	    pool->wait(jobs[i]);
+	}
+	delete jobs[i];
+    }
+}
+
+size_t TriangleListsVBO::indexSize() const
+{
+    return (_type == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+}
+
+void TriangleListsVBO::upload()
+{
+    _size = vector<GLuint>::size();
+    if (_size == 0) {
+	return;
+    }
+
+    if (_name == 0) {
+	glGenBuffers(1, &_name);
+    }
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _name);
+    if (*max_element(begin(), end()) <= numeric_limits<GLushort>::max()) {
+	vector<GLushort> shorts(begin(), end());
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * _size, 
+		     shorts.data(), GL_STATIC_DRAW);
+	_type = GL_UNSIGNED_SHORT;
+    } else {
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * _size, 
+		     data(), GL_STATIC_DRAW);
+	_type = GL_UNSIGNED_INT;
+    }
+    _gpuBytes = indexSize() * _size;
+
+    // We never keep anything.
+    vector<GLuint>().swap(*this);
+}
+
+void TriangleListsVBO::draw(const Batch &b)
+{
+    if (b.empty()) {
+	return;
+    }
+    if (!uploaded()) {
+	if (size() == 0) {
+	    return;
+	}
+	upload();
+    }
+
+    _offsets.resize(b._firsts.size());
+    for (size_t i = 0; i < b._firsts.size(); i++) {
+	_offsets[i] = (const GLvoid *)(b._firsts[i] * indexSize());
+    }
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _name);
+    glMultiDrawElements(GL_TRIANGLES, &b._counts[0], _type, &_offsets[0], 
+			b._counts.size());
+}
+
+void TriangleListsVBO::clear(bool deleteVBO)
+{
+    VBO<GLuint>::clear(deleteVBO);
+    _firsts.clear();
+    _lasts.clear();
+}
+
+size_t TriangleListsVBO::cpuBytes() const
+{
+    return VBO<GLuint>::cpuBytes() + 
+	(_firsts.capacity() + _lasts.capacity()) * sizeof(size_t) +
+	_offsets.capacity() * sizeof(const GLvoid *);
+}
+
 Subbucket::Subbucket(const SGPath &p): 
-    _path(p), _loaded(false), _palettized(false), _rawSize(0), _bytes(0)
+    _path(p), _loaded(false), _level(0), _palettizedLevel(0),
+    _palettized(false), _shaded(false), _rawSize(0), _cpuBytes(0), 
+    _gpuBytes(0), _measuredMode(-1), _scratchBytes(0)
 {
 }
 
@@ -280,8 +606,19 @@ bool Subbucket::load(Bucket::Projection projection)
     _normals.clear();
     _elevations.clear();
     _triangles.clear();
+    _lods.clear();
     _loaded = false;
     _palettized = false;
+    _scratchBytes = 0;
+
+    // If we've loaded this file before, the results may be in the
+    // cache, in which case we can skip all the hard work below.
+    if (_readCache(projection)) {
+	_calcSize();
+	_loaded = true;
+
+	return true;
+    }
 
     // A BTG file contains a bunch of points in 3D cartesian space,
     // where the origin is at the centre of the earth, the X axis goes
@@ -302,51 +639,51 @@ bool Subbucket::load(Bucket::Projection projection)
     // gbs_center to get a true world cartesian coordinate.  We ignore
     // the colors and texcoords vectors.
     //
-    // Triangles, strips, and fans are accessed with get_<foo>_v and
-    // get_<foo>_n (where <foo> is "tris", "strips", or "fans").  Note
-    // that these return a VECTOR OF VECTORS OF INDICES.
-    //
-    // So, get_fans_v()[i] returns the vertex indices for the ith
-    // triangle fan, and get_fans_n()[i] does the same for its normals
-    // (get_tris_v()[i] returns vertex indices for 1 or more
-    // triangles).
-    //
-    // To save typing, we'll write get_<foo>_v()[i][j] (the jth vertex
-    // index of the ith triangle thingy) as v[i][j].
+    // We read the file with read_bin_flat(), which returns
+    // triangles, strips, and fans via get_tris(), get_strips(), and
+    // get_fans().  Each returns an SGBinObjectIndices object with two
+    // parallel lists of vertex and normal indices (v and n) for ALL
+    // the triangles (or strips, or fans) in the file, and a list of
+    // spans, one per triangle thingy, saying where in v and n it
+    // lives and what its material is (an index into
+    // get_materials()).
     //
-    // Remember, v[i][j] is a vertex INDEX.  The actual vertex is
-    // wgs84_nodes[v[i][j]].
+    // Remember, v[j] is a vertex INDEX.  The actual vertex is
+    // wgs84_nodes[v[j]].
     //
     // And normals?  Although this is not documented as far as I can
     // tell, there seem to be two situations in BTG files:
     //
-    // (a) v[i].size() == n[i].size()
+    // (a) Separate normal indices are given.
     //
     //     If so, then:
     //
-    //     wgs84_nodes[v[i][j]] and normals[n[i][j]] are the actual
-    //     vertex and normal
+    //     wgs84_nodes[v[j]] and normals[n[j]] are the actual vertex
+    //     and normal
     //
     //     and
     //
-    //     v[i][j] != n[i][j] (generally, although they may
-    //     coincidentally be the same).
+    //     v[j] != n[j] (generally, although they may coincidentally
+    //     be the same).
     //
     // OR
     //
-    // (b) n[i].size() == 0
+    // (b) No normal indices are given.
     //
     //     If so, then:
     //
-    //     wgs84_nodes[v[i][j]] and normals[v[i][j]] are the actual
-    //     vertex and normal
+    //     wgs84_nodes[v[j]] and normals[v[j]] are the actual vertex
+    //     and normal
+    //
+    //     read_bin_flat() takes care of this case by copying v to n,
+    //     so we can always use n.
     //
     // Some documentation on the BTG file format can be found at:
     //
     // http://wiki.flightgear.org/index.php/BTG_File_Format
 
     SGBinObject btg;
-    if (!btg.read_bin(_path)) {
+    if (!btg.read_bin_flat(_path)) {
 	// EYE - throw an error?
 	// EYE - will the cache continue to call load() then?
 	return false;
@@ -377,16 +714,20 @@ bool Subbucket::load(Bucket::Projection projection)
     // <vertex, normal> pairs to unique indices.  
     //
     // Also, since vertex and normal indexes are the same, we no
-    // longer need the BTG file's separate vertex and normal indices
-    // (ie, tris_v and tris_n, strips_v and strips_n, and fans_v and
-    // fans_n).  Instead, we replace them with our own tris, strips,
-    // and fans variables, which use the unique indices created in
-    // vnMap.
-    VNMap vnMap;
-    group_list tris, strips, fans;
-    _massageIndices(btg.get_tris_v(), btg.get_tris_n(), vnMap, tris);
-    _massageIndices(btg.get_strips_v(), btg.get_strips_n(), vnMap, strips);
-    _massageIndices(btg.get_fans_v(), btg.get_fans_n(), vnMap, fans);
+    // longer need the BTG file's separate vertex and normal indices.
+    // Instead, we replace them with our own tris, strips, and fans
+    // lists, which use the unique indices created in vnMap (and
+    // which are parallel to the BTG's lists, so the spans still
+    // apply).
+    //
+    // Most vertices have a single normal, so the number of unique
+    // pairs is usually close to the number of vertices.
+    VNMap vnMap(btg.get_wgs84_nodes().size());
+    int_list tris, strips, fans;
+    _massageIndices(btg.get_tris(), vnMap, tris);
+    _massageIndices(btg.get_strips(), vnMap, strips);
+    _massageIndices(btg.get_fans(), vnMap, fans);
+    _scratchBytes = vnMap.bytes();
 
     // The BTG file's tris_v, tris_n, strips_v, ... lists just contain
     // indices - the real data is in the wgs84_nodes (ie, vertices)
@@ -404,14 +745,18 @@ bool Subbucket::load(Bucket::Projection projection)
     const vector<SGVec3<double> > &wgs84_nodes = btg.get_wgs84_nodes();
     const SGVec3<double> &gbs_p = btg.get_gbs_center();
     const vector<SGVec3<float> >& m_norms = btg.get_normals();
-    _maxElevation = -numeric_limits<double>::max();
-    for (VNMap::const_iterator i = vnMap.begin(); i != vnMap.end(); i++) {
-	// vn gives the <vertex, normal> pair in the BTG file; index
-	// is our new index.
-	pair<int, int> vn = i->first;
-	int index = i->second;
-	int v = vn.first;
-	int n = vn.second;
+
+    // Converting from cartesian to geodetic coordinates is the most
+    // expensive thing we do per vertex, so we do it in one batch (see
+    // SGGeodesy::SGCartToGeod()), which wants x, y, and z in separate
+    // arrays, indexed by our new indices.
+    size_t count = vnMap.size();
+    vector<double> xs(count), ys(count), zs(count);
+    for (size_t index = 0; index < count; index++) {
+	// v and n give the <vertex, normal> pair in the BTG file;
+	// index is our new index.
+	int v = vnMap.vertex(index);
+	int n = vnMap.normal(index);
 
 	// Each BTG file has a reference point, given by
 	// get_gbs_center().  All vertices within the BTG file are
@@ -424,47 +769,54 @@ bool Subbucket::load(Bucket::Projection projection)
      	// that is true) - strange that it would serve them up as
      	// doubles.
 	SGVec3<double> node = wgs84_nodes[v] + gbs_p;
+	xs[index] = node[0];
+	ys[index] = node[1];
+	zs[index] = node[2];
 
-	// Calculate lat, lon, and elevation.
-	SGGeod geod = SGGeod::fromCart(node);
+	// Note that the _vertices and _normals arrays contain <x, y,
+	// z> triples - the ith vertex is at _vertices[i * 3],
+	// _vertices[i * 3 + 1], and _vertices[i * 3 + 2] (ditto for
+	// the ith normal).
+	const SGVec3<float>& normals = m_norms[n];
+	_normals[index * 3] = normals[0];
+	_normals[index * 3 + 1] = normals[1];
+	_normals[index * 3 + 2] = normals[2];
+    }
 
+    // Calculate lat, lon, and elevation.
+    vector<double> lons(count), lats(count), elevs(count);
+    SGGeodesy::SGCartToGeod(count, xs.data(), ys.data(), zs.data(),
+			    lons.data(), lats.data(), elevs.data());
+
+    _maxElevation = -numeric_limits<double>::max();
+    for (size_t i = 0; i < count; i++) {
     	// Save our elevation.  This value is used to do elevation
     	// colouring, as well as calculate our maximum elevation
     	// figure.
-	double e = geod.getElevationM();
-	_elevations[index] = e;
+	double e = elevs[i];
+	_elevations[i] = e;
 	if (e > _maxElevation) {
 	    _maxElevation = e;
 	}
 
-	// Note that the _vertices and _normals arrays contain <x, y,
-	// z> triples - the ith vertex is at _vertices[i * 3],
-	// _vertices[i * 3 + 1], and _vertices[i * 3 + 2] (ditto for
-	// the ith normal).
-	index *= 3;
-
     	// Now convert the point using the given projection.
+	size_t index = i * 3;
 	if (projection == Bucket::CARTESIAN) {
 	    // This is a true 3D rendering.
 	    // EYE - we go from doubles back to floats.  Wise?
-	    _vertices[index] = node[0];
-	    _vertices[index + 1] = node[1];
-	    _vertices[index + 2] = node[2];
+	    _vertices[index] = xs[i];
+	    _vertices[index + 1] = ys[i];
+	    _vertices[index + 2] = zs[i];
 	} else if (projection == Bucket::RECTANGULAR) {
     	    // This is a flat projection.  X and Y are determined by
     	    // longitude and latitude, respectively.  We don't care
     	    // about Z, so set it to 0.0.  The colour will be
     	    // determined separately, and the shading will be
     	    // determined by the vertex normals.
-	    _vertices[index] = geod.getLongitudeDeg();
-	    _vertices[index + 1] = geod.getLatitudeDeg();
+	    _vertices[index] = lons[i] * SGD_RADIANS_TO_DEGREES;
+	    _vertices[index + 1] = lats[i] * SGD_RADIANS_TO_DEGREES;
 	    _vertices[index + 2] = 0.0;
 	}
-
-	const SGVec3<float>& normals = m_norms[n];
-	_normals[index] = normals[0];
-	_normals[index + 1] = normals[1];
-	_normals[index + 2] = normals[2];
     }
     _maxElevation *= SG_METER_TO_FEET;
     
@@ -474,8 +826,11 @@ bool Subbucket::load(Bucket::Projection projection)
     // _triangles["water"]).  
     //
     // Note that the BTG file doesn't use a C++ map as we do - it uses
-    // parallel lists instead.  So, for example, if tri_materials[i]
-    // is "water", then tris_v[i] contains all the water vertices.
+    // spans, each with a material index.  So, for example, if
+    // get_materials()[span.material] is "water", then the indices
+    // from span.offset to span.offset + span.count - 1 are all water
+    // vertices.  We look up each material's triangle list once, up
+    // front.
     //
     // Note as well that we check if any two vertices of a triangle
     // are the same.  If they are, we throw out the triangle, since it
@@ -485,13 +840,19 @@ bool Subbucket::load(Bucket::Projection projection)
     // don't seem to be limited to any particular kind of feature
     // (water, railroad, etc).  They also occur in Scenery 1.0, but
     // very rarely, and only in airports.
+    const string_list &materials = btg.get_materials();
+    vector<TrianglesVBO *> matTris(materials.size());
+    for (size_t i = 0; i < materials.size(); i++) {
+	matTris[i] = &_triangles[materials[i]];
+    }
 
     // Triangles
-    const string_list &tri_materials = btg.get_tri_materials();
-    for (size_t i = 0; i < btg.get_tris_v().size(); i++) {
-    	const int_list &oldTris = tris[i];
-    	TrianglesVBO &newTris = _triangles[tri_materials[i]];
-    	for (size_t j = 0; j < oldTris.size(); j += 3) {
+    const vector<SGBinObjectSpan> &triSpans = btg.get_tris().spans;
+    for (size_t i = 0; i < triSpans.size(); i++) {
+	const int *oldTris = &tris[triSpans[i].offset];
+	unsigned int count = triSpans[i].count;
+    	TrianglesVBO &newTris = *matTris[triSpans[i].material];
+    	for (size_t j = 0; j + 2 < count; j += 3) {
     	    int i0 = oldTris[j], i1 = oldTris[j + 1], i2 = oldTris[j + 2];
 	    // Check for zero-area triangle.
     	    if ((i0 == i1) || (i1 == i2) || (i2 == i0)) {
@@ -501,11 +862,12 @@ bool Subbucket::load(Bucket::Projection projection)
     	}
     }
     // Strips
-    const string_list &strip_materials = btg.get_strip_materials();
-    for (size_t i = 0; i < btg.get_strips_v().size(); i++) {
-    	const int_list &oldStrips = strips[i];
-    	TrianglesVBO &newTris = _triangles[strip_materials[i]];
-    	for (size_t j = 0; j < oldStrips.size() - 2; j++) {
+    const vector<SGBinObjectSpan> &stripSpans = btg.get_strips().spans;
+    for (size_t i = 0; i < stripSpans.size(); i++) {
+	const int *oldStrips = &strips[stripSpans[i].offset];
+	unsigned int count = stripSpans[i].count;
+    	TrianglesVBO &newTris = *matTris[stripSpans[i].material];
+    	for (size_t j = 0; j + 2 < count; j++) {
     	    int i0 = oldStrips[j], i1 = oldStrips[j + 1], i2 = oldStrips[j + 2];
 	    // Check for zero-area triangle.
     	    if ((i0 == i1) || (i1 == i2) || (i2 == i0)) {
@@ -519,12 +881,13 @@ bool Subbucket::load(Bucket::Projection projection)
     	}
     }
     // Fans
-    const string_list &fan_materials = btg.get_fan_materials();
-    for (size_t i = 0; i < btg.get_fans_v().size(); i++) {
-    	const int_list &oldFans = fans[i];
-    	TrianglesVBO &newTris = _triangles[fan_materials[i]];
+    const vector<SGBinObjectSpan> &fanSpans = btg.get_fans().spans;
+    for (size_t i = 0; i < fanSpans.size(); i++) {
+	const int *oldFans = &fans[fanSpans[i].offset];
+	unsigned int count = fanSpans[i].count;
+    	TrianglesVBO &newTris = *matTris[fanSpans[i].material];
     	int i0 = oldFans[0];
-    	for (size_t j = 1; j < oldFans.size() - 1; j++) {
+    	for (size_t j = 1; j + 1 < count; j++) {
     	    int i1 = oldFans[j], i2 = oldFans[j + 1];
 	    // Check for zero-area triangle.
     	    if ((i0 == i1) || (i1 == i2) || (i2 == i0)) {
@@ -533,34 +896,472 @@ bool Subbucket::load(Bucket::Projection projection)
     	    newTris.push_back(i0, i1, i2);
     	}
     }
+
+    // Create the simplified levels of detail, if wanted (note that
+    // _levelTriangles() gives level 0 if we don't have the level
+    // asked for).  The simplifier wants positions in metres, which
+    // we get by flattening latitude and longitude around our first
+    // vertex (subbuckets are small enough that this is plenty
+    // accurate).  All of our vertices made from the same BTG vertex
+    // are at the same place, so it's the BTG vertices that it deals
+    // with.
+    if (Bucket::levelsOfDetail) {
+	vector<int> nodes(count);
+	vector<double> positions(wgs84_nodes.size() * 3);
+	double scale = cos(lats[0]) * SGGeodesy::EQURAD;
+	for (size_t i = 0; i < count; i++) {
+	    int node = vnMap.vertex(i);
+	    nodes[i] = node;
+	    positions[node * 3] = (lons[i] - lons[0]) * scale;
+	    positions[node * 3 + 1] = (lats[i] - lats[0]) * SGGeodesy::EQURAD;
+	    positions[node * 3 + 2] = elevs[i];
+	}
+	_simplify(positions, nodes);
+    }
     
+    _calcSize();
+    _loaded = true;
+
+    // Save our hard work for next time.
+    _writeCache(projection);
+
+    return true;
+}
+
+void Subbucket::_simplify(const vector<double> &positions,
+			  const vector<int> &nodes)
+{
+    MeshSimplifier simplifier(positions, nodes, _normals);
+    map<string, TrianglesVBO>::const_iterator i;
+    for (i = _triangles.begin(); i != _triangles.end(); i++) {
+	simplifier.add(i->second);
+    }
+
+    // Each level continues where the last one left off.
+    _lods.resize(Bucket::LOD_LEVELS - 1);
+    for (unsigned int level = 1; level < Bucket::LOD_LEVELS; level++) {
+	simplifier.simplify(Bucket::lodError(level));
+	map<string, TrianglesVBO> &lod = _lods[level - 1];
+	size_t l = 0;
+	for (i = _triangles.begin(); i != _triangles.end(); i++, l++) {
+	    simplifier.list(l, lod[i->first]);
+	}
+    }
+}
+
+void Subbucket::_calcSize()
+{
     // Record the "base" size - the number of raw vertices.
     _rawSize = _vertices.size() / 3;
+
+    // When the palette changes, we need the raw vertices, normals,
+    // and triangles again.  Rather than downloading them from the GPU
+    // (which stalls the pipeline), we keep a copy of them when they
+    // get uploaded.  Elevations are only uploaded when we're shaded,
+    // and we need all of them to chop.
+    _vertices.keep(_rawSize * 3);
+    _normals.keep(_rawSize * 3);
+    _elevations.keep();
+    // Ditto for the triangles of each level of detail.
+    _triangleCounts.assign(Bucket::LOD_LEVELS, 0);
+    for (unsigned int level = 0; level < Bucket::LOD_LEVELS; level++) {
+	map<string, TrianglesVBO> &tris = _levelTriangles(level);
+	map<string, TrianglesVBO>::iterator i;
+	for (i = tris.begin(); i != tris.end(); i++) {
+	    i->second.keep();
+	    _triangleCounts[level] += i->second.size() / 3;
+	}
+    }
+
+    _calcBytes();
+}
+
+void Subbucket::_calcBytes()
+{
+    _cpuBytes = _vertices.cpuBytes() + _normals.cpuBytes() + 
+	_elevations.cpuBytes() + _colours.cpuBytes() + 
+	_contourLines.cpuBytes() + _indices.cpuBytes() +
+	_elevationIndices.capacity() * sizeof(int);
+    _gpuBytes = _vertices.gpuBytes() + _normals.gpuBytes() + 
+	_elevations.gpuBytes() + _colours.gpuBytes() + 
+	_contourLines.gpuBytes() + _indices.gpuBytes();
+
+    // Triangles, at all levels of detail.  They're only uploaded if
+    // we draw polygon edges.
+    for (unsigned int level = 0; level <= _lods.size(); level++) {
+	map<string, TrianglesVBO> &tris = _levelTriangles(level);
+	map<string, TrianglesVBO>::const_iterator i;
+	for (i = tris.begin(); i != tris.end(); i++) {
+	    _cpuBytes += i->second.cpuBytes();
+	    _gpuBytes += i->second.gpuBytes();
+	}
+    }
+    for (size_t i = 0; i < _contours.size(); i++) {
+	_cpuBytes += _contours[i].cpuBytes();
+	_gpuBytes += _contours[i].gpuBytes();
+    }
+
+    _measuredMode = -1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Compiled scenery cache
+//////////////////////////////////////////////////////////////////////
+
+// A cache file is a flat image of a loaded subbucket, laid out so that
+// it can be mapped into memory and used more or less as is.  All
+// values are little-endian, and every item is aligned on a 4-byte
+// boundary (8 bytes for the header).  It looks like this:
+//
+//   __CacheHeader
+//   scenery file path (pathLength bytes, padded to a multiple of 4)
+//   vertices (vertices * 3 floats)
+//   normals (vertices * 3 floats)
+//   elevations (vertices floats)
+//   materials, each one being:
+//     name length (uint32_t)
+//     index count (uint32_t)
+//     name (padded to a multiple of 4)
+//     triangle indices (index count uint32_t)
+//   for each level of detail after 0, for each material (in the
+//   same order as above):
+//     index count (uint32_t)
+//     triangle indices (index count uint32_t)
+//
+// The path is there in case of hash collisions.
+struct __CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t projection;
+    int64_t mtime;		// Scenery file modification time
+    int64_t size;		// and size.
+    double maxElevation;	// In feet.
+    uint32_t vertices;
+    uint32_t materials;
+    uint32_t pathLength;
+    uint32_t levels;		// Levels of detail, including level 0.
+};
+static const char __cacheMagic[8] = {'A', 'T', 'L', 'A', 'S', 'S', 'B', 'C'};
+// Bump this whenever load() changes what it produces.
+static const uint32_t __cacheVersion = 2;
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Rounds n up to a multiple of 4.
+static size_t __pad4(size_t n)
+{
+    return (n + 3) & ~(size_t)3;
+}
+
+// True if the given triangles (count indices) only refer to vertices
+// 0 to n - 1.
+static bool __validTriangles(const GLuint *is, size_t count, size_t n)
+{
+    if (count % 3 != 0) {
+	return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+	if (is[i] >= n) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+// A read-only memory-mapped file.  If the file can't be mapped (or
+// we're on Windows, where we don't bother), we read it into memory
+// instead.
+class __MappedFile {
+  public:
+    __MappedFile(const char *path): _data(NULL), _size(0), _mapped(false)
+    {
+	int fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+	    return;
+	}
+	struct stat st;
+	if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+	    _size = st.st_size;
+#ifndef WIN32
+	    void *p = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+	    if (p != MAP_FAILED) {
+		_data = (const char *)p;
+		_mapped = true;
+	    }
+#endif
+	    if (!_mapped) {
+		char *buf = new char[_size];
+		if (read(fd, buf, _size) == (ssize_t)_size) {
+		    _data = buf;
+		} else {
+		    delete []buf;
+		}
+	    }
+	}
+	close(fd);
+    }
+    ~__MappedFile()
+    {
+#ifndef WIN32
+	if (_mapped) {
+	    munmap((void *)_data, _size);
+	    return;
+	}
+#endif
+	delete []_data;
+    }
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+
+  protected:
+    const char *_data;
+    size_t _size;
+    bool _mapped;
+};
+
+// Returns the name of our cache file, or a null path if there's no
+// cache.  The name is a hash of our scenery file path, plus a letter
+// for the projection.
+SGPath Subbucket::_cacheFile(Bucket::Projection projection) const
+{
+    // EYE - we only write little-endian files, and can't be bothered
+    // to swap bytes on the rare big-endian machine.
+    if (Bucket::cacheDir.isNull() || sgIsBigEndian()) {
+	return SGPath();
+    }
+
+    // 64-bit FNV-1a hash.
+    unsigned long long hash = 14695981039346656037ULL;
+    const string &p = _path.str();
+    for (size_t i = 0; i < p.size(); i++) {
+	hash ^= (unsigned char)p[i];
+	hash *= 1099511628211ULL;
+    }
+
+    AtlasString name;
+    name.printf("%016llx-%c.sbc", hash, 
+		(projection == Bucket::CARTESIAN) ? 'c' : 'r');
+    SGPath result(Bucket::cacheDir);
+    result.append(name.str());
+
+    return result;
+}
+
+// Tries to load ourselves from the cache.  Returns true if
+// successful.  This is safe to call in a worker thread.
+bool Subbucket::_readCache(Bucket::Projection projection)
+{
+    SGPath cache = _cacheFile(projection);
+    if (cache.isNull() || !cache.exists()) {
+	return false;
+    }
+
+    if (_parseCache(cache, projection)) {
+	// Touch the file, so that Bucket::pruneCache() knows it's
+	// still wanted.
+	utime(cache.c_str(), NULL);
+	return true;
+    }
+
+    // The cache file is out of date (our scenery file has changed or
+    // disappeared), or damaged.  Either way it's useless, so get rid
+    // of it.  If we're loaded successfully, we'll write a new one.
+    unlink(cache.c_str());
+    return false;
+}
+
+// Loads ourselves from the given cache file, if it's valid.
+bool Subbucket::_parseCache(const SGPath &cache, 
+			    Bucket::Projection projection)
+{
+    // Our scenery file must not have changed since the cache file
+    // was created.
+    struct stat st;
+    if (stat(_path.c_str(), &st) != 0) {
+	return false;
+    }
+
+    __MappedFile f(cache.c_str());
+    const char *data = f.data(), *end = data + f.size();
+    if ((data == NULL) || (f.size() < sizeof(__CacheHeader))) {
+	return false;
+    }
+    const __CacheHeader *h = (const __CacheHeader *)data;
+    const string &path = _path.str();
+    if ((memcmp(h->magic, __cacheMagic, sizeof(__cacheMagic)) != 0) ||
+	(h->version != __cacheVersion) ||
+	(h->projection != (uint32_t)projection) ||
+	(h->mtime != (int64_t)st.st_mtime) ||
+	(h->size != (int64_t)st.st_size) ||
+	(h->pathLength != path.size()) ||
+	(h->levels != (Bucket::levelsOfDetail ? Bucket::LOD_LEVELS : 1))) {
+	return false;
+    }
+    data += sizeof(__CacheHeader);
     
-    // Calculate our loaded size.  Note that this ignores the extra
-    // stuff created when we contour chop, so is merely an
-    // approximation.  First, vertices and normals.
-    _bytes = _rawSize * sizeof(sgVec3) * 2;
+    // Check that it really is our file, and that it isn't truncated.
+    // Everything after this is paranoid about running off the end,
+    // and about triangles referring to vertices we don't have, since
+    // the file could be damaged.
+    if (((size_t)(end - data) < __pad4(h->pathLength)) ||
+	(memcmp(data, path.data(), path.size()) != 0)) {
+	return false;
+    }
+    data += __pad4(h->pathLength);
 
-    // Elevations.
-    _bytes += _rawSize * sizeof(float);
+    size_t n = h->vertices;
+    if ((size_t)(end - data) < n * 7 * sizeof(float)) {
+	return false;
+    }
+    const float *fs = (const float *)data;
+    _vertices.assign(fs, fs + n * 3);
+    fs += n * 3;
+    _normals.assign(fs, fs + n * 3);
+    fs += n * 3;
+    _elevations.assign(fs, fs + n);
+    data += n * 7 * sizeof(float);
+
+    bool ok = true;
+    vector<string> materials;
+    for (uint32_t i = 0; i < h->materials; i++) {
+	if ((size_t)(end - data) < sizeof(uint32_t) * 2) {
+	    break;
+	}
+	const uint32_t *counts = (const uint32_t *)data;
+	uint32_t nameLength = counts[0], indices = counts[1];
+	data += sizeof(uint32_t) * 2;
+	if (((size_t)(end - data) < __pad4(nameLength)) ||
+	    ((size_t)(end - data - __pad4(nameLength)) < 
+	     indices * sizeof(uint32_t))) {
+	    break;
+	}
+	string material(data, nameLength);
+	data += __pad4(nameLength);
 
-    // Triangles (we ignore the string keys).
-    map<string, TrianglesVBO>::const_iterator i;
-    for (i = _triangles.begin(); i != _triangles.end(); i++) {
-	const TrianglesVBO &tris = i->second;
-	_bytes += tris.size() * sizeof(GLuint);
+	const GLuint *is = (const GLuint *)data;
+	if (!__validTriangles(is, indices, n)) {
+	    ok = false;
+	    break;
+	}
+	_triangles[material].assign(is, is + indices);
+	data += indices * sizeof(uint32_t);
+	materials.push_back(material);
+    }
+
+    _lods.resize(h->levels - 1);
+    for (size_t i = 0; i < _lods.size() * materials.size(); i++) {
+	if ((size_t)(end - data) < sizeof(uint32_t)) {
+	    break;
+	}
+	uint32_t indices = *(const uint32_t *)data;
+	data += sizeof(uint32_t);
+	if ((size_t)(end - data) < indices * sizeof(uint32_t)) {
+	    break;
+	}
+	const GLuint *is = (const GLuint *)data;
+	if (!__validTriangles(is, indices, n)) {
+	    ok = false;
+	    break;
+	}
+	_lods[i / materials.size()][materials[i % materials.size()]].
+	    assign(is, is + indices);
+	data += indices * sizeof(uint32_t);
     }
 
-    // Elevation indices and colours.
-    _bytes += _rawSize * sizeof(int);
-    _bytes += _rawSize * sizeof(float) * 4;
+    if (!ok || (data != end) || (materials.size() != h->materials)) {
+	// Something's wrong.  Clean up after ourselves.
+	_vertices.clear();
+	_normals.clear();
+	_elevations.clear();
+	_triangles.clear();
+	_lods.clear();
 
-    _loaded = true;
+	return false;
+    }
+
+    _maxElevation = h->maxElevation;
 
     return true;
 }
 
+// Saves our freshly loaded data to the cache.  This is safe to call
+// in a worker thread.  If something goes wrong, we just don't create
+// a cache file.
+void Subbucket::_writeCache(Bucket::Projection projection)
+{
+    SGPath cache = _cacheFile(projection);
+    if (cache.isNull()) {
+	return;
+    }
+
+    struct stat st;
+    if (stat(_path.c_str(), &st) != 0) {
+	return;
+    }
+
+    __CacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, __cacheMagic, sizeof(__cacheMagic));
+    h.version = __cacheVersion;
+    h.projection = projection;
+    h.mtime = st.st_mtime;
+    h.size = st.st_size;
+    h.maxElevation = _maxElevation;
+    h.vertices = _elevations.size();
+    h.materials = _triangles.size();
+    h.pathLength = _path.str().size();
+    h.levels = _lods.size() + 1;
+
+    // Nobody (including another copy of Atlas) must ever see a
+    // partially written file.
+    AtomicFile out(cache.c_str());
+    FILE *f = out.fp();
+    if (f == NULL) {
+	return;
+    }
+
+    static const char zeroes[4] = {0, 0, 0, 0};
+    const string &path = _path.str();
+    bool ok = true;
+    ok = ok && (fwrite(&h, sizeof(h), 1, f) == 1);
+    ok = ok && (fwrite(path.data(), 1, path.size(), f) == path.size());
+    ok = ok && (fwrite(zeroes, 1, __pad4(path.size()) - path.size(), f) == 
+		__pad4(path.size()) - path.size());
+    ok = ok && (fwrite(_vertices.data(), sizeof(GLfloat), _vertices.size(), f) 
+		== _vertices.size());
+    ok = ok && (fwrite(_normals.data(), sizeof(GLfloat), _normals.size(), f) 
+		== _normals.size());
+    ok = ok && (fwrite(_elevations.data(), sizeof(float), 
+		       _elevations.size(), f) == _elevations.size());
+    map<string, TrianglesVBO>::const_iterator i;
+    for (i = _triangles.begin(); ok && (i != _triangles.end()); i++) {
+	const string &material = i->first;
+	const TrianglesVBO &tris = i->second;
+	uint32_t counts[2] = {(uint32_t)material.size(), (uint32_t)tris.size()};
+	size_t padding = __pad4(material.size()) - material.size();
+	ok = ok && (fwrite(counts, sizeof(uint32_t), 2, f) == 2);
+	ok = ok && (fwrite(material.data(), 1, material.size(), f) == 
+		    material.size());
+	ok = ok && (fwrite(zeroes, 1, padding, f) == padding);
+	ok = ok && (fwrite(tris.data(), sizeof(GLuint), tris.size(), f) ==
+		    tris.size());
+    }
+    for (size_t level = 0; ok && (level < _lods.size()); level++) {
+	for (i = _lods[level].begin(); ok && (i != _lods[level].end()); i++) {
+	    const TrianglesVBO &tris = i->second;
+	    uint32_t count = tris.size();
+	    ok = ok && (fwrite(&count, sizeof(uint32_t), 1, f) == 1);
+	    ok = ok && (fwrite(tris.data(), sizeof(GLuint), tris.size(), f) ==
+			tris.size());
+	}
+    }
+    out.commit(ok);
+}
+
 void Subbucket::unload()
 {
     if (!_loaded) {
@@ -578,11 +1379,12 @@ void Subbucket::unload()
     // destructors).
     _vertices.clear(true);
     _normals.clear(true);
-    _elevations.clear();
+    _elevations.clear(true);
 
     _triangles.clear();
+    _lods.clear();
 
-    _elevationIndices.clear();
+    vector<int>().swap(_elevationIndices);
     _colours.clear(true);
 
     _materials.clear();
@@ -590,8 +1392,16 @@ void Subbucket::unload()
     _contours.clear();
     _contourLines.clear(true);
 
+    _indices.clear(true);
+    _materialBatches.clear();
+    _contourBatches.clear();
+    _allContours.clear();
+
     _palettized = false;
+    _shaded = false;
     _loaded = false;
+
+    _calcBytes();
 }
 
 void Subbucket::paletteChanged() 
@@ -600,33 +1410,43 @@ void Subbucket::paletteChanged()
 	return;
     }
 
+    // If we're shaded, the palette lives in the shader, and our data
+    // hasn't been touched, so there's nothing to undo.
+    if (_shaded) {
+	_palettized = false;
+	return;
+    }
+
     // If we've palettized the scenery, then we'll have a bunch of
-    // vertex buffer objects that need to be deleted.  But some of
+    // vertex buffer objects that need to be replaced.  But some of
     // this data (_vertices, _normals and _triangles) we'll need when
-    // we process the new palette, so we need to grab it back from the
-    // GPU before we delete it.
+    // we process the new palette.  We kept copies of the raw data
+    // when it was uploaded (see _calcSize()), so we don't need to go
+    // to the GPU to get it.
 
     // Get the vertices, ignoring the extra ones creating by contour
-    // chopping.
+    // chopping.  This trims the copy, and marks the VBO as needing
+    // to be uploaded again.  If we haven't been drawn since being
+    // palettized, nothing's been uploaded, and download() leaves the
+    // vector alone, so we trim it ourselves.
     _vertices.download(_rawSize * 3);
+    _vertices.resize(_rawSize * 3);
 
     // Normals.
     _normals.download(_rawSize * 3);
+    _normals.resize(_rawSize * 3);
 
-    // Triangles.
-    for (map<string, TrianglesVBO>::iterator i = _triangles.begin(); 
-	 i != _triangles.end();
-	 i++) {
-	TrianglesVBO &indices = i->second;
-	indices.download();
-    }
+    // Triangles aren't changed by palettizing, so we can leave them
+    // on the GPU, and just use the copies.
 
     // Resize the elevations vector to match the restored vertices and
-    // normals vectors.
+    // normals vectors.  If the raw elevations are on the GPU (from an
+    // earlier shaded palettization), they're still good.
     _elevations.resize(_rawSize);
 
     // We are now officially de-palettized.
     _palettized = false;
+    _calcBytes();
 }
 
 // This is a helper routine for the load() method.  For each unique
@@ -641,37 +1461,172 @@ void Subbucket::paletteChanged()
 // value (indices are generated sequentially from 0; for our example,
 // let's say the index is 42).  We also add that index, 42, to
 // indices[3].
-void Subbucket::_massageIndices(const group_list &vertices, 
-				const group_list &normals,
-				VNMap &map, group_list &indices)
-{
-    // EYE - is this the preferred way to set the initial size?
-    indices.resize(vertices.size());
-    for (size_t i = 0; i < vertices.size(); i++) {
-	assert(vertices.size() == normals.size());
-	int_list &is = indices[i];
-    	for (size_t j = 0; j < vertices[i].size(); j++) {
-    	    int v = vertices[i][j];
-	    int n = v;
-	    if (normals[i].size() > 0) {
-		// We have independently specified normals.
-		assert(vertices[i].size() == normals[i].size());
-		n = normals[i][j];
-	    }
-	    // Now that we have our <vertex, normal> pair, see if it's
-	    // in the map already.  If not, add it.  Use the index of
-	    // the pair in our 'is' list.
-	    pair<int, int> vn(v, n);
-	    int index;
-	    VNMap::const_iterator vni = map.find(vn);
-	    if (vni != map.end()) {
-		index = vni->second;
+void Subbucket::_massageIndices(const SGBinObjectIndices &btgIndices,
+				VNMap &map, int_list &indices)
+{
+    const int_list &vs = btgIndices.v;
+    const int_list &ns = btgIndices.n;
+    assert(vs.size() == ns.size());
+    indices.resize(vs.size());
+    for (size_t i = 0; i < vs.size(); i++) {
+	indices[i] = map.insert(vs[i], ns[i]);
+    }
+}
+
+Subbucket::VNMap::VNMap(size_t expected): _mask(0)
+{
+    _pairs.reserve(expected);
+    size_t capacity = 16;
+    while (capacity < expected * 2) {
+	capacity *= 2;
+    }
+    _resize(capacity);
+}
+
+int Subbucket::VNMap::insert(int v, int n)
+{
+    uint64_t key = _key(v, n);
+    for (size_t i = _slot(key); ; i = (i + 1) & _mask) {
+	int index = _slots[i];
+	if (index < 0) {
+	    // Not there - add it.
+	    index = _pairs.size();
+	    _pairs.push_back(key);
+	    if (_pairs.size() * 2 > _slots.size()) {
+		// Too full - rehash (which takes care of adding the
+		// new key).
+		_resize(_slots.size() * 2);
 	    } else {
-		index = map.size();
-		map[vn] = index;
+		_slots[i] = index;
 	    }
-	    is.push_back(index);
+	    return index;
+	} else if (_pairs[index] == key) {
+	    return index;
+	}
+    }
+}
+
+size_t Subbucket::VNMap::bytes() const
+{
+    return _slots.capacity() * sizeof(int) + 
+	_pairs.capacity() * sizeof(uint64_t);
+}
+
+size_t Subbucket::VNMap::_slot(uint64_t key) const
+{
+    // Usually the normal index is the same as the vertex index, and
+    // triangles refer to vertices that are close together in the BTG
+    // file.  So, when they're equal, we just put vertex v at 2v,
+    // which keeps lookups for neighbouring vertices in neighbouring
+    // cache lines.  When they differ, the difference is hashed and
+    // added on.
+    uint32_t v = (uint32_t)(key >> 32), n = (uint32_t)key;
+    return ((size_t)v * 2 + (size_t)((n - v) * 0x9E3779B1U)) & _mask;
+}
+
+void Subbucket::VNMap::_resize(size_t capacity)
+{
+    _slots.assign(capacity, -1);
+    _mask = capacity - 1;
+
+    // Re-insert everything.  There are no duplicates in _pairs, so
+    // we just need to find an empty slot for each.
+    for (size_t j = 0; j < _pairs.size(); j++) {
+	size_t i = _slot(_pairs[j]);
+	while (_slots[i] >= 0) {
+	    i = (i + 1) & _mask;
 	}
+	_slots[i] = j;
+    }
+}
+
+
+// For runs shorter than 2048 triangles, the overhead of farming them
+// out isn't worth it.
+size_t Subbucket::minChopRun = 2048;
+unsigned int Subbucket::maxChopRuns = 0;
+
+// Contour chopping for a run of triangles.  This is done in a worker
+// thread, so a chopper only reads the subbucket's (raw) vertex data,
+// and puts everything it creates in its own buffers.  New vertices
+// are numbered as if they were appended to the subbucket's vertices,
+// starting at _base.  When done, the subbucket merges the results
+// with _mergeChop().
+class Subbucket::_Chopper: public WorkerPool::Job {
+  public:
+    // Chops triangles[begin] to triangles[end - 1].
+    _Chopper(const Subbucket *sb, const std::vector<GLuint> &triangles, 
+	     size_t begin, size_t end);
+
+    // Chops our triangles.
+    void run();
+
+    // The subbucket's vertex data (read only).
+    const VertexVBO &_vertices;
+    const NormalVBO &_normals;
+    const std::vector<float> &_elevations;
+    const std::vector<int> &_elevationIndices;
+
+    // Our triangles (in GL_TRIANGLES format).
+    const std::vector<GLuint> &_triangles;
+    size_t _begin, _end;
+
+    // The index of our first new vertex.
+    int _base;
+    // New vertex data, in the same format as the subbucket's.
+    VertexVBO _newVertices;
+    NormalVBO _newNormals;
+    std::vector<float> _newElevations;
+    std::vector<int> _newElevationIndices;
+
+    // Like the subbucket's _contours and _contourLines.
+    std::vector<TrianglesVBO> _contours;
+    LinesVBO _contourLines;
+    // Like the subbucket's _edgeContours.  We also record the edges
+    // in the order we found them, since the order affects the order
+    // of iteration in the subbucket's set.
+    std::tr1::unordered_set<std::pair<int, int>, PairHash> _edgeContours;
+    std::vector<std::pair<int, int> > _edgeContourList;
+
+    // Like the subbucket's _edgeMap, but split in two: _edges gives
+    // each edge <i0, i1> an index (a VNMap is really just a table of
+    // int pairs), and _edgeResults[index] is its <first vertex,
+    // vertex count> pair.  This is much faster than an unordered_map,
+    // which matters because we look up every edge of every triangle.
+    VNMap _edges;
+    std::vector<std::pair<int, int> > _edgeResults;
+    // The edges along which we created vertices, in order of
+    // creation, along with the vertices.
+    std::vector<std::pair<std::pair<int, int>, std::pair<int, int> > > 
+	_newEdges;
+
+  protected:
+    void _chopTriangle(int i0, int i1, int i2);
+    std::pair<int, int> _chopEdge(int i0, int i1);
+    void _createTriangle(int i0, int i1, int i2, bool cw, int e);
+    void _doEdgeContour(int i0, int i1, int e0);
+    void _addElevationSlice(std::deque<int> &vs, int e, bool cw);
+};
+
+Subbucket::_Chopper::_Chopper(const Subbucket *sb, 
+			      const vector<GLuint> &triangles,
+			      size_t begin, size_t end):
+    _vertices(sb->_vertices), _normals(sb->_normals), 
+    _elevations(sb->_elevations), _elevationIndices(sb->_elevationIndices),
+    _triangles(triangles), _begin(begin), _end(end), 
+    _base(sb->_elevations.size()), _contours(sb->_contours.size()),
+    // Each triangle shares most of its edges with its neighbours, so
+    // there are about 1.5 edges per triangle.
+    _edges((end - begin) / 2)
+{
+}
+
+// Takes our series of triangles and chops each triangle along contour
+// lines.
+void Subbucket::_Chopper::run()
+{
+    for (size_t i = _begin; i < _end; i += 3) {
+	_chopTriangle(_triangles[i], _triangles[i + 1], _triangles[i + 2]);
     }
 }
 
@@ -693,18 +1648,60 @@ void Subbucket::_massageIndices(const group_list &vertices,
 // vertices, normals, and elevations).
 //
 // Whenever _palettize is called, we assume _vertices, _normals,
-// _elevations, and _triangles are correctly initialized with the
-// "base" data as loaded from the scenery file (before any
-// palettization has taken place).
-void Subbucket::_palettize()
+// _elevations, and _triangles (and _lods) are correctly initialized
+// with the "base" data as loaded from the scenery file (before any
+// palettization has taken place).  We use the triangles of the
+// current level of detail.
+void Subbucket::_palettize(WorkerPool *pool)
 {
+    const map<string, TrianglesVBO> &lod = _levelTriangles(_level);
+
     // Reset the data structures that palettization modifies.
     _elevationIndices.clear();
     _colours.clear();
-    _materials.clear();
     _contours.clear();
     _contourLines.clear();
 
+    // If we can, we let ContourShader colour by elevation, in which
+    // case all we need to do is find the material triangles.
+    ContourShader *shader = ContourShader::get();
+    bool shaded = Bucket::shadedContours && shader && 
+	shader->canShade(Bucket::palette);
+    if (shaded) {
+	set<string> materials;
+	map<string, TrianglesVBO>::const_iterator i;
+	for (i = lod.begin(); i != lod.end(); i++) {
+	    if (Bucket::palette->colour(i->first.c_str()) != NULL) {
+		materials.insert(i->first);
+	    }
+	}
+
+	if (_shaded && (materials == _materials) && 
+	    (_palettizedLevel == _level)) {
+	    // The same triangles are coloured by material as last
+	    // time, so our packed triangles are still good - only
+	    // their colours might have changed.
+	    _batch();
+	} else {
+	    _materials.swap(materials);
+	    _shaded = true;
+	    _pack(pool);
+	}
+	_palettizedLevel = _level;
+	_palettized = true;
+	return;
+    }
+    _materials.clear();
+
+    if (_shaded) {
+	// Our raw vertices and normals are on the GPU, and chopping
+	// is going to add to them, so they'll need to be uploaded
+	// again.
+	_vertices.download(_rawSize * 3);
+	_normals.download(_rawSize * 3);
+	_shaded = false;
+    }
+
     // Initialize our elevation indices (more will be added later as
     // we contour chop).
     for (unsigned int i = 0; i < _elevations.size(); i++) {
@@ -722,18 +1719,50 @@ void Subbucket::_palettize()
     // is listed in the palette (ie, those triangles are to be
     // coloured according to the material colour), then just record
     // the material.  If the triangles are to be coloured by
-    // elevation, then we need to chop them up.
-    for (map<string, TrianglesVBO>::const_iterator i = _triangles.begin();
-	 i != _triangles.end();
+    // elevation, then we need to chop them up, so we gather them
+    // together.
+    vector<GLuint> tris;
+    for (map<string, TrianglesVBO>::const_iterator i = lod.begin();
+	 i != lod.end();
 	 i++) {
 	const string &material = i->first;
-	const TrianglesVBO &tris = i->second;
 	if (Bucket::palette->colour(material.c_str()) != NULL) {
 	    _materials.insert(material);
 	} else {
-	    _chopTriangles(tris);
+	    tris.insert(tris.end(), i->second.begin(), i->second.end());
 	}
     }
+
+    // Chopping is expensive, so we split the triangles into runs and
+    // chop them in parallel, then merge the results in order.  The
+    // merge takes care of edges shared by triangles in different
+    // runs, so the result is exactly what we'd get if we did it all
+    // in one go.  We do the first run ourselves, and all of them if
+    // we don't have a pool.
+    size_t triangles = tris.size() / 3;
+    size_t maxRuns = 1;
+    if (pool) {
+	maxRuns = maxChopRuns ? maxChopRuns : pool->threads() + 1;
+    }
+    size_t runs = min(maxRuns, max(triangles / minChopRun, (size_t)1));
+    vector<_Chopper *> choppers;
+    for (size_t i = 0; i < runs; i++) {
+	size_t begin = triangles * i / runs, end = triangles * (i + 1) / runs;
+	choppers.push_back(new _Chopper(this, tris, begin * 3, end * 3));
+	if (i > 0) {
+	    pool->submit(choppers[i]);
+	}
+    }
+    choppers[0]->run();
+    // Merging adds to _vertices, _normals, and so on, which the
+    // choppers read, so we can't start until they're all done.
+    for (size_t i = 1; i < runs; i++) {
+	pool->wait(choppers[i]);
+    }
+    for (size_t i = 0; i < runs; i++) {
+	_mergeChop(*choppers[i], i == runs - 1);
+	delete choppers[i];
+    }
     _edgeMap.clear();
 
     // Add all contours that run along the shared edges of triangles
@@ -744,9 +1773,120 @@ void Subbucket::_palettize()
     }
     _edgeContours.clear();
 
+    _pack(pool);
+    _palettizedLevel = _level;
     _palettized = true;
 }
 
+void Subbucket::_pack(WorkerPool *pool)
+{
+    map<string, TrianglesVBO> &triangles = _levelTriangles(_level);
+    _indices.clear();
+
+    // Materials first, in the same order as _materials.
+    for (set<string>::const_iterator i = _materials.begin();
+	 i != _materials.end();
+	 i++) {
+	_indices.add(triangles[*i]);
+    }
+
+    if (_shaded) {
+	// Everything not coloured by material is coloured by the
+	// shader.
+	map<string, TrianglesVBO>::const_iterator i;
+	for (i = triangles.begin(); i != triangles.end(); i++) {
+	    if (_materials.find(i->first) == _materials.end()) {
+		_indices.add(i->second);
+	    }
+	}
+    } else {
+	for (size_t i = 0; i < _contours.size(); i++) {
+	    _indices.add(_contours[i]);
+	}
+	// We won't need these again until the next palettization.
+	vector<TrianglesVBO>().swap(_contours);
+    }
+    _indices.reorder(pool);
+
+    _batch();
+}
+
+// Sorts the lists in _indices into batches, according to the current
+// palette.  See _pack() for the list order.
+void Subbucket::_batch()
+{
+    _materialBatches.clear();
+    _contourBatches.clear();
+    _allContours.clear();
+
+    size_t list = 0;
+    for (set<string>::const_iterator i = _materials.begin();
+	 i != _materials.end();
+	 i++, list++) {
+	_addToBatch(_materialBatches, Bucket::palette->colour(i->c_str()), 
+		    list);
+    }
+
+    // The rest are contours.  If we're not shaded, contour i is in
+    // list i past the materials.
+    for (size_t i = 0; list < _indices.lists(); i++, list++) {
+	_allContours.add(_indices, list);
+	if (!_shaded) {
+	    _addToBatch(_contourBatches, 
+			Bucket::palette->contourAtIndex(i).colour, list);
+	}
+    }
+}
+
+// Adds the list to the batch in 'batches' with the given colour,
+// creating the batch if necessary.  Empty lists are ignored.
+void Subbucket::_addToBatch(vector<_ColourBatch> &batches, 
+			    const float *colour, size_t list)
+{
+    if (_indices.count(list) == 0) {
+	return;
+    }
+
+    size_t i;
+    for (i = 0; i < batches.size(); i++) {
+	if (memcmp(batches[i].colour, colour, sizeof(sgVec4)) == 0) {
+	    break;
+	}
+    }
+    if (i == batches.size()) {
+	batches.push_back(_ColourBatch());
+	sgCopyVec4(batches[i].colour, colour);
+    }
+    batches[i].batch.add(_indices, list);
+}
+
+void Subbucket::palettize(WorkerPool *pool)
+{
+    if (!_loaded || palettized() || (Bucket::palette == NULL)) {
+	return;
+    }
+
+    // If we're palettized, but at the wrong level, we need to get rid
+    // of the old palettization, just as for a palette change.
+    paletteChanged();
+    _palettize(pool);
+    _calcBytes();
+}
+
+void Subbucket::setLevel(unsigned int level)
+{
+    _level = min(level, Bucket::LOD_LEVELS - 1);
+}
+
+size_t Subbucket::triangles(unsigned int level) const
+{
+    if (!_loaded) {
+	return 0;
+    }
+
+    return _triangleCounts[min(level, Bucket::LOD_LEVELS - 1)];
+}
+
 void Subbucket::draw()
 {
     // We can only draw this subbucket if we've actually loaded it and
@@ -754,9 +1894,14 @@ void Subbucket::draw()
     if (!_loaded || (Bucket::palette == NULL)) {
     	return;
     }
+    // If we've been palettized at another level of detail, we draw
+    // that until someone palettizes us at the new level.
     if (!_palettized) {
-	_palettize();
+	palettize();
     }
+    // How we draw determines what gets uploaded (see _measuredMode).
+    int mode = (Bucket::discreteContours ? 1 : 0) | 
+	(Bucket::contourLines ? 2 : 0) | (Bucket::polygonEdges ? 4 : 0);
 
     glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT); {
 	// Tell OpenGL where our data is.
@@ -771,36 +1916,39 @@ void Subbucket::draw()
 	// Draw the "material" objects (ie, objects coloured based on
 	// their material, not elevation).  Note that we assume that
 	// glColorMaterial() has been called.
-	for (set<string>::const_iterator i = _materials.begin();
-	     i != _materials.end();
-	     i++) {
-	    const string &material = *i;
-	    TrianglesVBO &indices = _triangles[material];
-
-	    glColor4fv(Bucket::palette->colour(material.c_str()));
-	    indices.draw();
+	for (size_t i = 0; i < _materialBatches.size(); i++) {
+	    glColor4fv(_materialBatches[i].colour);
+	    _indices.draw(_materialBatches[i].batch);
 	}
 
 	// ---------- Contours ----------
-	if (!Bucket::discreteContours) {
+	if (_shaded) {
+	    // The shader does the colouring (and contour lines) for
+	    // all the non-material triangles.
+	    _elevations.stage();
+	    ContourShader *shader = ContourShader::get();
+	    shader->begin(Bucket::palette, Bucket::discreteContours, 
+			  Bucket::contourLines);
+	    _indices.draw(_allContours);
+	    shader->end();
+	    ElevationVBO::disable();
+	} else if (!Bucket::discreteContours) {
 	    // We delay calculating smooth colour information as long
 	    // as possible.
 	    if (!_colours.uploaded()) {
 		for (unsigned int i = 0; i < _elevations.size(); i++) {
-		    // EYE - we should be able to do this in a shader
 		    sgVec4 colour;
 		    Bucket::palette->smoothColour(_elevations[i], colour);
 		    _colours.push_back(colour);
 		}
 	    }
 	    _colours.stage();
-	}
-	for (size_t i = 0; i < _contours.size(); i++) {
-	    TrianglesVBO &indices = _contours[i];
-	    if (Bucket::discreteContours) {
-		glColor4fv(Bucket::palette->contourAtIndex(i).colour);
+	    _indices.draw(_allContours);
+	} else {
+	    for (size_t i = 0; i < _contourBatches.size(); i++) {
+		glColor4fv(_contourBatches[i].colour);
+		_indices.draw(_contourBatches[i].batch);
 	    }
-	    indices.draw();
 	}
 
 	// EYE - To reduce the number of times we turn the depth test
@@ -812,7 +1960,7 @@ void Subbucket::draw()
 	// ---------- Contour lines ----------
 	NormalVBO::disable();
 	ColourVBO::disable();
-	if (Bucket::contourLines) {
+	if (Bucket::contourLines && !_shaded) {
 	    glPushAttrib(GL_LINE_BIT | GL_CURRENT_BIT | GL_DEPTH_BUFFER_BIT); {
 	    	glDisable(GL_DEPTH_TEST);
 		glLineWidth(0.5);
@@ -830,8 +1978,10 @@ void Subbucket::draw()
 		glPolygonMode(GL_FRONT, GL_LINE);
 		glLineWidth(0.5);
 		glColor4f(1.0, 0.0, 0.0, 1.0);
+		map<string, TrianglesVBO> &tris = 
+		    _levelTriangles(_palettizedLevel);
 		map<string, TrianglesVBO>::iterator i;
-		for (i = _triangles.begin(); i != _triangles.end(); i++) {
+		for (i = tris.begin(); i != tris.end(); i++) {
 		    TrianglesVBO &indices = i->second;
 		    indices.draw();
 		}
@@ -840,23 +1990,77 @@ void Subbucket::draw()
 	}
     }
     glPopClientAttrib();
+
+    if (mode != _measuredMode) {
+	_calcBytes();
+	_measuredMode = mode;
+    }
 }
 
-// Takes a vector representing a series of triangles (ie, GL_TRIANGLES
-// format) and chops each triangle along contour lines.
-void Subbucket::_chopTriangles(const vector<GLuint> &triangles)
+void Subbucket::rasterize(Rasterizer &r)
 {
-    for (size_t i = 0; i < triangles.size(); i += 3) {
-	_chopTriangle(triangles[i], triangles[i + 1], triangles[i + 2]);
+    if (!_loaded || (Bucket::palette == NULL)) {
+    	return;
+    }
+    if (!_palettized) {
+	palettize();
+    }
+    // We draw straight from our vectors, so nothing can have been
+    // uploaded (or shaded, which needs OpenGL).
+    assert(!_shaded && !_indices.uploaded() && !_vertices.uploaded());
+    if (_vertices.empty()) {
+	return;
+    }
+
+    // ---------- Materials ----------
+    for (size_t i = 0; i < _materialBatches.size(); i++) {
+	const TriangleListsVBO::Batch &b = _materialBatches[i].batch;
+	for (size_t j = 0; j < b.spans(); j++) {
+	    r.triangles(&_vertices[0], &_normals[0], NULL,
+			_materialBatches[i].colour, &_indices[b.first(j)],
+			b.count(j));
+	}
+    }
+
+    // ---------- Contours ----------
+    if (!Bucket::discreteContours) {
+	if (_colours.empty()) {
+	    for (unsigned int i = 0; i < _elevations.size(); i++) {
+		sgVec4 colour;
+		Bucket::palette->smoothColour(_elevations[i], colour);
+		_colours.push_back(colour);
+	    }
+	}
+	for (size_t j = 0; j < _allContours.spans(); j++) {
+	    r.triangles(&_vertices[0], &_normals[0], &_colours[0], NULL,
+			&_indices[_allContours.first(j)],
+			_allContours.count(j));
+	}
+    } else {
+	for (size_t i = 0; i < _contourBatches.size(); i++) {
+	    const TriangleListsVBO::Batch &b = _contourBatches[i].batch;
+	    for (size_t j = 0; j < b.spans(); j++) {
+		r.triangles(&_vertices[0], &_normals[0], NULL,
+			    _contourBatches[i].colour, &_indices[b.first(j)],
+			    b.count(j));
+	    }
+	}
+    }
+
+    // ---------- Contour lines ----------
+    if (Bucket::contourLines && !_contourLines.empty()) {
+	const float black[3] = {0.0, 0.0, 0.0};
+	r.lines(&_vertices[0], &_contourLines[0], _contourLines.size(),
+		black, 0.5);
     }
 }
 
 // Chops up the given triangle along contour lines.  This will result
 // in new vertices, normals, elevations, and elevation indices being
-// added to _vertices, _normals, _elevations, and _elevationIndices,
-// and triangles being added to _contours.  Also, we add contour line
-// segments to _contourLines.
-void Subbucket::_chopTriangle(int i0, int i1, int i2)
+// added to _newVertices, _newNormals, _newElevations, and
+// _newElevationIndices, and triangles being added to _contours.
+// Also, we add contour line segments to _contourLines.
+void Subbucket::_Chopper::_chopTriangle(int i0, int i1, int i2)
 {
     // It's very important to keep the number of new vertices (and
     // triangles) to a minimum.  I initially tried a simple recursive
@@ -997,7 +2201,7 @@ void Subbucket::_chopTriangle(int i0, int i1, int i2)
 // three points to the _contours vector at the correct contour index
 // (as given by e).  If cw ('clockwise') is true, we swap i0 and i1 so
 // that the triangle will be rendered counterclockwise.
-void Subbucket::_createTriangle(int i0, int i1, int i2, bool cw, int e)
+void Subbucket::_Chopper::_createTriangle(int i0, int i1, int i2, bool cw, int e)
 {
     TrianglesVBO &indices = _contours[e];
     if (cw) {
@@ -1012,7 +2216,7 @@ void Subbucket::_createTriangle(int i0, int i1, int i2, bool cw, int e)
 // documentation for _chopTriangle, vs would contain a figure like
 // B-A-i1-C-D, for example).  If cw is true, we reverse the order of
 // the first two vertices to restore a counterclockwise winding.
-void Subbucket::_addElevationSlice(deque<int>& vs, int e, bool cw)
+void Subbucket::_Chopper::_addElevationSlice(deque<int>& vs, int e, bool cw)
 {
     assert((vs.size() >= 3) && (vs.size() <= 5));
     if (vs.size() == 3) {
@@ -1039,17 +2243,17 @@ void Subbucket::_addElevationSlice(deque<int>& vs, int e, bool cw)
 
 // Checks if the edge connecting i0 and i1 (at elevation index e0)
 // runs along a contour.  If it does, it adds it to the _edgeContours
-// set.  Note that this is only intended to be called for the edges of
-// raw triangles, not the contours created by slicing triangles.
-void Subbucket::_doEdgeContour(int i0, int i1, int e0)
+// set (and, if it's new, to the _edgeContourList).  Note that this is
+// only intended to be called for the edges of raw triangles, not the
+// contours created by slicing triangles.
+void Subbucket::_Chopper::_doEdgeContour(int i0, int i1, int e0)
 {
     if ((_elevations[i0] == _elevations[i1]) &&
     	(_elevations[i0] == Bucket::palette->contourAtIndex(e0).elevation)) {
-    	if (i0 <= i1) {
-    	    _edgeContours.insert(make_pair(i0, i1));
-    	} else {
-    	    _edgeContours.insert(make_pair(i1, i0));
-    	}
+	pair<int, int> edge = (i0 <= i1) ? make_pair(i0, i1) : make_pair(i1, i0);
+	if (_edgeContours.insert(edge).second) {
+	    _edgeContourList.push_back(edge);
+	}
     }
 }
 
@@ -1058,11 +2262,12 @@ void Subbucket::_doEdgeContour(int i0, int i1, int e0)
 // Returns a pair giving the starting index of the first vertex
 // created, and the number of vertices created.  If no vertices are
 // created, it returns <0, 0>.  Can be safely called multiple times on
-// the same <i0, i1> pair.
+// the same <i0, i1> pair.  New vertices are numbered from _base (ie,
+// as if they were added to the end of the subbucket's vertices).
 //
 // Note that this is where we spend most of our time (about 50%), so
 // it's imperative that it be as efficient as possible.
-pair<int, int> Subbucket::_chopEdge(int i0, int i1)
+pair<int, int> Subbucket::_Chopper::_chopEdge(int i0, int i1)
 {
     pair<int, int> result(0, 0);
 
@@ -1080,12 +2285,14 @@ pair<int, int> Subbucket::_chopEdge(int i0, int i1)
     assert(i0 != i1);
 
     // Now we're ready.  First see if the edge has been processed
-    // already.  The following code is a bit of a trick, relying on
-    // two things: (1) New vertices we create will never have an index
-    // of 0, and (2) If the given edge doesn't exist, _edgeMap[]
-    // returns <0, 0> (ie, a newly created int is given a default
-    // value of 0).
-    result = _edgeMap[make_pair(i0, i1)];
+    // already.  New vertices we create will never have an index of 0
+    // (they start at _base), so if the edge is new, or if we didn't
+    // create any vertices for it, we'll get <0, 0>.
+    size_t edge = _edges.insert(i0, i1);
+    if (edge == _edgeResults.size()) {
+	_edgeResults.push_back(result);
+    }
+    result = _edgeResults[edge];
     if (result.first != 0) {
 	return result;
     }
@@ -1105,7 +2312,7 @@ pair<int, int> Subbucket::_chopEdge(int i0, int i1)
 	return result;
     }
 
-    result.first = _vertices.size() / 3;
+    result.first = _base + _newElevations.size();
     if (elev1 != Bucket::palette->contourAtIndex(e1).elevation) {
 	// If the upper point is not on a contour (ie, it's above it),
 	// then we need to create a vertex for that contour too.
@@ -1114,8 +2321,8 @@ pair<int, int> Subbucket::_chopEdge(int i0, int i1)
     int i = result.first;
     for (int e = e0 + 1; e < e1; e++, i++) {
 	const Palette::Contour& contour = Bucket::palette->contourAtIndex(e);
-	_elevations.push_back(contour.elevation);
-	_elevationIndices.push_back(e);
+	_newElevations.push_back(contour.elevation);
+	_newElevationIndices.push_back(e);
 
 	// Calculate a scale factor.  Strictly speaking, linear
 	// interpolation is not correct, because the earth is not
@@ -1133,24 +2340,143 @@ pair<int, int> Subbucket::_chopEdge(int i0, int i1)
 
 	// Interpolate the vertex.
 	sgVec3 v;
-	float *v0 = &(_vertices[i0 * 3]), *v1 = &(_vertices[i1 * 3]);
+	const float *v0 = &(_vertices[i0 * 3]), *v1 = &(_vertices[i1 * 3]);
 	sgSubVec3(v, v1, v0);
 	sgScaleVec3(v, scaling);
 	sgAddVec3(v, v0);
-	_vertices.push_back(v);
+	_newVertices.push_back(v);
 
 	// Interpolate the normal.
 	sgVec3 n;
-	float *n0 = &(_normals[i0 * 3]), *n1 = &(_normals[i1 * 3]);
+	const float *n0 = &(_normals[i0 * 3]), *n1 = &(_normals[i1 * 3]);
 	sgSubVec3(n, n1, n0);
 	sgScaleVec3(n, scaling);
 	sgAddVec3(n, n0);
-	_normals.push_back(n);
+	_newNormals.push_back(n);
 
 	result.second++;
     }
 
-    _edgeMap[make_pair(i0, i1)] = result;
+    _edgeResults[edge] = result;
+    if (result.second > 0) {
+	_newEdges.push_back(make_pair(make_pair(i0, i1), result));
+    }
 
     return result;
 }
+
+// Adds the results of a chopper to ours.  Choppers must be merged in
+// the order of their triangles.  The chopper numbered its new vertices
+// starting from _base, but some may have already been created by an
+// earlier chopper (for edges shared between their triangles).  So,
+// we go through its new edges in the order they were created - if we
+// already have vertices for an edge, we use those, otherwise we add
+// the chopper's.  This creates vertices in the same order, with the
+// same indices, as if all the chopping were done by one chopper.  If
+// this is the last chopper, we don't bother recording its edges.  Note
+// that the chopper's triangles and contour lines may be taken (rather
+// than copied), so it's useless afterwards.
+void Subbucket::_mergeChop(_Chopper &c, bool last)
+{
+    if (_elevations.size() == (size_t)c._base) {
+	// Nobody has created any vertices yet, so all of the
+	// chopper's vertices are new, and they already have the right
+	// indices.  This is the usual case for the first chopper (and
+	// the only case if there's only one), so it's worth
+	// special-casing.  If we have no triangles or lines yet, we
+	// can just take the chopper's.
+	_elevations.insert(_elevations.end(), 
+			   c._newElevations.begin(), c._newElevations.end());
+	_elevationIndices.insert(_elevationIndices.end(), 
+				 c._newElevationIndices.begin(), 
+				 c._newElevationIndices.end());
+	_vertices.insert(_vertices.end(), 
+			 c._newVertices.begin(), c._newVertices.end());
+	_normals.insert(_normals.end(), 
+			c._newNormals.begin(), c._newNormals.end());
+	for (size_t e = 0; e < c._contours.size(); e++) {
+	    if (_contours[e].empty()) {
+		_contours[e].swap(c._contours[e]);
+	    } else {
+		_contours[e].insert(_contours[e].end(), 
+				    c._contours[e].begin(), 
+				    c._contours[e].end());
+	    }
+	}
+	if (_contourLines.empty()) {
+	    _contourLines.swap(c._contourLines);
+	} else {
+	    _contourLines.insert(_contourLines.end(), 
+				 c._contourLines.begin(), 
+				 c._contourLines.end());
+	}
+	if (!last) {
+	    for (size_t i = 0; i < c._newEdges.size(); i++) {
+		_edgeMap.insert(c._newEdges[i]);
+	    }
+	}
+    } else {
+	// Maps the chopper's new vertex indices (less c._base) to ours.
+	vector<GLuint> remap(c._newElevations.size());
+	for (size_t i = 0; i < c._newEdges.size(); i++) {
+	    const pair<int, int> &edge = c._newEdges[i].first;
+	    const pair<int, int> &theirs = c._newEdges[i].second;
+	    pair<int, int> &ours = _edgeMap[edge];
+	    if (ours.first == 0) {
+		// A new edge, so add its vertices.
+		ours.first = _elevations.size();
+		ours.second = theirs.second;
+		size_t k = theirs.first - c._base, n = theirs.second;
+		_elevations.insert(_elevations.end(), 
+				   c._newElevations.begin() + k,
+				   c._newElevations.begin() + k + n);
+		_elevationIndices.insert(_elevationIndices.end(), 
+					 c._newElevationIndices.begin() + k,
+					 c._newElevationIndices.begin() + k + n);
+		_vertices.insert(_vertices.end(), 
+				 c._newVertices.begin() + k * 3,
+				 c._newVertices.begin() + (k + n) * 3);
+		_normals.insert(_normals.end(), 
+				c._newNormals.begin() + k * 3,
+				c._newNormals.begin() + (k + n) * 3);
+	    }
+	    assert(ours.second == theirs.second);
+	    for (int j = 0; j < theirs.second; j++) {
+		remap[theirs.first - c._base + j] = ours.first + j;
+	    }
+	}
+
+	// Now add the chopper's triangles and contour lines,
+	// renumbering new vertices as we go.
+	GLuint v[3];
+	for (size_t e = 0; e < c._contours.size(); e++) {
+	    const TrianglesVBO &theirs = c._contours[e];
+	    TrianglesVBO &ours = _contours[e];
+	    ours.reserve(ours.size() + theirs.size());
+	    for (size_t i = 0; i < theirs.size(); i += 3) {
+		for (int j = 0; j < 3; j++) {
+		    v[j] = theirs[i + j];
+		    if (v[j] >= (GLuint)c._base) {
+			v[j] = remap[v[j] - c._base];
+		    }
+		}
+		ours.push_back(v[0], v[1], v[2]);
+	    }
+	}
+	for (size_t i = 0; i < c._contourLines.size(); i += 2) {
+	    for (int j = 0; j < 2; j++) {
+		v[j] = c._contourLines[i + j];
+		if (v[j] >= (GLuint)c._base) {
+		    v[j] = remap[v[j] - c._base];
+		}
+	    }
+	    _contourLines.push_back(v[0], v[1]);
+	}
+    }
+
+    // Edge contours are only ever between original vertices, so they
+    // don't need renumbering.
+    for (size_t i = 0; i < c._edgeContourList.size(); i++) {
+	_edgeContours.insert(c._edgeContourList[i]);
+    }
+}
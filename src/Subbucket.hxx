@@ -52,19 +52,22 @@
 
 #include <simgear/misc/sg_path.hxx> // SGPath
 #include <simgear/io/sg_binobj.hxx> // SGBinObject
+#include <simgear/misc/stdint.hxx> // uint64_t
 
 #include "Bucket.hxx"		// Bucket::Projection, ...
 
+class Rasterizer;
+
 // The following classes (VBO, AttributeVBO, etc) simplify the
 // management of OpenGL vertex buffer objects (VBOs).  Hopefully this
 // will reduce the chances of falling into the many traps OpenGL sets
 // for the unwary programmer.
 
 // The VBO class is not meant to be used by itself - use one of the
-// subclasses: VertexVBO, NormalVBO, ColourVBO, TrianglesVBO, or
-// LinesVBO.  As hinted at by the name, the VertexVBO implements a
-// vertex buffer object containing vertex data.  Ditto for NormalVBO,
-// ColourVBO, TrianglesVBO and LinesVBO.  VBO is a subclass of the STL
+// subclasses: VertexVBO, NormalVBO, ColourVBO, ElevationVBO,
+// TrianglesVBO, or LinesVBO.  As hinted at by the name, the VertexVBO
+// implements a vertex buffer object containing vertex data.  Ditto
+// for NormalVBO, ColourVBO, ElevationVBO, TrianglesVBO and LinesVBO.  VBO is a subclass of the STL
 // vector class, with a few extra bits thrown in to manage the OpenGL
 // side of things.
 //
@@ -97,7 +100,9 @@
 //     well, after uploading, local data is deleted (if you do a
 //     size() after staging or drawing, you'll see that it is empty).
 //     The thinking behind this behaviour is that we don't want copies
-//     eating memory locally and on the GPU.
+//     eating memory locally and on the GPU.  If you know you'll need
+//     (some of) the data again, call keep() before uploading, and the
+//     initial range you specify will stay in the vector.
 //
 // (4) If you need to look at or modify data that has been uploaded to
 //     the GPU, download it.  If you don't want it all, you can
@@ -105,7 +110,9 @@
 //     rawSize parameter.  Although we don't explicitly erase the data
 //     on the GPU, it is no longer accessible through the class
 //     methods provided.  Subsequent staging (attribute VBOs) or
-//     drawing (index VBOs) will overwrite whatever is there.
+//     drawing (index VBOs) will overwrite whatever is there.  If the
+//     range was kept (see keep()), downloading just trims the vector,
+//     and never touches the GPU.
 //
 //     If you don't need to download it, but need to indicate that the
 //     uploaded data is no longer valid, call clear().  Note that this
@@ -115,6 +122,12 @@
 //     have to worry about buffers lying around on the GPU taking up
 //     resources.
 //
+// A VBO knows exactly how much memory it's using, locally (the
+// vector's storage) and on the GPU (the buffer, which exists from the
+// first upload until it's deleted, even if it has been downloaded) -
+// see cpuBytes() and gpuBytes().  Uploading and clearing release the
+// vector's storage, not just its contents.
+//
 // In general, requests to VBOs will be silently ignored if they can't
 // be fulfilled.  This means, for example, you can safely call draw()
 // without checking if there's anything to draw.
@@ -135,6 +148,9 @@ class VBO: public std::vector<T> {
     // Download the data from the GPU to the vector.  If rawSize is
     // not NaRS, only the first rawSize objects will be downloaded.
     void download(GLenum target, size_t rawSize = NaRS);
+    // After the next upload(), keep the first n objects in the vector
+    // rather than clearing it.  If n is NaRS, everything is kept.
+    void keep(size_t n = NaRS) { _keep = n; }
     // Clear the data and mark the VBO as not uploaded.  If deleteVBO
     // is true, the VBO will be deleted as well, freeing all
     // resources.
@@ -144,9 +160,16 @@ class VBO: public std::vector<T> {
     // being subsequently downloaded or cleared.
     bool uploaded();
 
+    // Memory used by the vector (including any excess capacity), and
+    // by our buffer on the GPU, in bytes.
+    size_t cpuBytes() const { return std::vector<T>::capacity() * sizeof(T); }
+    size_t gpuBytes() const { return _gpuBytes; }
+
   protected:
     GLuint _name;
     size_t _size;
+    size_t _keep;		// See keep().
+    size_t _gpuBytes;		// Size of our buffer on the GPU.
 };
 
 // A base class for all attribute VBOs.  All attribute VBOs are
@@ -194,6 +217,17 @@ class ColourVBO: public AttributeVBO {
     void stage();
 };
 
+// ElevationVBOs have a single float per vertex.  OpenGL doesn't have
+// an elevation array, so they are passed in as 1D texture coordinates
+// (texture unit 0), which is where ContourShader expects them.
+class ElevationVBO: public AttributeVBO {
+  public:
+    static void enable();
+    static void disable();
+
+    void stage();
+};
+
 // A base class for all index VBOs.  Like attribute VBOs, you have no
 // choice over data type or index VBOs - they are unsigned ints.  It
 // would be nice to use unsigned shorts (they take half the space),
@@ -221,6 +255,74 @@ class LinesVBO: public IndexVBO {
     void push_back(GLuint i0, GLuint i1);
 };
 
+// A TriangleListsVBO packs several GL_TRIANGLES index lists into a
+// single buffer, so that they can be drawn with fewer calls.  Lists
+// are appended with add(), which returns the list's number.  To draw,
+// collect the lists you want in a Batch, and pass the batch to draw()
+// - the whole batch is drawn with a single glMultiDrawElements() call
+// (adjacent lists are merged, so a batch of consecutive lists is
+// really just one list).
+//
+// Once all lists are added, their triangles can be reordered to make
+// better use of the GPU's post-transform vertex cache (see
+// reorder()).  And when
+// uploaded, if all indices fit in an unsigned short, that's what we
+// use, halving the size of the buffer (which also explains why we
+// can't use VBO's upload() method).  Unlike other VBOs, a
+// TriangleListsVBO is never kept after being uploaded.
+class TriangleListsVBO: public VBO<GLuint> {
+  public:
+    // A set of lists to be drawn with one call.  The lists must all
+    // come from the same TriangleListsVBO.
+    class Batch {
+      public:
+	void add(const TriangleListsVBO &vbo, size_t list);
+	bool empty() const { return _counts.empty(); }
+	void clear();
+	// The batch's spans of indices, for those who draw it themselves
+	// (see Subbucket::rasterize()).
+	size_t spans() const { return _counts.size(); }
+	size_t first(size_t span) const { return _firsts[span]; }
+	size_t count(size_t span) const { return _counts[span]; }
+
+      protected:
+	friend class TriangleListsVBO;
+	// For each span of indices: its length and where it starts.
+	std::vector<GLsizei> _counts;
+	std::vector<size_t> _firsts;
+    };
+
+    TriangleListsVBO();
+
+    // Adds the given triangles as a new list, returning its number.
+    size_t add(const std::vector<GLuint> &triangles);
+    // Reorders the triangles in each list for the vertex cache, using
+    // the given pool (if any) to do it in parallel.  The vertex order
+    // of each triangle (and hence its winding) is preserved.
+    void reorder(WorkerPool *pool);
+    size_t lists() const { return _firsts.size(); }
+    // The number of indices in the given list.
+    size_t count(size_t list) const { return _lasts[list] - _firsts[list]; }
+    // The number of bytes used by each index (valid after upload).
+    size_t indexSize() const;
+
+    void upload();
+    void draw(const Batch &b);
+    void clear(bool deleteVBO = false);
+
+    // Like VBO::cpuBytes(), but including our list bookkeeping.
+    size_t cpuBytes() const;
+
+  protected:
+    // The beginning and end (in indices) of each list.
+    std::vector<size_t> _firsts, _lasts;
+    // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, depending on what we
+    // uploaded.
+    GLenum _type;
+    // Used by draw() to hold the batch's offsets into the buffer.
+    std::vector<const GLvoid *> _offsets;
+};
+
 // Create a hash function for pairs of integers.  This will be used in
 // several of the unordered sets and maps.
 struct PairHash {
@@ -245,34 +347,166 @@ class Subbucket {
     Subbucket(const SGPath &p);
     ~Subbucket();
 
+    // Contour chopping (see palettize()) is split into runs of at
+    // least minChopRun triangles, which are chopped in parallel.
+    // There are at most maxChopRuns runs, or, if it's 0, one per
+    // thread in the pool plus one for the caller.  The results don't
+    // depend on either, which is why ChopTest can change them.
+    static size_t minChopRun;
+    static unsigned int maxChopRuns;
+
+    // Reads the scenery file and prepares it for drawing.  This does
+    // no OpenGL calls (data is uploaded to the GPU lazily, in
+    // draw()), so it can be called from a worker thread.
     bool load(Bucket::Projection p = Bucket::CARTESIAN);
     bool loaded() const { return _loaded; }
+    const SGPath& path() const { return _path; }
     void unload();
-    // The (very) approximate size of the subbucket, in bytes.
-    unsigned int size() const { return _bytes; }
+    // The memory used by our data in main memory and on the GPU, in
+    // bytes.  The storage of every array is counted exactly, but
+    // bookkeeping (map nodes and the like) is ignored.  Data is
+    // uploaded to the GPU lazily, so gpuBytes() grows (and, usually,
+    // cpuBytes() shrinks) when we're drawn.
+    size_t cpuBytes() const { return _cpuBytes; }
+    size_t gpuBytes() const { return _gpuBytes; }
     double maximumElevation() const { return _maxElevation; }
+    // Temporary memory used by the last load() to build the
+    // <vertex, normal> table (0 if we were loaded from the cache).
+    size_t scratchBytes() const { return _scratchBytes; }
 
+    // Tells us the palette has changed.  This is cheap - we don't
+    // actually do anything about it until palettize() or draw() is
+    // called.
     void paletteChanged();
+    // True if we've been coloured according to the current palette,
+    // at the current level of detail.
+    bool palettized() const 
+    { return _palettized && (_palettizedLevel == _level); }
+    // Colours us according to the current palette, if we haven't
+    // been already.  This can take a while.  If given a pool, we use
+    // it to chop triangles in parallel; otherwise everything is done
+    // in the calling thread.  It is called by draw() if necessary
+    // (without a pool), but can be called explicitly beforehand to
+    // control when and how the work is done.
+    void palettize(WorkerPool *pool = NULL);
+
+    // Besides the scenery as given in the scenery file (level 0), we
+    // have simplified versions of it, one for each level of detail
+    // (see Bucket::LOD_LEVELS).  All levels share the same vertices
+    // - only the triangles differ.  Changing the level is like
+    // changing the palette - nothing happens until we're palettized
+    // again.  Until then, draw() draws the old level.
+    void setLevel(unsigned int level);
+    unsigned int level() const { return _level; }
+    // The number of triangles at the given level (before contour
+    // chopping).
+    size_t triangles(unsigned int level) const;
+    // True if we have something to draw - we've been palettized,
+    // although perhaps not with the current palette or level of
+    // detail.
+    bool drawable() const { return _palettized; }
 
     void draw();
+    // Like draw(), but draws into the given rasterizer rather than
+    // with OpenGL.  Polygon edges aren't drawn, and we must not have
+    // been palettized for ContourShader (see Bucket::shadedContours).
+    void rasterize(Rasterizer &r);
 
   protected:
-    // Normally I avoid typedefs, but this one is just too darned
-    // long.  A VNMap maps from the <vertex, normal> pairs in the
-    // original BTG file to our corrected indices.  It is used
-    // internally in load() and _massageIndices().
-    typedef std::tr1::unordered_map<std::pair<int, int>, int, PairHash> VNMap;
-    void _massageIndices(const group_list &vertices, const group_list &normals, 
-    			 VNMap &map, group_list &indices);
-
-    void _palettize();
-    void _chopTriangles(const std::vector<GLuint> &triangles);
-    void _chopTriangle(int i0, int i1, int i2);
-    std::pair<int, int> _chopEdge(int i0, int i1);
-    void _createTriangle(int i0, int i1, int i2, bool cw, int e);
+    // A VNMap maps from the <vertex, normal> pairs in the original BTG
+    // file to our corrected indices.  It is used internally in load()
+    // and _massageIndices().  Every index in the BTG file goes
+    // through it, so rather than a general-purpose unordered_map, it
+    // is a flat open-addressing hash table keyed on the pair packed
+    // into 64 bits.  New indices are handed out in order, starting at
+    // 0, and the pair for each index is remembered, so there's no
+    // need to iterate over the table itself.
+    class VNMap {
+      public:
+	// Pre-sizes the table for the given number of pairs.  It will
+	// grow if needed, but that's expensive, so give a good guess.
+	VNMap(size_t expected);
+
+	// Returns the index of the given pair, adding it if necessary.
+	int insert(int v, int n);
+
+	size_t size() const { return _pairs.size(); }
+	int vertex(int index) const { return (int)(_pairs[index] >> 32); }
+	int normal(int index) const { return (int)(_pairs[index] & 0xffffffff); }
+
+	// Memory used by the table, in bytes.
+	size_t bytes() const;
+
+      protected:
+	static uint64_t _key(int v, int n) 
+	{ return ((uint64_t)(uint32_t)v << 32) | (uint32_t)n; }
+	// The slot at which to start looking for the given key.
+	size_t _slot(uint64_t key) const;
+	void _resize(size_t capacity);
+
+	// The table proper.  Each slot holds an index into _pairs (so
+	// the key itself is _pairs[index]), or -1 if it's empty.  Its
+	// size is always a power of 2, and is at least twice the
+	// number of pairs.
+	std::vector<int> _slots;
+	size_t _mask;		// _slots.size() - 1
+	// The packed <vertex, normal> pairs, in index order.
+	std::vector<uint64_t> _pairs;
+    };
+    void _massageIndices(const SGBinObjectIndices &btgIndices,
+			 VNMap &map, int_list &indices);
+
+    // Creates the simplified levels of detail in _lods.  Positions
+    // are in metres in a local frame, one per node (a node being a
+    // BTG vertex, which is shared by all of our vertices made from
+    // it), and nodes gives the node of each of our vertices.
+    void _simplify(const std::vector<double> &positions,
+		   const std::vector<int> &nodes);
+    // The triangles of the given level.
+    std::map<std::string, TrianglesVBO> &_levelTriangles(unsigned int level)
+    { return ((level == 0) || (level > _lods.size())) ? 
+	    _triangles : _lods[level - 1]; }
+
+    // Sets _rawSize after loading, tells our raw VBOs what to keep
+    // when uploaded, and measures us.
+    void _calcSize();
+    // Sets _cpuBytes and _gpuBytes.  This has to be called whenever
+    // our VBOs change, including when draw() uploads them.
+    void _calcBytes();
+
+    // The compiled scenery cache (see Bucket::cacheDir).  When we
+    // load a scenery file, we save the result (vertices, normals,
+    // elevations, triangles, and maximum elevation) in a cache file.
+    // The next time we're loaded, we read that instead of parsing
+    // the scenery file again, which is much faster.  Cache files
+    // record the scenery file's modification time and size, and the
+    // projection, and are deleted if they don't match (see also
+    // Bucket::pruneCache()).
+    SGPath _cacheFile(Bucket::Projection p) const;
+    bool _readCache(Bucket::Projection p);
+    bool _parseCache(const SGPath &cache, Bucket::Projection p);
+    void _writeCache(Bucket::Projection p);
+
+    void _palettize(WorkerPool *pool);
+    // A batch of triangle lists (in _indices) drawn in one colour.
+    struct _ColourBatch {
+	sgVec4 colour;
+	TriangleListsVBO::Batch batch;
+    };
+    // Moves the triangles to be drawn into _indices, and creates
+    // batches for them.
+    void _pack(WorkerPool *pool);
+    void _batch();
+    void _addToBatch(std::vector<_ColourBatch> &batches, const float *colour,
+		     size_t list);
+    // Contour chopping is done in parallel, by _Chopper jobs, each of
+    // which chops a run of triangles into its own buffers.
+    // _mergeChop() adds a chopper's results to ours.  See
+    // _palettize().
+    class _Chopper;
+    friend class _Chopper;
+    void _mergeChop(_Chopper &c, bool last);
     void _checkTriangle(int i0, int i1, int i2, int e);
-    void _doEdgeContour(int i0, int i1, int e0);
-    void _addElevationSlice(std::deque<int> &vs, int e, bool cw);
 
     SGPath _path;
     bool _loaded;
@@ -283,10 +517,11 @@ class Subbucket {
     // 3], _vertices[n * 3 + 1], and _vertices[n * 3 + 2].  The
     // corresponding normal for that vertex is at the same place in
     // the _normals array.  The elevation of that vertex is at
-    // _elevations[n].
+    // _elevations[n].  Elevations are only uploaded to the GPU if
+    // we're shaded (see _shaded).
     VertexVBO _vertices;
     NormalVBO _normals;
-    std::vector<float> _elevations;
+    ElevationVBO _elevations;
 
     // All of our triangles, indexed by material.  For example, all of
     // the "water" triangles can be found at _triangles["water"].  The
@@ -301,6 +536,16 @@ class Subbucket {
     // elevation.
     std::map<std::string, TrianglesVBO> _triangles;
 
+    // Simplified versions of _triangles, one per level of detail
+    // after 0 (so _lods[0] is level 1).  They have the same
+    // materials as _triangles, and index the same vertices.
+    std::vector<std::map<std::string, TrianglesVBO> > _lods;
+    // The level of detail we should draw, and the one we've been
+    // palettized with.
+    unsigned int _level, _palettizedLevel;
+    // The number of triangles at each level.
+    std::vector<size_t> _triangleCounts;
+
     // These depend on the palette that we have loaded.  The elevation
     // indices vector stores contour indices (as returned by the
     // palette), while the colours has smoothed RGBA colours (also as
@@ -313,13 +558,25 @@ class Subbucket {
     // This is true if we've used the current palette to slice, dice,
     // and colour the subbucket triangles.
     bool _palettized;
+    // If true, we were palettized to be coloured by ContourShader
+    // rather than by chopping, so _elevationIndices, _colours,
+    // _contours, and _contourLines are empty, and _vertices,
+    // _normals, and _elevations only have the raw data.  See
+    // Bucket::shadedContours.
+    bool _shaded;
 
     // The number of vertices, normals, elevations, etc, before
     // contour chopping.
     unsigned int _rawSize;
 
-    // The approximate size of the loaded data, in bytes.
-    unsigned int _bytes;
+    // See cpuBytes() and gpuBytes().  What draw() uploads depends on
+    // how it draws, so we remeasure after drawing in a new way (eg,
+    // with contour lines turned on).  _measuredMode records the way
+    // we last drew when we measured (-1 if we haven't drawn since).
+    size_t _cpuBytes, _gpuBytes;
+    int _measuredMode;
+    // See scratchBytes().
+    size_t _scratchBytes;
 
     // When we load a palette, we see which triangles (in _triangles)
     // are to be coloured by material - those materials are added to
@@ -332,8 +589,24 @@ class Subbucket {
     // through them (creating more, smaller, triangles).  We store
     // these triangles based on their colour index in the palette.
     // So, for example, _contours[3] has a list of vertex indices for
-    // triangles coloured with the fourth contour colour.
+    // triangles coloured with the fourth contour colour.  These are
+    // only used while palettizing - at the end they're moved to
+    // _indices (see _pack()).
     std::vector<TrianglesVBO> _contours;
+
+    // Everything we draw as triangles (except polygon edges, which
+    // use _triangles), packed into a single buffer by _pack().  There
+    // is one list per material in _materials, followed by one list
+    // per contour interval (or, if we're shaded, per material
+    // coloured by elevation).
+    TriangleListsVBO _indices;
+    // The lists in _indices are drawn in batches, one per colour.
+    // Material lists with the same colour are drawn together, as are
+    // contour lists with the same colour (when drawing discrete
+    // contours).  When we draw smooth contours, or are shaded, all
+    // contour lists are drawn in a single batch.
+    std::vector<_ColourBatch> _materialBatches, _contourBatches;
+    TriangleListsVBO::Batch _allContours;
     
     // A list of vertex index pairs, each one representing a contour
     // line segment (ie, GL_LINES format).  This is used for drawing
@@ -347,13 +620,14 @@ class Subbucket {
     // then add the contents of the set to _contourLines at the end.
     std::tr1::unordered_set<std::pair<int, int>, PairHash> _edgeContours;
 
-    // This is used while slicing triangles along contour lines.
-    // There is one entry per unique triangle edge (which is
-    // identified by the vertex indices of the two endpoints).  For
-    // each edge we store the beginning index of its intermediate
-    // vertices (one vertex per contour passing through the edge), and
-    // the number of intermediate vertices.  These vertices are
-    // created sequentially.
+    // This is used while merging chopped triangles (see
+    // _mergeChop()).  There is one entry per unique triangle edge
+    // (which is identified by the vertex indices of the two
+    // endpoints) that has had vertices created along it.  For each
+    // edge we store the beginning index of its intermediate vertices
+    // (one vertex per contour passing through the edge), and the
+    // number of intermediate vertices.  These vertices are created
+    // sequentially.
     std::tr1::unordered_map<std::pair<int, int>, 
 			    std::pair<int, int>, PairHash> _edgeMap;
 };
@@ -0,0 +1,97 @@
+/*-------------------------------------------------------------------------
+  TestScenery.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// Our include file
+#include "TestScenery.hxx"
+
+// C++ system include files
+#include <cmath>
+#include <vector>
+
+// Other libraries' include files
+#include <simgear/io/sg_binobj.hxx>
+#include <simgear/math/SGMath.hxx>
+
+using namespace std;
+
+// A repeatable bit of noise for the point <i, j>, from -1.0 to 1.0.
+static double __noise(int i, int j)
+{
+    unsigned int h = (unsigned int)i * 73856093U ^ (unsigned int)j * 19349663U;
+    h ^= h >> 13;
+    h *= 0x5bd1e995U;
+    h ^= h >> 15;
+
+    return (h % 2001) / 1000.0 - 1.0;
+}
+
+bool writeTestScenery(const SGPath &file, const SGBucket &bucket, int n)
+{
+    double west = bucket.get_center_lon() - bucket.get_width() / 2.0;
+    double south = bucket.get_center_lat() - bucket.get_height() / 2.0;
+    SGVec3d centre = SGVec3d::fromGeod(bucket.get_center());
+
+    vector<SGVec3d> nodes;
+    vector<SGVec3f> normals;
+    for (int i = 0; i < n; i++) {
+	for (int j = 0; j < n; j++) {
+	    double lat = south + bucket.get_height() * i / (n - 1);
+	    double lon = west + bucket.get_width() * j / (n - 1);
+	    // Elevations depend only on position, so that neighbouring
+	    // buckets join up.
+	    double elev = 400.0 + 450.0 * sin(lat * 30.0) * cos(lon * 25.0) +
+		40.0 * __noise(lround(lat * 1e5), lround(lon * 1e5));
+	    SGVec3d p = SGVec3d::fromGeod(SGGeod::fromDegM(lon, lat, elev));
+	    nodes.push_back(p);
+	    normals.push_back(toVec3f(normalize(p)));
+	}
+    }
+
+    SGBinObject btg;
+    btg.set_gbs_center(centre);
+    btg.set_gbs_radius(length(nodes.front() - centre));
+    btg.set_wgs84_nodes(nodes);
+    btg.set_normals(normals);
+    vector<SGVec2f> texcoords(1, SGVec2f(0.0, 0.0));
+    btg.set_texcoords(texcoords);
+
+    // Two triangles per grid square, wound counterclockwise (seen from
+    // above), as in real scenery.
+    for (int i = 0; i < n - 1; i++) {
+	for (int j = 0; j < n - 1; j++) {
+	    int sw = i * n + j, se = sw + 1, nw = sw + n, ne = nw + 1;
+	    int corners[2][3] = {{sw, se, ne}, {sw, ne, nw}};
+	    for (int k = 0; k < 2; k++) {
+		SGBinObjectTriangle tri;
+		tri.tc_list.resize(MAX_TC_SETS);
+		tri.va_list.resize(MAX_VAS);
+		tri.material = ((i / 6 + j / 9) % 7 == 3) ? "Lake" : "Grass";
+		tri.v_list.assign(corners[k], corners[k] + 3);
+		tri.n_list = tri.v_list;
+		btg.add_triangle(tri);
+	    }
+	}
+    }
+
+    return btg.write_bin_file(file);
+}
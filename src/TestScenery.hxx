@@ -0,0 +1,44 @@
+/*-------------------------------------------------------------------------
+  TestScenery.hxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  Makes synthetic scenery for the tests run by 'make check', so that
+  they don't depend on any real scenery being installed.  The scenery
+  is always the same, so tests can compare what they make from it with
+  known results.
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+#ifndef _TESTSCENERY_H_
+#define _TESTSCENERY_H_
+
+#include <simgear/bucket/newbucket.hxx> // SGBucket
+#include <simgear/misc/sg_path.hxx>	// SGPath
+
+// Writes a scenery (BTG) file for the given bucket: an n x n grid of
+// vertices covering it, with hills from about -100 to 900 metres, so
+// that it crosses several contours of the default palette.  The
+// hills are the same wherever they're made, so the scenery of
+// neighbouring buckets matches along their edges.  Most triangles are
+// coloured by elevation, but there are a few lakes.
+// Returns false if the file couldn't be written.
+bool writeTestScenery(const SGPath &file, const SGBucket &bucket, int n);
+
+#endif // _TESTSCENERY_H_
@@ -0,0 +1,294 @@
+/*-------------------------------------------------------------------------
+  TextureArray.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// As in Subbucket.cxx, glew must come before anything that includes
+// gl.h.
+#include <GL/glew.h>
+
+// Our include file
+#include "TextureArray.hxx"
+
+// C++ system include files
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+using namespace std;
+
+// We keep arrays to about this many bytes (but always allow at least
+// one layer).
+static const size_t __maxArrayBytes = 8 * 1024 * 1024;
+
+// All our arrays, and the shader program that draws them (0 if we
+// don't have one).
+static vector<TextureArray *> __arrays;
+static GLuint __program = 0;
+
+unsigned int TextureArray::__generation = 0;
+
+// The size of one size x size layer, with all its mipmaps.
+static size_t __layerBytes(int size, int depth)
+{
+    size_t result = 0;
+    for (; size > 0; size /= 2) {
+	result += (size_t)size * size * depth;
+    }
+
+    return result;
+}
+
+// The shaders.  The vertex shader passes on the texture coordinates
+// (s, t, and layer) and the primary colour, and the fragment shader
+// looks up the texel and applies it as GL_DECAL would.
+static const char *__vertexShader =
+    "#version 120\n"
+    "void main()\n"
+    "{\n"
+    "    gl_Position = ftransform();\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "    gl_FrontColor = gl_Color;\n"
+    "}\n";
+
+static const char *__fragmentShader =
+    "#version 120\n"
+    "#extension GL_EXT_texture_array : require\n"
+    "uniform sampler2DArray maps;\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 t = texture2DArray(maps, gl_TexCoord[0].stp);\n"
+    "    gl_FragColor = vec4(mix(gl_Color.rgb, t.rgb, t.a), gl_Color.a);\n"
+    "}\n";
+
+// Compiles the given shader, printing the log and returning 0 if it
+// fails.
+static GLuint __compileShader(GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+	GLint length;
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+	vector<GLchar> log(length + 1, '\0');
+	glGetShaderInfoLog(shader, length, NULL, &log[0]);
+	fprintf(stderr, "TextureArray: compile failed:\n%s\n", &log[0]);
+	glDeleteShader(shader);
+	shader = 0;
+    }
+
+    return shader;
+}
+
+// Compiles and links our shader program, returning 0 if it fails.
+static GLuint __compile()
+{
+    GLuint vs = __compileShader(GL_VERTEX_SHADER, __vertexShader);
+    GLuint fs = __compileShader(GL_FRAGMENT_SHADER, __fragmentShader);
+    if ((vs == 0) || (fs == 0)) {
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+	return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    glLinkProgram(program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint ok;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+	GLint length;
+	glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+	vector<GLchar> log(length + 1, '\0');
+	glGetProgramInfoLog(program, length, NULL, &log[0]);
+	fprintf(stderr, "TextureArray: link failed:\n%s\n", &log[0]);
+	glDeleteProgram(program);
+	return 0;
+    }
+
+    // The maps are always on texture unit 0.
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "maps"), 0);
+    glUseProgram(0);
+
+    return program;
+}
+
+bool TextureArray::supported()
+{
+    static bool tried = false;
+    if (!tried) {
+	tried = true;
+	if (GLEW_VERSION_2_0 && GLEW_EXT_texture_array) {
+	    __program = __compile();
+	}
+    }
+
+    return (__program != 0);
+}
+
+TextureArray *TextureArray::allocate(int size, int depth, int *layer)
+{
+    assert(supported());
+    ++__generation;
+
+    // Look for a free layer in an existing array.
+    for (size_t i = 0; i < __arrays.size(); i++) {
+	TextureArray *a = __arrays[i];
+	if ((a->_size != size) || (a->_depth != depth) ||
+	    (a->_count == a->_layers)) {
+	    continue;
+	}
+	for (int l = 0; l < a->_layers; l++) {
+	    if (!a->_used[l]) {
+		a->_used[l] = true;
+		a->_count++;
+		*layer = l;
+		return a;
+	    }
+	}
+    }
+
+    // None, so make a new array.
+    GLint maxLayers;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS_EXT, &maxLayers);
+    int layers = (int)(__maxArrayBytes / __layerBytes(size, depth));
+    layers = max(1, min(layers, (int)maxLayers));
+    TextureArray *a = new TextureArray(size, depth, layers);
+    __arrays.push_back(a);
+
+    a->_used[0] = true;
+    a->_count = 1;
+    *layer = 0;
+
+    return a;
+}
+
+void TextureArray::release(int layer)
+{
+    assert(_used[layer]);
+    ++__generation;
+
+    _used[layer] = false;
+    if (--_count == 0) {
+	__arrays.erase(find(__arrays.begin(), __arrays.end(), this));
+	delete this;
+    }
+}
+
+void TextureArray::upload(int layer, const GLvoid *data,
+			  int width, int height)
+{
+    assert(_used[layer] && (max(width, height) == _size));
+    ++__generation;
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, _name);
+    glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    GLenum format = (_depth == 3) ? GL_RGB : GL_RGBA;
+    const char *image = (const char *)data;
+    for (int l = 0, size = _size; size > 0; l++, size /= 2) {
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY_EXT, l, 0, 0, layer,
+			width, height, 1, format, GL_UNSIGNED_BYTE, image);
+
+	// If the image doesn't fill the layer, we copy its last
+	// column (or row) into the next one over, so that filtering
+	// at its edge doesn't pick up whatever is beside it (in the
+	// same way that GL_CLAMP_TO_EDGE would for an ordinary
+	// texture).  Since the image fills the layer in one direction,
+	// we never need to do both.
+	if (width < size) {
+	    glPixelStorei(GL_UNPACK_SKIP_PIXELS, width - 1);
+	    glTexSubImage3D(GL_TEXTURE_2D_ARRAY_EXT, l, width, 0, layer,
+			    1, height, 1, format, GL_UNSIGNED_BYTE, image);
+	    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+	}
+	if (height < size) {
+	    glPixelStorei(GL_UNPACK_SKIP_ROWS, height - 1);
+	    glTexSubImage3D(GL_TEXTURE_2D_ARRAY_EXT, l, 0, height, layer,
+			    width, 1, 1, format, GL_UNSIGNED_BYTE, image);
+	    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+	}
+
+	image += (size_t)width * height * _depth;
+	width = max(width / 2, 1);
+	height = max(height / 2, 1);
+    }
+    glPopClientAttrib();
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, 0);
+}
+
+void TextureArray::begin()
+{
+    glPushAttrib(GL_TEXTURE_BIT);
+    glUseProgram(__program);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void TextureArray::bind()
+{
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, _name);
+}
+
+void TextureArray::end()
+{
+    glUseProgram(0);
+    glPopAttrib();
+}
+
+TextureArray::TextureArray(int size, int depth, int layers):
+    _size(size), _depth(depth), _layers(layers),
+    _layerBytes(__layerBytes(size, depth)), _used(layers, false), _count(0)
+{
+    glGenTextures(1, &_name);
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, _name);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_WRAP_S,
+		    GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_WRAP_T,
+		    GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MAG_FILTER,
+		    GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MIN_FILTER,
+		    GL_LINEAR_MIPMAP_LINEAR);
+
+    // Allocate all the levels, for all the layers.
+    GLenum internal = (_depth == 3) ? GL_RGB8 : GL_RGBA8;
+    GLenum format = (_depth == 3) ? GL_RGB : GL_RGBA;
+    for (int l = 0, s = _size; s > 0; l++, s /= 2) {
+	glTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, l, internal, s, s, _layers, 0,
+		     format, GL_UNSIGNED_BYTE, NULL);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, 0);
+}
+
+TextureArray::~TextureArray()
+{
+    glDeleteTextures(1, &_name);
+}
@@ -0,0 +1,112 @@
+/*-------------------------------------------------------------------------
+  TextureArray.hxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+#ifndef _TEXTUREARRAY_H_
+#define _TEXTUREARRAY_H_
+
+#include <cstddef>
+#include <vector>
+
+#if defined( __APPLE__)		// For GLuint
+#  include <OpenGL/gl.h>
+#else
+#  include <GL/gl.h>
+#endif
+
+// Drawing maps one at a time means binding a texture and making a
+// draw call for every visible tile, and zoomed out there can be
+// hundreds or thousands of them.  A texture array (the
+// EXT_texture_array extension) holds many textures of the same size
+// as the layers of one texture, so all the maps in it can be drawn
+// with a single draw call, with the layer given as a third texture
+// coordinate.
+//
+// Maps at a given level are 2^level pixels high, and at most that
+// wide (narrower at high latitudes), so each level gets arrays of
+// square layers, size x size.  A narrower map goes in the left part
+// of its layer, and should be drawn with s coordinates scaled by
+// width / size.
+//
+// Arrays are created as needed, and deleted when their last layer is
+// released.  Since an array is allocated all at once, we keep arrays
+// to a modest size (which means big maps get just a few layers per
+// array).
+//
+// Texture arrays can't be used by the fixed-function pipeline, so we
+// draw them with a shader, and need OpenGL 2.0 as well as the
+// extension.  Check supported() before using them.  The first call to
+// supported() compiles the shader, so there must be a current OpenGL
+// context.  Like ContourShader, this is only meant to be used from the
+// main thread.
+class TextureArray {
+  public:
+    static bool supported();
+
+    // Finds a free layer for a size x size texture of the given depth
+    // (3 for RGB, 4 for RGBA), creating a new array if necessary.
+    // Returns the array, with the layer in *layer.
+    static TextureArray *allocate(int size, int depth, int *layer);
+    // Frees a layer.  If it was the last one in use, the array is
+    // deleted.
+    void release(int layer);
+
+    // Loads an image into the given layer.  The image is width x
+    // height (both powers of 2, the larger of them equal to size),
+    // followed by its complete mipmap chain, packed with no padding
+    // (as in Texture::_create()).  As with glTexSubImage3D(), data may be an
+    // offset into the currently bound pixel buffer object.
+    void upload(int layer, const GLvoid *data, int width, int height);
+
+    GLuint name() const { return _name; }
+    int size() const { return _size; }
+    // GPU memory used by a single layer, including mipmaps.
+    size_t layerBytes() const { return _layerBytes; }
+
+    // This changes whenever a layer is allocated, released, or
+    // loaded, so that anyone batching up layers to draw knows when
+    // their batches are out of date.
+    static unsigned int generation() { return __generation; }
+
+    // To draw, call begin(), then bind() each array in turn and draw
+    // its triangles (with vertices and 3D texture coordinates),
+    // then call end().  Like GL_DECAL, textures replace the primary
+    // colour (or are blended with it, if they have alpha).
+    static void begin();
+    void bind();
+    static void end();
+
+  protected:
+    TextureArray(int size, int depth, int layers);
+    ~TextureArray();
+
+    static unsigned int __generation;
+
+    GLuint _name;
+    int _size, _depth, _layers;
+    size_t _layerBytes;
+    // Which layers are in use, and how many.
+    std::vector<bool> _used;
+    int _count;
+};
+
+#endif // _TEXTUREARRAY_H_
@@ -30,19 +30,165 @@
 #include "TileMapper.hxx"
 
 // C++ system files
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 
+// System include files
+#ifdef WIN32
+#  include <io.h>
+#else
+#  include <unistd.h>
+#endif
+
 // Other libraries' include files
 #include <simgear/misc/sg_path.hxx>
+#include <simgear/threads/SGGuard.hxx>
+#include <simgear/threads/SGThread.hxx>
 
 // Our project's include files
 #include "Bucket.hxx"
+#include "Downsampler.hxx"
 #include "Image.hxx"
+#include "MapArchive.hxx"
 #include "Palette.hxx"
+#include "Rasterizer.hxx"
 #include "Tiles.hxx"
+#include "WorkerPool.hxx"
 
 using namespace std;
 
+// Maps for all the tiles in a chunk go in the same map archive, so
+// only one save job at a time is allowed to change archives.
+static SGMutex __archiveMutex;
+
+// The diffuse brightness of our light.  The values used here must be
+// the same as used in Atlas if you want live scenery to match
+// pre-rendered scenery (the same goes for the palette used).
+// EYE - make this a global constant
+static const float __brightness = 0.8;
+
+// When reading back asynchronously, we allow this many tiles' images
+// to be in flight between the GPU and us before waiting for the
+// oldest.
+static const size_t __maxReadbacks = 4;
+
+// True if we can read maps back asynchronously, with pixel buffer
+// objects and fences.
+static bool __asyncReadback()
+{
+    return (GLEW_VERSION_2_1 || GLEW_ARB_pixel_buffer_object) && 
+	GLEW_ARB_sync;
+}
+
+// Encodes and writes a map.  This may be done in a worker thread, so
+// the job is given everything it needs when it's created, and
+// doesn't look at the tile mapper or the tile.  The image belongs to
+// the tile mapper, which fills it in before the job is run, and
+// recycles it after.
+class TileMapper::SaveJob: public WorkerPool::Job {
+  public:
+    SaveJob(vector<GLubyte> *image, int width, int height, 
+	    float maximumElevation, Tile *t, unsigned int level, 
+	    ImageType imageType, unsigned int JPEGQuality, bool packed);
+
+    void run();
+
+    vector<GLubyte> *image() const { return _image; }
+    Tile *tile() const { return _tile; }
+    unsigned int level() const { return _level; }
+
+  protected:
+    vector<GLubyte> *_image;
+    Tile *_tile;
+    unsigned int _level;
+    int _width, _height;
+    float _maximumElevation;
+    string _name;
+    SGPath _png, _jpg, _archive;
+    unsigned int _slot;
+    ImageType _imageType;
+    unsigned int _JPEGQuality;
+    bool _packed;
+};
+
+TileMapper::SaveJob::SaveJob(vector<GLubyte> *image, int width, int height, 
+			     float maximumElevation, Tile *t, 
+			     unsigned int level, ImageType imageType, 
+			     unsigned int JPEGQuality, bool packed):
+    _image(image), _tile(t), _level(level), _width(width), _height(height), 
+    _maximumElevation(maximumElevation), _name(t->name()), 
+    _slot(MapArchive::slot(t->name())), _imageType(imageType), 
+    _JPEGQuality(JPEGQuality), _packed(packed)
+{
+    // We save it in _atlas/size/_name.<type> (if that makes any
+    // sense), or in the chunk's map archive, _atlas/size/<chunk>.pack.
+    SGPath dir = t->mapsDir();
+    char str[3];
+    snprintf(str, 3, "%d", level);
+    dir.append(str);
+    SGPath file = dir;
+    file.append(t->name());
+    _png = _jpg = file;
+    _png.concat(".png");
+    _jpg.concat(".jpg");
+    _archive = MapArchive::path(dir, t->chunk()->name());
+}
+
+void TileMapper::SaveJob::run()
+{
+    if (_packed) {
+	vector<char> data;
+	if (_imageType == PNG) {
+	    encodePNG(data, &(*_image)[0], _width, _height, 
+		      _maximumElevation);
+	} else if (_imageType == JPEG) {
+	    encodeJPEG(data, _JPEGQuality, 
+		       &(*_image)[0], _width, _height, _maximumElevation);
+	}
+
+	SGGuard<SGMutex> g(__archiveMutex);
+	if (!data.empty() &&
+	    MapArchive::add(_archive, _slot, &data[0], data.size(), 
+			    _maximumElevation)) {
+	    // Get rid of any old loose files, so that there's only
+	    // one copy of the map.
+	    unlink(_png.c_str());
+	    unlink(_jpg.c_str());
+	} else {
+	    fprintf(stderr, "TileMapper::save: couldn't add %s to '%s'\n",
+		    _name.c_str(), _archive.c_str());
+	}
+    } else {
+	if (_imageType == PNG) {
+	    savePNG(_png.c_str(), &(*_image)[0], _width, _height, 
+		    _maximumElevation);
+	} else if (_imageType == JPEG) {
+	    saveJPEG(_jpg.c_str(), _JPEGQuality, 
+		     &(*_image)[0], _width, _height, _maximumElevation);
+	}
+	// Likewise, make sure the archive (if there is one) doesn't
+	// have an old copy.
+	SGGuard<SGMutex> g(__archiveMutex);
+	MapArchive::remove(_archive, _slot);
+    }
+}
+
+// A tile's full-sized image, and the jobs waiting to be given their
+// maps, which are made from it.  If buffer isn't 0, the image is
+// being read back from the GPU into that pixel buffer object, and
+// once the fence has been passed, we copy it into image.
+class TileMapper::Readback {
+  public:
+    Readback(): buffer(0), fence(0), image(NULL) {}
+
+    GLuint buffer;
+    GLsync fence;
+    vector<GLubyte> *image;
+    int width, height;
+    vector<SaveJob *> jobs;
+};
+
 // We generate maps by rendering to a frame buffer, the generating a
 // texture from the results.  Therefore, the biggest map we can create
 // is limited to the smaller of the maximum frame buffer size and
@@ -90,12 +236,16 @@ TileMapper::TileMapper(Palette *p, unsigned int maxDesiredLevel,
 		       bool discreteContours, bool contourLines,
 		       float azimuth, float elevation, bool lighting, 
 		       bool smoothShading, ImageType imageType, 
-		       unsigned int JPEGQuality):
+		       unsigned int JPEGQuality, bool packed,
+		       WorkerPool *loader, WorkerPool *encoder,
+		       Renderer renderer):
     _palette(p), _maxLevel(maxDesiredLevel),
     _discreteContours(discreteContours), _contourLines(contourLines),
     _azimuth(azimuth), _elevation(elevation), _lighting(lighting),
     _smoothShading(smoothShading), _imageType(imageType), 
-    _JPEGQuality(JPEGQuality), _tile(NULL), _to(0)
+    _JPEGQuality(JPEGQuality), _packed(packed), _renderer(renderer),
+    _tile(NULL), _loader(loader), _encoder(encoder), _readback(NULL),
+    _to(0)
 {
     // We must have a palette.
     if (!_palette) {
@@ -117,16 +267,59 @@ TileMapper::TileMapper(Palette *p, unsigned int maxDesiredLevel,
 
 TileMapper::~TileMapper()
 {
+    finish();
     _unloadBuckets();
+    while (!_prefetched.empty()) {
+	Prefetch &p = _prefetched.front();
+	for (size_t i = 0; i < p.buckets.size(); i++) {
+	    delete p.buckets[i];
+	}
+	_prefetched.pop_front();
+    }
+
+    // Delete the texture object and pixel buffer objects (if we made
+    // any - when rendering on the CPU, there may not even be an
+    // OpenGL context).
+    if (_to != 0) {
+	glDeleteTextures(1, &_to);
+    }
+    if (!_freeBuffers.empty()) {
+	glDeleteBuffers(_freeBuffers.size(), &_freeBuffers[0]);
+    }
+    for (size_t i = 0; i < _freeImages.size(); i++) {
+	delete _freeImages[i];
+    }
+}
+
+// Starts loading the given tile's buckets in the background.
+void TileMapper::prefetch(Tile *t)
+{
+    if (!_loader || !t) {
+	return;
+    }
 
-    // Delete the texture object.
-    glDeleteTextures(1, &_to);
+    Prefetch p;
+    p.tile = t;
+    vector<long int> indices;
+    t->bucketIndices(indices);
+    for (unsigned int i = 0; i < indices.size(); i++) {
+    	Bucket *b = new Bucket(t->sceneryDir(), indices[i]);
+    	b->load(Bucket::RECTANGULAR, _loader);
+    	p.buckets.push_back(b);
+    }
+    _prefetched.push_back(p);
 }
 
 // Tells TileMapper which tile is to be rendered.  We load the tile's
-// buckets, and set _maximumElevation.
+// buckets (or take them from the prefetched tiles), and set
+// _maximumElevation.
 void TileMapper::set(Tile *t)
 {
+    // We're done with the current tile's image (if any).  Pass on any
+    // maps that have been read back while we were busy.
+    _closeReadback();
+    _reapReadbacks(false);
+
     // Remove any old information we have.
     _unloadBuckets();
 
@@ -136,49 +329,163 @@ void TileMapper::set(Tile *t)
 	return;
     }
 
-    vector<long int> indices;
-    _tile->bucketIndices(indices);
-    for (unsigned int i = 0; i < indices.size(); i++) {
-    	Bucket *b = new Bucket(_tile->sceneryDir(), indices[i]);
-    	b->load(Bucket::RECTANGULAR);
+    // Throw away any prefetched tiles before this one (if it was
+    // prefetched).
+    size_t skipped = 0;
+    while ((skipped < _prefetched.size()) && 
+	   (_prefetched[skipped].tile != _tile)) {
+	skipped++;
+    }
+    if (skipped == _prefetched.size()) {
+	skipped = 0;
+    }
+    for (; skipped > 0; skipped--) {
+	Prefetch &p = _prefetched.front();
+	for (size_t i = 0; i < p.buckets.size(); i++) {
+	    delete p.buckets[i];
+	}
+	_prefetched.pop_front();
+    }
 
-    	_buckets.push_back(b);
+    if (!_prefetched.empty() && (_prefetched.front().tile == _tile)) {
+	// We've got it.  The buckets may still be loading, in which
+	// case we wait.
+	_buckets.swap(_prefetched.front().buckets);
+	_prefetched.pop_front();
+	for (unsigned int i = 0; i < _buckets.size(); i++) {
+	    _buckets[i]->wait();
+	}
+    } else {
+	vector<long int> indices;
+	_tile->bucketIndices(indices);
+	for (unsigned int i = 0; i < indices.size(); i++) {
+	    Bucket *b = new Bucket(_tile->sceneryDir(), indices[i]);
+	    b->load(Bucket::RECTANGULAR);
+	    _buckets.push_back(b);
+	}
+    }
 
-    	if (b->maximumElevation() > _maximumElevation) {
-    	    _maximumElevation = b->maximumElevation();
+    for (unsigned int i = 0; i < _buckets.size(); i++) {
+    	if (_buckets[i]->maximumElevation() > _maximumElevation) {
+    	    _maximumElevation = _buckets[i]->maximumElevation();
     	}
     }
 }
 
-// Draws the tile into a mipmapped texture (_to) via a multisampled
-// renderbuffer (fboms/rbo).
-void TileMapper::render()
+size_t TileMapper::scratchBytes() const
 {
-    // EYE - remove this eventually
-    assert(glGetError() == GL_NO_ERROR);
+    size_t result = 0;
+    for (unsigned int i = 0; i < _buckets.size(); i++) {
+	result = max(result, _buckets[i]->scratchBytes());
+    }
+
+    return result;
+}
+
+// Loads the tile's map at _maxLevel into _readback, as if we'd
+// rendered it and called save().
+bool TileMapper::setFromMap(Tile *t)
+{
+    set(NULL);
+    if (!t || !t->maps()[_maxLevel]) {
+	return false;
+    }
+
+    // The map is either in _atlas/size/<chunk>.pack, or
+    // _atlas/size/_name.<type> (see SaveJob).
+    SGPath dir = t->mapsDir();
+    char str[3];
+    snprintf(str, 3, "%d", _maxLevel);
+    dir.append(str);
+
+    _tile = t;
+    _setSize();
+    vector<GLubyte> *image = _getImage((size_t)_width * _height * 3);
+    char *buffer = (char *)&(*image)[0], *data = NULL;
+    int width = 0, height = 0, depth = 0;
+    float maximumElevation = Bucket::NanE;
+    if (t->mapPacked(_maxLevel)) {
+	MapArchive archive(MapArchive::path(dir, t->chunk()->name()));
+	const char *compressed;
+	size_t length;
+	if (archive.valid() && 
+	    (compressed = archive.image(MapArchive::slot(t->name()), 
+					&length))) {
+	    data = decodeImage(compressed, length, &width, &height, &depth,
+			       &maximumElevation, buffer, image->size());
+	}
+    } else {
+	SGPath file = dir;
+	file.append(t->name());
+	SGPath jpg = file, png = file;
+	jpg.concat(".jpg");
+	png.concat(".png");
+	if (jpg.exists()) {
+	    data = loadJPEG(jpg.c_str(), &width, &height, &depth,
+			    &maximumElevation, buffer, image->size());
+	} else if (png.exists()) {
+	    data = loadPNG(png.c_str(), &width, &height, &depth,
+			   &maximumElevation, buffer, image->size());
+	}
+    }
+
+    // It has to be just what we would have rendered.
+    if ((data != buffer) || (width != _width) || (height != _height) || 
+	(depth != 3)) {
+	if (data != buffer) {
+	    delete []data;
+	}
+	_freeImages.push_back(image);
+	_tile = NULL;
+	return false;
+    }
+
+    // Images are loaded top row first, but we (like OpenGL) work
+    // bottom row first.
+    size_t stride = (size_t)_width * 3;
+    for (int y = 0; y < _height / 2; y++) {
+	swap_ranges(image->begin() + y * stride, 
+		    image->begin() + (y + 1) * stride,
+		    image->begin() + (_height - 1 - y) * stride);
+    }
+
+    _maximumElevation = maximumElevation;
+    _readback = new Readback;
+    _readback->image = image;
+    _readback->width = _width;
+    _readback->height = _height;
+
+    return true;
+}
 
+// Draws the tile into a texture (_to) via a multisampled
+// renderbuffer (fboms/rbo), or, on the CPU, into _image.
+void TileMapper::render()
+{
     if (!_palette || !_tile) {
 	// EYE - throw an error?
 	return;
     }
 
-    // Calculate the proper width and height for the given level.
-    // Note that we don't check if _maxLevel is reasonable - that's up
-    // to the caller.
-    _tile->mapSize(_maxLevel, &_width, &_height);
-    // EYE - What could reasonably be described as a hack.  At the
-    // poles, a tile is 4x wider than it is high.  At a map resolution
-    // of 10, this results in a 4096x1024 renderbuffer/texture/map.
-    // More importantly, with my video card it hangs the machine.  I
-    // can find no way to query OpenGL state to predict reliably that
-    // this will happen.  However, limiting the width of the tiles to
-    // no more than the height works (for a reasonable height of
-    // course).  It's a bit scary, and it would be nice to have a
-    // reliable way to determine buffer size limits.
-    if (_width > _height) {
-	_width = _height;
+    // Any maps already asked for are made from the old image.
+    _closeReadback();
+    _setSize();
+
+    // Colour the buckets.  Drawing them would do it anyway, but only
+    // in this thread - this way the loaders help.
+    for (unsigned int i = 0; i < _buckets.size(); i++) {
+	_buckets[i]->palettize(_loader);
     }
 
+    if (_renderer == CPU) {
+	_rasterize();
+	return;
+    }
+    _reapReadbacks(false);
+
+    // EYE - remove this eventually
+    assert(glGetError() == GL_NO_ERROR);
+
     // Create the main framebuffer object and bind it to our context.
     // We'll attach a multisampled renderbuffer to it.
     GLuint fboms;
@@ -240,13 +547,9 @@ void TileMapper::render()
 	glColorMaterial(GL_FRONT, GL_AMBIENT_AND_DIFFUSE);
 	glEnable(GL_COLOR_MATERIAL);
 
-	// Set up lighting.  The values used here must be the same as used
-	// in Atlas if you want live scenery to match pre-rendered scenery
-	// (the same goes for the palette used).
+	// Set up lighting.
 	sgVec4 lightPosition;
-	// EYE - make this a global constant
-	const float brightness = 0.8;
-	GLfloat diffuse[] = {brightness, brightness, brightness, 1.0f};
+	GLfloat diffuse[] = {__brightness, __brightness, __brightness, 1.0f};
 	if (_lighting) {
 	    // We make a copy of the light position because we may rotate
 	    // it later.
@@ -280,49 +583,12 @@ void TileMapper::render()
 	    glEnd();
 	}
 
-#ifdef ROTATE_NORMALS
-	// If ROTATE_NORMALS is defined, then vertex normals will be
-	// rotated to the correct orientation in the bucket's draw()
-	// routine.
-	//     printf("TileNew: rotating normals\n");
-#else
-	// If ROTATE_NORMALS is not defined, then we just rotate the light
-	// source.
-	//
-	// To visualize this, consider looking in the default camera
-	// orientation (along the negative z-axis, with the positive
-	// y-axis 'up', and so the positive x-axis is right).  In our
-	// world coordinates, this means looking down from the north pole,
-	// with our head pointing to 90 degrees east (the Indian Ocean),
-	// and our butt pointing to 90 degrees west (Lake Superior).  What
-	// do we need to do to rotate to an arbitrary <lat, lon>?
-	//
-	// Consider moving to <-123, 37> (KSFO).  Our local coordinate
-	// system is initially aligned with the world's.  First, we need
-	// to rotate our local coordinate system 33 degrees clockwise
-	// around our negative z-axis (a pin through our belly button), so
-	// our butt is facing KSFO.  Rotations are specified around the
-	// positive axis, so that corresponds to rotating it -33 degrees
-	// clockwise around the positive z-axis.  This corresponds to 90.0
-	// + lon.
-	//
-	// Then, we need to rotate it 53 degrees clockwise around the
-	// positive y-axis (aligned with our right arm).  This corresponds
-	// to 90.0 - lat.
-
+	// For the buckets, the light needs to be rotated (see
+	// _rotateLight()).
 	if (_lighting) {
-	    // As a compromise, we rotate the light to be correct at the
-	    // centre of the tile.  This compromise gets worse as we near
-	    // the poles.
-	    float cLat = _tile->centreLat();
-	    float cLon = _tile->centreLon();
-	    sgMat4 rot;
-	    sgMakeRotMat4(rot, 90.0 + cLon, 90.0 - cLat, 0.0);
-	    //     printf("TileNew: Not rotating normals\n");
-	    sgXformVec3(lightPosition, rot);
+	    _rotateLight(lightPosition);
 	    glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
 	}
-#endif
 
 	// After all that work, the drawing is a bit anticlimactic.
 	for (unsigned int i = 0; i < _buckets.size(); i++) {
@@ -361,8 +627,9 @@ void TileMapper::render()
 	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, 
-			    GL_LINEAR_MIPMAP_LINEAR);
+	    // We only ever read back the full-sized image, so it has
+	    // no mipmaps.
+	    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	}
 	glBindTexture(GL_TEXTURE_2D, _to);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, _width, _height, 0, GL_RGB, 
@@ -384,7 +651,6 @@ void TileMapper::render()
 	glBlitFramebufferEXT(0, 0, _width, _height, 
 			     0, 0, _width, _height,
 			     GL_COLOR_BUFFER_BIT, GL_LINEAR);
-	glGenerateMipmapEXT(GL_TEXTURE_2D);
 	glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, 0);
 	glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER_EXT, 0);
 
@@ -397,6 +663,114 @@ void TileMapper::render()
     glPopAttrib();
 }
 
+void TileMapper::_setSize()
+{
+    // Calculate the proper width and height for the given level.
+    // Note that we don't check if _maxLevel is reasonable - that's up
+    // to the caller.
+    _tile->mapSize(_maxLevel, &_width, &_height);
+    // EYE - What could reasonably be described as a hack.  At the
+    // poles, a tile is 4x wider than it is high.  At a map resolution
+    // of 10, this results in a 4096x1024 renderbuffer/texture/map.
+    // More importantly, with my video card it hangs the machine.  I
+    // can find no way to query OpenGL state to predict reliably that
+    // this will happen.  However, limiting the width of the tiles to
+    // no more than the height works (for a reasonable height of
+    // course).  It's a bit scary, and it would be nice to have a
+    // reliable way to determine buffer size limits.
+    if (_width > _height) {
+	_width = _height;
+    }
+}
+
+// Draws the tile into _image with a Rasterizer, setting things up just
+// as render() does for OpenGL.
+void TileMapper::_rasterize()
+{
+    Rasterizer r(_width, _height);
+
+    int lat = _tile->lat();
+    int lon = _tile->lon();
+    int w = _tile->width();
+    int h = _tile->height();
+    r.setView(lon, lon + w, lat, lat + h);
+
+    sgVec4 lightPosition;
+    sgCopyVec4(lightPosition, _lightPosition);
+    r.setLight(_lighting, lightPosition, __brightness);
+    r.setSmoothShading(_smoothShading);
+
+    // The ocean, as two triangles.
+    const float *c;
+    if ((c = _palette->colour("Ocean"))) {
+	const GLfloat west = lon, east = lon + w, south = lat, north = lat + h;
+	const GLfloat vertices[] = {west, south, 0.0, east, south, 0.0,
+				    east, north, 0.0, west, north, 0.0};
+	const GLfloat normals[] = {0.0, 0.0, 1.0, 0.0, 0.0, 1.0,
+				   0.0, 0.0, 1.0, 0.0, 0.0, 1.0};
+	const GLuint indices[] = {0, 1, 2, 0, 2, 3};
+	r.triangles(vertices, normals, NULL, c, indices, 6);
+    }
+
+    // The buckets.
+    if (_lighting) {
+	_rotateLight(lightPosition);
+	r.setLight(true, lightPosition, __brightness);
+    }
+    for (unsigned int i = 0; i < _buckets.size(); i++) {
+	_buckets[i]->rasterize(r);
+    }
+
+    // The loaders are done with this tile's buckets, so they can
+    // help.
+    _image.resize((size_t)_width * _height * 3);
+    r.finish(&_image[0], _loader);
+}
+
+void TileMapper::_rotateLight(sgVec4 lightPosition)
+{
+#ifdef ROTATE_NORMALS
+    // If ROTATE_NORMALS is defined, then vertex normals will be
+    // rotated to the correct orientation in the bucket's draw()
+    // routine.
+    //     printf("TileNew: rotating normals\n");
+#else
+    // If ROTATE_NORMALS is not defined, then we just rotate the light
+    // source.
+    //
+    // To visualize this, consider looking in the default camera
+    // orientation (along the negative z-axis, with the positive
+    // y-axis 'up', and so the positive x-axis is right).  In our
+    // world coordinates, this means looking down from the north pole,
+    // with our head pointing to 90 degrees east (the Indian Ocean),
+    // and our butt pointing to 90 degrees west (Lake Superior).  What
+    // do we need to do to rotate to an arbitrary <lat, lon>?
+    //
+    // Consider moving to <-123, 37> (KSFO).  Our local coordinate
+    // system is initially aligned with the world's.  First, we need
+    // to rotate our local coordinate system 33 degrees clockwise
+    // around our negative z-axis (a pin through our belly button), so
+    // our butt is facing KSFO.  Rotations are specified around the
+    // positive axis, so that corresponds to rotating it -33 degrees
+    // clockwise around the positive z-axis.  This corresponds to 90.0
+    // + lon.
+    //
+    // Then, we need to rotate it 53 degrees clockwise around the
+    // positive y-axis (aligned with our right arm).  This corresponds
+    // to 90.0 - lat.
+    //
+    // As a compromise, we rotate the light to be correct at the
+    // centre of the tile.  This compromise gets worse as we near the
+    // poles.
+    float cLat = _tile->centreLat();
+    float cLon = _tile->centreLon();
+    sgMat4 rot;
+    sgMakeRotMat4(rot, 90.0 + cLon, 90.0 - cLat, 0.0);
+    //     printf("TileNew: Not rotating normals\n");
+    sgXformVec3(lightPosition, rot);
+#endif
+}
+
 // Saves the currently rendered map at the given size.  We assume that
 // render() has been called.  Note that level must be <= maxLevel
 // (given in the constructor).
@@ -407,45 +781,232 @@ void TileMapper::save(unsigned int level)
     }
 
     // First, calculate the desired map size in pixels.
-    int shrinkage = _maxLevel - level;
-    int width = _width / (1 << shrinkage),
-	height = _height / (1 << shrinkage);
+    int width, height;
+    downsampledSize(_width, _height, _maxLevel - level, &width, &height);
+
+    // The map will be made once we've got the full-sized image and
+    // know what other maps are wanted (see _downsample()).
+    if (!_readback) {
+	_grab();
+    }
+    SaveJob *job = new SaveJob(_getImage((size_t)width * height * 3), 
+			       width, height, _maximumElevation,
+			       _tile, level, _imageType, _JPEGQuality, _packed);
+    _readback->jobs.push_back(job);
+    _unsaved[_tile]++;
+}
+
+Tile *TileMapper::saved()
+{
+    if (_savedTiles.empty()) {
+	return NULL;
+    }
+
+    Tile *result = _savedTiles.front();
+    _savedTiles.pop_front();
+
+    return result;
+}
+
+void TileMapper::finish()
+{
+    _closeReadback();
+    _reapReadbacks(true);
+    _reapSaves(true);
+    _checkSaved(_tile);
+}
+
+vector<GLubyte> *TileMapper::_getImage(size_t size)
+{
+    vector<GLubyte> *result;
+    if (_freeImages.empty()) {
+	result = new vector<GLubyte>;
+    } else {
+	result = _freeImages.back();
+	_freeImages.pop_back();
+    }
+    result->resize(size);
+
+    return result;
+}
 
-    // With skinny tiles, the above calculation sometimes results in
-    // zero-width tiles, so we correct it manually.
-    if (width == 0) {
-	width = 1;
+void TileMapper::_grab()
+{
+    _readback = new Readback;
+    _readback->width = _width;
+    _readback->height = _height;
+    if (_renderer == CPU) {
+	// The rasterizer has already given us the image.
+	_readback->image = _getImage(0);
+	_readback->image->swap(_image);
+	return;
     }
 
-    // Grab the image.
-    glPushAttrib(GL_TEXTURE_BIT); {
+    vector<GLubyte> *image = _getImage((size_t)_width * _height * 3);
+    _readback->image = image;
+    glPushAttrib(GL_TEXTURE_BIT);
+    glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT); {
 	glBindTexture(GL_TEXTURE_2D, _to);
-	GLubyte *image = new GLubyte[width * height * 3];
-	assert(image);
-	glGetTexImage(GL_TEXTURE_2D, shrinkage, GL_RGB, GL_UNSIGNED_BYTE, 
-		      image);
-
-	// Save to a file.  We save it in _atlas/size/_name.<type> (if
-	// that makes any sense).
-	SGPath file = _tile->mapsDir();
-	char str[3];
-	snprintf(str, 3, "%d", level);
-	file.append(str);
-	file.append(_tile->name());
-	if (_imageType == PNG) {
-	    file.concat(".png");
-	    savePNG(file.c_str(), image, width, height, _maximumElevation);
-	} else if (_imageType == JPEG) {
-	    file.concat(".jpg");
-	    saveJPEG(file.c_str(), _JPEGQuality, 
-		     image, width, height, _maximumElevation);
+	// Our buffers have no padding at the end of rows.
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	if (__asyncReadback()) {
+	    // Read the image into a pixel buffer object, and go on
+	    // our way.  Until the fence is passed, the GPU may still
+	    // be working on it (see _reapReadbacks()).
+	    if (_freeBuffers.empty()) {
+		glGenBuffers(1, &_readback->buffer);
+	    } else {
+		_readback->buffer = _freeBuffers.back();
+		_freeBuffers.pop_back();
+	    }
+	    glBindBuffer(GL_PIXEL_PACK_BUFFER, _readback->buffer);
+	    glBufferData(GL_PIXEL_PACK_BUFFER, image->size(), NULL, 
+			 GL_STREAM_READ);
+	    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, 
+			  (GLvoid *)0);
+	    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	    _readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	} else {
+	    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, 
+			  &(*image)[0]);
 	}
-    
-	delete[] image;
     }
+    glPopClientAttrib();
     glPopAttrib();
 }
 
+void TileMapper::_closeReadback()
+{
+    if (_readback) {
+	_readbacks.push_back(_readback);
+	_readback = NULL;
+    }
+}
+
+void TileMapper::_downsample(Readback *r)
+{
+    // Where each level goes (results[n - 1] for the map shrunk by
+    // 2^n).  The full-sized map is just a copy.
+    vector<GLubyte *> results(_maxLevel, (GLubyte *)NULL);
+    for (size_t i = 0; i < r->jobs.size(); i++) {
+	vector<GLubyte> *image = r->jobs[i]->image();
+	unsigned int shrinkage = _maxLevel - r->jobs[i]->level();
+	if (shrinkage == 0) {
+	    memcpy(&(*image)[0], &(*r->image)[0], image->size());
+	} else {
+	    results[shrinkage - 1] = &(*image)[0];
+	}
+    }
+    if (!results.empty()) {
+	downsample(&(*r->image)[0], r->width, r->height, 3, 
+		   results.size(), &results[0], _loader);
+    }
+
+    // If a level was asked for more than once, only one of its jobs
+    // got it.
+    for (size_t i = 0; i < r->jobs.size(); i++) {
+	vector<GLubyte> *image = r->jobs[i]->image();
+	unsigned int shrinkage = _maxLevel - r->jobs[i]->level();
+	if ((shrinkage > 0) && (results[shrinkage - 1] != &(*image)[0])) {
+	    memcpy(&(*image)[0], results[shrinkage - 1], image->size());
+	}
+    }
+
+    _freeImages.push_back(r->image);
+    for (size_t i = 0; i < r->jobs.size(); i++) {
+	_submit(r->jobs[i]);
+    }
+}
+
+void TileMapper::_submit(SaveJob *job)
+{
+    if (_encoder) {
+	_encoder->submit(job);
+	_saves.push_back(job);
+	_reapSaves(false);
+    } else {
+	job->run();
+	_saved(job);
+    }
+}
+
+void TileMapper::_reapSaves(bool all)
+{
+    if (!_encoder) {
+	return;
+    }
+
+    // Keeping a couple of maps per thread queued is enough to keep
+    // the encoders busy, without images piling up in memory if
+    // rendering is faster than encoding.
+    size_t limit = all ? 0 : 2 * _encoder->threads();
+    while (!_saves.empty() && 
+	   ((_saves.size() > limit) || _encoder->done(_saves.front()))) {
+	SaveJob *job = _saves.front();
+	_saves.pop_front();
+	_encoder->wait(job);
+	_saved(job);
+    }
+}
+
+void TileMapper::_reapReadbacks(bool all)
+{
+    while (!_readbacks.empty()) {
+	Readback *r = _readbacks.front();
+	if (r->buffer != 0) {
+	    // We only wait for the oldest readback if we've been
+	    // asked to, or if there are too many.  Otherwise we just
+	    // check it.
+	    bool wait = all || (_readbacks.size() > __maxReadbacks);
+	    const GLuint64 second = 1000000000;
+	    GLenum status = glClientWaitSync(r->fence, 
+					     GL_SYNC_FLUSH_COMMANDS_BIT,
+					     wait ? second : 0);
+	    if (status == GL_TIMEOUT_EXPIRED) {
+		if (wait) {
+		    continue;
+		}
+		break;
+	    }
+	    // If the wait failed, we carry on anyway -
+	    // glGetBufferSubData() will wait if it has to.
+	    glDeleteSync(r->fence);
+
+	    glBindBuffer(GL_PIXEL_PACK_BUFFER, r->buffer);
+	    glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, r->image->size(), 
+			       &(*r->image)[0]);
+	    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	    _freeBuffers.push_back(r->buffer);
+	}
+	_readbacks.pop_front();
+
+	_downsample(r);
+	delete r;
+    }
+}
+
+void TileMapper::_saved(SaveJob *job)
+{
+    Tile *t = job->tile();
+    t->setMapExists(job->level(), true, _packed);
+    _freeImages.push_back(job->image());
+    delete job;
+
+    _unsaved[t]--;
+    if (t != _tile) {
+	_checkSaved(t);
+    }
+}
+
+void TileMapper::_checkSaved(Tile *t)
+{
+    map<Tile *, size_t>::iterator i = _unsaved.find(t);
+    if ((i != _unsaved.end()) && (i->second == 0)) {
+	_unsaved.erase(i);
+	_savedTiles.push_back(t);
+    }
+}
+
 // Cleans things up - unloads buckets, resets the maximum elevation
 // figure, and deletes our texture.  This should be called when
 // finished with a tile.
@@ -455,6 +1016,9 @@ void TileMapper::_unloadBuckets()
 	delete _buckets[i];
     }
     _buckets.clear();
+    // We're done with the tile, so if its maps have been written, so
+    // has the tile.
+    _checkSaved(_tile);
     _tile = NULL;
 
     // This might be overkill, but presumably if we're unloading
@@ -27,6 +27,18 @@
   There must be an valid OpenGL context when a TileMapper object is
   created and used.
 
+  Only the full-sized map is read back from the GPU (once per tile,
+  however many maps are saved).  Smaller maps are made from it on the
+  CPU (see Downsampler), which is also how maps can be made for a
+  tile without its scenery, from an existing full-sized map (see
+  setFromMap()).
+
+  Mapping a tile has three stages: loading its scenery, rendering it,
+  and saving the maps.  Only rendering needs OpenGL, so if given
+  worker pools, a tile mapper will load the scenery for upcoming tiles
+  (see prefetch()) and encode and write maps in the background, while
+  it renders in the main thread.
+
   This file is part of Atlas.
 
   Atlas is free software: you can redistribute it and/or modify it
@@ -46,6 +58,8 @@
 #ifndef _TILEMAPPER_H_
 #define _TILEMAPPER_H_
 
+#include <deque>
+#include <map>
 #include <vector>
 
 #include <plib/pu.h>		// sgVec4
@@ -54,6 +68,7 @@
 class Palette;
 class Tile;
 class Bucket;
+class WorkerPool;
 
 class TileMapper {
   public:
@@ -67,8 +82,17 @@ class TileMapper {
     static unsigned int maxPossibleLevel();
 
     enum ImageType {PNG, JPEG};
+    // How maps are rendered: with OpenGL (which needs a current
+    // context), or on the CPU by a Rasterizer (which doesn't).
+    enum Renderer {OPENGL, CPU};
 
-    // Create a tile mapper with the given rendering parameters.
+    // Create a tile mapper with the given rendering parameters.  If
+    // packed is true, maps are saved in map archives (see
+    // MapArchive), rather than in individual files.  If loader is
+    // non-NULL, it's used to load prefetched tiles.  If encoder is
+    // non-NULL, save() hands maps to it to be encoded and written,
+    // rather than doing it right away.  Both must outlive the tile
+    // mapper.
     TileMapper(Palette *p,
     	       unsigned int maxDesiredLevel = 10,
     	       bool discreteContours = true,
@@ -78,24 +102,60 @@ class TileMapper {
     	       bool lighting = true,
     	       bool smoothShading = true,
 	       ImageType imageType = JPEG,
-	       unsigned int jpegQuality = 75);
+	       unsigned int jpegQuality = 75,
+	       bool packed = false,
+	       WorkerPool *loader = NULL,
+	       WorkerPool *encoder = NULL,
+	       Renderer renderer = OPENGL);
+    // Waits for any maps still being saved.
     ~TileMapper();
 
+    // Starts loading the scenery for the given tile in the background
+    // (if we have a loader pool), so that it's ready (or closer to
+    // ready) by the time set() gets to it.  Tiles must be passed to
+    // set() in the order they were prefetched - any prefetched tiles
+    // that set() skips over are thrown away (but passing set() a tile
+    // that wasn't prefetched doesn't skip anything).
+    void prefetch(Tile *t);
+
     // Specify the tile upon which future operations will operate.
-    // This will load the scenery for the tile.  If t is NULL, this
+    // This will load the scenery for the tile (or wait for it to
+    // finish loading, if it was prefetched).  If t is NULL, this
     // essentially clears the current values (and calls to render() or
     // save() are ignored).
     void set(Tile *t);
+    // Like set() followed by render(), but rather than loading and
+    // rendering the tile's scenery, uses its existing map at
+    // maxDesiredLevel, so that smaller maps can be made from it with
+    // save().  Returns false, with no current tile, if that map
+    // doesn't exist or can't be read.  Don't call render() after
+    // this.
+    bool setFromMap(Tile *t);
 
-    // Renders the current tile at the size given by maxLevel.
-    // Rendering is done via a frame buffer object drawing into a
-    // texture.  This only needs to be done once per tile.
+    // Renders the current tile at the size given by maxLevel.  With
+    // OpenGL, rendering is done via a frame buffer object drawing
+    // into a texture.  On the CPU, it's done into an image in main
+    // memory.  This only needs to be done once per tile.
     void render();
 
-    // Save the current image to a file at the given level (<=
-    // maxDesiredLevel).  You must call render() before the first call
-    // to save() (for each tile).
+    // Save the current image to a file (or map archive) at the given
+    // level (<= maxDesiredLevel).  You must call render() before the
+    // first call to save() (for each tile).  With OpenGL, the image is
+    // read back asynchronously if possible, and maps aren't made
+    // until we've moved on to another tile (and so know all the
+    // levels wanted).  With an encoder pool they're encoded in the
+    // background, so a map may not be written until some time later
+    // - call saved() to find out when, or finish() to be sure.  As
+    // each map is written, the tile is told that it exists (see
+    // Tile::setMapExists()).
     void save(unsigned int level);
+    // Returns the next tile (oldest first) whose maps have all been
+    // written, or NULL if there are none.  A tile is only returned
+    // once we've moved on to another tile (with set()), or finish()
+    // has been called.
+    Tile *saved();
+    // Waits until all maps passed to save() have been written.
+    void finish();
 
     // Accessors.
     const Palette *palette() const { return _palette; }
@@ -106,9 +166,49 @@ class TileMapper {
     bool contourLines() const { return _contourLines; }
     bool lighting() const { return _lighting; }
     bool smoothShading() const { return _smoothShading; }
+    bool packed() const { return _packed; }
+    Renderer renderer() const { return _renderer; }
+    // The most temporary memory used to load any of the current
+    // tile's scenery files (see Subbucket::scratchBytes()).
+    size_t scratchBytes() const;
 
   protected:
+    class SaveJob;
+    class Readback;
+
     void _unloadBuckets();
+    // Sets _width and _height for the current tile.
+    void _setSize();
+    // The CPU version of render().
+    void _rasterize();
+    // Rotates the light (in eye coordinates) to be correct for our
+    // tile's scenery.
+    void _rotateLight(sgVec4 lightPosition);
+    // Returns an image buffer of the given size.
+    std::vector<GLubyte> *_getImage(size_t size);
+    // Starts getting the full-sized image for the current tile's
+    // maps, creating _readback.
+    void _grab();
+    // Moves _readback (if there is one) to _readbacks - the current
+    // tile's maps can be made once its image is ready.
+    void _closeReadback();
+    // Makes the maps for a readback's jobs from its image, and
+    // submits them.
+    void _downsample(Readback *r);
+    // Hands a job whose image is ready to the encoder (or runs it
+    // ourselves, if we don't have one).
+    void _submit(SaveJob *job);
+    // Deletes finished save jobs and, if there are too many
+    // outstanding, waits for the oldest ones to finish.  If all is
+    // true, waits for all of them.
+    void _reapSaves(bool all);
+    // Likewise for readbacks, submitting their jobs.
+    void _reapReadbacks(bool all);
+    // Called when a job has written its map.
+    void _saved(SaveJob *job);
+    // If all of the given tile's maps have been written, adds it to
+    // _savedTiles.
+    void _checkSaved(Tile *t);
 
     // Our palette.
     Palette *_palette;
@@ -129,6 +229,10 @@ class TileMapper {
     ImageType _imageType;
     // If JPEG, this gives our image quality.
     unsigned int _JPEGQuality;
+    // True if we save maps in map archives.
+    bool _packed;
+    // OPENGL or CPU.
+    Renderer _renderer;
 
     // The tile we're working on.
     Tile *_tile;
@@ -140,11 +244,42 @@ class TileMapper {
     // Our scenery.
     std::vector<Bucket *> _buckets;
 
+    // Our worker pools (NULL if we do things in the main thread).
+    WorkerPool *_loader, *_encoder;
+    // Tiles being loaded in the background, in the order they were
+    // prefetched.
+    struct Prefetch {
+	Tile *tile;
+	std::vector<Bucket *> buckets;
+    };
+    std::deque<Prefetch> _prefetched;
+    // The current tile's image, and the maps waiting for it (NULL
+    // until the first save()).
+    Readback *_readback;
+    // Images being read back from the GPU, and maps being saved in
+    // the background, oldest first.
+    std::deque<Readback *> _readbacks;
+    std::deque<SaveJob *> _saves;
+    // The number of maps not yet written for each tile that has any,
+    // and the tiles that have had all of their maps written (see
+    // saved()).
+    std::map<Tile *, size_t> _unsaved;
+    std::deque<Tile *> _savedTiles;
+    // Image buffers and pixel buffer objects not in use.  Once we've
+    // done a tile or two, we have enough of each to keep going
+    // without allocating any more.
+    std::vector<std::vector<GLubyte> *> _freeImages;
+    std::vector<GLuint> _freeBuffers;
+
     // The width and height of the full-sized tile.
     int _width, _height;
 
-    // Our texture object, the ultimate destination for our rendering.
+    // Our texture object, the ultimate destination for our rendering
+    // (with OpenGL).
     GLuint _to;
+    // When rendering on the CPU, the image, as RGB rows, bottom to
+    // top.
+    std::vector<GLubyte> _image;
 };
 
 #endif	// _TILEMAPPER_H_
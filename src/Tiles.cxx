@@ -33,6 +33,9 @@
 #include <plib/ul.h>
 #include <simgear/constants.h>
 
+// Our project's include files
+#include "MapArchive.hxx"
+
 using namespace std;
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -232,7 +235,9 @@ int GeoLocation::operator<(const GeoLocation& right) const
 
 const unsigned char TileManager::NaPI = numeric_limits<unsigned char>::max();
 
-TileManager::TileManager(const SGPath& scenery, const SGPath& maps): _maps(maps)
+TileManager::TileManager(const SGPath& scenery, const SGPath& maps,
+			 bool deriveMaps): 
+    _maps(maps), _deriveMaps(deriveMaps)
 {
     ////////// Chunks and Tiles //////////
 
@@ -437,6 +442,40 @@ void TileManager::scanScenery()
 	    if (e->d_isdir) {
 		continue;
 	    }
+	    // Mip files (see Texture::mipFiles) are just copies of
+	    // maps, not maps themselves.
+	    const char *suffix = strrchr(e->d_name, '.');
+	    if (suffix && (strcmp(suffix, ".mip") == 0)) {
+		continue;
+	    }
+
+	    // A map archive holds the maps for a whole chunk, so we
+	    // only need to read its index.
+	    if (MapArchive::isArchive(e->d_name)) {
+		char name[8];
+		strncpy(name, e->d_name, sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		Chunk *c = chunk(name);
+		SGPath path(maps);
+		path.append(e->d_name);
+		MapArchive archive(path, false);
+		if (!c || !archive.valid()) {
+		    fprintf(stderr, "TileManager::scanScenery: unexpected map archive '%s' - ignoring\n", e->d_name);
+		    continue;
+		}
+		for (unsigned int s = 0; s < MapArchive::SLOTS; s++) {
+		    if (!archive.has(s)) {
+			continue;
+		    }
+		    GeoLocation loc(c->loc().lat() + s / 10, 
+				    c->loc().lon() + s % 10);
+		    Tile *t = tile(loc);
+		    if (t) {
+			t->setMapExists(i, true, true);
+		    }
+		}
+		continue;
+	    }
 
 	    // We've found a file.  See if it has a "tilish" name
 	    // followed by a suffix.
@@ -561,6 +600,30 @@ void TileManager::setMapLevels(std::bitset<MAX_MAP_LEVEL>& levels)
     }
 }
 
+// Goes down through the desired map levels, rendering a level only
+// if there's no rendered level within MAX_SHRINK above it.
+bitset<TileManager::MAX_MAP_LEVEL> TileManager::derivedLevels() const
+{
+    bitset<MAX_MAP_LEVEL> result;
+    if (!_deriveMaps) {
+	return result;
+    }
+
+    unsigned int rendered = MAX_MAP_LEVEL;
+    for (int i = MAX_MAP_LEVEL - 1; i >= 0; i--) {
+	if (!_mapLevels[i]) {
+	    continue;
+	}
+	if ((rendered < MAX_MAP_LEVEL) && (rendered - i <= MAX_SHRINK)) {
+	    result[i] = true;
+	} else {
+	    rendered = i;
+	}
+    }
+
+    return result;
+}
+
 // Returns the number of tiles of the given type.
 int TileManager::tileCount(SceneryType type)
 {
@@ -886,11 +949,45 @@ void Tile::bucketIndices(vector<long int>& indices)
     }
 }
 
+bitset<TileManager::MAX_MAP_LEVEL> Tile::maps() const
+{
+    bitset<TileManager::MAX_MAP_LEVEL> result = _maps;
+    if (_tm->deriveMaps()) {
+	for (unsigned int i = 0; i < TileManager::MAX_MAP_LEVEL; i++) {
+	    if (mapLevels()[i] && (mapSource(i) < TileManager::MAX_MAP_LEVEL)) {
+		result[i] = true;
+	    }
+	}
+    }
+
+    return result;
+}
+
+unsigned int Tile::mapSource(unsigned int level) const
+{
+    if (_maps[level]) {
+	return level;
+    }
+    if (_tm->deriveMaps()) {
+	// Use the nearest rendered map above us that we can shrink.
+	for (unsigned int i = level + 1; 
+	     (i <= level + TileManager::MAX_SHRINK) && 
+		 (i < TileManager::MAX_MAP_LEVEL);
+	     i++) {
+	    if (_maps[i]) {
+		return i;
+	    }
+	}
+    }
+
+    return TileManager::MAX_MAP_LEVEL;
+}
+
 // Tell the tile that a map at the given level exists or not.  The
 // tile will then tell its owning chunk if its mapped status has
 // changed (a tile is mapped when there is a rendered map for all
 // desired map levels).
-void Tile::setMapExists(unsigned int i, bool exists)
+void Tile::setMapExists(unsigned int i, bool exists, bool packed)
 {
     // If we don't have scenery, or the map level is out of bounds,
     // just return.
@@ -905,6 +1002,7 @@ void Tile::setMapExists(unsigned int i, bool exists)
     // chunk.
     bool wasUnmapped = missingMaps().any();
     _maps[i] = exists;
+    _packed[i] = exists && packed;
     bool isUnmapped = missingMaps().any();
     if (wasUnmapped && !isUnmapped) {
 	chunk()->_tileBecameMapped();
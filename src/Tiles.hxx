@@ -226,8 +226,11 @@ class TileIterator;
 class TileManager {
   public:
     // Initialize a tile manager, telling it where to look for scenery
-    // and maps.
-    TileManager(const SGPath& scenery, const SGPath& maps);
+    // and maps.  If deriveMaps is true, we only expect to find maps
+    // at some levels, and derive the rest from them (see
+    // derivedLevels()).
+    TileManager(const SGPath& scenery, const SGPath& maps, 
+		bool deriveMaps = false);
     ~TileManager();
 
     // Scans the scenery and map directories to find out the current
@@ -266,6 +269,21 @@ class TileManager {
     // be careful when calling it.
     void setMapLevels(std::bitset<MAX_MAP_LEVEL>& levels);
 
+    // Maps at one level can be made from a map up to MAX_SHRINK
+    // levels higher, by shrinking it as it's loaded (see loadJPEG()).
+    // If we're deriving maps, then only the largest of any group of
+    // levels within MAX_SHRINK of each other is rendered and stored,
+    // and the others are derived from it.  For example, with the
+    // default levels of 4, 6, 8, 9, and 10, we store maps at 6 and
+    // 10 and derive 4, 8, and 9, saving about a third of the space.
+    // Derived levels still have (empty) directories in the map
+    // directory.
+    static const unsigned int MAX_SHRINK = 3;
+    bool deriveMaps() const { return _deriveMaps; }
+    // The desired map levels that are derived rather than rendered.
+    // Empty if we're not deriving maps.
+    std::bitset<MAX_MAP_LEVEL> derivedLevels() const;
+
     // Tiles are subdivided into different types: ALL means all
     // scenery, whether downloaded or not; DOWNLOADED means only
     // downloaded scenery, whether mapped or not; UNMAPPED means
@@ -308,6 +326,7 @@ class TileManager {
     // Map info
     SGPath _maps;
     std::bitset<MAX_MAP_LEVEL> _mapLevels;
+    bool _deriveMaps;
 
     // Chunks and tiles
     std::map<GeoLocation, Chunk *> _chunks;
@@ -461,24 +480,36 @@ class Tile {
     
     // Our owning chunk.
     Chunk *chunk() { return _tm->chunk(_loc); }
+    TileManager *tileManager() { return _tm; }
 
     // A bit set of all *desired* maps.  If the bitset is true at
     // index i, then we want a map i^2 pixels high.
     const std::bitset<TileManager::MAX_MAP_LEVEL>& mapLevels() const
     { return _tm->mapLevels(); }
 
-    // A bitset of all *rendered* maps.
-    const std::bitset<TileManager::MAX_MAP_LEVEL>& maps() const 
-    { return _maps; }
+    // A bitset of all maps we have, whether rendered or (if the tile
+    // manager is deriving maps) derived from a rendered map.
+    std::bitset<TileManager::MAX_MAP_LEVEL> maps() const;
     // Returns a bitset of all *unrendered* maps.
      const std::bitset<TileManager::MAX_MAP_LEVEL> missingMaps() const 
     { return maps() ^ mapLevels(); }
 
-    // Informs us that a rendered map exists or not.  We trust what we
-    // are told, so we don't check the maps directory to see if it's
-    // true.  It will tell its owning chunk if its mapped/unmapped
-    // status has changed.
-    void setMapExists(unsigned int i, bool exists);
+    // The level of the rendered map used for the map at the given
+    // level.  This is just level if we have a map there, or a higher
+    // level if the map is derived.  Returns MAX_MAP_LEVEL if we have
+    // no map for that level.
+    unsigned int mapSource(unsigned int level) const;
+
+    // True if the map at the given level is in the chunk's map
+    // archive (see MapArchive), rather than in its own file.
+    bool mapPacked(unsigned int level) const { return _packed[level]; }
+
+    // Informs us that a rendered map exists or not, and if it does,
+    // whether it's in a map archive.  We trust what we are told, so
+    // we don't check the maps directory to see if it's true.  It will
+    // tell its owning chunk if its mapped/unmapped status has
+    // changed.
+    void setMapExists(unsigned int i, bool exists, bool packed = false);
 
     //////////////////////////////
     // Tile metrics.
@@ -514,7 +545,7 @@ class Tile {
     // chunk before it does a scenery scan.  Later, at the end of the
     // tile manager's scenery scan, it will check the maps directories
     // and tell us which ones we have (with calls to setMapExists()).
-    void _resetExists() { _maps.reset(); }
+    void _resetExists() { _maps.reset(); _packed.reset(); }
 
     // Sets our scenery.  This is meant to be called by the
     // TileManager only.
@@ -522,8 +553,9 @@ class Tile {
 
     TileManager *_tm;		// Our tile manager.
 
-    // This keeps track of what maps we have.
-    std::bitset<TileManager::MAX_MAP_LEVEL> _maps;
+    // This keeps track of what maps have been rendered, and which of
+    // those are in map archives.
+    std::bitset<TileManager::MAX_MAP_LEVEL> _maps, _packed;
 
     // SW corner of tile.
     GeoLocation _loc;
@@ -0,0 +1,191 @@
+/*-------------------------------------------------------------------------
+  WorkerPool.cxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+// Our include file
+#include "WorkerPool.hxx"
+
+// C++ system include files
+#include <algorithm>
+#include <cassert>
+
+// System include files
+#ifdef WIN32
+#  include <windows.h>
+#else
+#  include <unistd.h>
+#endif
+
+// Other libraries' include files
+#include <simgear/threads/SGGuard.hxx>
+
+using namespace std;
+
+WorkerPool::Job::Job(): _state(IDLE)
+{
+}
+
+WorkerPool::Job::~Job()
+{
+    // If this fails, someone deleted a job out from under the pool.
+    assert((_state != QUEUED) && (_state != RUNNING));
+}
+
+WorkerPool::WorkerPool(unsigned int threads): _running(0), _quit(false)
+{
+    if (threads == 0) {
+	threads = max(processors(), 2U) - 1;
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+	_Worker *w = new _Worker(this);
+	if (w->start()) {
+	    _workers.push_back(w);
+	} else {
+	    delete w;
+	}
+    }
+    // EYE - if no threads could be started, nothing will ever get
+    // done.  We should fall back to running jobs synchronously.
+    assert(!_workers.empty());
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+	SGGuard<SGMutex> g(_mutex);
+
+	// Anything that hasn't started won't be.
+	for (size_t i = 0; i < _queue.size(); i++) {
+	    _queue[i]->_state = Job::IDLE;
+	}
+	_queue.clear();
+
+	_quit = true;
+	_jobQueued.broadcast();
+    }
+
+    for (size_t i = 0; i < _workers.size(); i++) {
+	_workers[i]->join();
+	delete _workers[i];
+    }
+}
+
+void WorkerPool::submit(Job *j)
+{
+    SGGuard<SGMutex> g(_mutex);
+
+    assert((j->_state == Job::IDLE) || (j->_state == Job::DONE));
+    j->_state = Job::QUEUED;
+    _queue.push_back(j);
+    _jobQueued.signal();
+}
+
+bool WorkerPool::done(Job *j)
+{
+    SGGuard<SGMutex> g(_mutex);
+    return (j->_state == Job::DONE);
+}
+
+bool WorkerPool::busy(Job *j)
+{
+    SGGuard<SGMutex> g(_mutex);
+    return (j->_state == Job::QUEUED) || (j->_state == Job::RUNNING);
+}
+
+void WorkerPool::wait(Job *j)
+{
+    SGGuard<SGMutex> g(_mutex);
+    while ((j->_state == Job::QUEUED) || (j->_state == Job::RUNNING)) {
+	_jobDone.wait(_mutex);
+    }
+}
+
+void WorkerPool::waitAll()
+{
+    SGGuard<SGMutex> g(_mutex);
+    while (!_queue.empty() || (_running > 0)) {
+	_jobDone.wait(_mutex);
+    }
+}
+
+bool WorkerPool::cancel(Job *j)
+{
+    SGGuard<SGMutex> g(_mutex);
+
+    if (j->_state == Job::QUEUED) {
+	deque<Job *>::iterator i = find(_queue.begin(), _queue.end(), j);
+	assert(i != _queue.end());
+	_queue.erase(i);
+	j->_state = Job::IDLE;
+    }
+    // There's no safe way to interrupt a running job, so we just
+    // have to wait.  Jobs are meant to be short, so this shouldn't
+    // take long.
+    while (j->_state == Job::RUNNING) {
+	_jobDone.wait(_mutex);
+    }
+
+    return (j->_state == Job::DONE);
+}
+
+unsigned int WorkerPool::processors()
+{
+    long result;
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    result = info.dwNumberOfProcessors;
+#else
+    result = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return (result > 0) ? (unsigned int)result : 1;
+}
+
+void WorkerPool::_work()
+{
+    _mutex.lock();
+    while (true) {
+	while (_queue.empty() && !_quit) {
+	    _jobQueued.wait(_mutex);
+	}
+	if (_quit) {
+	    break;
+	}
+
+	Job *j = _queue.front();
+	_queue.pop_front();
+	j->_state = Job::RUNNING;
+	_running++;
+
+	// Don't hold the lock while doing the real work.
+	_mutex.unlock();
+	j->run();
+	_mutex.lock();
+
+	j->_state = Job::DONE;
+	_running--;
+	_jobDone.broadcast();
+    }
+    _mutex.unlock();
+}
@@ -0,0 +1,131 @@
+/*-------------------------------------------------------------------------
+  WorkerPool.hxx
+
+  Written by agent
+
+  Copyright (C) 2026 agent
+
+  A worker pool is a set of threads that execute jobs in the
+  background.  It's meant for CPU-bound work that would otherwise
+  stall the main (GLUT) thread, like decoding scenery files.  Jobs
+  are executed in the order in which they're submitted.
+
+  Worker threads must never touch OpenGL (only the main thread has a
+  current context), nor anything else that isn't thread-safe.  The
+  usual pattern is for a job to prepare data in the background, and
+  for the main thread to check if the job is done, and if so, adopt
+  the results (eg, by uploading them to the GPU).
+
+  This file is part of Atlas.
+
+  Atlas is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Atlas is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Atlas.  If not, see <http://www.gnu.org/licenses/>.
+---------------------------------------------------------------------------*/
+
+#ifndef _WORKERPOOL_H_
+#define _WORKERPOOL_H_
+
+#include <deque>
+#include <vector>
+
+#include <simgear/threads/SGThread.hxx>
+
+class WorkerPool {
+  public:
+    // A unit of work.  Subclass it and implement run(), which will be
+    // called in one of the pool's threads.  A job can be submitted
+    // more than once, but only after it has finished (or has been
+    // cancelled).  The job is owned by the caller, not the pool, and
+    // must not be deleted while the pool has it queued or running -
+    // call cancel() first if you aren't sure.
+    class Job {
+      public:
+	friend class WorkerPool;
+
+	Job();
+	virtual ~Job();
+
+	virtual void run() = 0;
+
+      protected:
+	// IDLE: never submitted, or cancelled before it ran.
+	// QUEUED: waiting for a thread.  RUNNING: in run().  DONE:
+	// run() has returned.  Only touched with the pool's mutex
+	// locked.
+	enum State {IDLE, QUEUED, RUNNING, DONE};
+	State _state;
+    };
+
+    // Creates a pool with the given number of threads.  If threads
+    // is 0, we create one thread per processor, less one for the
+    // main thread (but always at least one).
+    WorkerPool(unsigned int threads = 0);
+    // Cancels all queued jobs, waits for running jobs to finish,
+    // then shuts down the threads.
+    ~WorkerPool();
+
+    unsigned int threads() const { return _workers.size(); }
+
+    // Adds a job to the end of the queue.
+    void submit(Job *j);
+    // True if the job has been run to completion.  Note that a job
+    // that has never been submitted (or has been cancelled) is not
+    // done.
+    bool done(Job *j);
+    // True if the job is queued or running.
+    bool busy(Job *j);
+    // Blocks until the given job is done.  If it isn't queued or
+    // running, returns immediately.
+    void wait(Job *j);
+    // Blocks until all submitted jobs are done.
+    void waitAll();
+    // Removes the job from the queue if it hasn't started yet.  If
+    // it's running, we wait for it to finish.  After cancel()
+    // returns, the pool has no further interest in the job, and it
+    // can be safely deleted or resubmitted.  Returns true if the job
+    // ran (ie, it's done).
+    bool cancel(Job *j);
+
+    // The number of processors online.
+    static unsigned int processors();
+
+  protected:
+    class _Worker: public SGThread {
+      public:
+	_Worker(WorkerPool *pool): _pool(pool) {}
+	virtual ~_Worker() {}
+
+      protected:
+	void run() { _pool->_work(); }
+
+	WorkerPool *_pool;
+    };
+
+    // The main loop of each worker thread.
+    void _work();
+
+    std::vector<_Worker *> _workers;
+    std::deque<Job *> _queue;
+    // Number of jobs currently in run().
+    unsigned int _running;
+    // Set when we're being destroyed.
+    bool _quit;
+
+    // Protects all of the above (and all job states).  Workers wait
+    // on _jobQueued for something to do; everyone else waits on
+    // _jobDone for jobs to finish.
+    SGMutex _mutex;
+    SGWaitCondition _jobQueued, _jobDone;
+};
+
+#endif // _WORKERPOOL_H_
@@ -28,6 +28,14 @@
 #include <cassert>
 #include <limits>
 
+// System include files
+#ifdef WIN32
+#  include <io.h>
+#  include <process.h>
+#else
+#  include <unistd.h>
+#endif
+
 // Other libraries' include files
 #include <simgear/magvar/magvar.hxx>
 #include <simgear/math/SGMath.hxx>
@@ -549,6 +557,47 @@ const char *AtlasString::_appendf(const char *fmt, va_list ap)
     return _buf;
 }
 
+//////////////////////////////////////////////////////////////////////
+// AtomicFile
+//////////////////////////////////////////////////////////////////////
+
+AtomicFile::AtomicFile(const char *path): _path(path), _fp(NULL)
+{
+    // The process id makes the name unique, so that several copies
+    // of Atlas can write the same file at once.
+    AtlasString tmp;
+    tmp.printf("%s.%ld", path, (long)getpid());
+    _tmp = tmp.str();
+    _fp = fopen(_tmp.c_str(), "wb");
+}
+
+AtomicFile::~AtomicFile()
+{
+    commit(false);
+}
+
+bool AtomicFile::commit(bool ok)
+{
+    if (_fp == NULL) {
+	return false;
+    }
+    ok = (fclose(_fp) == 0) && ok;
+    _fp = NULL;
+
+#ifdef WIN32
+    // Windows won't rename over an existing file.
+    if (ok) {
+	unlink(_path.c_str());
+    }
+#endif
+    if (!ok || (rename(_tmp.c_str(), _path.c_str()) != 0)) {
+	unlink(_tmp.c_str());
+	return false;
+    }
+
+    return true;
+}
+
 // // next-largest power of 2 (nlpo2)
 // //
 // // From 
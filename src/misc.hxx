@@ -27,6 +27,9 @@
 #ifndef _MISC_H_
 #define _MISC_H_
 
+#include <cstdio>
+#include <string>
+
 #include <zlib.h>
 
 #include <plib/fnt.h>
@@ -243,6 +246,29 @@ class AtlasString {
     const char *_appendf(const char *fmt, va_list ap);
 };
 
+// AtomicFile - writes a file so that nobody (including another copy
+// of Atlas) ever sees it partially written.
+//
+// Write to fp(), which is a temporary file next to the real one, then
+// call commit(), which renames it to the real one if all went well.
+// Otherwise (including if commit() is never called), the temporary
+// file is deleted, and the real one is left alone.  If fp() is NULL,
+// the temporary file couldn't be created.
+class AtomicFile {
+  public:
+    AtomicFile(const char *path);
+    ~AtomicFile();
+
+    FILE *fp() { return _fp; }
+    // Closes the temporary file and, if ok is true, replaces the real
+    // file with it.  Returns true if the real file was replaced.
+    bool commit(bool ok = true);
+
+  protected:
+    std::string _path, _tmp;
+    FILE *_fp;
+};
+
 // I use this for printing frequencies.  VHF frequencies on charts are
 // printed without trailing zeroes, except when that would mean
 // printing nothing after the decimal, in which case a zero is added